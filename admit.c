@@ -0,0 +1,290 @@
+#include "admit.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ADMIT_BUCKETS   256
+
+#define TICKET_NONE     0
+#define TICKET_QUEUED   1
+#define TICKET_HELD     2
+
+#define STR(x)  #x
+#define XSTR(x) STR(x)
+
+struct admit_origin {
+    char* key;
+    size_t keylen;
+    uint64_t hash;
+    int active;
+    int waiting;
+    admit_origin* hnext;
+};
+
+// Guards everything below and the state of every ticket.
+static pthread_mutex_t admit_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Threads waiting in admit_enter, woken by every grant.
+static pthread_cond_t admit_cond = PTHREAD_COND_INITIALIZER;
+static admit_limits limits = {
+    ADMIT_DEFAULT_GLOBAL, ADMIT_DEFAULT_PER_ORIGIN, ADMIT_DEFAULT_QUEUE, ADMIT_DEFAULT_WAIT_MS,
+};
+static admit_origin* buckets[ADMIT_BUCKETS];
+static int active;
+static int queued;
+static admit_ticket* first;
+static admit_ticket* last;
+
+static char const page[] =
+    "HTTP/1.1 503 Service Unavailable\r\n"
+    "Retry-After: " XSTR(ADMIT_RETRY_AFTER) "\r\n"
+    "Connection: close\r\n"
+    "\r\n"
+    "<html><body>503 Service Unavailable: too many requests in flight</body></html>";
+
+slice admit_page(void) {
+    return (slice){(uint8_t const*)page, sizeof(page) - 1};
+}
+
+static
+uint64_t hash_key(slice key) {
+    uint64_t h = 5381;
+    for (size_t i = 0; i < key.len; ++i) {
+        h = h*33 + key.ptr[i];
+    }
+    return h;
+}
+
+static
+admit_origin** bucket_slot(uint64_t hash, slice key) {
+    admit_origin** slot = &buckets[hash % ADMIT_BUCKETS];
+    while (*slot) {
+        admit_origin* o = *slot;
+        if ((*o).hash == hash && (*o).keylen == key.len
+            && memcmp((*o).key, key.ptr, key.len) == 0) {
+            break;
+        }
+        slot = &(*o).hnext;
+    }
+    return slot;
+}
+
+// Finds or adds the origin node:service. Must hold admit_mutex.
+static
+admit_origin* origin_get(slice node, slice service) {
+    char buf[512];
+    int n = snprintf(buf, sizeof(buf), "%.*s://%.*s",
+        (int)service.len, service.ptr, (int)node.len, node.ptr);
+    if (n < 0 || (size_t)n >= sizeof(buf)) {
+        return NULL;
+    }
+    slice key = {(uint8_t const*)buf, n};
+    uint64_t hash = hash_key(key);
+    admit_origin** slot = bucket_slot(hash, key);
+    if (*slot) {
+        return *slot;
+    }
+    admit_origin* o = calloc(1, sizeof(admit_origin));
+    if (o) {
+        (*o).key = malloc(key.len);
+    }
+    if (!o || !(*o).key) {
+        free(o);
+        return NULL;
+    }
+    memcpy((*o).key, key.ptr, key.len);
+    (*o).keylen = key.len;
+    (*o).hash = hash;
+    *slot = o;
+    return o;
+}
+
+// Forgets an origin nothing refers to anymore. Must hold admit_mutex.
+static
+void origin_put(admit_origin* o) {
+    if ((*o).active > 0 || (*o).waiting > 0) {
+        return;
+    }
+    admit_origin** slot = bucket_slot((*o).hash, (slice){(uint8_t const*)(*o).key, (*o).keylen});
+    *slot = (*o).hnext;
+    free((*o).key);
+    free(o);
+}
+
+static
+int fits(admit_origin const* o) {
+    return active < limits.global && (*o).active < limits.per_origin;
+}
+
+// Must hold admit_mutex.
+static
+void dequeue(admit_ticket* t) {
+    if ((*t).prev) {
+        (*(*t).prev).next = (*t).next;
+    } else {
+        first = (*t).next;
+    }
+    if ((*t).next) {
+        (*(*t).next).prev = (*t).prev;
+    } else {
+        last = (*t).prev;
+    }
+    (*t).next = NULL;
+    (*t).prev = NULL;
+    queued -= 1;
+    (*(*t).origin).waiting -= 1;
+}
+
+// Hands the free slots to the queued tickets, in order, skipping those
+// whose origin is at its limit. Must hold admit_mutex.
+static
+void dispatch(void) {
+    int woke = 0;
+    admit_ticket* t = first;
+    while (t && active < limits.global) {
+        admit_ticket* next = (*t).next;
+        if (fits((*t).origin)) {
+            dequeue(t);
+            active += 1;
+            (*(*t).origin).active += 1;
+            __atomic_store_n(&(*t).state, TICKET_HELD, __ATOMIC_RELEASE);
+            if ((*t).fd == -1) {
+                woke = 1;
+            } else {
+                uint64_t one = 1;
+                if (write((*t).fd, &one, sizeof(one)) != sizeof(one)) {
+                    perror("write(eventfd)");
+                }
+            }
+        }
+        t = next;
+    }
+    if (woke) {
+        pthread_cond_broadcast(&admit_cond);
+    }
+}
+
+void admit_set(admit_limits l) {
+    pthread_mutex_lock(&admit_mutex);
+    limits = l;
+    dispatch();
+    pthread_mutex_unlock(&admit_mutex);
+}
+
+admit_limits admit_get(void) {
+    pthread_mutex_lock(&admit_mutex);
+    admit_limits l = limits;
+    pthread_mutex_unlock(&admit_mutex);
+    return l;
+}
+
+void admit_counts(int* a, int* q) {
+    pthread_mutex_lock(&admit_mutex);
+    *a = active;
+    *q = queued;
+    pthread_mutex_unlock(&admit_mutex);
+}
+
+int admit_try(admit_ticket* t, slice node, slice service, int fd) {
+    memset(t, 0, sizeof(*t));
+    (*t).fd = fd;
+    pthread_mutex_lock(&admit_mutex);
+    admit_origin* o = origin_get(node, service);
+    if (!o) {
+        pthread_mutex_unlock(&admit_mutex);
+        return admit_shed;
+    }
+    // nobody of the same origin may be passed in the queue
+    if (fits(o) && (*o).waiting == 0) {
+        active += 1;
+        (*o).active += 1;
+        (*t).origin = o;
+        (*t).state = TICKET_HELD;
+        pthread_mutex_unlock(&admit_mutex);
+        return admit_ok;
+    }
+    if (queued >= limits.queue || limits.wait_ms <= 0) {
+        origin_put(o);
+        pthread_mutex_unlock(&admit_mutex);
+        return admit_shed;
+    }
+    (*t).origin = o;
+    (*t).state = TICKET_QUEUED;
+    (*t).prev = last;
+    if (last) {
+        (*last).next = t;
+    } else {
+        first = t;
+    }
+    last = t;
+    queued += 1;
+    (*o).waiting += 1;
+    pthread_mutex_unlock(&admit_mutex);
+    return admit_queued;
+}
+
+int admit_granted(admit_ticket const* t) {
+    return __atomic_load_n(&(*t).state, __ATOMIC_ACQUIRE) == TICKET_HELD;
+}
+
+// Must hold admit_mutex.
+static
+int cancel_locked(admit_ticket* t) {
+    if ((*t).state != TICKET_QUEUED) {
+        return (*t).state == TICKET_HELD;
+    }
+    admit_origin* o = (*t).origin;
+    dequeue(t);
+    (*t).origin = NULL;
+    (*t).state = TICKET_NONE;
+    origin_put(o);
+    return 0;
+}
+
+int admit_cancel(admit_ticket* t) {
+    pthread_mutex_lock(&admit_mutex);
+    int held = cancel_locked(t);
+    pthread_mutex_unlock(&admit_mutex);
+    return held;
+}
+
+int admit_enter(admit_ticket* t, slice node, slice service) {
+    int ret = admit_try(t, node, service, -1);
+    if (ret != admit_queued) {
+        return ret;
+    }
+    pthread_mutex_lock(&admit_mutex);
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    long ns = deadline.tv_nsec + (long)(limits.wait_ms % 1000) * 1000000;
+    deadline.tv_sec += limits.wait_ms / 1000 + ns / 1000000000;
+    deadline.tv_nsec = ns % 1000000000;
+    while ((*t).state == TICKET_QUEUED) {
+        if (pthread_cond_timedwait(&admit_cond, &admit_mutex, &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+    int held = cancel_locked(t);
+    pthread_mutex_unlock(&admit_mutex);
+    return held ? admit_ok : admit_shed;
+}
+
+void admit_leave(admit_ticket* t) {
+    pthread_mutex_lock(&admit_mutex);
+    if ((*t).state == TICKET_HELD) {
+        admit_origin* o = (*t).origin;
+        active -= 1;
+        (*o).active -= 1;
+        (*t).origin = NULL;
+        (*t).state = TICKET_NONE;
+        origin_put(o);
+        dispatch();
+    } else {
+        cancel_locked(t);
+    }
+    pthread_mutex_unlock(&admit_mutex);
+}
@@ -0,0 +1,66 @@
+#ifndef ADMIT_H
+#define ADMIT_H
+#include "tprintf.h"
+#include "slice.h"
+
+#define ADMIT_DEFAULT_GLOBAL        1024
+#define ADMIT_DEFAULT_PER_ORIGIN    64
+#define ADMIT_DEFAULT_QUEUE         128
+#define ADMIT_DEFAULT_WAIT_MS       100
+#define ADMIT_RETRY_AFTER           1   // seconds, sent with the 503
+
+// Admission control for origin fetches: at most global of them in
+// flight, and at most per_origin to any one <service>://<node>. A fetch
+// over either limit waits for a slot, up to wait_ms, in a FIFO of at
+// most queue fetches, and is shed with admit_page otherwise. A slow
+// origin thus holds per_origin threads or connections at most, and
+// its waiters never hold up fetches from other origins.
+typedef struct {
+    int global;
+    int per_origin;
+    int queue;
+    int wait_ms;
+} admit_limits;
+
+// Takes effect for the next fetches; raising a limit lets queued ones in.
+void admit_set(admit_limits limits);
+admit_limits admit_get(void);
+// Fetches in flight and waiting, for the metrics.
+void admit_counts(int* active, int* queued);
+
+#define admit_ok        0
+#define admit_queued    1
+#define admit_shed      -1
+
+typedef struct admit_origin admit_origin;
+
+// A fetch's slot, or its place in the queue. Zeroed, it holds neither.
+typedef struct admit_ticket admit_ticket;
+struct admit_ticket {
+    admit_origin* origin;
+    int state;
+    // eventfd written once a queued ticket is granted its slot,
+    // -1 for a thread waiting in admit_enter
+    int fd;
+    admit_ticket* next;
+    admit_ticket* prev;
+};
+
+// Takes a slot for a fetch from node:service, or queues t for one.
+// Returns admit_ok, admit_queued or admit_shed.
+int admit_try(admit_ticket* t, slice node, slice service, int fd);
+// Whether the queued t has been granted its slot since.
+int admit_granted(admit_ticket const* t);
+// Takes t out of the queue once its wait is over. Returns 1 if it was
+// granted its slot after all, 0 if the fetch is to be shed.
+int admit_cancel(admit_ticket* t);
+// Takes a slot, blocking the calling thread in the queue for up to
+// wait_ms. Returns admit_ok or admit_shed.
+int admit_enter(admit_ticket* t, slice node, slice service);
+// Gives back t's slot, or its place in the queue.
+void admit_leave(admit_ticket* t);
+
+// The 503 sent to shed fetches, with Retry-After. It never changes.
+slice admit_page(void);
+
+#endif
@@ -0,0 +1,174 @@
+#include "arena.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_ALIGN 16
+
+typedef struct chunk chunk;
+struct chunk {
+    chunk* prev;
+    size_t size;
+    size_t used;
+    _Alignas(ARENA_ALIGN) uint8_t data[];
+};
+
+struct arena {
+    // the chunk allocations come from, older ones through prev
+    chunk* cur;
+    // chunks released by arena_restore, reused before new ones
+    chunk* spare;
+    arena* next_idle;
+};
+
+static pthread_mutex_t arena_mutex = PTHREAD_MUTEX_INITIALIZER;
+static arena* idle;
+static int nidle;
+
+static
+chunk* chunk_new(size_t size) {
+    chunk* c = malloc(sizeof(chunk) + size);
+    if (!c) {
+        perror("malloc");
+        return NULL;
+    }
+    (*c).prev = NULL;
+    (*c).size = size;
+    (*c).used = 0;
+    return c;
+}
+
+static
+size_t align_up(size_t n) {
+    return (n + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+}
+
+arena* arena_take(void) {
+    pthread_mutex_lock(&arena_mutex);
+    arena* a = idle;
+    if (a) {
+        idle = (*a).next_idle;
+        nidle -= 1;
+    }
+    pthread_mutex_unlock(&arena_mutex);
+    if (a) {
+        return a;
+    }
+
+    a = malloc(sizeof(arena));
+    if (!a) {
+        perror("malloc");
+        return NULL;
+    }
+    (*a).cur = chunk_new(ARENA_CHUNK);
+    if (!(*a).cur) {
+        free(a);
+        return NULL;
+    }
+    (*a).spare = NULL;
+    (*a).next_idle = NULL;
+    return a;
+}
+
+static
+void free_chunks(chunk* c) {
+    while (c) {
+        chunk* prev = (*c).prev;
+        free(c);
+        c = prev;
+    }
+}
+
+void arena_put(arena* a) {
+    // keep only the first chunk, so idle arenas stay small
+    while ((*(*a).cur).prev) {
+        chunk* c = (*a).cur;
+        (*a).cur = (*c).prev;
+        free(c);
+    }
+    (*(*a).cur).used = 0;
+    free_chunks((*a).spare);
+    (*a).spare = NULL;
+
+    pthread_mutex_lock(&arena_mutex);
+    if (nidle < ARENA_MAX_IDLE) {
+        (*a).next_idle = idle;
+        idle = a;
+        nidle += 1;
+        a = NULL;
+    }
+    pthread_mutex_unlock(&arena_mutex);
+    if (a) {
+        free((*a).cur);
+        free(a);
+    }
+}
+
+// Makes cur a chunk with room for n more bytes.
+static
+int add_chunk(arena* a, size_t n) {
+    chunk** link = &(*a).spare;
+    for (; *link; link = &(**link).prev) {
+        if ((**link).size >= n) {
+            break;
+        }
+    }
+    chunk* c = *link;
+    if (c) {
+        *link = (*c).prev;
+    } else {
+        c = chunk_new(n > ARENA_CHUNK ? n : ARENA_CHUNK);
+        if (!c) {
+            return -1;
+        }
+    }
+    (*c).used = 0;
+    (*c).prev = (*a).cur;
+    (*a).cur = c;
+    return 0;
+}
+
+void* arena_alloc(arena* a, size_t n) {
+    n = align_up(n);
+    chunk* c = (*a).cur;
+    if ((*c).size - (*c).used < n) {
+        if (add_chunk(a, n) != 0) {
+            return NULL;
+        }
+        c = (*a).cur;
+    }
+    void* ptr = &(*c).data[(*c).used];
+    (*c).used += n;
+    return ptr;
+}
+
+void* arena_grow(arena* a, void* ptr, size_t old, size_t n) {
+    chunk* c = (*a).cur;
+    old = align_up(old);
+    if (ptr && (uint8_t*)ptr + old == &(*c).data[(*c).used]
+        && (*c).used - old + align_up(n) <= (*c).size) {
+        (*c).used = (*c).used - old + align_up(n);
+        return ptr;
+    }
+    void* grown = arena_alloc(a, n);
+    if (grown && ptr) {
+        memcpy(grown, ptr, old < n ? old : n);
+    }
+    return grown;
+}
+
+arena_mark arena_save(arena const* a) {
+    return (arena_mark){(*a).cur, (*(*a).cur).used};
+}
+
+void arena_restore(arena* a, arena_mark m) {
+    while ((*a).cur != m.chunk) {
+        chunk* c = (*a).cur;
+        (*a).cur = (*c).prev;
+        (*c).prev = (*a).spare;
+        (*a).spare = c;
+    }
+    (*(*a).cur).used = m.used;
+}
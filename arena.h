@@ -0,0 +1,35 @@
+#ifndef ARENA_H
+#define ARENA_H
+#include "tprintf.h"
+#include <stddef.h>
+
+#define ARENA_CHUNK     (64 << 10)
+#define ARENA_MAX_IDLE  64
+
+// Memory of one client connection: allocations are bumped off chunks
+// and only released all at once, back to a mark or when the arena is
+// put back. Arenas are recycled through a free list, keeping their
+// first chunk, so a connection normally costs no malloc at all.
+typedef struct arena arena;
+
+typedef struct {
+    void* chunk;
+    size_t used;
+} arena_mark;
+
+// Returns an empty arena, or NULL if none can be allocated.
+arena* arena_take(void);
+void arena_put(arena* a);
+
+// Returns n bytes aligned for any type, or NULL.
+void* arena_alloc(arena* a, size_t n);
+// Resizes the allocation ptr of old bytes to n, in place if it is the
+// last one and its chunk has room, else by copying it (the old bytes
+// stay allocated until released). Returns NULL on failure.
+void* arena_grow(arena* a, void* ptr, size_t old, size_t n);
+
+// Everything allocated after arena_save is released by arena_restore.
+arena_mark arena_save(arena const* a);
+void arena_restore(arena* a, arena_mark m);
+
+#endif
@@ -0,0 +1,159 @@
+// Measures memory cache lookup throughput (cache_lookup and
+// cache_release of an entry that is there) from 1, 2, 4, ... threads,
+// all looking up random keys of one prefilled cache. Each count of
+// threads also runs with every lookup under one global mutex, as a
+// cache behind a single lock would, for comparison.
+//
+//   -t threads   the most threads to run (default 32)
+//   -k keys      entries in the cache (default 100000)
+//   -d seconds   duration of each run (default 1)
+#define _GNU_SOURCE
+#include "../cache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define BENCH_BODY      512
+#define BENCH_HEADERS   8
+
+typedef struct {
+    pthread_t thread;
+    uint64_t seed;
+    uint64_t lookups;
+    uint64_t misses;
+    int locked;
+} worker;
+
+static char** keys;
+static size_t nkeys;
+static int stop;
+static pthread_mutex_t global_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static
+void fill(void) {
+    static uint8_t body[BENCH_BODY];
+    char head[128];
+    int n = snprintf(head, sizeof(head),
+        "HTTP/1.1 200 OK\r\nContent-Length: %d\r\nCache-Control: max-age=3600\r\n\r\n", BENCH_BODY);
+    http_header headers[BENCH_HEADERS];
+    http_response res;
+    http_response_init(&res, (http_headerbuf){headers, BENCH_HEADERS});
+    if (http_parse_response((slice){(uint8_t const*)head, n}, &res) != 0) {
+        fprintf(stderr, "bad response head\n");
+        exit(1);
+    }
+    keys = calloc(nkeys, sizeof(char*));
+    for (size_t i = 0; i < nkeys; ++i) {
+        char key[64];
+        snprintf(key, sizeof(key), "http://origin:80/object/%zu", i);
+        keys[i] = strdup(key);
+        slice k = {(uint8_t const*)keys[i], strlen(keys[i])};
+        cache_fill f;
+        if (cache_fill_begin(&f, k, (slice){(uint8_t const*)head, n - 2}, &res,
+                             time(NULL) + 3600) != 0
+            || cache_fill_append(&f, (slice){body, BENCH_BODY}) != 0) {
+            fprintf(stderr, "cannot store %s\n", keys[i]);
+            exit(1);
+        }
+        cache_fill_commit(&f);
+    }
+}
+
+static
+void* run(void* arg) {
+    worker* w = arg;
+    uint64_t x = (*w).seed;
+    uint64_t sink = 0;
+    while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+        for (int i = 0; i < 256; ++i) {
+            x ^= x << 13;
+            x ^= x >> 7;
+            x ^= x << 17;
+            char const* key = keys[x % nkeys];
+            int state;
+            if ((*w).locked) {
+                pthread_mutex_lock(&global_mutex);
+            }
+            cache_entry* e = cache_lookup((slice){(uint8_t const*)key, strlen(key)}, &state);
+            if (e) {
+                sink += (*e).data[(*e).headlen];
+                cache_release(e);
+            } else {
+                (*w).misses += 1;
+            }
+            if ((*w).locked) {
+                pthread_mutex_unlock(&global_mutex);
+            }
+        }
+        (*w).lookups += 256;
+    }
+    (*w).seed = sink;
+    return NULL;
+}
+
+static
+double measure(int nthreads, int locked, double seconds, uint64_t* misses) {
+    worker* workers = calloc(nthreads, sizeof(worker));
+    stop = 0;
+    for (int i = 0; i < nthreads; ++i) {
+        workers[i].seed = 0x9e3779b97f4a7c15ULL * (i + 1);
+        workers[i].locked = locked;
+        pthread_create(&workers[i].thread, NULL, run, &workers[i]);
+    }
+    usleep((useconds_t)(seconds * 1e6));
+    __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+    uint64_t total = 0;
+    for (int i = 0; i < nthreads; ++i) {
+        pthread_join(workers[i].thread, NULL);
+        total += workers[i].lookups;
+        *misses += workers[i].misses;
+    }
+    free(workers);
+    return total / seconds;
+}
+
+int main(int argc, char* const argv[]) {
+    int max_threads = 32;
+    double seconds = 1;
+    nkeys = 100000;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:k:d:")) != -1) {
+        switch (opt) {
+        case 't': max_threads = atoi(optarg); break;
+        case 'k': nkeys = strtoull(optarg, NULL, 10); break;
+        case 'd': seconds = atof(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-t threads] [-k keys] [-d seconds]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (max_threads < 1 || nkeys == 0 || seconds <= 0) {
+        fprintf(stderr, "%s: -t, -k and -d must be positive\n", argv[0]);
+        return 1;
+    }
+    // room for every key, so that every lookup hits
+    cache_init(nkeys * (BENCH_BODY + 512) * 2, 1 << 20);
+    fill();
+    printf("%zu keys, %ld CPUs\n", nkeys, sysconf(_SC_NPROCESSORS_ONLN));
+    printf("%7s %14s %8s %14s %8s\n", "threads", "lookups/s", "scaling", "one mutex", "scaling");
+    double base = 0;
+    double base_locked = 0;
+    uint64_t misses = 0;
+    for (int n = 1; n <= max_threads; n *= 2) {
+        double rate = measure(n, 0, seconds, &misses);
+        double locked = measure(n, 1, seconds, &misses);
+        if (n == 1) {
+            base = rate;
+            base_locked = locked;
+        }
+        printf("%7d %14.0f %7.2fx %14.0f %7.2fx\n", n, rate, rate / base, locked, locked / base_locked);
+        fflush(stdout);
+    }
+    if (misses) {
+        printf("%llu lookups missed\n", (unsigned long long)misses);
+    }
+    return 0;
+}
@@ -0,0 +1,266 @@
+// Replays a request trace through the memory cache (cache.c) under each
+// eviction policy and prints their hit ratios. Every miss stores the
+// object as a response of its size that never expires, as a proxy
+// would fetch it, so the policies see the same requests in the same
+// order and only their eviction and admission decisions differ.
+//
+// A trace has a request per line: the key, then optionally the size of
+// the response in bytes (1k when it is missing). Without a trace file,
+// a synthetic one is generated: requests for a Zipf-distributed set of
+// objects, interleaved with scans that request new keys once each, as a
+// crawler or a batch job walking one-hit URLs would.
+//
+// Each policy also runs with the cache in a shared region, as worker
+// processes share it (-f), which should keep the same entries. The
+// memory column is what the cache took from the heap (malloc's bytes
+// in use) or from the region (its pages taken).
+//
+//   -c bytes     cache budget (default 64m)
+//   -o bytes     largest object stored (default 1m)
+//   -n requests  length of the synthetic trace (default 2000000)
+//   -k objects   objects in its Zipf set (default 100000)
+//   -s skew      Zipf exponent (default 0.9)
+//   -x percent   requests that belong to scans (default 30)
+#define _GNU_SOURCE
+#include "../cache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <malloc.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define SIM_KEYLEN      256
+#define SIM_HEADERS     8
+#define SIM_SIZE        1024
+#define SIM_SCAN_RUN    1000    // keys per scan
+
+typedef struct {
+    char* key;
+    size_t size;
+} request;
+
+static request* trace;
+static size_t ntrace;
+static size_t captrace;
+
+static
+void add_request(char const* key, size_t size) {
+    if (ntrace == captrace) {
+        captrace = captrace ? captrace * 2 : 4096;
+        trace = realloc(trace, captrace * sizeof(request));
+        if (!trace) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    trace[ntrace].key = strdup(key);
+    trace[ntrace].size = size;
+    ntrace += 1;
+}
+
+static
+void load_trace(char const* path) {
+    FILE* f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        exit(1);
+    }
+    char line[4096];
+    while (fgets(line, sizeof(line), f)) {
+        char key[SIM_KEYLEN];
+        unsigned long long size = SIM_SIZE;
+        if (line[0] == '#' || sscanf(line, "%255s %llu", key, &size) < 1) {
+            continue;
+        }
+        add_request(key, size);
+    }
+    fclose(f);
+}
+
+// Object sizes between 512 bytes and 32k, fixed per object.
+static
+size_t object_size(unsigned long i) {
+    unsigned long h = i * 2654435761UL;
+    return 512 + (h >> 7) % (32 << 10);
+}
+
+static
+void generate(size_t n, size_t objects, double skew, int scan_percent) {
+    double* cdf = malloc(objects * sizeof(double));
+    if (!cdf) {
+        perror("malloc");
+        exit(1);
+    }
+    double sum = 0;
+    for (size_t i = 0; i < objects; ++i) {
+        sum += 1 / pow(i + 1, skew);
+        cdf[i] = sum;
+    }
+    srand48(1);
+    unsigned long scanned = 0;
+    size_t run = 0;
+    char key[SIM_KEYLEN];
+    for (size_t r = 0; r < n; ++r) {
+        // scans start at the rate that makes scan_percent of the requests theirs
+        if (run > 0 || drand48() * (100 - scan_percent) * SIM_SCAN_RUN < scan_percent) {
+            // a scan, once started, requests SIM_SCAN_RUN keys in a row
+            run = run > 0 ? run - 1 : SIM_SCAN_RUN - 1;
+            snprintf(key, sizeof(key), "http://origin:80/scan/%lu", scanned);
+            add_request(key, object_size(scanned));
+            scanned += 1;
+            continue;
+        }
+        double u = drand48() * sum;
+        size_t lo = 0;
+        size_t hi = objects - 1;
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (cdf[mid] < u) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        snprintf(key, sizeof(key), "http://origin:80/object/%zu", lo);
+        add_request(key, object_size(lo));
+    }
+    free(cdf);
+}
+
+static
+void store(slice key, size_t size, uint8_t const* body) {
+    char head[128];
+    int n = snprintf(head, sizeof(head),
+        "HTTP/1.1 200 OK\r\nContent-Length: %zu\r\n\r\n", size);
+    http_header headers[SIM_HEADERS];
+    http_response res;
+    http_response_init(&res, (http_headerbuf){headers, SIM_HEADERS});
+    if (http_parse_response((slice){(uint8_t const*)head, n}, &res) != 0) {
+        return;
+    }
+    // without the blank line, as cache entries keep their heads
+    slice h = {(uint8_t const*)head, n - 2};
+    cache_fill fill;
+    if (cache_fill_begin(&fill, key, h, &res, (time_t)1 << 40) != 0) {
+        return;
+    }
+    if (cache_fill_append(&fill, (slice){body, size}) == 0) {
+        cache_fill_commit(&fill);
+    }
+}
+
+static
+void run(int policy, int shared, size_t budget, size_t max_object) {
+    uint8_t* body = calloc(1, max_object);
+    if (!body) {
+        perror("calloc");
+        exit(1);
+    }
+    size_t heap = mallinfo2().uordblks;
+    if (shared) {
+        if (cache_init_shared(budget, max_object, 1) != 0) {
+            exit(1);
+        }
+        cache_attach(0);
+    } else {
+        cache_init(budget, max_object);
+    }
+    cache_set_policy(policy);
+    size_t hits = 0;
+    unsigned long long bytes = 0;
+    unsigned long long hit_bytes = 0;
+    for (size_t i = 0; i < ntrace; ++i) {
+        slice key = {(uint8_t const*)trace[i].key, strlen(trace[i].key)};
+        int state;
+        cache_entry* e = cache_lookup(key, &state);
+        bytes += trace[i].size;
+        if (e) {
+            hits += 1;
+            hit_bytes += trace[i].size;
+            cache_release(e);
+        } else if (trace[i].size <= max_object) {
+            store(key, trace[i].size, body);
+        }
+    }
+    cache_usage usage;
+    cache_counts(&usage);
+    size_t memory = shared ? usage.region_used : mallinfo2().uordblks - heap;
+    char name[32];
+    snprintf(name, sizeof(name), "%s%s", cache_policy_name(policy), shared ? "/shm" : "");
+    printf("%-12s %9.2f%% %9.2f%% %9zu %10llu %10llu %9.1fm %9.1fm\n", name,
+        100.0 * hits / ntrace, bytes ? 100.0 * hit_bytes / bytes : 0.0, usage.entries,
+        (unsigned long long)usage.admitted, (unsigned long long)usage.rejected,
+        usage.used / 1048576.0, memory / 1048576.0);
+    free(body);
+}
+
+static
+size_t parse_size(char const* s) {
+    char* end;
+    size_t n = strtoull(s, &end, 10);
+    switch (*end) {
+    case 'k': case 'K': n <<= 10; break;
+    case 'm': case 'M': n <<= 20; break;
+    case 'g': case 'G': n <<= 30; break;
+    }
+    return n;
+}
+
+int main(int argc, char* const argv[]) {
+    size_t budget = CACHE_DEFAULT_BUDGET;
+    size_t max_object = CACHE_DEFAULT_MAXOBJ;
+    size_t n = 2000000;
+    size_t objects = 100000;
+    double skew = 0.9;
+    int scan_percent = 30;
+    int opt;
+    while ((opt = getopt(argc, argv, "c:o:n:k:s:x:")) != -1) {
+        switch (opt) {
+        case 'c': budget = parse_size(optarg); break;
+        case 'o': max_object = parse_size(optarg); break;
+        case 'n': n = strtoull(optarg, NULL, 10); break;
+        case 'k': objects = strtoull(optarg, NULL, 10); break;
+        case 's': skew = atof(optarg); break;
+        case 'x': scan_percent = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-c bytes] [-o bytes] [-n requests] [-k objects]"
+                " [-s skew] [-x scan_percent] [trace]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (budget == 0 || objects == 0 || scan_percent < 0 || scan_percent > 100) {
+        fprintf(stderr, "%s: -c and -k must be positive, -x a percentage\n", argv[0]);
+        return 1;
+    }
+    if (optind < argc) {
+        load_trace(argv[optind]);
+    } else {
+        generate(n, objects, skew, scan_percent);
+    }
+    if (ntrace == 0) {
+        fprintf(stderr, "%s: empty trace\n", argv[0]);
+        return 1;
+    }
+    printf("%zu requests, %zu byte cache\n", ntrace, budget);
+    printf("%-12s %10s %10s %9s %10s %10s %10s %10s\n", "policy", "hits", "byte hits", "entries",
+        "admitted", "rejected", "used", "memory");
+    fflush(stdout);
+    // each policy in a process of its own, to start from an empty cache
+    int policies[] = {cache_lru, cache_tinylfu, cache_lru, cache_tinylfu};
+    for (size_t i = 0; i < sizeof(policies) / sizeof(policies[0]); ++i) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            return 1;
+        }
+        if (pid == 0) {
+            run(policies[i], i >= 2, budget, max_object);
+            fflush(stdout);
+            _exit(0);
+        }
+        waitpid(pid, NULL, 0);
+    }
+    return 0;
+}
@@ -0,0 +1,137 @@
+// Hammers the memory cache from several threads at once, each mixing
+// lookups, fills of what missed, drops and revalidations over a key
+// space larger than the cache, so that entries are evicted, replaced
+// and reclaimed while others read them. Every body read is checked.
+// Meant to be built with ThreadSanitizer or AddressSanitizer (make
+// cache-stress builds and runs both).
+//
+//   -t threads      threads (default 8)
+//   -n iterations   operations per thread (default 200000)
+//   -k keys         distinct keys (default 5000)
+#define _GNU_SOURCE
+#include "../cache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define STRESS_BODY     2048
+#define STRESS_HEADERS  8
+#define STRESS_BYTE     'b'
+
+typedef struct {
+    pthread_t thread;
+    uint64_t seed;
+    uint64_t hits;
+    uint64_t fills;
+} worker;
+
+static char head[128];
+static int headlen;
+static long iterations = 200000;
+static uint64_t nkeys = 5000;
+
+static
+void store(slice key, uint64_t x) {
+    static uint8_t body[STRESS_BODY];
+    if (body[0] != STRESS_BYTE) {
+        memset(body, STRESS_BYTE, sizeof(body));
+    }
+    http_header headers[STRESS_HEADERS];
+    http_response res;
+    http_response_init(&res, (http_headerbuf){headers, STRESS_HEADERS});
+    if (http_parse_response((slice){(uint8_t const*)head, headlen}, &res) != 0) {
+        fprintf(stderr, "bad response head\n");
+        exit(1);
+    }
+    // some go stale within the run, to be revalidated
+    time_t expires = time(NULL) + (x % 7 == 0 ? 1 : 3600);
+    cache_fill f;
+    if (cache_fill_begin(&f, key, (slice){(uint8_t const*)head, headlen - 2}, &res, expires) != 0) {
+        return;
+    }
+    if (cache_fill_append(&f, (slice){body, 100 + x % (STRESS_BODY - 100)}) == 0) {
+        cache_fill_commit(&f);
+    }
+}
+
+static
+void* run(void* arg) {
+    worker* w = arg;
+    uint64_t x = (*w).seed;
+    for (long it = 0; it < iterations; ++it) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        char key[64];
+        int n = snprintf(key, sizeof(key), "http://origin:80/%llu", (unsigned long long)(x % nkeys));
+        slice k = {(uint8_t const*)key, n};
+        int state;
+        cache_entry* e = cache_lookup(k, &state);
+        if (e == NULL) {
+            store(k, x);
+            (*w).fills += 1;
+            continue;
+        }
+        (*w).hits += 1;
+        for (size_t i = (*e).headlen; i < (*e).len; i += 256) {
+            if ((*e).data[i] != STRESS_BYTE) {
+                fprintf(stderr, "corrupt body in %.*s\n", n, key);
+                abort();
+            }
+        }
+        if (x % 97 == 0) {
+            cache_drop(e);
+        }
+        if (state == cache_revalidate) {
+            cache_revalidated(e, x % 2);
+            cache_release(e);
+        }
+        cache_release(e);
+    }
+    return NULL;
+}
+
+int main(int argc, char* const argv[]) {
+    int nthreads = 8;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:n:k:")) != -1) {
+        switch (opt) {
+        case 't': nthreads = atoi(optarg); break;
+        case 'n': iterations = atol(optarg); break;
+        case 'k': nkeys = strtoull(optarg, NULL, 10); break;
+        default:
+            fprintf(stderr, "usage: %s [-t threads] [-n iterations] [-k keys]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (nthreads < 1 || iterations < 1 || nkeys == 0) {
+        fprintf(stderr, "%s: -t, -n and -k must be positive\n", argv[0]);
+        return 1;
+    }
+    headlen = snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\nCache-Control: max-age=3600\r\n\r\n");
+    // about a fifth of the keys fit
+    cache_init(1 << 20, 16 << 10);
+    cache_set_stale(3600, 3600);
+
+    worker* workers = calloc(nthreads, sizeof(worker));
+    for (int i = 0; i < nthreads; ++i) {
+        workers[i].seed = 0x9e3779b97f4a7c15ULL * (i + 1);
+        pthread_create(&workers[i].thread, NULL, run, &workers[i]);
+    }
+    uint64_t hits = 0;
+    uint64_t fills = 0;
+    for (int i = 0; i < nthreads; ++i) {
+        pthread_join(workers[i].thread, NULL);
+        hits += workers[i].hits;
+        fills += workers[i].fills;
+    }
+    free(workers);
+    cache_usage u;
+    cache_counts(&u);
+    printf("%d threads: %llu hits, %llu fills; %zu entries, %zu bytes left\n", nthreads,
+           (unsigned long long)hits, (unsigned long long)fills, u.entries, u.used);
+    return 0;
+}
@@ -0,0 +1,179 @@
+// Checks dial_race against local sockets: a listener, a closed port
+// and a black hole, a listener whose accept queue is full so that it
+// drops the SYNs of further connects. Each case checks how the dial
+// ends and how long it took, and that no socket is left open.
+//
+//   black hole, then listener   connects after one stagger
+//   closed port, then listener  connects at once
+//   closed port                 fails at once with ECONNREFUSED
+//   black hole                  fails after the attempt time, ETIMEDOUT
+//   two black holes             fails at the overall deadline, given
+//                               attempts that would outlast it
+#define _GNU_SOURCE
+#include "../tcp.h"
+#include "../timer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#define TEST_STAGGER_MS 250
+#define TEST_ATTEMPT_MS 400
+#define TEST_TIMEOUT_MS 1000
+#define TEST_SLACK_MS   100     // for scheduling
+
+static int failures;
+
+// Listens on a free loopback port, returning the socket and *addr.
+static
+int listener(struct sockaddr_in* addr, int backlog) {
+    int fd = socket(AF_INET, SOCK_STREAM|SOCK_CLOEXEC, 0);
+    memset(addr, 0, sizeof(*addr));
+    (*addr).sin_family = AF_INET;
+    (*addr).sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(*addr);
+    if (fd == -1 || bind(fd, (struct sockaddr*)addr, len) != 0 || listen(fd, backlog) != 0
+        || getsockname(fd, (struct sockaddr*)addr, &len) != 0) {
+        perror("listener");
+        exit(1);
+    }
+    return fd;
+}
+
+// Connects to addr until a connect stays pending: the accept queue is
+// full and SYNs are dropped from then on. The sockets are returned in
+// fill, to keep the queue full.
+static
+int black_hole(struct sockaddr_in* addr, int* fill, int max) {
+    int ln = listener(addr, 0);
+    for (int i = 0; i < max; ++i) {
+        fill[i] = socket(AF_INET, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+        if (connect(fill[i], (struct sockaddr*)addr, sizeof(*addr)) != 0 && errno != EINPROGRESS) {
+            perror("black hole");
+            exit(1);
+        }
+        usleep(20000);
+        int soerr = 0;
+        socklen_t len = sizeof(soerr);
+        getsockopt(fill[i], SOL_SOCKET, SO_ERROR, &soerr, &len);
+        struct sockaddr_in peer;
+        len = sizeof(peer);
+        if (soerr == 0 && getpeername(fill[i], (struct sockaddr*)&peer, &len) != 0) {
+            return ln;
+        }
+    }
+    fprintf(stderr, "black hole: connects to a full accept queue did not stall\n");
+    exit(1);
+}
+
+// A closed port: bound for a moment, so it is free.
+static
+void closed_port(struct sockaddr_in* addr) {
+    close(listener(addr, 1));
+}
+
+static
+void add(dns_result* addrs, struct sockaddr_in const* addr) {
+    memcpy(&(*addrs).addr[(*addrs).n], addr, sizeof(*addr));
+    (*addrs).addrlen[(*addrs).n] = sizeof(*addr);
+    (*addrs).n += 1;
+}
+
+static
+int open_fds(void) {
+    DIR* d = opendir("/proc/self/fd");
+    int n = 0;
+    if (d == NULL) {
+        return -1;
+    }
+    while (readdir(d) != NULL) {
+        n += 1;
+    }
+    closedir(d);
+    return n;
+}
+
+// Dials addrs and checks the outcome: the port of the peer it must
+// connect to, or 0 and the errno it must fail with, within [lo, hi] ms.
+static
+void check(char const* name, dns_result const* addrs, int port, int err, int lo, int hi) {
+    int before = open_fds();
+    uint64_t start = timer_now();
+    int fd = dial_tcp_addrs(addrs);
+    int saved = errno;
+    int took = (int)(timer_now() - start);
+    int ok = took >= lo && took <= hi;
+    if (port) {
+        struct sockaddr_in peer;
+        socklen_t len = sizeof(peer);
+        ok = ok && fd >= 0 && getpeername(fd, (struct sockaddr*)&peer, &len) == 0
+            && ntohs(peer.sin_port) == port;
+    } else {
+        ok = ok && fd == -1 && saved == err;
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    int leaked = open_fds() - before;
+    ok = ok && leaked == 0;
+    printf("%-28s %4d ms  %s%s\n", name, took, fd >= 0 ? "connected" : strerror(saved),
+           ok ? "" : "  FAILED");
+    if (leaked) {
+        printf("%-28s %d sockets left open\n", "", leaked);
+    }
+    failures += !ok;
+}
+
+int main(void) {
+    dial_stagger_ms = TEST_STAGGER_MS;
+    dial_attempt_ms = TEST_ATTEMPT_MS;
+    dial_timeout_ms = TEST_TIMEOUT_MS;
+
+    struct sockaddr_in live, hole, closed;
+    int fill[64];
+    int ln = listener(&live, 16);
+    int hole_ln = black_hole(&hole, fill, 64);
+    closed_port(&closed);
+    int live_port = ntohs(live.sin_port);
+
+    dns_result addrs = {0};
+    add(&addrs, &hole);
+    add(&addrs, &live);
+    check("black hole, then listener", &addrs, live_port, 0,
+          TEST_STAGGER_MS - TEST_SLACK_MS, TEST_STAGGER_MS + TEST_SLACK_MS);
+
+    memset(&addrs, 0, sizeof(addrs));
+    add(&addrs, &closed);
+    add(&addrs, &live);
+    check("closed port, then listener", &addrs, live_port, 0, 0, TEST_SLACK_MS);
+
+    memset(&addrs, 0, sizeof(addrs));
+    add(&addrs, &closed);
+    check("closed port", &addrs, 0, ECONNREFUSED, 0, TEST_SLACK_MS);
+
+    memset(&addrs, 0, sizeof(addrs));
+    add(&addrs, &hole);
+    check("black hole", &addrs, 0, ETIMEDOUT,
+          TEST_ATTEMPT_MS - TEST_SLACK_MS, TEST_ATTEMPT_MS + TEST_SLACK_MS);
+
+    dial_attempt_ms = 2 * TEST_TIMEOUT_MS;
+    memset(&addrs, 0, sizeof(addrs));
+    add(&addrs, &hole);
+    add(&addrs, &hole);
+    check("two black holes, deadline", &addrs, 0, ETIMEDOUT,
+          TEST_TIMEOUT_MS - TEST_SLACK_MS, TEST_TIMEOUT_MS + TEST_SLACK_MS);
+
+    close(ln);
+    close(hole_ln);
+    if (failures) {
+        printf("%d failed\n", failures);
+        return 1;
+    }
+    printf("all passed\n");
+    return 0;
+}
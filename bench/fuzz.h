@@ -0,0 +1,41 @@
+// Shared by the parser fuzz targets: the libFuzzer entry point and
+// the checks both targets run.
+#ifndef FUZZ_H
+#define FUZZ_H
+#include "../http.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FUZZ_HEADERS 16
+
+int LLVMFuzzerTestOneInput(uint8_t const* data, size_t size);
+
+// Aborts, so that the fuzzer keeps the input, unless cond holds.
+#define fuzz_check(cond) do {                                       \
+    if (!(cond)) {                                                  \
+        fprintf(stderr, "%s:%d: check failed: %s\n",                \
+                __FILE__, __LINE__, #cond);                         \
+        abort();                                                    \
+    }                                                               \
+} while (0)
+
+// Slices are empty or lie within the input.
+static inline
+void fuzz_check_slice(slice s, uint8_t const* base, size_t size) {
+    fuzz_check(s.len == 0 || (s.ptr >= base && s.ptr + s.len <= base + size));
+}
+
+// Slices of two parses of the same input point at the same bytes.
+static inline
+int fuzz_same_slice(slice a, uint8_t const* abase, slice b, uint8_t const* bbase) {
+    if (a.len != b.len) {
+        return 0;
+    }
+    if (a.len == 0) {
+        return 1;
+    }
+    return a.ptr - abase == b.ptr - bbase;
+}
+
+#endif
@@ -0,0 +1,153 @@
+// Runs a fuzz target without libFuzzer: replays every file or directory
+// given (stdin if none, which is also how AFL drives it), and with
+// -m rounds feeds that many random mutations of each input as well.
+#define _GNU_SOURCE
+#include "fuzz.h"
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define FUZZ_MAX_INPUT (1 << 16)
+
+static size_t rounds = 0;
+static size_t inputs = 0;
+static unsigned seed = 1;
+
+static
+uint8_t const interesting[] = {' ', '\t', '\r', '\n', ':', '/', '.', '0', '9', 'H', 0, 0xff};
+
+// Writes a mutation of in[0..len) to out and returns its length.
+static
+size_t mutate(uint8_t const* in, size_t len, uint8_t* out) {
+    memcpy(out, in, len);
+    int n = 1 + rand_r(&seed) % 4;
+    for (int i = 0; i < n; ++i) {
+        size_t at = len == 0 ? 0 : rand_r(&seed) % len;
+        switch (rand_r(&seed) % 5) {
+        case 0:
+            if (len > 0) {
+                out[at] ^= 1 << (rand_r(&seed) % 8);
+            }
+            break;
+        case 1:
+            if (len > 0) {
+                out[at] = interesting[rand_r(&seed) % sizeof(interesting)];
+            }
+            break;
+        case 2:
+            if (len < FUZZ_MAX_INPUT) {
+                memmove(&out[at + 1], &out[at], len - at);
+                out[at] = interesting[rand_r(&seed) % sizeof(interesting)];
+                len += 1;
+            }
+            break;
+        case 3:
+            if (len > 0) {
+                size_t k = 1 + rand_r(&seed) % (len - at);
+                memmove(&out[at], &out[at + k], len - at - k);
+                len -= k;
+            }
+            break;
+        case 4:
+            // truncation, the most common way a message arrives
+            len = at;
+            break;
+        }
+    }
+    return len;
+}
+
+// Each input is copied into a buffer of exactly its size, so that the
+// sanitizers catch reads past its end.
+static
+void run(uint8_t const* data, size_t len) {
+    uint8_t* copy = malloc(len == 0 ? 1 : len);
+    memcpy(copy, data, len);
+    LLVMFuzzerTestOneInput(copy, len);
+    free(copy);
+    inputs += 1;
+
+    static uint8_t mutated[2*FUZZ_MAX_INPUT];
+    for (size_t i = 0; i < rounds; ++i) {
+        size_t n = mutate(data, len, mutated);
+        copy = malloc(n == 0 ? 1 : n);
+        memcpy(copy, mutated, n);
+        LLVMFuzzerTestOneInput(copy, n);
+        free(copy);
+        inputs += 1;
+    }
+}
+
+static
+void run_fd(int fd, char const* name) {
+    static uint8_t buf[FUZZ_MAX_INPUT];
+    size_t len = 0;
+    ssize_t n;
+    while (len < sizeof(buf) && (n = read(fd, &buf[len], sizeof(buf) - len)) > 0) {
+        len += n;
+    }
+    if (n < 0) {
+        perror(name);
+        exit(1);
+    }
+    run(buf, len);
+}
+
+static
+void run_path(char const* path) {
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        perror(path);
+        exit(1);
+    }
+    if (S_ISDIR(st.st_mode)) {
+        DIR* dir = opendir(path);
+        if (!dir) {
+            perror(path);
+            exit(1);
+        }
+        struct dirent* e;
+        while ((e = readdir(dir)) != NULL) {
+            if (e->d_name[0] == '.') {
+                continue;
+            }
+            char sub[4096];
+            snprintf(sub, sizeof(sub), "%s/%s", path, e->d_name);
+            run_path(sub);
+        }
+        closedir(dir);
+        return;
+    }
+    FILE* f = fopen(path, "rb");
+    if (!f) {
+        perror(path);
+        exit(1);
+    }
+    run_fd(fileno(f), path);
+    fclose(f);
+}
+
+int main(int argc, char** argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "m:s:")) != -1) {
+        switch (opt) {
+        case 'm':
+            rounds = strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            seed = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-m rounds] [-s seed] [file|dir]...\n", argv[0]);
+            return 1;
+        }
+    }
+    if (optind == argc) {
+        run_fd(0, "stdin");
+    }
+    for (int i = optind; i < argc; ++i) {
+        run_path(argv[i]);
+    }
+    fprintf(stderr, "%zu inputs ok\n", inputs);
+    return 0;
+}
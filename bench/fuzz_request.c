@@ -0,0 +1,92 @@
+// Fuzz target for http_parse_request. Besides crashes it checks that
+// every slice points into the input, that a request arriving one byte
+// at a time parses exactly like the whole of it, and that every scan
+// implementation gives the same parse.
+#include "fuzz.h"
+#include "../scan.h"
+
+typedef struct {
+    int err;
+    http_request req;
+    http_header headers[FUZZ_HEADERS];
+} parse;
+
+static
+void parse_whole(uint8_t const* data, size_t size, parse* p) {
+    http_request_init(&(*p).req, (*p).headers, FUZZ_HEADERS);
+    (*p).err = http_parse_request(data, size, &(*p).req);
+}
+
+static
+void parse_bytewise(uint8_t const* data, size_t size, parse* p) {
+    http_request_init(&(*p).req, (*p).headers, FUZZ_HEADERS);
+    (*p).err = http_partial;
+    for (size_t n = 1; n <= size && (*p).err == http_partial; ++n) {
+        (*p).err = http_parse_request(data, n, &(*p).req);
+    }
+}
+
+static
+void check_parse(parse const* p, uint8_t const* data, size_t size) {
+    if ((*p).err != 0) {
+        return;
+    }
+    http_request const* r = &(*p).req;
+    fuzz_check((*r).buf.ptr == data && (*r).buf.len <= size);
+    fuzz_check((*r).headerbuf.cap <= FUZZ_HEADERS);
+    fuzz_check_slice((*r).method, data, size);
+    fuzz_check_slice((*r).url, data, size);
+    fuzz_check_slice((*r).node, data, size);
+    fuzz_check_slice((*r).service, data, size);
+    fuzz_check_slice((*r).version_slice, data, size);
+    fuzz_check((*r).version <= 1);
+    for (size_t i = 0; i < (*r).headerbuf.cap; ++i) {
+        fuzz_check_slice((*r).headerbuf.ptr[i].name, data, size);
+        fuzz_check_slice((*r).headerbuf.ptr[i].value, data, size);
+        fuzz_check((*r).headerbuf.ptr[i].name.len > 0);
+    }
+    // must not crash on any parsed request
+    http_request_keep_alive(r);
+    http_request_has_body(r);
+}
+
+static
+void check_same(parse const* a, parse const* b, uint8_t const* data) {
+    fuzz_check((*a).err == (*b).err);
+    if ((*a).err != 0) {
+        return;
+    }
+    http_request const* x = &(*a).req;
+    http_request const* y = &(*b).req;
+    fuzz_check((*x).buf.len == (*y).buf.len);
+    fuzz_check(fuzz_same_slice((*x).method, data, (*y).method, data));
+    fuzz_check(fuzz_same_slice((*x).url, data, (*y).url, data));
+    fuzz_check(fuzz_same_slice((*x).node, data, (*y).node, data));
+    fuzz_check(fuzz_same_slice((*x).service, data, (*y).service, data));
+    fuzz_check((*x).version == (*y).version);
+    fuzz_check((*x).headerbuf.cap == (*y).headerbuf.cap);
+    for (size_t i = 0; i < (*x).headerbuf.cap; ++i) {
+        fuzz_check(fuzz_same_slice((*x).headerbuf.ptr[i].name, data, (*y).headerbuf.ptr[i].name, data));
+        fuzz_check(fuzz_same_slice((*x).headerbuf.ptr[i].value, data, (*y).headerbuf.ptr[i].value, data));
+    }
+}
+
+int LLVMFuzzerTestOneInput(uint8_t const* data, size_t size) {
+    static parse whole;
+    static parse bytewise;
+    char const* impls[] = {"scalar", "sse2", "avx2"};
+    char const* selected = scan_selected();
+
+    parse_whole(data, size, &whole);
+    check_parse(&whole, data, size);
+    parse_bytewise(data, size, &bytewise);
+    check_same(&whole, &bytewise, data);
+    for (size_t i = 0; i < sizeof(impls)/sizeof(impls[0]); ++i) {
+        if (scan_select(impls[i]) == 0) {
+            parse_whole(data, size, &bytewise);
+            check_same(&whole, &bytewise, data);
+        }
+    }
+    scan_select(selected);
+    return 0;
+}
@@ -0,0 +1,147 @@
+// Fuzz target for http_parse_response, with the same checks as
+// fuzz_request.c: slices within the input, byte-at-a-time parses equal
+// to whole ones, and every scan implementation agreeing. The bytes
+// after a parsed head are scanned as its body, whole, a byte at a
+// time and skipping over content, which must all find the same end.
+#include "fuzz.h"
+#include "../scan.h"
+
+typedef struct {
+    int err;
+    http_response res;
+    http_header headers[FUZZ_HEADERS];
+} parse;
+
+static
+void parse_whole(uint8_t const* data, size_t size, parse* p) {
+    http_response_init(&(*p).res, (http_headerbuf){(*p).headers, FUZZ_HEADERS});
+    (*p).err = http_parse_response((slice){data, size}, &(*p).res);
+}
+
+static
+void parse_bytewise(uint8_t const* data, size_t size, parse* p) {
+    http_response_init(&(*p).res, (http_headerbuf){(*p).headers, FUZZ_HEADERS});
+    (*p).err = http_partial;
+    for (size_t n = 1; n <= size && (*p).err == http_partial; ++n) {
+        (*p).err = http_parse_response((slice){data, n}, &(*p).res);
+    }
+}
+
+static
+void check_parse(parse const* p, uint8_t const* data, size_t size) {
+    if ((*p).err != 0) {
+        return;
+    }
+    http_response const* r = &(*p).res;
+    fuzz_check((*r).buf.ptr == data && (*r).buf.len <= size);
+    fuzz_check((*r).headerbuf.cap <= FUZZ_HEADERS);
+    fuzz_check_slice((*r).version.slice, data, size);
+    fuzz_check_slice((*r).status.phrase, data, size);
+    fuzz_check((*r).version.minor <= 1);
+    fuzz_check((*r).status.code >= 100 && (*r).status.code <= 999);
+    for (size_t i = 0; i < (*r).headerbuf.cap; ++i) {
+        fuzz_check_slice((*r).headerbuf.ptr[i].name, data, size);
+        fuzz_check_slice((*r).headerbuf.ptr[i].value, data, size);
+        fuzz_check((*r).headerbuf.ptr[i].name.len > 0);
+    }
+    // must not crash on any parsed response
+    size_t len;
+    http_content_length((*r).headerbuf, &len);
+    http_response_keep_alive(r);
+    http_response_body_length(r, 0);
+    http_response_body_length(r, 1);
+}
+
+static
+void check_same(parse const* a, parse const* b, uint8_t const* data) {
+    fuzz_check((*a).err == (*b).err);
+    if ((*a).err != 0) {
+        return;
+    }
+    http_response const* x = &(*a).res;
+    http_response const* y = &(*b).res;
+    fuzz_check((*x).buf.len == (*y).buf.len);
+    fuzz_check((*x).version.minor == (*y).version.minor);
+    fuzz_check((*x).status.code == (*y).status.code);
+    fuzz_check(fuzz_same_slice((*x).status.phrase, data, (*y).status.phrase, data));
+    fuzz_check((*x).headerbuf.cap == (*y).headerbuf.cap);
+    for (size_t i = 0; i < (*x).headerbuf.cap; ++i) {
+        fuzz_check(fuzz_same_slice((*x).headerbuf.ptr[i].name, data, (*y).headerbuf.ptr[i].name, data));
+        fuzz_check(fuzz_same_slice((*x).headerbuf.ptr[i].value, data, (*y).headerbuf.ptr[i].value, data));
+    }
+}
+
+typedef struct {
+    ssize_t err;
+    size_t len;
+    int done;
+} body_scan;
+
+static
+void scan_body(http_response const* r, slice body, size_t step, int skip, body_scan* s) {
+    http_body b;
+    http_body_init(&b, r, 0);
+    (*s).err = 0;
+    (*s).len = 0;
+    size_t pos = 0;
+    while (pos < body.len && !http_body_done(&b)) {
+        size_t opaque = skip ? http_body_opaque(&b, body.len - pos) : 0;
+        if (opaque > 0) {
+            http_body_skip(&b, opaque);
+            pos += opaque;
+            (*s).len += opaque;
+            continue;
+        }
+        size_t n = body.len - pos < step ? body.len - pos : step;
+        ssize_t m = http_body_scan(&b, (slice){&body.ptr[pos], n});
+        if (m < 0) {
+            (*s).err = m;
+            break;
+        }
+        fuzz_check((size_t)m <= n);
+        fuzz_check((size_t)m == n || http_body_done(&b));
+        pos += n;
+        (*s).len += m;
+    }
+    (*s).done = http_body_done(&b);
+    fuzz_check(!(*s).done || http_body_eof(&b) == 0);
+}
+
+static
+void check_body(parse const* p, uint8_t const* data, size_t size) {
+    if ((*p).err != 0) {
+        return;
+    }
+    http_response const* r = &(*p).res;
+    slice body = {&data[(*r).buf.len], size - (*r).buf.len};
+    body_scan whole, bytewise, skipping;
+    scan_body(r, body, body.len, 0, &whole);
+    scan_body(r, body, 1, 0, &bytewise);
+    scan_body(r, body, 7, 1, &skipping);
+    fuzz_check(whole.err == bytewise.err && whole.err == skipping.err);
+    if (whole.err == 0) {
+        fuzz_check(whole.len == bytewise.len && whole.len == skipping.len);
+        fuzz_check(whole.done == bytewise.done && whole.done == skipping.done);
+    }
+}
+
+int LLVMFuzzerTestOneInput(uint8_t const* data, size_t size) {
+    static parse whole;
+    static parse bytewise;
+    char const* impls[] = {"scalar", "sse2", "avx2"};
+    char const* selected = scan_selected();
+
+    parse_whole(data, size, &whole);
+    check_parse(&whole, data, size);
+    check_body(&whole, data, size);
+    parse_bytewise(data, size, &bytewise);
+    check_same(&whole, &bytewise, data);
+    for (size_t i = 0; i < sizeof(impls)/sizeof(impls[0]); ++i) {
+        if (scan_select(impls[i]) == 0) {
+            parse_whole(data, size, &bytewise);
+            check_same(&whole, &bytewise, data);
+        }
+    }
+    scan_select(selected);
+    return 0;
+}
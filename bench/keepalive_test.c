@@ -0,0 +1,133 @@
+// Requests url from the proxy count times over one connection and
+// checks that every response is a 200 whose body is framed, ends
+// where its framing says, and leaves the connection open. A response
+// the client cannot find the end of fails after TEST_TIMEOUT_S rather
+// than hanging.
+//
+//   keepalive_test proxy_port url count
+#define _GNU_SOURCE
+#include "../http.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#define TEST_BUFLEN     65536
+#define TEST_HEADERS    64
+#define TEST_TIMEOUT_S  2
+
+static uint8_t buf[TEST_BUFLEN];
+static size_t count;
+
+static
+int dial(int port) {
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    int fd = socket(AF_INET, SOCK_STREAM|SOCK_CLOEXEC, 0);
+    struct timeval tv = {TEST_TIMEOUT_S, 0};
+    if (fd == -1 || setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) != 0
+        || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        perror("connect");
+        exit(1);
+    }
+    return fd;
+}
+
+// Reads more into buf. Returns what read returned.
+static
+ssize_t more(int fd) {
+    if (count == TEST_BUFLEN) {
+        return -1;
+    }
+    ssize_t n = read(fd, &buf[count], TEST_BUFLEN - count);
+    if (n > 0) {
+        count += n;
+    }
+    return n;
+}
+
+// Reads one response. Returns NULL if it passed, else what is wrong.
+static
+char const* check_response(int fd) {
+    http_header headers[TEST_HEADERS];
+    http_response res;
+    http_response_init(&res, (http_headerbuf){headers, TEST_HEADERS});
+    while (1) {
+        int err = http_parse_response((slice){buf, count}, &res);
+        if (err == 0) {
+            break;
+        }
+        if (err != http_partial) {
+            return "bad response head";
+        }
+        ssize_t n = more(fd);
+        if (n <= 0) {
+            return n == 0 ? "closed before the head" : "no head in time";
+        }
+    }
+    if (res.status.code != 200) {
+        return "status is not 200";
+    }
+    http_body body;
+    http_body_init(&body, &res, 0);
+    if (body.framing == HTTP_BODY_CLOSE) {
+        return "body not framed";
+    }
+    if (!http_response_keep_alive(&res)) {
+        return "connection not kept";
+    }
+    size_t pos = res.buf.len;
+    while (1) {
+        ssize_t used = http_body_scan(&body, (slice){&buf[pos], count - pos});
+        if (used < 0) {
+            return "bad chunk framing";
+        }
+        pos += used;
+        if (http_body_done(&body)) {
+            break;
+        }
+        count = 0;
+        pos = 0;
+        ssize_t n = more(fd);
+        if (n <= 0) {
+            return n == 0 ? "closed before the end of the body" : "no end of the body in time";
+        }
+    }
+    memmove(buf, &buf[pos], count - pos);
+    count -= pos;
+    return NULL;
+}
+
+int main(int argc, char* const argv[]) {
+    if (argc != 4) {
+        fprintf(stderr, "usage: %s proxy_port url count\n", argv[0]);
+        return 1;
+    }
+    char const* url = argv[2];
+    int n = atoi(argv[3]);
+    char const* host = strstr(url, "://");
+    host = host ? host + 3 : url;
+    int hostlen = strcspn(host, "/");
+    char req[2048];
+    int reqlen = snprintf(req, sizeof(req), "GET %s HTTP/1.1\r\nHost: %.*s\r\n\r\n", url, hostlen, host);
+
+    int fd = dial(atoi(argv[1]));
+    for (int i = 0; i < n; ++i) {
+        char const* err = "cannot send the request";
+        if (write(fd, req, reqlen) == reqlen) {
+            err = check_response(fd);
+        }
+        if (err) {
+            printf("response %d: %s\n", i + 1, err);
+            return 1;
+        }
+    }
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,74 @@
+#!/bin/bash
+# Checks that hits keep the client connection, including hits on
+# objects the origin sent without framing (the end of the body told by
+# its close): those are stored with a Content-Length. Each engine and
+# tier first fetches every object once, a miss, then must serve it
+# twice over one keep-alive connection.
+set -e
+cd "$(dirname "$0")/.."
+
+ORIGIN_PORT=${ORIGIN_PORT:-18090}
+PROXY_PORT=${PROXY_PORT:-18091}
+ORIGIN=http://127.0.0.1:$ORIGIN_PORT
+
+origin=
+proxy=
+dir=$(mktemp -d)
+cleanup() {
+    [ -n "$proxy" ] && kill $proxy 2>/dev/null
+    [ -n "$origin" ] && kill $origin 2>/dev/null
+    rm -rf "$dir"
+    return 0
+}
+trap cleanup EXIT INT TERM
+
+# Waits until something accepts connections on port $1.
+wait_port() {
+    i=0
+    while ! (exec 3<>/dev/tcp/127.0.0.1/$1) 2>/dev/null; do
+        i=$((i + 1))
+        [ $i -gt 50 ] && { echo "nothing listening on port $1" >&2; exit 1; }
+        sleep 0.1
+    done
+}
+
+# Fetches $1 through the proxy on a connection of its own.
+fetch() {
+    exec 3<>/dev/tcp/127.0.0.1/$PROXY_PORT
+    printf "GET %s HTTP/1.0\r\n\r\n" "$1" >&3
+    cat <&3 >/dev/null
+    exec 3<&-
+}
+
+./bench/origin $ORIGIN_PORT &
+origin=$!
+wait_port $ORIGIN_PORT
+
+failed=0
+# label, then webproxy flags
+check() {
+    label=$1
+    shift
+    rm -rf "$dir"/*
+    ./webproxy -l error "$@" $PROXY_PORT &
+    proxy=$!
+    wait_port $PROXY_PORT
+    for object in "length?size=5000" "chunked?size=5000&chunked=1" "unframed?size=5000&unframed=1"; do
+        fetch "$ORIGIN/$object"
+        if out=$(./bench/keepalive_test $PROXY_PORT "$ORIGIN/$object" 2); then
+            echo "$label ${object%%\?*}: ok"
+        else
+            echo "$label ${object%%\?*}: $out"
+            failed=1
+        fi
+    done
+    kill $proxy
+    wait $proxy 2>/dev/null || true
+    proxy=
+}
+
+check threaded
+check epoll -e
+check threaded/disk -d "$dir"
+check epoll/disk -e -d "$dir"
+exit $failed
@@ -0,0 +1,407 @@
+// A closed-loop HTTP load generator for benchmarking webproxy: every
+// connection runs on its own thread, sends a request for the next of
+// the urls, reads the whole response and sends the next one on the same
+// connection if it stays open. Prints requests per second and latency
+// percentiles, and appends them as one JSON object to the -o file.
+// Threads get small stacks and the fd limit is raised as far as -c
+// needs, so one generator can hold 10k connections.
+//
+//   -c connections   concurrent connections (default 16)
+//   -d seconds       measured duration (default 5)
+//   -w seconds       warmup before measuring (default 1)
+//   -o file          append the results as JSON to file
+//   -l label         name of the run in the results
+#define _GNU_SOURCE
+#include "../http.h"
+#include "../stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+
+#define LOAD_BUFLEN     65536
+#define LOAD_HEADERS    64
+#define LOAD_STACK      (64 << 10)  // the buffer is on the heap
+
+typedef struct {
+    int id;
+    pthread_t thread;
+    uint64_t requests;
+    uint64_t errors;
+    uint64_t bytes;
+    uint64_t hist[STATS_BUCKETS];
+} client;
+
+static int port;
+static char* const* urls;
+static int nurls;
+static uint64_t measure_from;
+static uint64_t measure_until;
+
+static
+int dial(void) {
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    int fd = socket(AF_INET, SOCK_STREAM|SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+static
+int write_all(int fd, char const* buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Unread bytes are buf[*pos, *count).
+typedef struct {
+    int fd;
+    uint8_t* buf;
+    size_t pos;
+    size_t count;
+} stream;
+
+// Moves the unread bytes to the front of the buffer.
+static
+void compact(stream* s) {
+    if ((*s).pos > 0) {
+        memmove((*s).buf, &(*s).buf[(*s).pos], (*s).count - (*s).pos);
+        (*s).count -= (*s).pos;
+        (*s).pos = 0;
+    }
+}
+
+// Reads more bytes, keeping the unread ones. Returns the number read.
+static
+ssize_t fill(stream* s) {
+    compact(s);
+    if ((*s).count == LOAD_BUFLEN) {
+        return -1;
+    }
+    ssize_t n = read((*s).fd, &(*s).buf[(*s).count], LOAD_BUFLEN - (*s).count);
+    if (n > 0) {
+        (*s).count += n;
+    }
+    return n;
+}
+
+// Consumes len bytes, or everything up to EOF if len is -1.
+static
+int skip(stream* s, ssize_t len, uint64_t* bytes) {
+    while (len != 0) {
+        if ((*s).pos == (*s).count) {
+            ssize_t n = fill(s);
+            if (n == 0 && len < 0) {
+                return 0;
+            }
+            if (n <= 0) {
+                return -1;
+            }
+        }
+        size_t n = (*s).count - (*s).pos;
+        if (len >= 0 && (size_t)len < n) {
+            n = len;
+        }
+        (*s).pos += n;
+        *bytes += n;
+        if (len > 0) {
+            len -= n;
+        }
+    }
+    return 0;
+}
+
+// Consumes one line, returning its start, NULL on error.
+static
+char const* line(stream* s, size_t* len) {
+    while (1) {
+        uint8_t* lf = memchr(&(*s).buf[(*s).pos], '\n', (*s).count - (*s).pos);
+        if (lf) {
+            char const* start = (char const*)&(*s).buf[(*s).pos];
+            *len = (char const*)lf - start + 1;
+            (*s).pos += *len;
+            return start;
+        }
+        if (fill(s) <= 0) {
+            return NULL;
+        }
+    }
+}
+
+static
+int skip_chunked(stream* s, uint64_t* bytes) {
+    while (1) {
+        size_t len;
+        char const* l = line(s, &len);
+        if (l == NULL) {
+            return -1;
+        }
+        size_t size = strtoull(l, NULL, 16);
+        if (size == 0) {
+            break;
+        }
+        if (skip(s, size, bytes) != 0 || line(s, &len) == NULL) {
+            return -1;
+        }
+    }
+    // trailers, up to the empty line
+    while (1) {
+        size_t len;
+        char const* l = line(s, &len);
+        if (l == NULL) {
+            return -1;
+        }
+        if (len <= 2) {
+            return 0;
+        }
+    }
+}
+
+// Reads one response. Returns its status code, or -1 on error;
+// *keep says whether the connection carries on.
+static
+int read_response(stream* s, uint64_t* bytes, int* keep) {
+    http_header headers[LOAD_HEADERS];
+    http_response res;
+    http_response_init(&res, (http_headerbuf){headers, LOAD_HEADERS});
+    compact(s);
+    while (1) {
+        int err = http_parse_response((slice){&(*s).buf[(*s).pos], (*s).count - (*s).pos}, &res);
+        if (err == 0) {
+            break;
+        }
+        // the parser resumes by offset, so the unread bytes must not move
+        if (err != http_partial || (*s).count == LOAD_BUFLEN) {
+            return -1;
+        }
+        ssize_t n = read((*s).fd, &(*s).buf[(*s).count], LOAD_BUFLEN - (*s).count);
+        if (n <= 0) {
+            return -1;
+        }
+        (*s).count += n;
+    }
+    (*s).pos += res.buf.len;
+    int status = res.status.code;
+
+    slice te;
+    int chunked = http_find_header(res.headerbuf, "Transfer-Encoding", &te)
+        && te.len >= 7 && strncasecmp((char const*)&te.ptr[te.len - 7], "chunked", 7) == 0;
+    ssize_t bodylen = http_response_body_length(&res, 0);
+    *keep = http_response_keep_alive(&res) && (chunked || bodylen >= 0);
+    int err = chunked ? skip_chunked(s, bytes) : skip(s, bodylen, bytes);
+    return err == 0 ? status : -1;
+}
+
+static
+void* run(void* arg) {
+    client* c = arg;
+    uint8_t* buf = malloc(LOAD_BUFLEN);
+    if (buf == NULL) {
+        (*c).errors += 1;
+        return NULL;
+    }
+    stream s = {-1, buf, 0, 0};
+    char req[2048];
+    int next = (*c).id;
+    uint64_t now;
+    while ((now = stats_now()) < measure_until) {
+        if (s.fd == -1) {
+            s.fd = dial();
+            s.pos = 0;
+            s.count = 0;
+            if (s.fd == -1) {
+                (*c).errors += now >= measure_from;
+                struct timespec ts = {0, 1000000};
+                nanosleep(&ts, NULL);
+                continue;
+            }
+        }
+        char const* url = urls[next++ % nurls];
+        char const* host = strstr(url, "://");
+        host = host ? host + 3 : url;
+        int hostlen = strcspn(host, "/");
+        int n = snprintf(req, sizeof(req), "GET %s HTTP/1.1\r\nHost: %.*s\r\n\r\n", url, hostlen, host);
+
+        uint64_t start = stats_now();
+        uint64_t bytes = 0;
+        int keep = 0;
+        int status = -1;
+        if (write_all(s.fd, req, n) == 0) {
+            status = read_response(&s, &bytes, &keep);
+        }
+        uint64_t end = stats_now();
+        if (start >= measure_from && end <= measure_until) {
+            if (status == 200) {
+                (*c).requests += 1;
+                (*c).bytes += bytes;
+                (*c).hist[stats_bucket(end - start)] += 1;
+            } else {
+                (*c).errors += 1;
+            }
+        }
+        if (status < 0 || !keep) {
+            close(s.fd);
+            s.fd = -1;
+        }
+    }
+    if (s.fd != -1) {
+        close(s.fd);
+    }
+    free(buf);
+    return NULL;
+}
+
+// Raises the soft limit on open files to fit n connections.
+static
+int raise_nofile(int n) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) != 0) {
+        return -1;
+    }
+    rlim_t want = n + 64;
+    if (rl.rlim_cur >= want) {
+        return 0;
+    }
+    if (rl.rlim_max != RLIM_INFINITY && rl.rlim_max < want) {
+        fprintf(stderr, "load: %d connections need %llu files, the hard limit is %llu\n",
+                n, (unsigned long long)want, (unsigned long long)rl.rlim_max);
+        return -1;
+    }
+    rl.rlim_cur = want;
+    return setrlimit(RLIMIT_NOFILE, &rl);
+}
+
+static
+double percentile(uint64_t const* hist, uint64_t count, double q) {
+    uint64_t rank = (uint64_t)(q * count + 0.999999);
+    uint64_t seen = 0;
+    for (int b = 0; b < STATS_BUCKETS && count > 0; ++b) {
+        seen += hist[b];
+        if (seen >= rank) {
+            return stats_bucket_top(b) / 1e3;
+        }
+    }
+    return 0;
+}
+
+static
+void usage(char const* argv0) {
+    fprintf(stderr, "usage: %s [-c connections] [-d seconds] [-w warmup_seconds]"
+                    " [-o results.json] [-l label] proxy_port url...\n", argv0);
+}
+
+int main(int argc, char* const argv[]) {
+    int nconns = 16;
+    double duration = 5;
+    double warmup = 1;
+    char const* out = NULL;
+    char const* label = "";
+    int opt;
+    while ((opt = getopt(argc, argv, "c:d:w:o:l:")) != -1) {
+        switch (opt) {
+        case 'c': nconns = atoi(optarg); break;
+        case 'd': duration = atof(optarg); break;
+        case 'w': warmup = atof(optarg); break;
+        case 'o': out = optarg; break;
+        case 'l': label = optarg; break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (nconns < 1 || optind + 2 > argc) {
+        usage(argv[0]);
+        return 1;
+    }
+    port = atoi(argv[optind]);
+    if (raise_nofile(nconns) != 0) {
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    urls = &argv[optind + 1];
+    nurls = argc - optind - 1;
+
+    client* clients = calloc(nconns, sizeof(client));
+    if (clients == NULL) {
+        perror("calloc");
+        return 1;
+    }
+    measure_from = stats_now() + (uint64_t)(warmup * 1e9);
+    measure_until = measure_from + (uint64_t)(duration * 1e9);
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, LOAD_STACK);
+    for (int i = 0; i < nconns; ++i) {
+        clients[i].id = i;
+        if (pthread_create(&clients[i].thread, &attr, run, &clients[i]) != 0) {
+            perror("pthread_create");
+            return 1;
+        }
+    }
+
+    static uint64_t hist[STATS_BUCKETS];
+    uint64_t requests = 0;
+    uint64_t errors = 0;
+    uint64_t bytes = 0;
+    for (int i = 0; i < nconns; ++i) {
+        pthread_join(clients[i].thread, NULL);
+        requests += clients[i].requests;
+        errors += clients[i].errors;
+        bytes += clients[i].bytes;
+        for (int b = 0; b < STATS_BUCKETS; ++b) {
+            hist[b] += clients[i].hist[b];
+        }
+    }
+    free(clients);
+
+    double rps = requests / duration;
+    double mbps = bytes / duration / (1 << 20);
+    double p50 = percentile(hist, requests, 0.5);
+    double p99 = percentile(hist, requests, 0.99);
+    double p999 = percentile(hist, requests, 0.999);
+    printf("%-24s %6d conns %10.0f req/s %9.1f MiB/s  p50 %8.0fus  p99 %8.0fus  p99.9 %8.0fus  errors %llu\n",
+           label, nconns, rps, mbps, p50, p99, p999, (unsigned long long)errors);
+    if (out) {
+        FILE* f = fopen(out, "a");
+        if (f == NULL) {
+            perror(out);
+            return 1;
+        }
+        fprintf(f, "{\"label\": \"%s\", \"connections\": %d, \"duration_s\": %g,"
+                   " \"requests\": %llu, \"errors\": %llu, \"rps\": %.1f, \"mib_per_s\": %.2f,"
+                   " \"p50_us\": %.0f, \"p99_us\": %.0f, \"p999_us\": %.0f}\n",
+                label, nconns, duration, (unsigned long long)requests, (unsigned long long)errors,
+                rps, mbps, p50, p99, p999);
+        fclose(f);
+    }
+    return 0;
+}
@@ -0,0 +1,270 @@
+// A local origin server for benchmarks. Every request is answered
+// with a body of 'x' bytes; the defaults below can be overridden per
+// request with query parameters, e.g. /a?size=4096&delay=5&nostore=1,
+// and unframed=1 ends the body by closing instead of framing it.
+//
+//   -s size      body size, or min-max for uniformly random sizes
+//   -d delay     milliseconds to wait before answering
+//   -c           chunked framing instead of Content-Length
+//   -n           Cache-Control: no-store instead of max-age=3600
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#define HEADLEN     8192
+#define CHUNKLEN    16384
+
+typedef struct {
+    size_t min;
+    size_t max;
+    int delay;
+    int chunked;
+    int nostore;
+    int unframed;
+} options;
+
+static options defaults = {100, 100, 0, 0, 0, 0};
+static char filler[CHUNKLEN];
+
+static
+int parse_sizes(char const* s, size_t* min, size_t* max) {
+    char* end = NULL;
+    *min = strtoull(s, &end, 10);
+    *max = *min;
+    if (*end == '-') {
+        *max = strtoull(end + 1, &end, 10);
+    }
+    return *end == '\0' && *max >= *min ? 0 : -1;
+}
+
+static
+int write_all(int fd, char const* buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static
+int write_body(int fd, size_t len, int chunked) {
+    while (len > 0) {
+        size_t n = len < CHUNKLEN ? len : CHUNKLEN;
+        if (chunked) {
+            char size[32];
+            int m = snprintf(size, sizeof(size), "%zx\r\n", n);
+            if (write_all(fd, size, m) != 0) {
+                return -1;
+            }
+        }
+        if (write_all(fd, filler, n) != 0 || (chunked && write_all(fd, "\r\n", 2) != 0)) {
+            return -1;
+        }
+        len -= n;
+    }
+    return chunked ? write_all(fd, "0\r\n\r\n", 5) : 0;
+}
+
+// Applies the query parameters of target to o.
+static
+void parse_query(char const* target, size_t len, options* o) {
+    char query[1024];
+    char const* q = memchr(target, '?', len);
+    if (q == NULL || (size_t)(target + len - q) >= sizeof(query)) {
+        return;
+    }
+    memcpy(query, q + 1, target + len - q - 1);
+    query[target + len - q - 1] = '\0';
+    char* save = NULL;
+    for (char* kv = strtok_r(query, "&", &save); kv; kv = strtok_r(NULL, "&", &save)) {
+        char* v = strchr(kv, '=');
+        if (v == NULL) {
+            continue;
+        }
+        *v++ = '\0';
+        if (strcmp(kv, "size") == 0) {
+            parse_sizes(v, &(*o).min, &(*o).max);
+        } else if (strcmp(kv, "delay") == 0) {
+            (*o).delay = atoi(v);
+        } else if (strcmp(kv, "chunked") == 0) {
+            (*o).chunked = atoi(v);
+        } else if (strcmp(kv, "nostore") == 0) {
+            (*o).nostore = atoi(v);
+        } else if (strcmp(kv, "unframed") == 0) {
+            (*o).unframed = atoi(v);
+        }
+    }
+}
+
+// Answers the request in head. Returns 1 if the connection stays open.
+static
+int respond(int fd, char* head, unsigned* seed) {
+    options o = defaults;
+    char* sp1 = strchr(head, ' ');
+    char* sp2 = sp1 ? strchr(sp1 + 1, ' ') : NULL;
+    if (sp2 == NULL) {
+        return 0;
+    }
+    int is_head = sp1 - head == 4 && memcmp(head, "HEAD", 4) == 0;
+    parse_query(sp1 + 1, sp2 - sp1 - 1, &o);
+    int http11 = strncmp(sp2 + 1, "HTTP/1.1", 8) == 0;
+    // good enough for the Connection headers clients send
+    int keep = http11 ? strcasestr(head, "\nConnection: close") == NULL
+                      : strcasestr(head, "\nConnection: keep-alive") != NULL;
+    if ((o.chunked && !http11) || o.unframed) {
+        // the end of the body can only be told by the close
+        keep = 0;
+    }
+
+    size_t len = o.min;
+    if (o.max > o.min) {
+        len += rand_r(seed) % (o.max - o.min + 1);
+    }
+    if (o.delay > 0) {
+        struct timespec ts = {o.delay / 1000, (o.delay % 1000) * 1000000L};
+        nanosleep(&ts, NULL);
+    }
+
+    char res[512];
+    int n = snprintf(res, sizeof(res),
+        "HTTP/1.1 200 OK\r\n"
+        "Content-Type: application/octet-stream\r\n"
+        "Cache-Control: %s\r\n",
+        o.nostore ? "no-store" : "max-age=3600");
+    if (o.unframed) {
+        o.chunked = 0;
+    } else if (o.chunked) {
+        n += snprintf(&res[n], sizeof(res) - n, "Transfer-Encoding: chunked\r\n");
+    } else {
+        n += snprintf(&res[n], sizeof(res) - n, "Content-Length: %zu\r\n", len);
+    }
+    n += snprintf(&res[n], sizeof(res) - n, "Connection: %s\r\n\r\n", keep ? "keep-alive" : "close");
+    if (write_all(fd, res, n) != 0) {
+        return 0;
+    }
+    if (!is_head && write_body(fd, len, o.chunked) != 0) {
+        return 0;
+    }
+    return keep;
+}
+
+static
+void* serve(void* arg) {
+    int fd = (int)(intptr_t)arg;
+    unsigned seed = (unsigned)fd * 2654435761u;
+    char buf[HEADLEN + 1];
+    size_t count = 0;
+    int keep = 1;
+    while (keep) {
+        char* end;
+        buf[count] = '\0';
+        while ((end = strstr(buf, "\r\n\r\n")) == NULL) {
+            if (count == HEADLEN) {
+                goto done;
+            }
+            ssize_t n = read(fd, &buf[count], HEADLEN - count);
+            if (n <= 0) {
+                goto done;
+            }
+            count += n;
+            buf[count] = '\0';
+        }
+        end += 4;
+        char saved = *end;
+        *end = '\0';
+        keep = respond(fd, buf, &seed);
+        *end = saved;
+        count -= end - buf;
+        memmove(buf, end, count);
+    }
+done:
+    close(fd);
+    return NULL;
+}
+
+static
+void usage(char const* argv0) {
+    fprintf(stderr, "usage: %s [-s size|min-max] [-d delay_ms] [-c] [-n] port\n", argv0);
+}
+
+int main(int argc, char* const argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "s:d:cn")) != -1) {
+        switch (opt) {
+        case 's':
+            if (parse_sizes(optarg, &defaults.min, &defaults.max) != 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'd':
+            defaults.delay = atoi(optarg);
+            break;
+        case 'c':
+            defaults.chunked = 1;
+            break;
+        case 'n':
+            defaults.nostore = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind >= argc) {
+        usage(argv[0]);
+        return 1;
+    }
+    memset(filler, 'x', sizeof(filler));
+    signal(SIGPIPE, SIG_IGN);
+
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(atoi(argv[optind]));
+    int ln = socket(AF_INET, SOCK_STREAM|SOCK_CLOEXEC, 0);
+    int one = 1;
+    setsockopt(ln, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (ln == -1 || bind(ln, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(ln, 1024) != 0) {
+        perror("origin: listen");
+        return 1;
+    }
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_attr_setstacksize(&attr, 256 * 1024);
+    while (1) {
+        int fd = accept4(ln, NULL, NULL, SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno != EINTR && errno != ECONNABORTED) {
+                perror("origin: accept4");
+            }
+            continue;
+        }
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        pthread_t thread;
+        if (pthread_create(&thread, &attr, serve, (void*)(intptr_t)fd) != 0) {
+            close(fd);
+        }
+    }
+}
@@ -0,0 +1,114 @@
+// Parses every message of the request and response corpora (the seeds
+// in bench/corpus, or a corpus grown by the fuzz targets) over and over
+// and reports messages and bytes parsed per second.
+#define _GNU_SOURCE
+#include "../http.h"
+#include "../scan.h"
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define MAX_MESSAGES    4096
+#define MAX_MESSAGE     (1 << 16)
+#define HEADERS         64
+#define SECONDS         1.0
+
+typedef struct {
+    uint8_t* ptr;
+    size_t len;
+} message;
+
+static
+size_t load(char const* dir, message* msgs) {
+    DIR* d = opendir(dir);
+    if (!d) {
+        perror(dir);
+        exit(1);
+    }
+    size_t n = 0;
+    struct dirent* e;
+    while ((e = readdir(d)) != NULL && n < MAX_MESSAGES) {
+        if (e->d_name[0] == '.') {
+            continue;
+        }
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+        FILE* f = fopen(path, "rb");
+        if (!f) {
+            continue;
+        }
+        msgs[n].ptr = malloc(MAX_MESSAGE);
+        msgs[n].len = fread(msgs[n].ptr, 1, MAX_MESSAGE, f);
+        fclose(f);
+        n += 1;
+    }
+    closedir(d);
+    return n;
+}
+
+static
+double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static
+int parse(int response, message const* m) {
+    http_header headers[HEADERS];
+    if (response) {
+        http_response res;
+        http_response_init(&res, (http_headerbuf){headers, HEADERS});
+        return http_parse_response((slice){(*m).ptr, (*m).len}, &res);
+    }
+    http_request req;
+    http_request_init(&req, headers, HEADERS);
+    return http_parse_request((*m).ptr, (*m).len, &req);
+}
+
+static
+void bench(char const* dir, int response) {
+    static message msgs[MAX_MESSAGES];
+    size_t n = load(dir, msgs);
+    if (n == 0) {
+        fprintf(stderr, "%s: empty corpus\n", dir);
+        return;
+    }
+    size_t valid = 0;
+    for (size_t i = 0; i < n; ++i) {
+        valid += parse(response, &msgs[i]) == 0;
+    }
+
+    size_t parsed = 0;
+    size_t bytes = 0;
+    volatile int sink = 0;
+    double start = now();
+    double elapsed;
+    do {
+        for (int round = 0; round < 100; ++round) {
+            for (size_t i = 0; i < n; ++i) {
+                sink += parse(response, &msgs[i]);
+                bytes += msgs[i].len;
+            }
+            parsed += n;
+        }
+        elapsed = now() - start;
+    } while (elapsed < SECONDS);
+
+    printf("%-24s %5zu messages (%zu valid)  %10.0f parses/s  %8.1f MB/s\n",
+        dir, n, valid, parsed / elapsed, bytes / elapsed / 1e6);
+    for (size_t i = 0; i < n; ++i) {
+        free(msgs[i].ptr);
+    }
+}
+
+int main(int argc, char** argv) {
+    char const* requests = argc > 1 ? argv[1] : "bench/corpus/request";
+    char const* responses = argc > 2 ? argv[2] : "bench/corpus/response";
+    printf("scan: %s\n", scan_selected());
+    bench(requests, 0);
+    bench(responses, 1);
+    return 0;
+}
@@ -0,0 +1,97 @@
+#!/bin/bash
+# Runs bench/load against webproxy in front of bench/origin, for each
+# engine (thread per connection, one epoll loop, and 1, 2, 4, ... event
+# loop workers up to the number of CPUs) and each scenario below.
+# Results are appended to $OUT, one JSON object per run.
+#
+#   hit      1 KiB cacheable object, served from the memory cache
+#   miss     1 KiB no-store object, over pooled origin connections
+#   large    1 MiB no-store object, relayed with splice
+#   chunked  16 KiB no-store chunked object, ended by its chunk framing
+#
+# Then the thread per connection engine (sized to one thread per
+# connection) and one epoll loop each serve the hit scenario to
+# $BIG_CONNS connections at once.
+set -e
+cd "$(dirname "$0")/.."
+
+ORIGIN_PORT=${ORIGIN_PORT:-18080}
+PROXY_PORT=${PROXY_PORT:-18081}
+DURATION=${DURATION:-5}
+WARMUP=${WARMUP:-1}
+CONNS=${CONNS:-32}
+MAX_WORKERS=${MAX_WORKERS:-$(nproc)}
+BIG_CONNS=${BIG_CONNS:-10000}
+OUT=${OUT:-bench/results.json}
+
+origin=
+proxy=
+cleanup() {
+    [ -n "$proxy" ] && kill $proxy 2>/dev/null
+    [ -n "$origin" ] && kill $origin 2>/dev/null
+    return 0
+}
+trap cleanup EXIT INT TERM
+
+# webproxy needs a file for each of the $BIG_CONNS clients; bench/load
+# raises its own limit
+ulimit -n $(ulimit -Hn)
+
+# Waits until something accepts connections on port $1.
+wait_port() {
+    i=0
+    while ! (exec 3<>/dev/tcp/127.0.0.1/$1) 2>/dev/null; do
+        i=$((i + 1))
+        [ $i -gt 50 ] && { echo "nothing listening on port $1" >&2; exit 1; }
+        sleep 0.1
+    done
+}
+
+ORIGIN=http://127.0.0.1:$ORIGIN_PORT
+./bench/origin $ORIGIN_PORT &
+origin=$!
+wait_port $ORIGIN_PORT
+
+# engine label, then webproxy flags
+bench_engine() {
+    label=$1
+    shift
+    ./webproxy -l error "$@" $PROXY_PORT &
+    proxy=$!
+    wait_port $PROXY_PORT
+    load="./bench/load -c $CONNS -d $DURATION -w $WARMUP -o $OUT"
+    $load -l "$label/hit" $PROXY_PORT "$ORIGIN/hit?size=1024"
+    $load -l "$label/miss" $PROXY_PORT "$ORIGIN/miss?size=1024&nostore=1"
+    $load -l "$label/large" $PROXY_PORT "$ORIGIN/large?size=1048576&nostore=1"
+    $load -l "$label/chunked" $PROXY_PORT "$ORIGIN/chunked?size=16384&nostore=1&chunked=1"
+    kill $proxy
+    wait $proxy 2>/dev/null || true
+    proxy=
+}
+
+bench_engine threaded
+bench_engine epoll -e
+n=1
+while [ $n -le $MAX_WORKERS ]; do
+    bench_engine "workers-$n" -w $n
+    n=$((n * 2))
+done
+
+# engine label, then webproxy flags
+bench_big() {
+    label=$1
+    shift
+    ./webproxy -l error "$@" $PROXY_PORT &
+    proxy=$!
+    wait_port $PROXY_PORT
+    # connecting them all takes a while
+    ./bench/load -c $BIG_CONNS -d $DURATION -w $((WARMUP + 5)) -o $OUT \
+        -l "$label/hit-$BIG_CONNS" $PROXY_PORT "$ORIGIN/hit?size=1024"
+    kill $proxy
+    wait $proxy 2>/dev/null || true
+    proxy=
+}
+
+bench_big threaded -t $BIG_CONNS -S 128k -q $BIG_CONNS
+bench_big epoll -e
+echo "results appended to $OUT"
@@ -0,0 +1,148 @@
+// Compares the delimiter scanners of scan.c on header blocks:
+// checks that every implementation finds the same offsets as the
+// scalar one, then reports bytes per cycle for scanning alone and
+// for whole http_parse_request calls.
+#include "../http.h"
+#include "../scan.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#define ROUNDS      200000
+#define HEADERS     64
+
+static char const* requests[] = {
+    "GET http://www.example.org/ HTTP/1.1\r\n"
+    "Host: www.example.org\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 Firefox/115.0\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate\r\n"
+    "Connection: keep-alive\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "\r\n",
+
+    "GET http://static.example.org/assets/app.3f9c2e1b.js HTTP/1.1\r\n"
+    "Host: static.example.org\r\n"
+    "User-Agent: Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0.0.0 Safari/537.36\r\n"
+    "Accept: */*\r\n"
+    "Referer: http://www.example.org/products/category/shoes?page=2&sort=price_asc\r\n"
+    "Accept-Encoding: gzip, deflate\r\n"
+    "Accept-Language: en-GB,en-US;q=0.9,en;q=0.8\r\n"
+    "Cookie: session=8f14e45fceea167a5a36dedd4bea2543; _ga=GA1.2.1234567890.1700000000; prefs=theme%3Ddark%26lang%3Den\r\n"
+    "If-None-Match: \"5d8c72a5edda8d6a:3239\"\r\n"
+    "\r\n",
+
+    "HEAD http://api.example.org/v1/items/42 HTTP/1.0\r\n"
+    "Host: api.example.org\r\n"
+    "Accept: application/json\r\n"
+    "\r\n",
+};
+#define NREQUESTS (sizeof(requests)/sizeof(requests[0]))
+
+static
+uint64_t now_cycles(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+static
+int check(char const* name) {
+    uint8_t buf[256];
+    srand(1);
+    for (int round = 0; round < 20000; ++round) {
+        size_t len = rand() % sizeof(buf);
+        for (size_t i = 0; i < len; ++i) {
+            // mostly token bytes, some delimiters
+            int r = rand() % 40;
+            buf[i] = r == 0 ? ' ' : r == 1 ? '\t' : r == 2 ? '\r' : r == 3 ? '\n' : 'a' + r;
+        }
+        size_t off = len ? rand() % len : 0;
+        scan_select("scalar");
+        size_t space = scan_space(&buf[off], len - off);
+        size_t eol = scan_eol(&buf[off], len - off);
+        scan_select(name);
+        if (scan_space(&buf[off], len - off) != space || scan_eol(&buf[off], len - off) != eol) {
+            printf("%s: mismatch at round %d\n", name, round);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Scans every request the way the parser does: tokens, then lines.
+static
+size_t scan_all(void) {
+    size_t found = 0;
+    for (size_t r = 0; r < NREQUESTS; ++r) {
+        uint8_t const* buf = (uint8_t const*)requests[r];
+        size_t len = strlen(requests[r]);
+        size_t pos = 0;
+        while (pos < len) {
+            size_t n = scan_eol(&buf[pos], len - pos);
+            found += scan_space(&buf[pos], n);
+            pos += n + 1;
+        }
+    }
+    return found;
+}
+
+static
+int parse_all(void) {
+    http_header headers[HEADERS];
+    int ok = 0;
+    for (size_t r = 0; r < NREQUESTS; ++r) {
+        http_request req;
+        http_request_init(&req, headers, HEADERS);
+        ok += http_parse_request((uint8_t const*)requests[r], strlen(requests[r]), &req) == 0;
+    }
+    return ok;
+}
+
+int main(void) {
+    size_t bytes = 0;
+    for (size_t r = 0; r < NREQUESTS; ++r) {
+        bytes += strlen(requests[r]);
+    }
+
+    char const* names[] = {"scalar", "sse2", "avx2"};
+    printf("%-8s %14s %14s\n", "impl", "scan B/cycle", "parse B/cycle");
+    for (size_t i = 0; i < sizeof(names)/sizeof(names[0]); ++i) {
+        if (scan_select(names[i]) != 0) {
+            printf("%-8s unsupported\n", names[i]);
+            continue;
+        }
+        if (check(names[i]) != 0) {
+            return 1;
+        }
+        scan_select(names[i]);
+
+        volatile size_t sink = 0;
+        uint64_t start = now_cycles();
+        for (int round = 0; round < ROUNDS; ++round) {
+            sink += scan_all();
+        }
+        uint64_t scan_cycles = now_cycles() - start;
+
+        start = now_cycles();
+        for (int round = 0; round < ROUNDS; ++round) {
+            sink += parse_all();
+        }
+        uint64_t parse_cycles = now_cycles() - start;
+        (void)sink;
+
+        printf("%-8s %14.3f %14.3f\n", names[i],
+            (double)bytes * ROUNDS / scan_cycles,
+            (double)bytes * ROUNDS / parse_cycles);
+    }
+    return 0;
+}
@@ -0,0 +1,1234 @@
+#define _GNU_SOURCE
+#include "cache.h"
+#include "sketch.h"
+#include "epoch.h"
+#include "shm.h"
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <time.h>
+
+#define CACHE_SHARDS        16      // at most, a power of two
+#define CACHE_MIN_BUCKETS   64      // per shard, a power of two
+#define CACHE_SLOTS         4       // per bucket, which fills a cache line
+#define CACHE_READS         64      // lookups buffered per shard, a power of two
+#define CACHE_FILL_CHUNK    16384
+#define CACHE_HOLDS         16384   // references tracked per worker process, a power of two
+// room in the shared region for each worker process's statistics
+#define CACHE_WORKER_SLACK  (16 << 20)
+// the average object size assumed to size the frequency sketch
+#define CACHE_SKETCH_OBJECT 4096
+
+#define REGION_WINDOW       0
+#define REGION_MAIN         1
+
+// Slot hashes that stand for no entry: none ever was in the slot, or
+// the one that was has been removed. Entry hashes avoid both.
+#define SLOT_EMPTY          0
+#define SLOT_REMOVED        1
+
+// An LRU list, and the bytes of its entries.
+typedef struct {
+    cache_entry* head;  // the most recently used entry
+    cache_entry* tail;  // the next victim
+    size_t used;
+    size_t budget;
+} cache_region;
+
+// Slots are probed in order, bucket after bucket, from the bucket the
+// hash picks, until the entry or an empty slot turns up. Hashes are
+// inline, so a lookup touches no entry but the one it finds.
+typedef struct {
+    uint64_t hash[CACHE_SLOTS];
+    cache_entry* entry[CACHE_SLOTS];
+} __attribute__((aligned(64))) cache_bucket;
+
+typedef struct {
+    epoch_node retire;
+    size_t mask;        // buckets - 1
+    size_t filled;      // slots not empty
+    cache_bucket buckets[];
+} cache_table;
+
+// The cache is split by key hash into shards, each with a budget of
+// its own. Lookups take no lock: they read the table inside an epoch
+// section and leave the hash in reads, applied to the LRU lists and the
+// sketch by the next thread to take the mutex. Stores, evictions and
+// table growth take it; what they remove is retired to the epochs, so
+// a lookup that found it can still take a reference. The cache holds a
+// reference of its own to every entry in it, dropped when the epochs
+// have passed, so entries are freed once neither the cache nor any
+// response being sent from them needs them.
+//
+// W-TinyLFU: entries are stored into the window, a small LRU, and the
+// entries it evicts move on to the main LRU only if the sketch has seen
+// their keys more often than those of the main entries they would
+// evict. A burst of new keys can thus take the window at most. With
+// cache_lru the window is the whole budget.
+typedef struct {
+    pthread_mutex_t mutex;
+    cache_table* table;     // replaced under the mutex
+    size_t budget;
+    size_t used;
+    size_t count;
+    cache_region regions[2];
+    sketch freq;
+    uint64_t admitted;
+    uint64_t rejected;
+    unsigned reads_next;
+    uint64_t reads[CACHE_READS];  // lossy: a hash may be overwritten unapplied
+} __attribute__((aligned(64))) cache_shard;
+
+// The references a worker process holds, so that those of one that
+// died can be dropped: an entry pointer with the count in its top 16
+// bits, in an open addressing table whose slots are each written in a
+// single store. A worker dying while it moves a slot leaves it twice,
+// so the same entry in two slots is counted once; references it had
+// taken or dropped but not yet noted are leaked rather than dropped
+// twice. Only the worker's own threads change its table, under
+// hold_mutex, which being private to the process dies with it.
+typedef struct {
+    uint64_t slots[CACHE_HOLDS];
+} cache_holds;
+
+#define HOLD_ENTRY(v)       ((cache_entry*)(uintptr_t)((v) & ((1ULL << 48) - 1)))
+#define HOLD_COUNT(v)       ((v) >> 48)
+#define HOLD_MAX            0xffff
+
+static size_t cache_budget;
+static size_t cache_maxobj;
+static long cache_stale_while_revalidate = CACHE_DEFAULT_STALE_WHILE_REVALIDATE;
+static long cache_stale_if_error = CACHE_DEFAULT_STALE_IF_ERROR;
+static int cache_policy = CACHE_DEFAULT_POLICY;
+static int cache_shared;
+static cache_shard* shards;
+static size_t cache_nshards;
+static cache_holds* worker_holds;   // one table for each worker, when shared
+static cache_holds* holds;          // this worker's
+static pthread_mutex_t hold_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+uint64_t cache_hash(slice key) {
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < key.len; ++i) {
+        h ^= key.ptr[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+// cache_hash, clear of the slot markers.
+static
+uint64_t entry_hash(slice key) {
+    uint64_t h = cache_hash(key);
+    return h <= SLOT_REMOVED ? h + 2 : h;
+}
+
+// The top bits pick the shard, the bottom ones the bucket.
+static
+cache_shard* shard_of(uint64_t hash) {
+    return &shards[(hash >> 60) & (cache_nshards - 1)];
+}
+
+// Memory for the cache, from the heap or from the shared region.
+static
+void* cache_alloc(size_t n) {
+    return cache_shared ? shm_alloc(n) : malloc(n);
+}
+
+static
+void* cache_realloc(void* p, size_t n) {
+    return cache_shared ? shm_realloc(p, n) : realloc(p, n);
+}
+
+static
+void cache_free(void* p) {
+    if (cache_shared) {
+        shm_free(p);
+    } else {
+        free(p);
+    }
+}
+
+// Zeroed, and aligned to a cache line if n is a multiple of 64.
+static
+void* cache_calloc(size_t n) {
+    void* p = cache_shared ? shm_alloc(n) : aligned_alloc(64, (n + 63) / 64 * 64);
+    if (p) {
+        memset(p, 0, n);
+    }
+    return p;
+}
+
+static
+size_t entry_size(cache_entry const* e) {
+    return sizeof(cache_entry) + (*e).keylen + (*e).len;
+}
+
+static
+void entry_free(cache_entry* e) {
+    cache_free((*e).key);
+    cache_free((*e).data);
+    cache_free(e);
+}
+
+static
+cache_table* table_new(size_t buckets) {
+    cache_table* t = cache_calloc(sizeof(cache_table) + buckets * sizeof(cache_bucket));
+    if (!t) {
+        return NULL;
+    }
+    (*t).mask = buckets - 1;
+    return t;
+}
+
+void cache_init(size_t budget, size_t max_object) {
+    cache_budget = budget;
+    cache_maxobj = max_object;
+    if (cache_maxobj > cache_budget) {
+        cache_maxobj = cache_budget;
+    }
+    if (budget == 0) {
+        return;
+    }
+    // as many shards as leave each room for a few of the largest objects
+    cache_nshards = CACHE_SHARDS;
+    while (cache_nshards > 1 && budget / cache_nshards < 4 * cache_maxobj) {
+        cache_nshards /= 2;
+    }
+    shards = cache_calloc(cache_nshards * sizeof(cache_shard));
+    if (!shards) {
+        perror("cache_init");
+        cache_budget = 0;
+        return;
+    }
+    for (size_t i = 0; i < cache_nshards; ++i) {
+        cache_shard* s = &shards[i];
+        if (cache_shared) {
+            shm_mutex_init(&(*s).mutex);
+        } else {
+            pthread_mutex_init(&(*s).mutex, NULL);
+        }
+        (*s).budget = budget / cache_nshards;
+        (*s).table = table_new(CACHE_MIN_BUCKETS);
+        if (!(*s).table) {
+            perror("cache_init");
+            cache_budget = 0;
+            return;
+        }
+        if (sketch_init(&(*s).freq, (*s).budget / CACHE_SKETCH_OBJECT, cache_calloc) != 0) {
+            perror("cache_init");
+            cache_policy = cache_lru;
+        }
+    }
+    cache_set_policy(cache_policy);
+}
+
+int cache_init_shared(size_t budget, size_t max_object, int workers) {
+    // Entries count their bytes as in the heap, so the same budget keeps
+    // the same entries; the allocator's rounding, the tables and the
+    // sketches come on top. Pages are backed only once they are used.
+    size_t size = budget * 2 + (workers + 1) * (size_t)CACHE_WORKER_SLACK;
+    if (shm_init(size) != 0 || epoch_share() != 0) {
+        return -1;
+    }
+    if (budget == 0) {
+        cache_init(budget, max_object);
+        return 0;
+    }
+    cache_shared = 1;
+    worker_holds = cache_calloc(workers * sizeof(cache_holds));
+    if (!worker_holds) {
+        perror("cache_init_shared");
+        return -1;
+    }
+    cache_init(budget, max_object);
+    return cache_enabled() ? 0 : -1;
+}
+
+void cache_attach(int worker) {
+    if (worker_holds) {
+        holds = &worker_holds[worker];
+    }
+}
+
+static
+size_t hold_home(cache_entry const* e) {
+    uint64_t h = (uintptr_t)e * 0x9e3779b97f4a7c15ULL;
+    return (h >> 32) & (CACHE_HOLDS - 1);
+}
+
+// Notes n more references to e held by this worker. One that cannot
+// be noted is leaked if the worker dies.
+static
+void hold(cache_entry* e, int n) {
+    if (!holds) {
+        return;
+    }
+    pthread_mutex_lock(&hold_mutex);
+    size_t i = hold_home(e);
+    for (size_t probe = 0; probe < CACHE_HOLDS; ++probe) {
+        uint64_t v = (*holds).slots[i];
+        if (v == 0 || HOLD_ENTRY(v) == e) {
+            uint64_t count = HOLD_COUNT(v) + n;
+            if (count <= HOLD_MAX) {
+                (*holds).slots[i] = (uintptr_t)e | count << 48;
+            }
+            break;
+        }
+        i = (i + 1) & (CACHE_HOLDS - 1);
+    }
+    pthread_mutex_unlock(&hold_mutex);
+}
+
+// Notes that a reference to e was dropped, moving later slots of the
+// probe sequence back into the slot freed, if it was its last.
+static
+void unhold(cache_entry* e) {
+    if (!holds) {
+        return;
+    }
+    pthread_mutex_lock(&hold_mutex);
+    uint64_t* slots = (*holds).slots;
+    size_t i = hold_home(e);
+    for (size_t probe = 0; probe < CACHE_HOLDS && slots[i]; ++probe) {
+        if (HOLD_ENTRY(slots[i]) != e) {
+            i = (i + 1) & (CACHE_HOLDS - 1);
+            continue;
+        }
+        if (HOLD_COUNT(slots[i]) > 1) {
+            slots[i] -= 1ULL << 48;
+            break;
+        }
+        size_t j = i;
+        while (1) {
+            j = (j + 1) & (CACHE_HOLDS - 1);
+            if (slots[j] == 0) {
+                break;
+            }
+            size_t home = hold_home(HOLD_ENTRY(slots[j]));
+            // whether home lies cyclically in (i, j], where it may stay
+            if (i <= j ? (i < home && home <= j) : (i < home || home <= j)) {
+                continue;
+            }
+            slots[i] = slots[j];
+            i = j;
+        }
+        slots[i] = 0;
+        break;
+    }
+    pthread_mutex_unlock(&hold_mutex);
+}
+
+static
+void entry_put(cache_entry* e) {
+    if (__atomic_sub_fetch(&(*e).refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        entry_free(e);
+    }
+}
+
+static
+int compare_holds(void const* a, void const* b) {
+    uint64_t x = (uintptr_t)HOLD_ENTRY(*(uint64_t const*)a);
+    uint64_t y = (uintptr_t)HOLD_ENTRY(*(uint64_t const*)b);
+    return x < y ? -1 : x > y;
+}
+
+void cache_reclaim(int worker, pid_t pid) {
+    epoch_reclaim(pid);
+    if (!worker_holds) {
+        return;
+    }
+    cache_holds* h = &worker_holds[worker];
+    qsort((*h).slots, CACHE_HOLDS, sizeof(uint64_t), compare_holds);
+    size_t dropped = 0;
+    for (size_t i = 0; i < CACHE_HOLDS; ++i) {
+        uint64_t v = (*h).slots[i];
+        if (v == 0 || (i > 0 && HOLD_ENTRY((*h).slots[i - 1]) == HOLD_ENTRY(v))) {
+            continue;
+        }
+        for (uint64_t n = HOLD_COUNT(v); n > 0; --n) {
+            entry_put(HOLD_ENTRY(v));
+            dropped += 1;
+        }
+    }
+    memset(h, 0, sizeof(*h));
+    if (dropped) {
+        tlog(LOG_INFO, "cache: dropped %zu references held by worker %d\n", dropped, worker);
+    }
+}
+
+void cache_set_stale(long while_revalidate, long if_error) {
+    cache_stale_while_revalidate = while_revalidate;
+    cache_stale_if_error = if_error;
+}
+
+int cache_enabled(void) {
+    return cache_budget != 0;
+}
+
+size_t cache_max_object(void) {
+    return cache_maxobj;
+}
+
+int cache_key(mutslice buf, slice node, slice service, slice path, slice* key) {
+    size_t len = service.len + strlen("://") + node.len + path.len;
+    if (len > buf.len) {
+        return -1;
+    }
+    size_t pos = 0;
+    memcpy(&buf.ptr[pos], service.ptr, service.len);
+    pos += service.len;
+    memcpy(&buf.ptr[pos], "://", 3);
+    pos += 3;
+    // host names are case-insensitive, paths are not
+    for (size_t i = 0; i < node.len; ++i) {
+        buf.ptr[pos++] = tolower(node.ptr[i]);
+    }
+    memcpy(&buf.ptr[pos], path.ptr, path.len);
+    pos += path.len;
+    (*key).ptr = buf.ptr;
+    (*key).len = pos;
+    return 0;
+}
+
+// Calls fn for every comma separated directive of a Cache-Control value.
+static
+void each_directive(slice value, void (*fn)(slice, void*), void* arg) {
+    size_t pos = 0;
+    while (pos < value.len) {
+        while (pos < value.len && (value.ptr[pos] == ' ' || value.ptr[pos] == ',')) {
+            pos += 1;
+        }
+        size_t start = pos;
+        while (pos < value.len && value.ptr[pos] != ',') {
+            pos += 1;
+        }
+        size_t end = pos;
+        while (end > start && value.ptr[end - 1] == ' ') {
+            end -= 1;
+        }
+        if (end > start) {
+            fn((slice){&value.ptr[start], end - start}, arg);
+        }
+    }
+}
+
+static
+int directive_is(slice d, char const* name) {
+    size_t n = strlen(name);
+    return d.len == n && strncasecmp((char const*)d.ptr, name, n) == 0;
+}
+
+// Parses "name=seconds", returns -1 if d is not that directive.
+static
+long directive_seconds(slice d, char const* name) {
+    size_t n = strlen(name);
+    if (d.len <= n + 1 || strncasecmp((char const*)d.ptr, name, n) != 0
+        || d.ptr[n] != '=') {
+        return -1;
+    }
+    long secs = 0;
+    for (size_t i = n + 1; i < d.len; ++i) {
+        if (d.ptr[i] == '"') {
+            continue;
+        }
+        if (!isdigit(d.ptr[i])) {
+            return -1;
+        }
+        secs = secs*10 + (d.ptr[i] - '0');
+        if (secs > 0x7fffffffL) {
+            secs = 0x7fffffffL;
+        }
+    }
+    return secs;
+}
+
+typedef struct {
+    int no_store;
+    int no_cache;
+    int private;
+    int must_revalidate;
+    long max_age;
+    long s_maxage;
+    long stale_while_revalidate;
+    long stale_if_error;
+} cache_control;
+
+static
+void cache_control_directive(slice d, void* arg) {
+    cache_control* cc = arg;
+    long secs;
+    if (directive_is(d, "no-store")) {
+        (*cc).no_store = 1;
+    } else if (directive_is(d, "no-cache")) {
+        (*cc).no_cache = 1;
+    } else if (directive_is(d, "private")) {
+        (*cc).private = 1;
+    } else if (directive_is(d, "must-revalidate") || directive_is(d, "proxy-revalidate")) {
+        (*cc).must_revalidate = 1;
+    } else if ((secs = directive_seconds(d, "max-age")) >= 0) {
+        (*cc).max_age = secs;
+    } else if ((secs = directive_seconds(d, "s-maxage")) >= 0) {
+        (*cc).s_maxage = secs;
+    } else if ((secs = directive_seconds(d, "stale-while-revalidate")) >= 0) {
+        (*cc).stale_while_revalidate = secs;
+    } else if ((secs = directive_seconds(d, "stale-if-error")) >= 0) {
+        (*cc).stale_if_error = secs;
+    }
+}
+
+static
+void parse_cache_control(http_headerbuf headerbuf, cache_control* cc) {
+    memset(cc, 0, sizeof(*cc));
+    (*cc).max_age = -1;
+    (*cc).s_maxage = -1;
+    (*cc).stale_while_revalidate = -1;
+    (*cc).stale_if_error = -1;
+    for (size_t i = 0; i < headerbuf.cap; ++i) {
+        http_header const* h = &headerbuf.ptr[i];
+        if ((*h).name.len == strlen("Cache-Control")
+            && strncasecmp((char const*)(*h).name.ptr, "Cache-Control", (*h).name.len) == 0) {
+            each_directive((*h).value, cache_control_directive, cc);
+        }
+    }
+}
+
+// Parses an RFC 1123 date, returns -1 if invalid.
+static
+time_t parse_http_date(slice value) {
+    char buf[64];
+    if (value.len >= sizeof(buf)) {
+        return -1;
+    }
+    memcpy(buf, value.ptr, value.len);
+    buf[value.len] = '\0';
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    char const* end = strptime(buf, "%a, %d %b %Y %H:%M:%S", &tm);
+    if (!end) {
+        return -1;
+    }
+    return timegm(&tm);
+}
+
+int cache_request_cacheable(http_request const* req) {
+    if ((*req).method.len != 3 || memcmp((*req).method.ptr, "GET", 3) != 0) {
+        return 0;
+    }
+    slice value;
+    if (http_find_header((*req).headerbuf, "Authorization", &value)) {
+        return 0;
+    }
+    if (http_find_header((*req).headerbuf, "Pragma", &value)
+        && value.len >= 8 && strncasecmp((char const*)value.ptr, "no-cache", 8) == 0) {
+        return 0;
+    }
+    cache_control cc;
+    parse_cache_control((*req).headerbuf, &cc);
+    if (cc.no_store || cc.no_cache) {
+        return 0;
+    }
+    return 1;
+}
+
+time_t cache_response_expires(http_response const* res, time_t now) {
+    switch ((*res).status.code) {
+    case 200:
+    case 203:
+    case 300:
+    case 301:
+    case 404:
+    case 410:
+        break;
+    default:
+        return 0;
+    }
+
+    slice value;
+    if (http_find_header((*res).headerbuf, "Vary", &value)) {
+        // the key does not include request headers
+        return 0;
+    }
+
+    cache_control cc;
+    parse_cache_control((*res).headerbuf, &cc);
+    if (cc.no_store || cc.no_cache || cc.private) {
+        return 0;
+    }
+    if (cc.s_maxage >= 0) {
+        return cc.s_maxage > 0 ? now + cc.s_maxage : 0;
+    }
+    if (cc.max_age >= 0) {
+        return cc.max_age > 0 ? now + cc.max_age : 0;
+    }
+
+    if (!http_find_header((*res).headerbuf, "Expires", &value)) {
+        // no explicit freshness, don't guess
+        return 0;
+    }
+    time_t expires = parse_http_date(value);
+    if (expires < 0) {
+        return 0;
+    }
+    // measure freshness against the origin's clock if it sent one
+    time_t date = now;
+    if (http_find_header((*res).headerbuf, "Date", &value)) {
+        time_t d = parse_http_date(value);
+        if (d >= 0) {
+            date = d;
+        }
+    }
+    if (expires <= date) {
+        return 0;
+    }
+    return now + (expires - date);
+}
+
+// Sets how long past its expiry e may be served. must-revalidate
+// forbids it, s-maxage implies proxy-revalidate for a shared cache
+// unless the origin allows it explicitly.
+static
+void set_stale_windows(cache_entry* e, http_response const* res) {
+    cache_control cc;
+    parse_cache_control((*res).headerbuf, &cc);
+    long swr = cc.stale_while_revalidate;
+    long sie = cc.stale_if_error;
+    if (cc.must_revalidate) {
+        swr = 0;
+        sie = 0;
+    } else if (cc.s_maxage >= 0) {
+        swr = swr < 0 ? 0 : swr;
+        sie = sie < 0 ? 0 : sie;
+    }
+    (*e).stale_until = (*e).expires + (swr < 0 ? cache_stale_while_revalidate : swr);
+    (*e).error_until = (*e).expires + (sie < 0 ? cache_stale_if_error : sie);
+}
+
+
+static
+void lru_unlink(cache_shard* s, cache_entry* e) {
+    cache_region* r = &(*s).regions[(*e).region];
+    if ((*e).prev) {
+        (*(*e).prev).next = (*e).next;
+    } else {
+        (*r).head = (*e).next;
+    }
+    if ((*e).next) {
+        (*(*e).next).prev = (*e).prev;
+    } else {
+        (*r).tail = (*e).prev;
+    }
+    (*e).prev = NULL;
+    (*e).next = NULL;
+    (*r).used -= entry_size(e);
+}
+
+static
+void lru_push_front(cache_shard* s, cache_entry* e, int region) {
+    cache_region* r = &(*s).regions[region];
+    (*e).region = region;
+    (*e).prev = NULL;
+    (*e).next = (*r).head;
+    if ((*r).head) {
+        (*(*r).head).prev = e;
+    }
+    (*r).head = e;
+    if (!(*r).tail) {
+        (*r).tail = e;
+    }
+    (*r).used += entry_size(e);
+}
+
+// The entry for key, or with key.ptr NULL the first with hash. Safe
+// without the shard's mutex inside an epoch section: an entry is
+// published by storing its pointer before its hash, and a key that
+// matches is checked against the entry itself.
+static
+cache_entry* table_find(cache_table const* t, uint64_t hash, slice key) {
+    size_t b = hash & (*t).mask;
+    for (size_t n = 0; n <= (*t).mask; ++n) {
+        cache_bucket const* bucket = &(*t).buckets[b];
+        for (int i = 0; i < CACHE_SLOTS; ++i) {
+            uint64_t h = __atomic_load_n(&(*bucket).hash[i], __ATOMIC_ACQUIRE);
+            if (h == SLOT_EMPTY) {
+                return NULL;
+            }
+            if (h != hash) {
+                continue;
+            }
+            cache_entry* e = __atomic_load_n(&(*bucket).entry[i], __ATOMIC_ACQUIRE);
+            if (e && (!key.ptr || ((*e).keylen == key.len
+                                   && memcmp((*e).key, key.ptr, key.len) == 0))) {
+                return e;
+            }
+        }
+        b = (b + 1) & (*t).mask;
+    }
+    return NULL;
+}
+
+typedef struct {
+    cache_bucket* bucket;
+    int i;
+} cache_slot;
+
+// Finds the slot of e's key. Returns 1 if it holds an entry for it,
+// else 0 and the first slot one may go in. Must hold the shard's mutex.
+static
+int table_slot(cache_table* t, cache_entry const* e, cache_slot* slot) {
+    size_t b = (*e).hash & (*t).mask;
+    (*slot).bucket = NULL;
+    for (size_t n = 0; n <= (*t).mask; ++n) {
+        cache_bucket* bucket = &(*t).buckets[b];
+        for (int i = 0; i < CACHE_SLOTS; ++i) {
+            uint64_t h = (*bucket).hash[i];
+            cache_entry* other = (*bucket).entry[i];
+            if (h == (*e).hash && other && (*other).keylen == (*e).keylen
+                && memcmp((*other).key, (*e).key, (*e).keylen) == 0) {
+                (*slot).bucket = bucket;
+                (*slot).i = i;
+                return 1;
+            }
+            if (h <= SLOT_REMOVED && !(*slot).bucket) {
+                (*slot).bucket = bucket;
+                (*slot).i = i;
+            }
+            if (h == SLOT_EMPTY) {
+                return 0;
+            }
+        }
+        b = (b + 1) & (*t).mask;
+    }
+    return 0;
+}
+
+static
+void table_retire(epoch_node* n) {
+    cache_free((cache_table*)((char*)n - offsetof(cache_table, retire)));
+}
+
+// Replaces the shard's table with one of about twice the buckets its
+// entries need, without the removed slots. Readers still in the old one
+// find the same entries there. Must hold the shard's mutex.
+static
+void table_grow(cache_shard* s) {
+    size_t buckets = CACHE_MIN_BUCKETS;
+    while (buckets * CACHE_SLOTS < ((*s).count + 1) * 4) {
+        buckets *= 2;
+    }
+    cache_table* old = (*s).table;
+    cache_table* t = table_new(buckets);
+    if (!t) {
+        return;
+    }
+    for (size_t b = 0; b <= (*old).mask; ++b) {
+        for (int i = 0; i < CACHE_SLOTS; ++i) {
+            cache_entry* e = (*old).buckets[b].entry[i];
+            if (!e) {
+                continue;
+            }
+            cache_slot slot;
+            table_slot(t, e, &slot);
+            (*slot.bucket).entry[slot.i] = e;
+            (*slot.bucket).hash[slot.i] = (*e).hash;
+            (*t).filled += 1;
+        }
+    }
+    __atomic_store_n(&(*s).table, t, __ATOMIC_RELEASE);
+    epoch_retire(&(*old).retire, table_retire);
+}
+
+static
+void entry_retire(epoch_node* n) {
+    entry_put((cache_entry*)((char*)n - offsetof(cache_entry, retire)));
+}
+
+// Takes e out of the lists and the accounting and drops the cache's
+// reference to it once no lookup can find it anymore. Its slot has
+// been cleared or taken over. Must hold the shard's mutex.
+static
+void entry_detach(cache_shard* s, cache_entry* e) {
+    lru_unlink(s, e);
+    (*e).linked = 0;
+    (*s).used -= entry_size(e);
+    (*s).count -= 1;
+    epoch_retire(&(*e).retire, entry_retire);
+}
+
+// Must hold the shard's mutex.
+static
+void entry_unlink(cache_shard* s, cache_entry* e) {
+    cache_slot slot;
+    if (table_slot((*s).table, e, &slot) && (*slot.bucket).entry[slot.i] == e) {
+        __atomic_store_n(&(*slot.bucket).hash[slot.i], SLOT_REMOVED, __ATOMIC_RELEASE);
+        __atomic_store_n(&(*slot.bucket).entry[slot.i], NULL, __ATOMIC_RELEASE);
+    }
+    entry_detach(s, e);
+}
+
+// Splits the shard's budget between its regions for the policy.
+static
+void set_region_budgets(cache_shard* s) {
+    size_t window = (*s).budget;
+    if (cache_policy == cache_tinylfu) {
+        window = (*s).budget / 100 * CACHE_WINDOW_PERCENT;
+    }
+    (*s).regions[REGION_WINDOW].budget = window;
+    (*s).regions[REGION_MAIN].budget = (*s).budget - window;
+}
+
+// Empties a shard a worker process died updating, whose lists and
+// accounting cannot be trusted. Entries still in its table are retired
+// (those the worker was moving out of it are leaked), and lookups
+// that found them keep them until released. Must hold the mutex.
+static
+void shard_reset(cache_shard* s) {
+    tlog(LOG_WARN, "cache: a worker died updating shard %d, emptying it\n", (int)(s - shards));
+    cache_table* t = (*s).table;
+    for (size_t b = 0; b <= (*t).mask; ++b) {
+        cache_bucket* bucket = &(*t).buckets[b];
+        for (int i = 0; i < CACHE_SLOTS; ++i) {
+            cache_entry* e = (*bucket).entry[i];
+            if ((*bucket).hash[i] > SLOT_REMOVED) {
+                __atomic_store_n(&(*bucket).hash[i], SLOT_REMOVED, __ATOMIC_RELEASE);
+            }
+            __atomic_store_n(&(*bucket).entry[i], NULL, __ATOMIC_RELEASE);
+            if (e && (*e).linked) {
+                (*e).linked = 0;
+                epoch_retire(&(*e).retire, entry_retire);
+            }
+        }
+    }
+    memset((*s).regions, 0, sizeof((*s).regions));
+    (*s).used = 0;
+    (*s).count = 0;
+    set_region_budgets(s);
+}
+
+static
+void shard_lock(cache_shard* s) {
+    if (shm_lock(&(*s).mutex)) {
+        shard_reset(s);
+    }
+}
+
+static
+void shard_unlock(cache_shard* s) {
+    pthread_mutex_unlock(&(*s).mutex);
+}
+
+// Applies the lookups buffered since the last time: counts their keys
+// in the sketch and moves the entries they found to the front of their
+// lists. Must hold the shard's mutex.
+static
+void drain_reads(cache_shard* s) {
+    for (int i = 0; i < CACHE_READS; ++i) {
+        uint64_t hash = __atomic_exchange_n(&(*s).reads[i], 0, __ATOMIC_RELAXED);
+        if (hash == 0) {
+            continue;
+        }
+        if ((*s).freq.table) {
+            sketch_add(&(*s).freq, hash);
+        }
+        cache_entry* e = table_find((*s).table, hash, (slice){NULL, 0});
+        if (e) {
+            lru_unlink(s, e);
+            lru_push_front(s, e, (*e).region);
+        }
+    }
+}
+
+static
+void record_read(cache_shard* s, uint64_t hash) {
+    unsigned i = __atomic_fetch_add(&(*s).reads_next, 1, __ATOMIC_RELAXED) & (CACHE_READS - 1);
+    __atomic_store_n(&(*s).reads[i], hash, __ATOMIC_RELAXED);
+    if (i != CACHE_READS - 1) {
+        return;
+    }
+    int locked = shm_trylock(&(*s).mutex);
+    if (locked >= 0) {
+        if (locked) {
+            shard_reset(s);
+        }
+        drain_reads(s);
+        shard_unlock(s);
+    }
+}
+
+static
+void evict(cache_shard* s, cache_entry* e) {
+    tlog(LOG_DEBUG, "cache: evicting [%.*s]\n", (int)(*e).keylen, (*e).key);
+    entry_unlink(s, e);
+}
+
+// Whether the sketch has seen e's key more often than those of every
+// main entry that would have to make room for it, in which case they
+// are evicted. Must hold the shard's mutex.
+static
+int admit(cache_shard* s, cache_entry* e) {
+    cache_region* m = &(*s).regions[REGION_MAIN];
+    size_t size = entry_size(e);
+    if (size > (*m).budget) {
+        return 0;
+    }
+    int freq = sketch_estimate(&(*s).freq, (*e).hash);
+    size_t freed = 0;
+    cache_entry* victim = (*m).tail;
+    while ((*m).used - freed + size > (*m).budget) {
+        if (!victim || sketch_estimate(&(*s).freq, (*victim).hash) >= freq) {
+            return 0;
+        }
+        freed += entry_size(victim);
+        victim = (*victim).prev;
+    }
+    while ((*m).used + size > (*m).budget) {
+        evict(s, (*m).tail);
+    }
+    return 1;
+}
+
+// Brings both regions back within their budgets, moving entries the
+// window evicts to the main region if they are admitted.
+// Must hold the shard's mutex.
+static
+void rebalance(cache_shard* s) {
+    cache_region* w = &(*s).regions[REGION_WINDOW];
+    cache_region* m = &(*s).regions[REGION_MAIN];
+    while ((*m).used > (*m).budget) {
+        evict(s, (*m).tail);
+    }
+    while ((*w).used > (*w).budget) {
+        cache_entry* e = (*w).tail;
+        if (cache_policy == cache_lru) {
+            evict(s, e);
+        } else if (admit(s, e)) {
+            lru_unlink(s, e);
+            lru_push_front(s, e, REGION_MAIN);
+            (*s).admitted += 1;
+        } else {
+            tlog(LOG_DEBUG, "cache: not admitting [%.*s]\n", (int)(*e).keylen, (*e).key);
+            entry_unlink(s, e);
+            (*s).rejected += 1;
+        }
+    }
+}
+
+void cache_set_policy(int policy) {
+    for (size_t i = 0; i < cache_nshards; ++i) {
+        if (!shards[i].freq.table) {
+            policy = cache_lru;
+        }
+    }
+    cache_policy = policy;
+    for (size_t i = 0; i < cache_nshards; ++i) {
+        cache_shard* s = &shards[i];
+        shard_lock(s);
+        set_region_budgets(s);
+        rebalance(s);
+        shard_unlock(s);
+    }
+}
+
+int cache_parse_policy(char const* name) {
+    if (strcmp(name, "lru") == 0) {
+        return cache_lru;
+    }
+    if (strcmp(name, "tinylfu") == 0) {
+        return cache_tinylfu;
+    }
+    return -1;
+}
+
+char const* cache_policy_name(int policy) {
+    return policy == cache_lru ? "lru" : "tinylfu";
+}
+
+void cache_counts(cache_usage* u) {
+    memset(u, 0, sizeof(*u));
+    (*u).budget = cache_budget;
+    for (size_t i = 0; i < cache_nshards; ++i) {
+        cache_shard* s = &shards[i];
+        shard_lock(s);
+        (*u).used += (*s).used;
+        (*u).entries += (*s).count;
+        (*u).admitted += (*s).admitted;
+        (*u).rejected += (*s).rejected;
+        shard_unlock(s);
+    }
+    if (cache_shared) {
+        shm_usage region;
+        shm_counts(&region);
+        (*u).region_size = region.size;
+        (*u).region_used = region.pages;
+    }
+}
+
+// Removes e if it is still in the cache. Must hold the shard's mutex.
+static
+void unlink_if_linked(cache_shard* s, cache_entry* e) {
+    if ((*e).linked) {
+        entry_unlink(s, e);
+    }
+}
+
+cache_entry* cache_lookup(slice key, int* state) {
+    *state = cache_fresh;
+    if (!cache_enabled()) {
+        return NULL;
+    }
+    uint64_t hash = entry_hash(key);
+    cache_shard* s = shard_of(hash);
+    time_t now = time(NULL);
+
+    epoch_enter();
+    cache_entry* e = table_find(__atomic_load_n(&(*s).table, __ATOMIC_ACQUIRE), hash, key);
+    cache_entry* expired = NULL;
+    if (e && (*e).expires <= now) {
+        if (now < (*e).stale_until
+            || (__atomic_load_n(&(*e).failed, __ATOMIC_RELAXED) && now < (*e).error_until)) {
+            *state = __atomic_exchange_n(&(*e).revalidating, 1, __ATOMIC_ACQ_REL)
+                ? cache_stale : cache_revalidate;
+        } else if (now < (*e).error_until) {
+            // kept in case the origin fails
+            e = NULL;
+        } else {
+            expired = e;
+        }
+    }
+    if (e) {
+        // the cache's own reference keeps it from dropping to 0 here
+        __atomic_add_fetch(&(*e).refs, *state == cache_revalidate ? 2 : 1, __ATOMIC_RELAXED);
+    }
+    epoch_exit();
+    record_read(s, hash);
+    if (expired) {
+        tlog(LOG_DEBUG, "cache: expired [%.*s]\n", (int)key.len, key.ptr);
+        shard_lock(s);
+        unlink_if_linked(s, expired);
+        shard_unlock(s);
+        entry_put(expired);
+        return NULL;
+    }
+    if (e) {
+        hold(e, *state == cache_revalidate ? 2 : 1);
+    }
+    return e;
+}
+
+cache_entry* cache_lookup_if_error(slice key) {
+    if (!cache_enabled()) {
+        return NULL;
+    }
+    uint64_t hash = entry_hash(key);
+    cache_shard* s = shard_of(hash);
+    time_t now = time(NULL);
+
+    epoch_enter();
+    cache_entry* e = table_find(__atomic_load_n(&(*s).table, __ATOMIC_ACQUIRE), hash, key);
+    if (e && (*e).expires <= now && now < (*e).error_until) {
+        __atomic_store_n(&(*e).failed, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&(*e).refs, 1, __ATOMIC_RELAXED);
+    } else {
+        e = NULL;
+    }
+    epoch_exit();
+    if (e) {
+        hold(e, 1);
+    }
+    return e;
+}
+
+void cache_revalidated(cache_entry* e, int failed) {
+    if (failed >= 0) {
+        __atomic_store_n(&(*e).failed, failed, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&(*e).revalidating, 0, __ATOMIC_RELEASE);
+}
+
+void cache_drop(cache_entry* e) {
+    cache_shard* s = shard_of((*e).hash);
+    shard_lock(s);
+    unlink_if_linked(s, e);
+    shard_unlock(s);
+}
+
+void cache_release(cache_entry* e) {
+    unhold(e);
+    entry_put(e);
+}
+
+int cache_unframed(http_response const* res) {
+    http_body b;
+    http_body_init(&b, res, 0);
+    return b.framing == HTTP_BODY_CLOSE;
+}
+
+void cache_length_line(uint8_t* out, size_t len) {
+    char line[CACHE_LENGTH_LINE + 1];
+    snprintf(line, sizeof(line), "Content-Length: %-20zu\r\n", len);
+    memcpy(out, line, CACHE_LENGTH_LINE);
+}
+
+int cache_fill_begin(cache_fill* f, slice key, slice head,
+                     http_response const* res, time_t expires) {
+    memset(f, 0, sizeof(*f));
+    if (!cache_enabled() || head.len > cache_maxobj) {
+        return -1;
+    }
+
+    size_t hint = CACHE_FILL_CHUNK;
+    size_t n = 0;
+    switch (http_content_length((*res).headerbuf, &n)) {
+    case 1:
+        if (n > cache_maxobj || head.len + n > cache_maxobj) {
+            return -1;
+        }
+        (*f).content_length = n;
+        (*f).has_content_length = 1;
+        hint = n;
+        break;
+    case -1:
+        return -1;
+    }
+
+    size_t extra = cache_unframed(res) ? CACHE_LENGTH_LINE : 0;
+    if (head.len + extra > cache_maxobj) {
+        return -1;
+    }
+
+    cache_entry* e = cache_alloc(sizeof(cache_entry));
+    if (!e) {
+        return -1;
+    }
+    memset(e, 0, sizeof(*e));
+    (*e).key = cache_alloc(key.len);
+    (*e).cap = head.len + extra + hint;
+    (*e).data = cache_alloc((*e).cap);
+    if (!(*e).key || !(*e).data) {
+        entry_free(e);
+        return -1;
+    }
+    memcpy((*e).key, key.ptr, key.len);
+    (*e).keylen = key.len;
+    (*e).hash = entry_hash(key);
+    memcpy((*e).data, head.ptr, head.len);
+    if (extra) {
+        cache_length_line(&(*e).data[head.len], 0);
+        (*f).length_at = head.len;
+    }
+    (*e).headlen = head.len + extra;
+    (*e).len = head.len + extra;
+    (*e).expires = expires;
+    set_stale_windows(e, res);
+    (*f).entry = e;
+    (*f).content_length += (*e).headlen;
+    return 0;
+}
+
+int cache_fill_append(cache_fill* f, slice bytes) {
+    cache_entry* e = (*f).entry;
+    if (!e) {
+        return -1;
+    }
+    if ((*e).len + bytes.len > cache_maxobj) {
+        cache_fill_abort(f);
+        return -1;
+    }
+    if ((*e).len + bytes.len > (*e).cap) {
+        size_t cap = (*e).cap * 2;
+        if (cap < (*e).len + bytes.len) {
+            cap = (*e).len + bytes.len;
+        }
+        if (cap > cache_maxobj) {
+            cap = cache_maxobj;
+        }
+        uint8_t* data = cache_realloc((*e).data, cap);
+        if (!data) {
+            cache_fill_abort(f);
+            return -1;
+        }
+        (*e).data = data;
+        (*e).cap = cap;
+    }
+    memcpy(&(*e).data[(*e).len], bytes.ptr, bytes.len);
+    (*e).len += bytes.len;
+    return 0;
+}
+
+void cache_fill_abort(cache_fill* f) {
+    if ((*f).entry) {
+        entry_free((*f).entry);
+        (*f).entry = NULL;
+    }
+}
+
+void cache_fill_commit(cache_fill* f) {
+    cache_entry* e = (*f).entry;
+    if (!e) {
+        return;
+    }
+    (*f).entry = NULL;
+    if ((*f).has_content_length && (*e).len != (*f).content_length) {
+        tlog(LOG_WARN, "cache: truncated response for [%.*s], not storing\n",
+            (int)(*e).keylen, (*e).key);
+        entry_free(e);
+        return;
+    }
+    if ((*f).length_at) {
+        cache_length_line(&(*e).data[(*f).length_at], (*e).len - (*e).headlen);
+    }
+    if ((*e).len < (*e).cap) {
+        uint8_t* data = cache_realloc((*e).data, (*e).len ? (*e).len : 1);
+        if (data) {
+            (*e).data = data;
+            (*e).cap = (*e).len;
+        }
+    }
+    cache_shard* s = shard_of((*e).hash);
+    if (entry_size(e) > (*s).budget) {
+        entry_free(e);
+        return;
+    }
+
+    shard_lock(s);
+    drain_reads(s);
+    (*e).refs = 1;
+    (*e).linked = 1;
+    // a replaced entry keeps its place, new ones start in the window
+    int region = REGION_WINDOW;
+    cache_slot slot;
+    if (table_slot((*s).table, e, &slot)) {
+        cache_entry* old = (*slot.bucket).entry[slot.i];
+        region = (*old).region;
+        __atomic_store_n(&(*slot.bucket).entry[slot.i], e, __ATOMIC_RELEASE);
+        entry_detach(s, old);
+    } else {
+        cache_table* t = (*s).table;
+        if (((*t).filled + 1) * 4 > ((*t).mask + 1) * CACHE_SLOTS * 3) {
+            table_grow(s);
+            t = (*s).table;
+            table_slot(t, e, &slot);
+        }
+        if (!slot.bucket) {
+            shard_unlock(s);
+            entry_free(e);
+            return;
+        }
+        if ((*slot.bucket).hash[slot.i] == SLOT_EMPTY) {
+            (*t).filled += 1;
+        }
+        __atomic_store_n(&(*slot.bucket).entry[slot.i], e, __ATOMIC_RELAXED);
+        __atomic_store_n(&(*slot.bucket).hash[slot.i], (*e).hash, __ATOMIC_RELEASE);
+    }
+    lru_push_front(s, e, region);
+    (*s).used += entry_size(e);
+    (*s).count += 1;
+    tlog(LOG_DEBUG, "cache: stored [%.*s] (%zu bytes, %zu/%zu used)\n",
+        (int)(*e).keylen, (*e).key, (*e).len, (*s).used, (*s).budget);
+    rebalance(s);
+    shard_unlock(s);
+}
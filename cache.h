@@ -0,0 +1,152 @@
+#ifndef CACHE_H
+#define CACHE_H
+#include "tprintf.h"
+#include "slice.h"
+#include "http.h"
+#include "epoch.h"
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+#define CACHE_KEYLEN            2048
+#define CACHE_DEFAULT_BUDGET    (64 << 20)
+#define CACHE_DEFAULT_MAXOBJ    (1 << 20)
+// seconds past expiry, for responses that do not say (RFC 5861)
+#define CACHE_DEFAULT_STALE_WHILE_REVALIDATE 0
+#define CACHE_DEFAULT_STALE_IF_ERROR         0
+
+// Eviction policies: plain LRU, or W-TinyLFU, where a small LRU window
+// takes new entries and a frequency sketch of requested keys decides
+// which of those it evicts displace older ones, so that a scan of keys
+// requested once cannot flush the cache.
+#define cache_lru               0
+#define cache_tinylfu           1
+#define CACHE_DEFAULT_POLICY    cache_tinylfu
+#define CACHE_WINDOW_PERCENT    1   // of the budget, for cache_tinylfu
+
+// A cached response: the first headlen bytes are the status line and
+// end-to-end headers, each ending in CRLF but without the blank line,
+// so each client can be sent its own Connection header. Then the body.
+// Once stored, an entry does not change but for the revalidation flags;
+// it is freed when the last of its references, the cache's own among
+// them, is released.
+typedef struct cache_entry cache_entry;
+struct cache_entry {
+    char* key;
+    size_t keylen;
+    uint64_t hash;
+    uint8_t* data;
+    size_t headlen;
+    size_t len;
+    size_t cap;
+    time_t expires;
+    // past expires, the entry is served while it is revalidated until
+    // stale_until, and after the origin failed until error_until
+    time_t stale_until;
+    time_t error_until;
+    int revalidating;
+    int failed;
+    int refs;
+    // the rest belongs to the shard's mutex
+    int linked;
+    int region;
+    cache_entry* prev;
+    cache_entry* next;
+    epoch_node retire;
+};
+
+// An entry being filled while a response streams to the client.
+typedef struct {
+    cache_entry* entry;
+    size_t content_length;
+    int has_content_length;
+    size_t length_at;   // of the reserved Content-Length line, or 0
+} cache_fill;
+
+// A body that runs until the origin closes is stored with a
+// Content-Length, so that hits on it can keep the client connection.
+// A line of CACHE_LENGTH_LINE bytes is reserved after the head when
+// the fill begins and written when it commits, its value padded with
+// spaces as the disk tier cannot move a body it has written.
+#define CACHE_LENGTH_LINE   38
+// Returns 1 if res's body is delimited by the origin closing.
+int cache_unframed(http_response const* res);
+// Writes the line for a body of len bytes to out.
+void cache_length_line(uint8_t* out, size_t len);
+
+// budget of 0 disables the cache.
+void cache_init(size_t budget, size_t max_object);
+// Like cache_init, but with the cache in a region shared with up to
+// workers worker processes forked after it (prefork.h), which see the
+// same entries. Returns -1 if the region cannot be set up.
+int cache_init_shared(size_t budget, size_t max_object, int workers);
+// In a worker process, before its first lookup: which one it is.
+void cache_attach(int worker);
+// After a worker process died: drops the references it held and
+// ends its epoch sections, which would keep entries from being freed.
+void cache_reclaim(int worker, pid_t pid);
+int cache_enabled(void);
+size_t cache_max_object(void);
+
+// After cache_init.
+void cache_set_policy(int policy);
+// Returns cache_lru or cache_tinylfu, or -1 for an unknown name.
+int cache_parse_policy(char const* name);
+char const* cache_policy_name(int policy);
+
+typedef struct {
+    size_t used;
+    size_t budget;
+    size_t entries;
+    // entries the window evicted that did or did not displace others
+    uint64_t admitted;
+    uint64_t rejected;
+    // of the shared region, 0 unless shared
+    size_t region_size;
+    size_t region_used;     // pages taken by allocations
+} cache_usage;
+
+void cache_counts(cache_usage* u);
+
+// Writes the cache key for a request into buf. Returns -1 if it does not fit.
+int cache_key(mutslice buf, slice node, slice service, slice path, slice* key);
+
+// FNV-1a hash of a cache key.
+uint64_t cache_hash(slice key);
+
+// Returns 1 if the request may be answered from (and stored in) a cache.
+int cache_request_cacheable(http_request const* req);
+// Returns the absolute expiry time of a response, or 0 if it may not be stored.
+time_t cache_response_expires(http_response const* res, time_t now);
+
+// How long entries past their expiry may be served, for responses
+// without stale-while-revalidate or stale-if-error of their own.
+void cache_set_stale(long while_revalidate, long if_error);
+
+#define cache_fresh         0
+#define cache_stale         1   // past expiry, being revalidated
+#define cache_revalidate    2   // past expiry, the caller revalidates it
+
+// Returns a referenced entry that may be served, or NULL, and sets
+// *state. For cache_revalidate the entry is referenced twice, the
+// second reference to be handed to revalidate_start.
+// Release with cache_release.
+cache_entry* cache_lookup(slice key, int* state);
+// Returns the referenced entry for key if it may stand in for a
+// response the origin failed to give, marking its origin as failed.
+cache_entry* cache_lookup_if_error(slice key);
+void cache_release(cache_entry* e);
+// Ends the revalidation of e, noting whether the origin failed (1)
+// or answered (0); -1 if it was not asked after all.
+void cache_revalidated(cache_entry* e, int failed);
+// Removes e from the cache, if it still is in it.
+void cache_drop(cache_entry* e);
+
+int cache_fill_begin(cache_fill* f, slice key, slice head,
+                     http_response const* res, time_t expires);
+// Returns -1 (and abandons the fill) once the object outgrows max_object.
+int cache_fill_append(cache_fill* f, slice bytes);
+void cache_fill_commit(cache_fill* f);
+void cache_fill_abort(cache_fill* f);
+
+#endif
@@ -0,0 +1,150 @@
+#define _GNU_SOURCE
+#include "clients.h"
+#include "proxy.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+// A bounded MPMC queue (Vyukov's): a cell is free for the enqueue at
+// position pos when its seq is pos, and holds the item for the dequeue
+// at pos when its seq is pos + 1.
+typedef struct {
+    size_t seq;
+    int fd;
+    uint64_t accepted;
+} cell;
+
+static cell* cells;
+static size_t mask;
+// The producer and consumer positions on lines of their own.
+static size_t head __attribute__((aligned(64)));
+static size_t tail __attribute__((aligned(64)));
+// One post per queued socket, so idle threads sleep instead of polling.
+static sem_t ready;
+
+static
+int enqueue(int fd, uint64_t accepted) {
+    size_t pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+    cell* c;
+    while (1) {
+        c = &cells[pos & mask];
+        size_t seq = __atomic_load_n(&(*c).seq, __ATOMIC_ACQUIRE);
+        intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&head, &pos, pos + 1, 1,
+                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (dif < 0) {
+            return -1;
+        } else {
+            pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+        }
+    }
+    (*c).fd = fd;
+    (*c).accepted = accepted;
+    __atomic_store_n(&(*c).seq, pos + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static
+int dequeue(int* fd, uint64_t* accepted) {
+    size_t pos = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+    cell* c;
+    while (1) {
+        c = &cells[pos & mask];
+        size_t seq = __atomic_load_n(&(*c).seq, __ATOMIC_ACQUIRE);
+        intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&tail, &pos, pos + 1, 1,
+                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (dif < 0) {
+            return -1;
+        } else {
+            pos = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+        }
+    }
+    *fd = (*c).fd;
+    *accepted = (*c).accepted;
+    __atomic_store_n(&(*c).seq, pos + mask + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static
+void* client_thread(void* ptr) {
+    (void)ptr;
+    while (1) {
+        while (sem_wait(&ready) != 0) {
+            // EINTR
+        }
+        int fd;
+        uint64_t accepted;
+        // A post means a socket is queued, but with several producers
+        // the one at the tail may not be published yet.
+        while (dequeue(&fd, &accepted) != 0) {
+            sched_yield();
+        }
+        handle_client(fd, accepted);
+    }
+    return NULL;
+}
+
+int clients_start(int nthreads, size_t stack, size_t depth) {
+    size_t n = 1;
+    while (n < depth) {
+        n <<= 1;
+    }
+    cells = calloc(n, sizeof(cell));
+    if (!cells) {
+        perror("calloc");
+        return -1;
+    }
+    for (size_t i = 0; i < n; ++i) {
+        cells[i].seq = i;
+    }
+    mask = n - 1;
+    if (sem_init(&ready, 0, 0) != 0) {
+        perror("sem_init");
+        return -1;
+    }
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int err = pthread_attr_setstacksize(&attr, stack);
+    if (err != 0) {
+        tlog(LOG_ERROR, "pthread_attr_setstacksize: %s\n", strerror(err));
+        pthread_attr_destroy(&attr);
+        return -1;
+    }
+    int started = 0;
+    for (int i = 0; i < nthreads; ++i) {
+        pthread_t thread;
+        err = pthread_create(&thread, &attr, client_thread, NULL);
+        if (err != 0) {
+            tlog(LOG_ERROR, "pthread_create: %s\n", strerror(err));
+            break;
+        }
+        started += 1;
+    }
+    pthread_attr_destroy(&attr);
+    if (started == 0) {
+        return -1;
+    }
+    tprintf("clients: %d threads, up to %zu waiting\n", started, n);
+    return 0;
+}
+
+int clients_submit(int fd, uint64_t accepted) {
+    if (enqueue(fd, accepted) != 0) {
+        return -1;
+    }
+    sem_post(&ready);
+    return 0;
+}
@@ -0,0 +1,24 @@
+#ifndef CLIENTS_H
+#define CLIENTS_H
+#include "tprintf.h"
+#include <stddef.h>
+#include <stdint.h>
+
+#define CLIENTS_DEFAULT_THREADS 128
+#define CLIENTS_DEFAULT_STACK   (256 << 10)
+#define CLIENTS_MIN_STACK       (128 << 10)  // a transfer buffer and a DNS lookup
+#define CLIENTS_DEFAULT_QUEUE   1024
+
+// A fixed set of threads, each serving one client connection at a
+// time with handle_client. Accepted sockets wait for a free thread in a
+// bounded lock-free queue.
+
+// Starts nthreads threads with stack bytes of stack each, and a queue
+// of depth (rounded up to a power of two) sockets. Returns -1 if no
+// thread could be started.
+int clients_start(int nthreads, size_t stack, size_t depth);
+// Queues an accepted client for the next free thread. Returns -1 if
+// the queue is full, in which case the caller still owns fd.
+int clients_submit(int fd, uint64_t accepted);
+
+#endif
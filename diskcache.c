@@ -0,0 +1,434 @@
+#define _GNU_SOURCE
+#include "diskcache.h"
+#include "cache.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define DISKCACHE_MAGIC     0x32434450 // "PDC2"
+#define DISKCACHE_BUCKETS   65536
+#define TMP_PREFIX          "tmp."
+
+typedef struct diskcache_entry diskcache_entry;
+struct diskcache_entry {
+    uint64_t hash;
+    size_t size;
+    time_t expires;
+    time_t mtime;
+    diskcache_entry* hnext;
+    diskcache_entry* prev;
+    diskcache_entry* next;
+};
+
+static pthread_mutex_t disk_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int disk_dir = -1;
+static size_t disk_limit;
+static size_t disk_used;
+static unsigned disk_tmpseq;
+static diskcache_entry* disk_buckets[DISKCACHE_BUCKETS];
+static diskcache_entry* lru_head;
+static diskcache_entry* lru_tail;
+
+static
+void object_name(uint64_t hash, char name[17]) {
+    snprintf(name, 17, "%016llx", (unsigned long long)hash);
+}
+
+static
+diskcache_entry** bucket_slot(uint64_t hash) {
+    diskcache_entry** slot = &disk_buckets[hash & (DISKCACHE_BUCKETS - 1)];
+    while (*slot && (**slot).hash != hash) {
+        slot = &(**slot).hnext;
+    }
+    return slot;
+}
+
+static
+void lru_unlink(diskcache_entry* e) {
+    if ((*e).prev) {
+        (*(*e).prev).next = (*e).next;
+    } else {
+        lru_head = (*e).next;
+    }
+    if ((*e).next) {
+        (*(*e).next).prev = (*e).prev;
+    } else {
+        lru_tail = (*e).prev;
+    }
+    (*e).prev = NULL;
+    (*e).next = NULL;
+}
+
+static
+void lru_push_front(diskcache_entry* e) {
+    (*e).prev = NULL;
+    (*e).next = lru_head;
+    if (lru_head) {
+        (*lru_head).prev = e;
+    }
+    lru_head = e;
+    if (!lru_tail) {
+        lru_tail = e;
+    }
+}
+
+// Must hold disk_mutex. Removes e from the index and, if
+// remove_file, its object from the directory.
+static
+void entry_remove(diskcache_entry* e, int remove_file) {
+    diskcache_entry** slot = bucket_slot((*e).hash);
+    if (*slot == e) {
+        *slot = (*e).hnext;
+    }
+    lru_unlink(e);
+    disk_used -= (*e).size;
+    if (remove_file) {
+        char name[17];
+        object_name((*e).hash, name);
+        if (unlinkat(disk_dir, name, 0) != 0 && errno != ENOENT) {
+            perror("diskcache: unlinkat");
+        }
+    }
+    free(e);
+}
+
+// Must hold disk_mutex.
+static
+void entry_insert(diskcache_entry* e) {
+    diskcache_entry* old = *bucket_slot((*e).hash);
+    if (old) {
+        entry_remove(old, 0);
+    }
+    diskcache_entry** slot = &disk_buckets[(*e).hash & (DISKCACHE_BUCKETS - 1)];
+    (*e).hnext = *slot;
+    *slot = e;
+    lru_push_front(e);
+    disk_used += (*e).size;
+    while (disk_used > disk_limit && lru_tail && lru_tail != e) {
+        tlog(LOG_DEBUG, "diskcache: evicting %016llx\n", (unsigned long long)(*lru_tail).hash);
+        entry_remove(lru_tail, 1);
+    }
+}
+
+static
+int read_meta(int fd, diskcache_meta* meta) {
+    ssize_t n = pread(fd, meta, sizeof(*meta), 0);
+    if (n != sizeof(*meta) || (*meta).magic != DISKCACHE_MAGIC) {
+        return -1;
+    }
+    return 0;
+}
+
+static
+int by_mtime(void const* a, void const* b) {
+    diskcache_entry const* x = *(diskcache_entry* const*)a;
+    diskcache_entry const* y = *(diskcache_entry* const*)b;
+    return (x->mtime > y->mtime) - (x->mtime < y->mtime);
+}
+
+// Rebuilds the index from the object metas, oldest first so the
+// most recently used objects end up at the front of the LRU.
+static
+int scan_dir(void) {
+    int fd = dup(disk_dir);
+    if (fd == -1) {
+        return -1;
+    }
+    DIR* dir = fdopendir(fd);
+    if (!dir) {
+        close(fd);
+        return -1;
+    }
+
+    time_t now = time(NULL);
+    diskcache_entry** found = NULL;
+    size_t nfound = 0;
+    size_t capfound = 0;
+    struct dirent* d;
+    while ((d = readdir(dir)) != NULL) {
+        if (strncmp(d->d_name, TMP_PREFIX, strlen(TMP_PREFIX)) == 0) {
+            // left over from a fill that never finished
+            unlinkat(disk_dir, d->d_name, 0);
+            continue;
+        }
+        char* end = NULL;
+        unsigned long long hash = strtoull(d->d_name, &end, 16);
+        if (strlen(d->d_name) != 16 || *end != '\0') {
+            continue;
+        }
+
+        int obj = openat(disk_dir, d->d_name, O_RDONLY|O_CLOEXEC);
+        if (obj == -1) {
+            continue;
+        }
+        diskcache_meta meta;
+        struct stat st;
+        int ok = read_meta(obj, &meta) == 0 && fstat(obj, &st) == 0
+            && (uint64_t)st.st_size == sizeof(meta) + meta.keylen + meta.headlen + meta.bodylen
+            && meta.expires > now;
+        close(obj);
+        if (!ok) {
+            unlinkat(disk_dir, d->d_name, 0);
+            continue;
+        }
+
+        diskcache_entry* e = calloc(1, sizeof(diskcache_entry));
+        if (!e) {
+            break;
+        }
+        (*e).hash = hash;
+        (*e).size = st.st_size;
+        (*e).expires = meta.expires;
+        (*e).mtime = st.st_mtime;
+        if (nfound == capfound) {
+            capfound = capfound ? capfound*2 : 256;
+            diskcache_entry** p = realloc(found, capfound * sizeof(*found));
+            if (!p) {
+                free(e);
+                break;
+            }
+            found = p;
+        }
+        found[nfound++] = e;
+    }
+    closedir(dir);
+
+    qsort(found, nfound, sizeof(*found), by_mtime);
+    pthread_mutex_lock(&disk_mutex);
+    for (size_t i = 0; i < nfound; ++i) {
+        entry_insert(found[i]);
+    }
+    pthread_mutex_unlock(&disk_mutex);
+    free(found);
+    tprintf("diskcache: indexed %zu objects, %zu/%zu bytes\n", nfound, disk_used, disk_limit);
+    return 0;
+}
+
+int diskcache_init(char const* dir, size_t limit) {
+    if (limit == 0) {
+        return 0;
+    }
+    if (mkdir(dir, 0700) != 0 && errno != EEXIST) {
+        perror("diskcache: mkdir");
+        return -1;
+    }
+    disk_dir = open(dir, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    if (disk_dir == -1) {
+        perror("diskcache: open");
+        return -1;
+    }
+    disk_limit = limit;
+    if (scan_dir() != 0) {
+        perror("diskcache: scan");
+        close(disk_dir);
+        disk_dir = -1;
+        return -1;
+    }
+    return 0;
+}
+
+int diskcache_enabled(void) {
+    return disk_dir != -1;
+}
+
+int diskcache_lookup(slice key, diskcache_hit* hit) {
+    if (!diskcache_enabled()) {
+        return 0;
+    }
+    uint64_t hash = cache_hash(key);
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&disk_mutex);
+    diskcache_entry* e = *bucket_slot(hash);
+    if (e && (*e).expires <= now) {
+        entry_remove(e, 1);
+        e = NULL;
+    }
+    if (e) {
+        lru_unlink(e);
+        lru_push_front(e);
+    }
+    pthread_mutex_unlock(&disk_mutex);
+    if (!e) {
+        return 0;
+    }
+
+    // An eviction may unlink the object from here on, the
+    // open descriptor keeps its data readable.
+    char name[17];
+    object_name(hash, name);
+    int fd = openat(disk_dir, name, O_RDONLY|O_CLOEXEC);
+    if (fd == -1) {
+        return 0;
+    }
+    diskcache_meta meta;
+    uint8_t stored[CACHE_KEYLEN];
+    if (read_meta(fd, &meta) != 0 || meta.keylen != key.len || key.len > CACHE_KEYLEN
+        || pread(fd, stored, key.len, sizeof(meta)) != (ssize_t)key.len
+        || memcmp(stored, key.ptr, key.len) != 0) {
+        // hash collision with another key
+        close(fd);
+        return 0;
+    }
+    // keep the LRU order across restarts
+    futimens(fd, NULL);
+
+    (*hit).fd = fd;
+    (*hit).offset = sizeof(meta) + meta.keylen;
+    (*hit).headlen = meta.headlen;
+    (*hit).len = meta.headlen + meta.bodylen;
+    return 1;
+}
+
+static
+int pwrite_all(int fd, slice bytes, loff_t off) {
+    size_t total = 0;
+    while (total < bytes.len) {
+        ssize_t n = pwrite(fd, &bytes.ptr[total], bytes.len - total, off + total);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        total += n;
+    }
+    return 0;
+}
+
+int diskcache_fill_begin(diskcache_fill* f, slice key, slice head,
+                         http_response const* res, time_t expires) {
+    memset(f, 0, sizeof(*f));
+    (*f).fd = -1;
+    if (!diskcache_enabled()) {
+        return -1;
+    }
+    // see CACHE_LENGTH_LINE
+    size_t extra = cache_unframed(res) ? CACHE_LENGTH_LINE : 0;
+    size_t fixed = sizeof(diskcache_meta) + key.len + head.len + extra;
+    switch (http_content_length((*res).headerbuf, &(*f).content_length)) {
+    case 1:
+        if (fixed + (*f).content_length > disk_limit) {
+            return -1;
+        }
+        (*f).has_content_length = 1;
+        break;
+    case -1:
+        return -1;
+    }
+
+    pthread_mutex_lock(&disk_mutex);
+    unsigned seq = disk_tmpseq++;
+    pthread_mutex_unlock(&disk_mutex);
+    snprintf((*f).path, sizeof((*f).path), TMP_PREFIX "%d.%u", (int)getpid(), seq);
+    (*f).fd = openat(disk_dir, (*f).path, O_RDWR|O_CREAT|O_EXCL|O_CLOEXEC, 0600);
+    if ((*f).fd == -1) {
+        perror("diskcache: openat");
+        return -1;
+    }
+
+    (*f).hash = cache_hash(key);
+    (*f).meta.magic = DISKCACHE_MAGIC;
+    (*f).meta.keylen = key.len;
+    (*f).meta.headlen = head.len + extra;
+    (*f).meta.bodylen = 0;
+    (*f).meta.expires = expires;
+    (*f).off = sizeof(diskcache_meta);
+    uint8_t line[CACHE_LENGTH_LINE];
+    cache_length_line(line, 0);
+    if (pwrite_all((*f).fd, key, (*f).off) != 0
+        || pwrite_all((*f).fd, head, (*f).off + key.len) != 0
+        || pwrite_all((*f).fd, (slice){line, extra}, (*f).off + key.len + head.len) != 0) {
+        perror("diskcache: pwrite");
+        diskcache_fill_abort(f);
+        return -1;
+    }
+    if (extra) {
+        (*f).length_at = (*f).off + key.len + head.len;
+    }
+    (*f).off += key.len + head.len + extra;
+    return 0;
+}
+
+int diskcache_fill_spliced(diskcache_fill* f, size_t n) {
+    (*f).off += n;
+    (*f).meta.bodylen += n;
+    if ((size_t)(*f).off > disk_limit) {
+        diskcache_fill_abort(f);
+        return -1;
+    }
+    return 0;
+}
+
+int diskcache_fill_append(diskcache_fill* f, slice bytes) {
+    if ((*f).fd == -1) {
+        return -1;
+    }
+    if (pwrite_all((*f).fd, bytes, (*f).off) != 0) {
+        perror("diskcache: pwrite");
+        diskcache_fill_abort(f);
+        return -1;
+    }
+    return diskcache_fill_spliced(f, bytes.len);
+}
+
+void diskcache_fill_abort(diskcache_fill* f) {
+    if ((*f).fd == -1) {
+        return;
+    }
+    close((*f).fd);
+    (*f).fd = -1;
+    unlinkat(disk_dir, (*f).path, 0);
+}
+
+void diskcache_fill_commit(diskcache_fill* f) {
+    if ((*f).fd == -1) {
+        return;
+    }
+    if ((*f).has_content_length && (*f).meta.bodylen != (*f).content_length) {
+        tlog(LOG_WARN, "diskcache: truncated response for %016llx, not storing\n",
+            (unsigned long long)(*f).hash);
+        diskcache_fill_abort(f);
+        return;
+    }
+    uint8_t line[CACHE_LENGTH_LINE];
+    cache_length_line(line, (*f).meta.bodylen);
+    if (((*f).length_at && pwrite_all((*f).fd, (slice){line, sizeof(line)}, (*f).length_at) != 0)
+        || pwrite_all((*f).fd, (slice){(uint8_t const*)&(*f).meta, sizeof((*f).meta)}, 0) != 0) {
+        perror("diskcache: pwrite");
+        diskcache_fill_abort(f);
+        return;
+    }
+
+    diskcache_entry* e = calloc(1, sizeof(diskcache_entry));
+    if (!e) {
+        diskcache_fill_abort(f);
+        return;
+    }
+    (*e).hash = (*f).hash;
+    (*e).size = (*f).off;
+    (*e).expires = (*f).meta.expires;
+
+    char name[17];
+    object_name((*f).hash, name);
+    pthread_mutex_lock(&disk_mutex);
+    if (renameat(disk_dir, (*f).path, disk_dir, name) != 0) {
+        pthread_mutex_unlock(&disk_mutex);
+        perror("diskcache: renameat");
+        free(e);
+        diskcache_fill_abort(f);
+        return;
+    }
+    entry_insert(e);
+    tlog(LOG_DEBUG, "diskcache: stored %s (%zu bytes, %zu/%zu used)\n",
+        name, (*e).size, disk_used, disk_limit);
+    pthread_mutex_unlock(&disk_mutex);
+    close((*f).fd);
+    (*f).fd = -1;
+}
@@ -0,0 +1,63 @@
+#ifndef DISKCACHE_H
+#define DISKCACHE_H
+#include "tprintf.h"
+#include "slice.h"
+#include "http.h"
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+#define DISKCACHE_DEFAULT_LIMIT (1ULL << 30)
+
+// Every object is one file named after the key's hash:
+// a diskcache_meta, the key, the response head and the body.
+// The metas are the on-disk index; it is rebuilt at startup.
+typedef struct {
+    uint32_t magic;
+    uint32_t keylen;
+    uint64_t headlen;
+    uint64_t bodylen;
+    int64_t expires;
+} diskcache_meta;
+
+// An open cached object. The response is len bytes of fd at offset,
+// the first headlen of them laid out like a cache_entry's head.
+typedef struct {
+    int fd;
+    off_t offset;
+    size_t headlen;
+    size_t len;
+} diskcache_hit;
+
+// An object being written while its body streams to the client.
+typedef struct {
+    int fd;
+    char path[64];
+    uint64_t hash;
+    diskcache_meta meta;
+    loff_t off;
+    size_t content_length;
+    int has_content_length;
+    loff_t length_at;   // of the reserved Content-Length line, or 0
+} diskcache_fill;
+
+// Opens (creating if needed) the cache directory and indexes its
+// objects. Returns -1 on error. A limit of 0 disables the disk tier.
+int diskcache_init(char const* dir, size_t limit);
+int diskcache_enabled(void);
+
+// Returns 1 and an open hit for a fresh object, 0 on miss.
+// The caller closes (*hit).fd.
+int diskcache_lookup(slice key, diskcache_hit* hit);
+
+int diskcache_fill_begin(diskcache_fill* f, slice key, slice head,
+                         http_response const* res, time_t expires);
+// Accounts for n body bytes spliced into (*f).fd at (*f).off.
+// Both return -1 (and abandon the fill) once the object outgrows
+// the limit or the write fails.
+int diskcache_fill_spliced(diskcache_fill* f, size_t n);
+int diskcache_fill_append(diskcache_fill* f, slice bytes);
+void diskcache_fill_commit(diskcache_fill* f);
+void diskcache_fill_abort(diskcache_fill* f);
+
+#endif
@@ -0,0 +1,772 @@
+#define _GNU_SOURCE
+#include "dns.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/eventfd.h>
+#include <sys/random.h>
+
+#define DNS_SHARDS          16
+#define DNS_SHARD_BUCKETS   256
+#define DNS_SHARD_MAX       256
+#define DNS_TIMEOUT_MS      1000
+#define DNS_TRIES           2
+#define DNS_MSGLEN          1232
+
+#define DNS_TYPE_A      1
+#define DNS_TYPE_CNAME  5
+#define DNS_TYPE_SOA    6
+#define DNS_TYPE_AAAA   28
+#define DNS_RCODE_OK        0
+#define DNS_RCODE_NXDOMAIN  3
+
+// A cached lookup. The addresses are stored without a port.
+typedef struct dns_entry dns_entry;
+struct dns_entry {
+    char name[256];
+    uint64_t hash;
+    time_t expires;
+    dns_result result;
+    dns_entry* hnext;
+    // insertion order, the oldest entry is evicted first
+    dns_entry* older;
+    dns_entry* newer;
+};
+
+// The cache is split into shards, each under its own lock, so that
+// lookups from many threads rarely wait on each other.
+typedef struct {
+    pthread_mutex_t mutex;
+    dns_entry* buckets[DNS_SHARD_BUCKETS];
+    dns_entry* oldest;
+    dns_entry* newest;
+    int n;
+} dns_shard;
+
+static dns_shard dns_shards[DNS_SHARDS];
+static struct sockaddr_storage dns_ns;
+static socklen_t dns_nslen;
+static char const* dns_hosts = "/etc/hosts";
+
+static pthread_once_t dns_threads_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t dns_jobs_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dns_jobs_cond = PTHREAD_COND_INITIALIZER;
+static dns_query* dns_jobs_head;
+static dns_query* dns_jobs_tail;
+
+// Parses "addr", "addr:port" or "[addr6]:port".
+static
+int parse_nameserver(char const* s, struct sockaddr_storage* ss, socklen_t* len) {
+    char host[INET6_ADDRSTRLEN + 2];
+    int port = 53;
+    char const* colon = strrchr(s, ':');
+    size_t hostlen = strlen(s);
+    if (s[0] == '[') {
+        char const* end = strchr(s, ']');
+        if (!end) {
+            return -1;
+        }
+        s += 1;
+        hostlen = end - s;
+        if (end[1] == ':') {
+            port = atoi(&end[2]);
+        }
+    } else if (colon && strchr(s, ':') == colon) {
+        hostlen = colon - s;
+        port = atoi(colon + 1);
+    }
+    if (hostlen >= sizeof(host) || port <= 0 || port > 65535) {
+        return -1;
+    }
+    memcpy(host, s, hostlen);
+    host[hostlen] = '\0';
+
+    memset(ss, 0, sizeof(*ss));
+    struct sockaddr_in* in4 = (struct sockaddr_in*)ss;
+    struct sockaddr_in6* in6 = (struct sockaddr_in6*)ss;
+    if (inet_pton(AF_INET, host, &(*in4).sin_addr) == 1) {
+        (*in4).sin_family = AF_INET;
+        (*in4).sin_port = htons(port);
+        *len = sizeof(*in4);
+        return 0;
+    }
+    if (inet_pton(AF_INET6, host, &(*in6).sin6_addr) == 1) {
+        (*in6).sin6_family = AF_INET6;
+        (*in6).sin6_port = htons(port);
+        *len = sizeof(*in6);
+        return 0;
+    }
+    return -1;
+}
+
+// Finds the first nameserver in /etc/resolv.conf.
+static
+int resolv_conf_nameserver(struct sockaddr_storage* ss, socklen_t* len) {
+    FILE* f = fopen("/etc/resolv.conf", "re");
+    if (!f) {
+        return -1;
+    }
+    char line[512];
+    int err = -1;
+    while (err != 0 && fgets(line, sizeof(line), f)) {
+        char* save = NULL;
+        char* key = strtok_r(line, " \t\r\n", &save);
+        char* value = strtok_r(NULL, " \t\r\n", &save);
+        if (key && value && strcmp(key, "nameserver") == 0) {
+            err = parse_nameserver(value, ss, len);
+        }
+    }
+    fclose(f);
+    return err;
+}
+
+int dns_init(char const* nameserver, char const* hosts) {
+    for (int i = 0; i < DNS_SHARDS; ++i) {
+        pthread_mutex_init(&dns_shards[i].mutex, NULL);
+    }
+    if (hosts) {
+        dns_hosts = hosts;
+    }
+    dns_nslen = 0;
+    if (nameserver) {
+        if (parse_nameserver(nameserver, &dns_ns, &dns_nslen) != 0) {
+            tlog(LOG_ERROR, "dns: invalid nameserver: %s\n", nameserver);
+            return -1;
+        }
+    } else if (resolv_conf_nameserver(&dns_ns, &dns_nslen) != 0) {
+        tprintf("dns: no nameserver, resolving through getaddrinfo\n");
+        dns_nslen = 0;
+    }
+    return 0;
+}
+
+static
+uint64_t name_hash(char const* name) {
+    uint64_t h = 14695981039346656037ULL;
+    for (; *name; ++name) {
+        h ^= (uint8_t)*name;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static
+int service_port(slice service, int* port) {
+    char name[32];
+    if (service.len == 0 || service.len >= sizeof(name)) {
+        return -1;
+    }
+    memcpy(name, service.ptr, service.len);
+    name[service.len] = '\0';
+    char* end = NULL;
+    long n = strtol(name, &end, 10);
+    if (*end == '\0') {
+        if (n <= 0 || n > 65535) {
+            return -1;
+        }
+        *port = n;
+        return 0;
+    }
+    struct servent se;
+    struct servent* found = NULL;
+    char buf[1024];
+    if (getservbyname_r(name, "tcp", &se, buf, sizeof(buf), &found) != 0 || !found) {
+        return -1;
+    }
+    *port = ntohs((*found).s_port);
+    return 0;
+}
+
+static
+void set_port(dns_result* res, int port) {
+    for (int i = 0; i < (*res).n; ++i) {
+        struct sockaddr_storage* ss = &(*res).addr[i];
+        if ((*ss).ss_family == AF_INET) {
+            (*(struct sockaddr_in*)ss).sin_port = htons(port);
+        } else {
+            (*(struct sockaddr_in6*)ss).sin6_port = htons(port);
+        }
+    }
+}
+
+static
+void add_addr(dns_result* res, int family, void const* addr) {
+    if ((*res).n == DNS_MAX_ADDRS) {
+        return;
+    }
+    struct sockaddr_storage* ss = &(*res).addr[(*res).n];
+    memset(ss, 0, sizeof(*ss));
+    if (family == AF_INET) {
+        struct sockaddr_in* in4 = (struct sockaddr_in*)ss;
+        (*in4).sin_family = AF_INET;
+        memcpy(&(*in4).sin_addr, addr, 4);
+        (*res).addrlen[(*res).n] = sizeof(*in4);
+    } else {
+        struct sockaddr_in6* in6 = (struct sockaddr_in6*)ss;
+        (*in6).sin6_family = AF_INET6;
+        memcpy(&(*in6).sin6_addr, addr, 16);
+        (*res).addrlen[(*res).n] = sizeof(*in6);
+    }
+    (*res).n += 1;
+}
+
+static
+int parse_numeric(char const* name, dns_result* res) {
+    uint8_t addr[16];
+    if (inet_pton(AF_INET, name, addr) == 1) {
+        add_addr(res, AF_INET, addr);
+        return 1;
+    }
+    if (inet_pton(AF_INET6, name, addr) == 1) {
+        add_addr(res, AF_INET6, addr);
+        return 1;
+    }
+    return 0;
+}
+
+// Returns 1 if name is in the hosts file, with all its addresses.
+static
+int hosts_lookup(char const* name, dns_result* res) {
+    FILE* f = fopen(dns_hosts, "re");
+    if (!f) {
+        return 0;
+    }
+    char line[1024];
+    while (fgets(line, sizeof(line), f)) {
+        char* comment = strchr(line, '#');
+        if (comment) {
+            *comment = '\0';
+        }
+        char* save = NULL;
+        char* addr = strtok_r(line, " \t\r\n", &save);
+        if (!addr) {
+            continue;
+        }
+        char* alias;
+        while ((alias = strtok_r(NULL, " \t\r\n", &save)) != NULL) {
+            if (strcasecmp(alias, name) == 0) {
+                parse_numeric(addr, res);
+                break;
+            }
+        }
+    }
+    fclose(f);
+    return (*res).n > 0;
+}
+
+static
+void put16(uint8_t* p, uint16_t v) {
+    p[0] = v >> 8;
+    p[1] = v & 0xff;
+}
+
+static
+uint16_t get16(uint8_t const* p) {
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static
+uint32_t get32(uint8_t const* p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+// Writes a recursive query for name into buf. Returns its length,
+// or 0 if name is not a valid domain name.
+static
+size_t build_query(uint8_t* buf, size_t cap, uint16_t id, char const* name, uint16_t type) {
+    size_t namelen = strlen(name);
+    if (12 + namelen + 2 + 4 > cap) {
+        return 0;
+    }
+    memset(buf, 0, 12);
+    put16(&buf[0], id);
+    put16(&buf[2], 0x0100); // recursion desired
+    put16(&buf[4], 1);
+    size_t pos = 12;
+    char const* label = name;
+    while (*label) {
+        char const* dot = strchr(label, '.');
+        size_t len = dot ? (size_t)(dot - label) : strlen(label);
+        if (len == 0 || len > 63) {
+            return 0;
+        }
+        buf[pos++] = len;
+        memcpy(&buf[pos], label, len);
+        pos += len;
+        label += len;
+        if (*label == '.') {
+            label += 1;
+        }
+    }
+    buf[pos++] = 0;
+    put16(&buf[pos], type);
+    put16(&buf[pos + 2], 1); // IN
+    return pos + 4;
+}
+
+static
+int skip_name(uint8_t const* msg, size_t len, size_t* pos) {
+    while (*pos < len) {
+        uint8_t b = msg[*pos];
+        if (b == 0) {
+            *pos += 1;
+            return 0;
+        }
+        if ((b & 0xc0) == 0xc0) {
+            *pos += 2;
+            return *pos <= len ? 0 : -1;
+        }
+        *pos += 1 + b;
+    }
+    return -1;
+}
+
+// The outcome of one query: its rcode, addresses and the smallest
+// TTL of the records that led to them (or of the SOA for a failure).
+typedef struct {
+    int answered;
+    int rcode;
+    dns_result result;
+    uint32_t ttl;
+} dns_answer;
+
+static
+int parse_response(uint8_t const* msg, size_t len, dns_answer* ans) {
+    if (len < 12 || !(msg[2] & 0x80)) {
+        return -1;
+    }
+    (*ans).rcode = msg[3] & 0x0f;
+    int qd = get16(&msg[4]);
+    int an = get16(&msg[6]);
+    int ns = get16(&msg[8]);
+    size_t pos = 12;
+    for (int i = 0; i < qd; ++i) {
+        if (skip_name(msg, len, &pos) != 0) {
+            return -1;
+        }
+        pos += 4;
+    }
+    (*ans).ttl = UINT32_MAX;
+    uint32_t soa_ttl = UINT32_MAX;
+    for (int i = 0; i < an + ns; ++i) {
+        if (skip_name(msg, len, &pos) != 0 || pos + 10 > len) {
+            return -1;
+        }
+        uint16_t type = get16(&msg[pos]);
+        uint32_t ttl = get32(&msg[pos + 4]);
+        uint16_t rdlen = get16(&msg[pos + 8]);
+        pos += 10;
+        if (pos + rdlen > len) {
+            return -1;
+        }
+        if (i < an) {
+            if (type == DNS_TYPE_A && rdlen == 4) {
+                add_addr(&(*ans).result, AF_INET, &msg[pos]);
+            } else if (type == DNS_TYPE_AAAA && rdlen == 16) {
+                add_addr(&(*ans).result, AF_INET6, &msg[pos]);
+            }
+            if (type == DNS_TYPE_A || type == DNS_TYPE_AAAA || type == DNS_TYPE_CNAME) {
+                (*ans).ttl = ttl < (*ans).ttl ? ttl : (*ans).ttl;
+            }
+        } else if (type == DNS_TYPE_SOA && rdlen >= 4) {
+            // negative answers live for min(SOA TTL, SOA minimum)
+            uint32_t minimum = get32(&msg[pos + rdlen - 4]);
+            soa_ttl = ttl < minimum ? ttl : minimum;
+        }
+        pos += rdlen;
+    }
+    if ((*ans).result.n == 0) {
+        (*ans).ttl = soa_ttl;
+    }
+    (*ans).answered = 1;
+    return 0;
+}
+
+// Asks the nameserver for the A and AAAA records of name. Returns 0
+// with the addresses, or EAI_NONAME for a name that does not exist,
+// and the TTL; -1 if the nameserver could not give an answer.
+static
+int query_nameserver(char const* name, dns_result* res, uint32_t* ttl) {
+    int fd = socket(dns_ns.ss_family, SOCK_DGRAM|SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    // connected, so only the nameserver's datagrams are received
+    if (connect(fd, (struct sockaddr*)&dns_ns, dns_nslen) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    uint16_t types[2] = {DNS_TYPE_A, DNS_TYPE_AAAA};
+    uint16_t ids[2];
+    if (getrandom(ids, sizeof(ids), 0) != sizeof(ids)) {
+        ids[0] = rand();
+        ids[1] = rand();
+    }
+    ids[1] ^= ids[0] == ids[1];
+    uint8_t queries[2][DNS_MSGLEN];
+    size_t querylens[2];
+    for (int i = 0; i < 2; ++i) {
+        querylens[i] = build_query(queries[i], DNS_MSGLEN, ids[i], name, types[i]);
+        if (querylens[i] == 0) {
+            close(fd);
+            return -1;
+        }
+    }
+
+    dns_answer answers[2];
+    memset(answers, 0, sizeof(answers));
+    for (int try = 0; try < DNS_TRIES && !(answers[0].answered && answers[1].answered); ++try) {
+        for (int i = 0; i < 2; ++i) {
+            if (!answers[i].answered) {
+                send(fd, queries[i], querylens[i], 0);
+            }
+        }
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        while (!(answers[0].answered && answers[1].answered)) {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            long waited = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+            if (waited >= DNS_TIMEOUT_MS) {
+                break;
+            }
+            struct pollfd p = {fd, POLLIN, 0};
+            if (poll(&p, 1, DNS_TIMEOUT_MS - waited) <= 0) {
+                continue;
+            }
+            uint8_t msg[DNS_MSGLEN];
+            ssize_t n = recv(fd, msg, sizeof(msg), 0);
+            if (n < 12) {
+                continue;
+            }
+            for (int i = 0; i < 2; ++i) {
+                if (!answers[i].answered && get16(msg) == ids[i]) {
+                    parse_response(msg, n, &answers[i]);
+                }
+            }
+        }
+    }
+    close(fd);
+
+    // IPv4 first, as most origins are reachable over it
+    *ttl = UINT32_MAX;
+    for (int i = 0; i < 2; ++i) {
+        dns_answer const* a = &answers[i];
+        if (!(*a).answered || (*a).rcode != DNS_RCODE_OK || (*a).result.n == 0) {
+            continue;
+        }
+        for (int j = 0; j < (*a).result.n && (*res).n < DNS_MAX_ADDRS; ++j) {
+            (*res).addr[(*res).n] = (*a).result.addr[j];
+            (*res).addrlen[(*res).n] = (*a).result.addrlen[j];
+            (*res).n += 1;
+        }
+        *ttl = (*a).ttl < *ttl ? (*a).ttl : *ttl;
+    }
+    if ((*res).n > 0) {
+        return 0;
+    }
+
+    // Only a definite "no such name" or "no such records" from both
+    // queries is a negative answer; anything else is a failure.
+    for (int i = 0; i < 2; ++i) {
+        dns_answer const* a = &answers[i];
+        if (!(*a).answered
+            || ((*a).rcode != DNS_RCODE_OK && (*a).rcode != DNS_RCODE_NXDOMAIN)) {
+            return -1;
+        }
+        *ttl = (*a).ttl < *ttl ? (*a).ttl : *ttl;
+    }
+    (*res).err = EAI_NONAME;
+    if (*ttl == UINT32_MAX) {
+        *ttl = DNS_NEGATIVE_TTL;
+    }
+    return 0;
+}
+
+static
+void resolve_getaddrinfo(char const* name, dns_result* res, uint32_t* ttl) {
+    struct addrinfo* ai = NULL;
+    struct addrinfo hints = {0, 0, SOCK_STREAM, 0, 0, 0, 0, 0};
+    int err = getaddrinfo(name, NULL, &hints, &ai);
+    if (err != 0) {
+        (*res).err = err;
+        // only cache answers, not failures to get one
+        *ttl = err == EAI_NONAME ? DNS_NEGATIVE_TTL : 0;
+        return;
+    }
+    for (struct addrinfo* r = ai; r != NULL; r = r->ai_next) {
+        if (r->ai_family == AF_INET) {
+            add_addr(res, AF_INET, &(*(struct sockaddr_in*)r->ai_addr).sin_addr);
+        } else if (r->ai_family == AF_INET6) {
+            add_addr(res, AF_INET6, &(*(struct sockaddr_in6*)r->ai_addr).sin6_addr);
+        }
+    }
+    freeaddrinfo(ai);
+    if ((*res).n == 0) {
+        (*res).err = EAI_NONAME;
+    }
+    *ttl = DNS_DEFAULT_TTL;
+}
+
+// Resolves name without the cache. Sets *ttl to how long the result
+// may be cached.
+static
+void resolve(char const* name, dns_result* res, uint32_t* ttl) {
+    memset(res, 0, sizeof(*res));
+    if (parse_numeric(name, res)) {
+        *ttl = 0; // nothing to save
+        return;
+    }
+    if (hosts_lookup(name, res)) {
+        *ttl = DNS_DEFAULT_TTL;
+        return;
+    }
+    // names without dots may need the resolv.conf search list
+    if (dns_nslen > 0 && strchr(name, '.') && query_nameserver(name, res, ttl) == 0) {
+        return;
+    }
+    memset(res, 0, sizeof(*res));
+    resolve_getaddrinfo(name, res, ttl);
+}
+
+// Lowercases node into name. Returns -1 if it is too long.
+static
+int node_name(slice node, char name[256]) {
+    if (node.len == 0 || node.len > 253) {
+        return -1;
+    }
+    for (size_t i = 0; i < node.len; ++i) {
+        uint8_t b = node.ptr[i];
+        name[i] = b >= 'A' && b <= 'Z' ? b - 'A' + 'a' : b;
+    }
+    name[node.len] = '\0';
+    if (name[node.len - 1] == '.') {
+        name[node.len - 1] = '\0';
+    }
+    return 0;
+}
+
+// Must hold the shard's mutex.
+static
+void entry_remove(dns_shard* s, dns_entry* e) {
+    dns_entry** slot = &(*s).buckets[(*e).hash % DNS_SHARD_BUCKETS];
+    while (*slot != e) {
+        slot = &(**slot).hnext;
+    }
+    *slot = (*e).hnext;
+    if ((*e).older) {
+        (*(*e).older).newer = (*e).newer;
+    } else {
+        (*s).oldest = (*e).newer;
+    }
+    if ((*e).newer) {
+        (*(*e).newer).older = (*e).older;
+    } else {
+        (*s).newest = (*e).older;
+    }
+    (*s).n -= 1;
+    free(e);
+}
+
+static
+int cache_get(char const* name, dns_result* res) {
+    uint64_t hash = name_hash(name);
+    dns_shard* s = &dns_shards[hash % DNS_SHARDS];
+    hash /= DNS_SHARDS;
+    time_t now = time(NULL);
+    int hit = 0;
+    pthread_mutex_lock(&(*s).mutex);
+    dns_entry* e = (*s).buckets[hash % DNS_SHARD_BUCKETS];
+    while (e && !((*e).hash == hash && strcmp((*e).name, name) == 0)) {
+        e = (*e).hnext;
+    }
+    if (e && (*e).expires <= now) {
+        entry_remove(s, e);
+        e = NULL;
+    }
+    if (e) {
+        *res = (*e).result;
+        hit = 1;
+    }
+    pthread_mutex_unlock(&(*s).mutex);
+    return hit;
+}
+
+static
+void cache_put(char const* name, dns_result const* res, uint32_t ttl) {
+    if (ttl == 0) {
+        return;
+    }
+    if (ttl > DNS_MAX_TTL) {
+        ttl = DNS_MAX_TTL;
+    }
+    dns_entry* e = malloc(sizeof(dns_entry));
+    if (!e) {
+        return;
+    }
+    uint64_t hash = name_hash(name);
+    strcpy((*e).name, name);
+    (*e).hash = hash / DNS_SHARDS;
+    (*e).expires = time(NULL) + ttl;
+    (*e).result = *res;
+
+    dns_shard* s = &dns_shards[hash % DNS_SHARDS];
+    pthread_mutex_lock(&(*s).mutex);
+    dns_entry** slot = &(*s).buckets[(*e).hash % DNS_SHARD_BUCKETS];
+    for (dns_entry* old = *slot; old; old = (*old).hnext) {
+        if ((*old).hash == (*e).hash && strcmp((*old).name, name) == 0) {
+            entry_remove(s, old);
+            break;
+        }
+    }
+    while ((*s).n >= DNS_SHARD_MAX) {
+        entry_remove(s, (*s).oldest);
+    }
+    (*e).hnext = *slot;
+    *slot = e;
+    (*e).older = (*s).newest;
+    (*e).newer = NULL;
+    if ((*s).newest) {
+        (*(*s).newest).newer = e;
+    } else {
+        (*s).oldest = e;
+    }
+    (*s).newest = e;
+    (*s).n += 1;
+    pthread_mutex_unlock(&(*s).mutex);
+}
+
+int dns_lookup(slice node, slice service, dns_result* res) {
+    char name[256];
+    int port = 0;
+    if (node_name(node, name) != 0 || service_port(service, &port) != 0) {
+        memset(res, 0, sizeof(*res));
+        (*res).err = node.len == 0 || node.len > 253 ? EAI_NONAME : EAI_SERVICE;
+        return 1;
+    }
+    if (!cache_get(name, res)) {
+        return 0;
+    }
+    set_port(res, port);
+    return 1;
+}
+
+void dns_resolve(slice node, slice service, dns_result* res) {
+    if (dns_lookup(node, service, res)) {
+        return;
+    }
+    char name[256];
+    int port = 0;
+    node_name(node, name);
+    service_port(service, &port);
+
+    uint32_t ttl = 0;
+    resolve(name, res, &ttl);
+    tlog(LOG_DEBUG, "dns: %s: %d addresses, err %d, ttl %u\n", name, (*res).n, (*res).err, ttl);
+    cache_put(name, res, ttl);
+    set_port(res, port);
+}
+
+static
+void* resolver_main(void* arg) {
+    (void)arg;
+    while (1) {
+        pthread_mutex_lock(&dns_jobs_mutex);
+        while (!dns_jobs_head) {
+            pthread_cond_wait(&dns_jobs_cond, &dns_jobs_mutex);
+        }
+        dns_query* q = dns_jobs_head;
+        dns_jobs_head = (*q).next;
+        if (!dns_jobs_head) {
+            dns_jobs_tail = NULL;
+        }
+        pthread_mutex_unlock(&dns_jobs_mutex);
+
+        dns_resolve((slice){(uint8_t const*)(*q).node, strlen((*q).node)},
+                    (slice){(uint8_t const*)(*q).service, strlen((*q).service)},
+                    &(*q).result);
+
+        dns_queue* done = (*q).queue;
+        pthread_mutex_lock(&(*done).mutex);
+        (*q).next = (*done).done;
+        (*done).done = q;
+        pthread_mutex_unlock(&(*done).mutex);
+        uint64_t one = 1;
+        if (write((*done).fd, &one, sizeof(one)) != sizeof(one)) {
+            perror("dns: write(eventfd)");
+        }
+    }
+    return NULL;
+}
+
+static
+void start_threads(void) {
+    for (int i = 0; i < DNS_THREADS; ++i) {
+        pthread_t thread;
+        int err = pthread_create(&thread, NULL, resolver_main, NULL);
+        if (err != 0) {
+            tlog(LOG_ERROR, "dns: pthread_create: %s\n", strerror(err));
+            continue;
+        }
+        pthread_detach(thread);
+    }
+}
+
+int dns_queue_init(dns_queue* q) {
+    (*q).fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+    if ((*q).fd == -1) {
+        perror("eventfd");
+        return -1;
+    }
+    pthread_mutex_init(&(*q).mutex, NULL);
+    (*q).done = NULL;
+    return 0;
+}
+
+dns_query* dns_resolve_async(dns_queue* q, slice node, slice service, void* arg) {
+    if (node.len >= sizeof(((dns_query*)0)->node)
+        || service.len >= sizeof(((dns_query*)0)->service)) {
+        return NULL;
+    }
+    dns_query* query = calloc(1, sizeof(dns_query));
+    if (!query) {
+        return NULL;
+    }
+    memcpy((*query).node, node.ptr, node.len);
+    memcpy((*query).service, service.ptr, service.len);
+    (*query).arg = arg;
+    (*query).queue = q;
+
+    pthread_once(&dns_threads_once, start_threads);
+    pthread_mutex_lock(&dns_jobs_mutex);
+    if (dns_jobs_tail) {
+        (*dns_jobs_tail).next = query;
+    } else {
+        dns_jobs_head = query;
+    }
+    dns_jobs_tail = query;
+    pthread_cond_signal(&dns_jobs_cond);
+    pthread_mutex_unlock(&dns_jobs_mutex);
+    return query;
+}
+
+dns_query* dns_queue_drain(dns_queue* q) {
+    uint64_t n;
+    while (read((*q).fd, &n, sizeof(n)) == -1 && errno == EINTR) {
+    }
+    pthread_mutex_lock(&(*q).mutex);
+    dns_query* done = (*q).done;
+    (*q).done = NULL;
+    pthread_mutex_unlock(&(*q).mutex);
+    return done;
+}
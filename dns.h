@@ -0,0 +1,67 @@
+#ifndef DNS_H
+#define DNS_H
+#include "tprintf.h"
+#include "slice.h"
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#define DNS_MAX_ADDRS       8
+#define DNS_DEFAULT_TTL     60  // for answers that carry no TTL
+#define DNS_NEGATIVE_TTL    30  // for failures that carry no TTL
+#define DNS_MAX_TTL         3600
+#define DNS_THREADS         4
+
+// Addresses of a node, with the port of the requested service.
+// err is 0 or an EAI_* code (see gai_strerror).
+typedef struct {
+    int err;
+    int n;
+    struct sockaddr_storage addr[DNS_MAX_ADDRS];
+    socklen_t addrlen[DNS_MAX_ADDRS];
+} dns_result;
+
+// Names are looked up in the hosts file, then by querying the
+// nameserver directly so the answers' TTLs are known, and only then
+// (no nameserver, or a name without dots) through getaddrinfo.
+// nameserver is "addr", "addr:port" or "[addr6]:port"; NULL takes the
+// first one from /etc/resolv.conf. hosts NULL means /etc/hosts.
+int dns_init(char const* nameserver, char const* hosts);
+
+// Answers from the cache only: returns 1 and fills res (which may be
+// a cached failure) on a hit, 0 on a miss.
+int dns_lookup(slice node, slice service, dns_result* res);
+// Looks up node in the cache, resolving and caching it on a miss.
+// Blocks the calling thread for the lookup.
+void dns_resolve(slice node, slice service, dns_result* res);
+
+typedef struct dns_query dns_query;
+
+// Completed lookups of one thread (e.g. an event loop). fd is an
+// eventfd that becomes readable when there are some to drain.
+typedef struct {
+    int fd;
+    pthread_mutex_t mutex;
+    dns_query* done;
+} dns_queue;
+
+// A lookup run on the resolver threads. Completed queries are handed
+// back through the dns_queue they were started on.
+struct dns_query {
+    char node[256];
+    char service[32];
+    dns_result result;
+    void* arg;
+    dns_queue* queue;
+    dns_query* next;
+};
+
+int dns_queue_init(dns_queue* q);
+// Starts resolving node:service for arg on a resolver thread.
+// Returns NULL if the query cannot be started.
+dns_query* dns_resolve_async(dns_queue* q, slice node, slice service, void* arg);
+// Takes all completed queries, linked through next. The caller frees
+// each one with free().
+dns_query* dns_queue_drain(dns_queue* q);
+
+#endif
@@ -0,0 +1,177 @@
+#include "epoch.h"
+#include "shm.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// A thread's place in the epochs. Like stats slots, a record outlives
+// its thread and is handed to the next new thread.
+typedef struct epoch_record epoch_record;
+struct epoch_record {
+    unsigned long epoch;    // the global epoch when the section began
+    int active;
+    int depth;              // of nested sections, owner only
+    int owned;
+    pid_t pid;              // of the owner's process
+    epoch_record* next;
+} __attribute__((aligned(64)));
+
+// What the threads reading one set of structures share: in the heap,
+// or in the shared region for the worker processes.
+typedef struct {
+    unsigned long global_epoch;
+    epoch_record* records;
+    // sections of threads that could not get a record; they hold up every epoch
+    int unrecorded;
+    // guards limbo: what was retired in each of the last three epochs
+    pthread_mutex_t retire_mutex;
+    epoch_node* limbo[3];
+} epoch_domain;
+
+static epoch_domain private_domain = {.retire_mutex = PTHREAD_MUTEX_INITIALIZER};
+static epoch_domain* domain = &private_domain;
+static __thread epoch_record* record;
+static pthread_key_t record_key;
+static pthread_once_t record_once = PTHREAD_ONCE_INIT;
+
+int epoch_share(void) {
+    epoch_domain* d = shm_alloc(sizeof(epoch_domain));
+    if (!d) {
+        return -1;
+    }
+    memset(d, 0, sizeof(*d));
+    shm_mutex_init(&(*d).retire_mutex);
+    domain = d;
+    return 0;
+}
+
+static
+void release_record(void* p) {
+    epoch_record* r = p;
+    // the next owner may be in another process: until it sets pid, the
+    // record must not pass for this one's (see epoch_reclaim)
+    __atomic_store_n(&(*r).pid, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&(*r).owned, 0, __ATOMIC_RELEASE);
+}
+
+static
+void make_record_key(void) {
+    pthread_key_create(&record_key, release_record);
+}
+
+static
+epoch_record* take_record(void) {
+    pthread_once(&record_once, make_record_key);
+    epoch_record* r = __atomic_load_n(&(*domain).records, __ATOMIC_ACQUIRE);
+    for (; r != NULL; r = (*r).next) {
+        int expected = 0;
+        if (__atomic_load_n(&(*r).owned, __ATOMIC_RELAXED) == 0 &&
+            __atomic_compare_exchange_n(&(*r).owned, &expected, 1, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+    if (r == NULL) {
+        r = domain == &private_domain ? aligned_alloc(64, sizeof(epoch_record))
+                                      : shm_alloc(sizeof(epoch_record));
+        if (r == NULL) {
+            return NULL;
+        }
+        (*r).epoch = 0;
+        (*r).active = 0;
+        (*r).depth = 0;
+        (*r).owned = 1;
+        (*r).pid = 0;
+        (*r).next = __atomic_load_n(&(*domain).records, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&(*domain).records, &(*r).next, r, 1,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        }
+    }
+    __atomic_store_n(&(*r).pid, getpid(), __ATOMIC_RELAXED);
+    pthread_setspecific(record_key, r);
+    return r;
+}
+
+void epoch_enter(void) {
+    if (record == NULL) {
+        record = take_record();
+    }
+    epoch_record* r = record;
+    if (r == NULL) {
+        __atomic_add_fetch(&(*domain).unrecorded, 1, __ATOMIC_SEQ_CST);
+        return;
+    }
+    if ((*r).depth++ > 0) {
+        return;
+    }
+    __atomic_store_n(&(*r).epoch, __atomic_load_n(&(*domain).global_epoch, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+    __atomic_store_n(&(*r).active, 1, __ATOMIC_SEQ_CST);
+    // the reads of the section must not pass the store of active
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void epoch_exit(void) {
+    epoch_record* r = record;
+    if (r == NULL) {
+        __atomic_sub_fetch(&(*domain).unrecorded, 1, __ATOMIC_SEQ_CST);
+        return;
+    }
+    if (--(*r).depth > 0) {
+        return;
+    }
+    __atomic_store_n(&(*r).active, 0, __ATOMIC_RELEASE);
+}
+
+// Moves to the next epoch if every thread inside a section is in this
+// one, and returns what was retired two epochs back, now unreachable.
+// Must hold the retire mutex.
+static
+epoch_node* advance(void) {
+    unsigned long g = __atomic_load_n(&(*domain).global_epoch, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&(*domain).unrecorded, __ATOMIC_RELAXED) > 0) {
+        return NULL;
+    }
+    for (epoch_record* r = __atomic_load_n(&(*domain).records, __ATOMIC_ACQUIRE); r; r = (*r).next) {
+        // acquire: what a thread read in its last section is done with
+        if (__atomic_load_n(&(*r).active, __ATOMIC_ACQUIRE)
+            && __atomic_load_n(&(*r).epoch, __ATOMIC_RELAXED) != g) {
+            return NULL;
+        }
+    }
+    __atomic_store_n(&(*domain).global_epoch, g + 1, __ATOMIC_RELEASE);
+    // retired in g - 1, the epoch before any thread may be in now
+    epoch_node* done = (*domain).limbo[(g + 2) % 3];
+    (*domain).limbo[(g + 2) % 3] = NULL;
+    return done;
+}
+
+void epoch_retire(epoch_node* n, void (*fn)(epoch_node*)) {
+    (*n).fn = fn;
+    // a process that died holding it left at worst a node unlinked
+    shm_lock(&(*domain).retire_mutex);
+    unsigned long g = __atomic_load_n(&(*domain).global_epoch, __ATOMIC_RELAXED);
+    (*n).next = (*domain).limbo[g % 3];
+    (*domain).limbo[g % 3] = n;
+    epoch_node* done = advance();
+    pthread_mutex_unlock(&(*domain).retire_mutex);
+    while (done) {
+        epoch_node* next = (*done).next;
+        (*done).fn(done);
+        done = next;
+    }
+}
+
+void epoch_reclaim(pid_t pid) {
+    for (epoch_record* r = __atomic_load_n(&(*domain).records, __ATOMIC_ACQUIRE); r; r = (*r).next) {
+        if (__atomic_load_n(&(*r).owned, __ATOMIC_ACQUIRE)
+            && __atomic_load_n(&(*r).pid, __ATOMIC_RELAXED) == pid) {
+            (*r).depth = 0;
+            __atomic_store_n(&(*r).active, 0, __ATOMIC_RELEASE);
+            __atomic_store_n(&(*r).pid, 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&(*r).owned, 0, __ATOMIC_RELEASE);
+        }
+    }
+}
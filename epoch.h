@@ -0,0 +1,38 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+#include "tprintf.h"
+#include <sys/types.h>
+
+// Epoch-based reclamation, for structures read without locks. Readers
+// bracket what they read with epoch_enter and epoch_exit; writers hand
+// what they unlinked to epoch_retire instead of freeing it. The global
+// epoch advances once every thread inside a section has seen it, and
+// what was retired two epochs back can no longer be reached by anyone,
+// so it is passed to its function then.
+//
+// Sections nest, must be short and must not block: a thread inside one
+// holds up every retired object.
+void epoch_enter(void);
+void epoch_exit(void);
+
+// Embedded in what is retired, so that retiring never allocates.
+typedef struct epoch_node epoch_node;
+struct epoch_node {
+    void (*fn)(epoch_node*);
+    epoch_node* next;
+};
+
+// Calls fn(n) once no reader can still see what n is embedded in. May
+// call it, and any other retired function whose time has come, before
+// returning; these must not take locks the caller may hold.
+void epoch_retire(epoch_node* n, void (*fn)(epoch_node*));
+
+// Moves the epochs into the shared region (shm.h), for readers in the
+// processes forked after it, before any thread enters a section.
+// Returns -1 if out of memory.
+int epoch_share(void);
+// Ends the sections of the threads of a process that died, which
+// would otherwise hold up every epoch.
+void epoch_reclaim(pid_t pid);
+
+#endif
@@ -0,0 +1,1592 @@
+#define _GNU_SOURCE
+#include "event.h"
+#include "proxy.h"
+#include "http.h"
+#include "cache.h"
+#include "diskcache.h"
+#include "pool.h"
+#include "pipes.h"
+#include "dns.h"
+#include "tcp.h"
+#include "stats.h"
+#include "arena.h"
+#include "flight.h"
+#include "timer.h"
+#include "admit.h"
+#include "revalidate.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+
+#define RELAY_BUFLEN    16384
+#define MAX_EVENTS      256
+
+#define SIDE_CLIENT     0
+#define SIDE_HOST       1
+
+// epoll data of the loop's own descriptors, connections use their address
+#define DATA_LISTENER   0
+#define DATA_DNS        1
+#define DATA_FLIGHT     2
+#define DATA_ADMIT      3
+
+enum {
+    S_READ_REQ,     // reading the request head from the client
+    S_ADMIT,        // queued for a slot to fetch from the origin
+    S_RESOLVE,      // waiting for a resolver thread to look up the origin
+    S_CONNECT,      // racing non-blocking connects to the origin
+    S_WRITE_REQ,    // forwarding the request head to the origin
+    S_READ_RES,     // reading the response head from the origin
+    S_RELAY,        // relaying the body, origin -> client
+    S_SEND,         // writing a whole response out to the client
+    S_SENDFILE,     // serving a disk cache hit
+    S_FOLLOW,       // streaming the response another request fetches
+};
+
+typedef struct conn conn;
+struct conn {
+    // the conn itself and everything of its requests are allocated
+    // from it; what a request allocates is released back to mark
+    arena* arena;
+    arena_mark mark;
+    int state;
+    int closed;
+    int client;
+    int host;
+    // current epoll interest of each side, 0 if not registered
+    uint32_t client_events;
+    uint32_t host_events;
+    // stats_now() at the start of the stage being timed
+    uint64_t stamp;
+    // the deadline of the current state
+    timer timeout;
+    // waiting for the next request on a kept-alive connection
+    int idle;
+    // body bytes relayed to the client
+    size_t sent;
+
+    // requests from the client; bytes past the current one are
+    // the next, pipelined, request
+    http_buf in;
+    http_request req;
+    // whether the client connection carries on after this response
+    int keep;
+
+    http_buf resbuf;
+    http_response res;
+    dns_result addrs;
+    // connects racing to addrs; bit k of dial_watched is set once
+    // dial.fd[k] is registered with epoll
+    dial_race dial;
+    int dial_watched;
+    // pending lookup, it outlives the connection if that is closed first
+    dns_query* query;
+
+    // request as forwarded, and whether the origin connection is
+    // (or came from) a pooled keep-alive connection
+    slice upreq;
+    int pool;
+    int reused;
+    int reusable;
+    int head;
+    uint8_t poolkeybuf[BUFLEN];
+    slice poolkey;
+    // where the response body ends
+    http_body body;
+
+    int cacheable;
+    uint8_t keybuf[CACHE_KEYLEN];
+    slice key;
+    cache_fill fill;
+    diskcache_fill dfill;
+    cache_entry* hit;
+    diskcache_hit dhit;
+
+    // the fetch of the response this request leads or follows
+    flight* flight;
+    int leading;
+    int follow_tries;
+    flight_reader reader;
+    flight_waiter waiter;
+    // links of the loop's followers
+    conn* follow_next;
+    conn** follow_link;
+    // the fetch's slot, or its place in the queue for one, and the
+    // links of the loop's queued fetches
+    admit_ticket admit;
+    conn* admit_next;
+    conn** admit_link;
+
+    // bytes pending to the destination of the current state
+    struct iovec out[3];
+    int nout;
+    // bodies that are not cached are spliced through a pipe,
+    // piped bytes are in it on their way to the client
+    int pipe[2];
+    size_t piped;
+
+    conn* next_dead;
+    uint8_t relay[RELAY_BUFLEN];
+};
+
+typedef struct {
+    int epfd;
+    int ln;
+    dns_queue dns;
+    // eventfd of the flight waiters of all followers
+    int flight_fd;
+    conn* followers;
+    // eventfd of the admission tickets of all queued fetches
+    int admit_fd;
+    conn* admitting;
+    // the deadlines of all connections
+    timer_wheel timers;
+    // connections closed during the current batch of events,
+    // freed once no event can refer to them anymore
+    conn* dead;
+} event_loop;
+
+static
+int watch(event_loop* loop, conn* c, int side, uint32_t events) {
+    int fd = side == SIDE_HOST ? (*c).host : (*c).client;
+    uint32_t* cur = side == SIDE_HOST ? &(*c).host_events : &(*c).client_events;
+    if (*cur == events) {
+        return 0;
+    }
+    // Unregister instead of waiting for no events at all, a level
+    // triggered EPOLLHUP would otherwise be reported forever.
+    int op = events == 0 ? EPOLL_CTL_DEL : (*cur == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD);
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.u64 = (uint64_t)(uintptr_t)c | side;
+    if (epoll_ctl((*loop).epfd, op, fd, &ev) != 0) {
+        perror("epoll_ctl");
+        return -1;
+    }
+    *cur = events;
+    return 0;
+}
+
+static
+void release_pipe(conn* c) {
+    if ((*c).pipe[0] == -1) {
+        return;
+    }
+    if ((*c).piped > 0) {
+        pipes_close((*c).pipe);
+    } else {
+        pipes_put((*c).pipe);
+    }
+    (*c).pipe[0] = -1;
+    (*c).pipe[1] = -1;
+    (*c).piped = 0;
+}
+
+// Gives c ms from now to get on with its current state.
+static
+void set_deadline(event_loop* loop, conn* c, int ms) {
+    timer_arm(&(*loop).timers, &(*c).timeout, timer_now() + ms);
+}
+
+// Leaves the flight (*c).req led or followed, failing it if the
+// response was not all published.
+static
+void drop_flight(conn* c) {
+    flight* f = (*c).flight;
+    if (!f) {
+        return;
+    }
+    (*c).flight = NULL;
+    if ((*c).leading) {
+        flight_finish(f);
+        return;
+    }
+    flight_unwatch(f, &(*c).waiter);
+    if ((*c).follow_link) {
+        *(*c).follow_link = (*c).follow_next;
+        if ((*c).follow_next) {
+            (*(*c).follow_next).follow_link = (*c).follow_link;
+        }
+        (*c).follow_link = NULL;
+        (*c).follow_next = NULL;
+    }
+    flight_leave(f);
+}
+
+static
+void admit_unlink(conn* c) {
+    if ((*c).admit_link) {
+        *(*c).admit_link = (*c).admit_next;
+        if ((*c).admit_next) {
+            (*(*c).admit_next).admit_link = (*c).admit_link;
+        }
+        (*c).admit_link = NULL;
+        (*c).admit_next = NULL;
+    }
+}
+
+// Gives back the slot of the fetch of (*c).req, or its place in the
+// queue for one.
+static
+void admit_release(conn* c) {
+    admit_unlink(c);
+    if ((*c).admit.origin) {
+        admit_leave(&(*c).admit);
+    }
+}
+
+static
+void conn_close(event_loop* loop, conn* c) {
+    if ((*c).closed) {
+        return;
+    }
+    tlog(LOG_DEBUG, "closing connection %d\n", (*c).client);
+    (*c).closed = 1;
+    close((*c).client);
+    if ((*c).host != -1) {
+        close((*c).host);
+    }
+    if ((*c).query) {
+        (*(*c).query).arg = NULL;
+    }
+    timer_cancel(&(*loop).timers, &(*c).timeout);
+    if ((*c).state == S_CONNECT) {
+        dial_race_cancel(&(*c).dial);
+    }
+    if ((*c).hit) {
+        cache_release((*c).hit);
+    }
+    if ((*c).dhit.fd != -1) {
+        close((*c).dhit.fd);
+    }
+    cache_fill_abort(&(*c).fill);
+    diskcache_fill_abort(&(*c).dfill);
+    drop_flight(c);
+    admit_release(c);
+    release_pipe(c);
+    (*c).next_dead = (*loop).dead;
+    (*loop).dead = c;
+}
+
+static
+void conn_free_dead(event_loop* loop) {
+    while ((*loop).dead) {
+        conn* c = (*loop).dead;
+        (*loop).dead = (*c).next_dead;
+        arena_put((*c).arena);
+    }
+}
+
+static
+void out_add(conn* c, slice bytes) {
+    if (bytes.len > 0) {
+        (*c).out[(*c).nout].iov_base = (void*)bytes.ptr;
+        (*c).out[(*c).nout].iov_len = bytes.len;
+        (*c).nout += 1;
+    }
+}
+
+// Writes as much of (*c).out to fd as the socket takes.
+// Returns 1 when all of it is out, 0 if it would block, -1 on error.
+static
+int flush_out(conn* c, int fd) {
+    struct iovec* iov = (*c).out;
+    while ((*c).nout > 0) {
+        ssize_t n = writev(fd, iov, (*c).nout);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                memmove((*c).out, iov, (*c).nout * sizeof(struct iovec));
+                return 0;
+            }
+            perror("writev");
+            return -1;
+        }
+        while ((*c).nout > 0 && (size_t)n >= (*iov).iov_len) {
+            n -= (*iov).iov_len;
+            iov += 1;
+            (*c).nout -= 1;
+        }
+        if ((*c).nout > 0) {
+            (*iov).iov_base = (uint8_t*)(*iov).iov_base + n;
+            (*iov).iov_len -= n;
+        }
+    }
+    return 1;
+}
+
+static
+void end_response(event_loop* loop, conn* c);
+
+// Writes out the response queued in (*c).out, then carries on with
+// the next request if (*c).keep.
+static
+void send_response(event_loop* loop, conn* c) {
+    (*c).state = S_SEND;
+    set_deadline(loop, c, proxy_stall_ms);
+    if ((*c).host != -1) {
+        watch(loop, c, SIDE_HOST, 0);
+    }
+    int done = flush_out(c, (*c).client);
+    if (done < 0) {
+        conn_close(loop, c);
+        return;
+    }
+    if (done == 0) {
+        watch(loop, c, SIDE_CLIENT, EPOLLOUT);
+        return;
+    }
+    end_response(loop, c);
+}
+
+static
+void send_and_close(event_loop* loop, conn* c, slice out) {
+    (*c).keep = 0;
+    (*c).nout = 0;
+    out_add(c, out);
+    send_response(loop, c);
+}
+
+static
+void send_error(event_loop* loop, conn* c, char const* status, char const* fmt, slice arg) {
+    size_t len = proxy_error_page((mutslice){(*c).relay, RELAY_BUFLEN},
+        status, fmt, (int)arg.len, arg.ptr);
+    send_and_close(loop, c, (slice){(*c).relay, len});
+}
+
+static
+void send_too_large(event_loop* loop, conn* c) {
+    size_t len = proxy_error_page((mutslice){(*c).relay, RELAY_BUFLEN},
+        "431 Request Header Fields Too Large",
+        "431 Request Header Fields Too Large: over %zu bytes", proxy_head_limit);
+    send_and_close(loop, c, (slice){(*c).relay, len});
+}
+
+// Answers a request whose origin failed with the stale response to
+// it, if it is within its stale-if-error window. Nothing of the
+// response has been sent to the client yet. Returns 1 if it did.
+static
+int send_stale(event_loop* loop, conn* c) {
+    cache_entry* e = (*c).cacheable && !(*c).hit ? cache_lookup_if_error((*c).key) : NULL;
+    if (!e) {
+        return 0;
+    }
+    tlog(LOG_INFO, "origin failed, serving stale [%.*s]\n", (int)(*c).key.len, (*c).key.ptr);
+    stats_count(STAT_CACHE_STALE);
+    drop_flight(c);
+    (*c).hit = e;
+    (*c).keep = 0;
+    (*c).nout = 0;
+    out_add(c, (slice){(*e).data, (*e).headlen});
+    out_add(c, proxy_connection_line(0));
+    out_add(c, (slice){&(*e).data[(*e).headlen], (*e).len - (*e).headlen});
+    send_response(loop, c);
+    return 1;
+}
+
+// Answers a request whose response could not be read. Nothing of the
+// response has been sent to the client yet.
+static
+void send_bad_gateway(event_loop* loop, conn* c, int err) {
+    if (send_stale(loop, c)) {
+        return;
+    }
+    size_t len = proxy_error_page((mutslice){(*c).relay, RELAY_BUFLEN},
+        "502 Bad Gateway", "502 Bad Gateway: invalid response from origin (%d)", err);
+    send_and_close(loop, c, (slice){(*c).relay, len});
+}
+
+// Sends the head queued in (*c).out, then the body with sendfile.
+static
+void send_cached_file(event_loop* loop, conn* c) {
+    set_deadline(loop, c, proxy_stall_ms);
+    int done = flush_out(c, (*c).client);
+    if (done < 0) {
+        conn_close(loop, c);
+        return;
+    }
+    if (done == 0) {
+        watch(loop, c, SIDE_CLIENT, EPOLLOUT);
+        return;
+    }
+    while ((*c).dhit.len > 0) {
+        ssize_t n = sendfile((*c).client, (*c).dhit.fd, &(*c).dhit.offset, (*c).dhit.len);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                watch(loop, c, SIDE_CLIENT, EPOLLOUT);
+                return;
+            }
+            perror("sendfile");
+            break;
+        }
+        if (n == 0) {
+            tlog(LOG_WARN, "sendfile: cached object truncated\n");
+            break;
+        }
+        (*c).dhit.len -= n;
+    }
+    if ((*c).dhit.len > 0) {
+        conn_close(loop, c);
+        return;
+    }
+    end_response(loop, c);
+}
+
+// Answers a request whose origin did not get back in time. Nothing
+// of the response has been sent to the client yet.
+static
+void send_gateway_timeout(event_loop* loop, conn* c, char const* what) {
+    if (send_stale(loop, c)) {
+        return;
+    }
+    size_t len = proxy_error_page((mutslice){(*c).relay, RELAY_BUFLEN},
+        "504 Gateway Timeout", "504 Gateway Timeout: %s %.*s://%.*s", what,
+        (int)((*c).req.service.len), (*c).req.service.ptr,
+        (int)((*c).req.node.len), (*c).req.node.ptr);
+    send_and_close(loop, c, (slice){(*c).relay, len});
+}
+
+static
+void connect_failed(event_loop* loop, conn* c, int err) {
+    char const* reason = strerror(err);
+    tlog(LOG_WARN, "unable to connect to %.*s://%.*s: %s\n",
+        (int)((*c).req.service.len), (*c).req.service.ptr,
+        (int)((*c).req.node.len), (*c).req.node.ptr,
+        reason);
+    if (err == ETIMEDOUT) {
+        stats_count(STAT_TIMEOUT_CONNECT);
+        send_gateway_timeout(loop, c, "connecting to");
+        return;
+    }
+    if (send_stale(loop, c)) {
+        return;
+    }
+    size_t len = proxy_error_page((mutslice){(*c).relay, RELAY_BUFLEN},
+        "404 Not Found", "404 Not Found: %s: %.*s://%.*s", reason,
+        (int)((*c).req.service.len), (*c).req.service.ptr,
+        (int)((*c).req.node.len), (*c).req.node.ptr);
+    send_and_close(loop, c, (slice){(*c).relay, len});
+}
+
+static
+void begin_forward(event_loop* loop, conn* c);
+
+// Registers the attempts started since the last call, so that their
+// connects wake the loop. Closing an attempt's socket unregisters it.
+static
+void watch_attempts(event_loop* loop, conn* c) {
+    dial_race* r = &(*c).dial;
+    for (int k = 0; k < (*r).next; ++k) {
+        if ((*r).fd[k] == -1 || ((*c).dial_watched & (1 << k))) {
+            continue;
+        }
+        struct epoll_event ev;
+        ev.events = EPOLLOUT;
+        ev.data.u64 = (uint64_t)(uintptr_t)c | SIDE_HOST;
+        if (epoll_ctl((*loop).epfd, EPOLL_CTL_ADD, (*r).fd[k], &ev) != 0) {
+            perror("epoll_ctl");
+        }
+        (*c).dial_watched |= 1 << k;
+    }
+}
+
+// Carries the race to the origin on, and forwards the request once
+// a connect is up.
+static
+void dial_progress(event_loop* loop, conn* c) {
+    dial_race* r = &(*c).dial;
+    // Every attempt the poll can pick as the winner is registered
+    // first, a loopback connect is often done by then.
+    watch_attempts(loop, c);
+    int fd = dial_race_poll(r, 0);
+    if (fd == dial_in_progress) {
+        watch_attempts(loop, c);
+        // the race's own clock: the next attempt or a deadline
+        set_deadline(loop, c, dial_race_timeout(r));
+        return;
+    }
+    if (fd == dial_failed) {
+        connect_failed(loop, c, (*r).err);
+        return;
+    }
+    // the winner is still registered for EPOLLOUT
+    (*c).host = fd;
+    (*c).host_events = EPOLLOUT;
+    stats_since(STAT_CONNECT, (*c).stamp);
+    begin_forward(loop, c);
+}
+
+static
+void start_connect(event_loop* loop, conn* c) {
+    (*c).state = S_CONNECT;
+    watch(loop, c, SIDE_CLIENT, 0);
+    dial_race_start(&(*c).dial, &(*c).addrs);
+    (*c).dial_watched = 0;
+    dial_progress(loop, c);
+}
+
+static
+void on_resolved(event_loop* loop, conn* c);
+
+// Takes a pooled connection to the origin if allowed, dials it otherwise.
+static
+void start_dial(event_loop* loop, conn* c, int allow_pool) {
+    http_request* req = &(*c).req;
+    (*c).reused = 0;
+    if ((*c).pool && allow_pool) {
+        int fd = pool_take((*c).poolkey);
+        if (fd >= 0) {
+            set_nonblocking(fd, 1);
+            (*c).host = fd;
+            (*c).host_events = 0;
+            (*c).reused = 1;
+            begin_forward(loop, c);
+            return;
+        }
+    }
+
+    // Only lookups missing from the cache go to the resolver threads.
+    (*c).stamp = stats_now();
+    if (!dns_lookup((*req).node, (*req).service, &(*c).addrs)) {
+        (*c).query = dns_resolve_async(&(*loop).dns, (*req).node, (*req).service, c);
+        if ((*c).query) {
+            // the lookup counts against the connect deadline
+            (*c).state = S_RESOLVE;
+            set_deadline(loop, c, dial_timeout_ms);
+            watch(loop, c, SIDE_CLIENT, 0);
+            return;
+        }
+        dns_resolve((*req).node, (*req).service, &(*c).addrs);
+    }
+    on_resolved(loop, c);
+}
+
+// The origin's addresses are in (*c).addrs.
+static
+void on_resolved(event_loop* loop, conn* c) {
+    http_request* req = &(*c).req;
+    stats_since(STAT_DNS, (*c).stamp);
+    if ((*c).addrs.err != 0) {
+        char const* reason = gai_strerror((*c).addrs.err);
+        tlog(LOG_WARN, "unable to connect to %.*s://%.*s: %s\n",
+            (int)((*req).service.len), (*req).service.ptr,
+            (int)((*req).node.len), (*req).node.ptr,
+            reason);
+        if (send_stale(loop, c)) {
+            return;
+        }
+        size_t len = proxy_error_page((mutslice){(*c).relay, RELAY_BUFLEN},
+            "404 Not Found", "404 Not Found: %s: %.*s://%.*s", reason,
+            (int)((*req).service.len), (*req).service.ptr,
+            (int)((*req).node.len), (*req).node.ptr);
+        send_and_close(loop, c, (slice){(*c).relay, len});
+        return;
+    }
+    (*c).stamp = stats_now();
+    start_connect(loop, c);
+}
+
+// A pooled connection turned out to be closed before any of the
+// response was read, so the request can be sent again on a new one.
+static
+int retry_stale(event_loop* loop, conn* c) {
+    if (!(*c).reused || (*c).resbuf.count != 0) {
+        return 0;
+    }
+    tlog(LOG_WARN, "pool: connection %d went stale, redialing\n", (*c).host);
+    watch(loop, c, SIDE_HOST, 0);
+    close((*c).host);
+    (*c).host = -1;
+    start_dial(loop, c, 0);
+    return 1;
+}
+
+static
+void start_fetch(event_loop* loop, conn* c);
+static
+void follow_flight(event_loop* loop, conn* c, flight* f);
+
+static
+void start_request(event_loop* loop, conn* c) {
+    http_request* req = &(*c).req;
+    if ((*req).version > HTTP_VERSION) {
+        tlog(LOG_WARN, "expected HTTP version %d or lower, got %d\n", HTTP_VERSION, (*req).version);
+        size_t len = proxy_error_page((mutslice){(*c).relay, RELAY_BUFLEN},
+            "501 Not Implemented", "501 Not Implemented HTTP Version: HTTP/1.%d",
+            (*req).version);
+        send_and_close(loop, c, (slice){(*c).relay, len});
+        return;
+    }
+
+    print_http_request(req);
+    // A request body we do not forward would be read as the next request.
+    (*c).keep = http_request_keep_alive(req) && !http_request_has_body(req);
+    (*c).mark = arena_save((*c).arena);
+
+    (*c).cacheable = proxy_cacheable(req, (mutslice){(*c).keybuf, CACHE_KEYLEN}, &(*c).key);
+    if ((*c).cacheable) {
+        slice key = (*c).key;
+        int state;
+        (*c).hit = cache_lookup(key, &state);
+        if ((*c).hit) {
+            cache_entry* e = (*c).hit;
+            if (state == cache_fresh) {
+                tlog(LOG_DEBUG, "cache hit: [%.*s]\n", (int)key.len, key.ptr);
+                stats_count(STAT_CACHE_HIT);
+            } else {
+                tlog(LOG_DEBUG, "cache hit, stale: [%.*s]\n", (int)key.len, key.ptr);
+                stats_count(STAT_CACHE_STALE);
+            }
+            if (state == cache_revalidate) {
+                revalidate_start(e, req);
+            }
+            (*c).nout = 0;
+            out_add(c, (slice){(*e).data, (*e).headlen});
+            out_add(c, proxy_connection_line((*c).keep));
+            out_add(c, (slice){&(*e).data[(*e).headlen], (*e).len - (*e).headlen});
+            send_response(loop, c);
+            return;
+        }
+        if (diskcache_lookup(key, &(*c).dhit)) {
+            diskcache_hit* hit = &(*c).dhit;
+            tlog(LOG_DEBUG, "disk cache hit: [%.*s]\n", (int)key.len, key.ptr);
+            stats_count(STAT_CACHE_DISK_HIT);
+            uint8_t* head = arena_alloc((*c).arena, (*hit).headlen);
+            if (!head
+                || pread((*hit).fd, head, (*hit).headlen, (*hit).offset) != (ssize_t)(*hit).headlen) {
+                conn_close(loop, c);
+                return;
+            }
+            (*hit).offset += (*hit).headlen;
+            (*hit).len -= (*hit).headlen;
+            (*c).nout = 0;
+            out_add(c, (slice){head, (*hit).headlen});
+            out_add(c, proxy_connection_line((*c).keep));
+            (*c).state = S_SENDFILE;
+            send_cached_file(loop, c);
+            return;
+        }
+        tlog(LOG_DEBUG, "cache miss: [%.*s]\n", (int)key.len, key.ptr);
+    } else {
+        stats_count(STAT_CACHE_BYPASS);
+    }
+    (*c).follow_tries = 0;
+    start_fetch(loop, c);
+}
+
+// Forwards (*c).req to its origin, once the fetch has its slot.
+static
+void begin_fetch(event_loop* loop, conn* c) {
+    http_request* req = &(*c).req;
+    (*c).head = (*req).method.len == 4 && memcmp((*req).method.ptr, "HEAD", 4) == 0;
+    (*c).pool = pool_enabled()
+        && pool_key((mutslice){(*c).poolkeybuf, BUFLEN},
+                    (*req).node, (*req).service, &(*c).poolkey) == 0;
+    size_t uplen = proxy_upstream_request_max(req);
+    uint8_t* upbuf = arena_alloc((*c).arena, uplen);
+    if (!upbuf || http_buf_init(&(*c).resbuf, (*c).arena, proxy_head_limit) != 0) {
+        conn_close(loop, c);
+        return;
+    }
+    size_t len = proxy_upstream_request(req, (*c).pool, (mutslice){upbuf, uplen});
+    if (len == 0) {
+        tlog(LOG_WARN, "request too large to forward\n");
+        conn_close(loop, c);
+        return;
+    }
+    (*c).upreq = (slice){upbuf, len};
+    start_dial(loop, c, 1);
+}
+
+// Answers 503 to a fetch that got no slot.
+static
+void shed_fetch(event_loop* loop, conn* c) {
+    tlog(LOG_INFO, "shedding fetch from %.*s\n", (int)(*c).req.node.len, (*c).req.node.ptr);
+    stats_count(STAT_SHED);
+    drop_flight(c);
+    send_and_close(loop, c, admit_page());
+}
+
+// Follows the flight of an identical request in progress, if there is
+// one, or fetches the response from the origin once admitted.
+static
+void start_fetch(event_loop* loop, conn* c) {
+    http_request* req = &(*c).req;
+    if ((*c).cacheable && (*c).follow_tries < FLIGHT_TRIES) {
+        int leader = 0;
+        flight* f = flight_join((*c).key, &leader);
+        if (f && !leader) {
+            follow_flight(loop, c, f);
+            return;
+        }
+        (*c).flight = f;
+        (*c).leading = 1;
+    }
+    if ((*c).cacheable) {
+        stats_count(STAT_CACHE_MISS);
+    }
+
+    switch (admit_try(&(*c).admit, (*req).node, (*req).service, (*loop).admit_fd)) {
+    case admit_ok:
+        begin_fetch(loop, c);
+        return;
+    case admit_queued:
+        (*c).admit_next = (*loop).admitting;
+        (*c).admit_link = &(*loop).admitting;
+        if ((*c).admit_next) {
+            (*(*c).admit_next).admit_link = &(*c).admit_next;
+        }
+        (*loop).admitting = c;
+        (*c).state = S_ADMIT;
+        set_deadline(loop, c, admit_get().wait_ms);
+        watch(loop, c, SIDE_CLIENT, 0);
+        return;
+    default:
+        shed_fetch(loop, c);
+        return;
+    }
+}
+
+// Parses the request in buf, if all of it has arrived.
+static
+void parse_request(event_loop* loop, conn* c) {
+    http_request* req = &(*c).req;
+    int err = http_buf_parse_request(&(*c).in, req);
+    if (err == 0) {
+        stats_since(STAT_READ_REQUEST, (*c).stamp);
+    } else if (err != http_partial) {
+        stats_error(err);
+    }
+    switch (err) {
+    case 0:
+        break;
+    case http_partial:
+        watch(loop, c, SIDE_CLIENT, EPOLLIN);
+        return;
+    case http_err_method:
+        tlog(LOG_WARN, "invalid method: [%.*s]\n", (int)((*req).method.len), (*req).method.ptr);
+        send_error(loop, c, "400 Bad Request",
+            "400 Bad Request Reason: Invalid Method: %.*s", (*req).method);
+        return;
+    case http_err_url:
+        tlog(LOG_WARN, "invalid url: [%.*s]\n", (int)((*req).url.len), (*req).url.ptr);
+        send_error(loop, c, "400 Bad Request",
+            "400 Bad Request Reason: Invalid URL: %.*s", (*req).url);
+        return;
+    case http_err_version:
+        tlog(LOG_WARN, "invalid version: [%.*s]\n",
+            (int)((*req).version_slice.len), (*req).version_slice.ptr);
+        send_error(loop, c, "400 Bad Request",
+            "400 Bad Request Reason: Invalid Version: %.*s", (*req).version_slice);
+        return;
+    case http_req_too_large:
+        tlog(LOG_WARN, "request head over %zu bytes\n", proxy_head_limit);
+        send_too_large(loop, c);
+        return;
+    default:
+        tlog(LOG_WARN, "invalid request: %d\n", err);
+        conn_close(loop, c);
+        return;
+    }
+    start_request(loop, c);
+}
+
+static
+void on_request_readable(event_loop* loop, conn* c) {
+    http_buf* in = &(*c).in;
+    switch (http_buf_reserve(in)) {
+    case -1:
+        tlog(LOG_WARN, "request head over %zu bytes\n", proxy_head_limit);
+        stats_error(http_req_too_large);
+        send_too_large(loop, c);
+        return;
+    case 1:
+        http_request_init(&(*c).req, (*in).headers, (*in).cap);
+        break;
+    }
+    ssize_t n = read((*c).client, &(*in).ptr[(*in).count], (*in).len - (*in).count);
+    if (n == -1) {
+        if (errno != EAGAIN && errno != EINTR) {
+            perror("read");
+            conn_close(loop, c);
+        }
+        return;
+    }
+    if (n == 0) {
+        if ((*in).count > 0) {
+            tlog(LOG_WARN, "only partial request received, then eof\n");
+        }
+        stats_error((*in).count > 0 ? http_partial : http_read_eof);
+        conn_close(loop, c);
+        return;
+    }
+    tlog(LOG_DEBUG, "read=%zd\n", n);
+    if ((*c).idle) {
+        // the head of the next request is on its way
+        (*c).idle = 0;
+        set_deadline(loop, c, proxy_header_ms);
+    }
+    (*in).count += n;
+    parse_request(loop, c);
+}
+
+static
+void on_request_writable(event_loop* loop, conn* c) {
+    int done = flush_out(c, (*c).host);
+    if (done < 0) {
+        if (!retry_stale(loop, c)) {
+            conn_close(loop, c);
+        }
+        return;
+    }
+    if (done == 0) {
+        watch(loop, c, SIDE_HOST, EPOLLOUT);
+        return;
+    }
+    (*c).state = S_READ_RES;
+    (*c).stamp = stats_now();
+    (*c).resbuf.count = 0;
+    http_response_init(&(*c).res, (http_headerbuf){(*c).resbuf.headers, (*c).resbuf.cap});
+    watch(loop, c, SIDE_HOST, EPOLLIN);
+}
+
+static
+void begin_forward(event_loop* loop, conn* c) {
+    (*c).state = S_WRITE_REQ;
+    set_deadline(loop, c, proxy_first_byte_ms);
+    (*c).nout = 0;
+    out_add(c, (*c).upreq);
+    (*c).resbuf.count = 0;
+    watch(loop, c, SIDE_CLIENT, 0);
+    on_request_writable(loop, c);
+}
+
+// The whole response has been relayed.
+static
+void finish_relay(event_loop* loop, conn* c) {
+    stats_since(STAT_TRANSFER, (*c).stamp);
+    stats_observe(STAT_TRANSFER_BYTES, (*c).sent);
+    cache_fill_commit(&(*c).fill);
+    diskcache_fill_commit(&(*c).dfill);
+    if ((*c).flight) {
+        flight_complete((*c).flight);
+    }
+    // whatever the origin sent past the response makes the
+    // connection unusable
+    if ((*c).reusable && (*c).body.extra == 0) {
+        watch(loop, c, SIDE_HOST, 0);
+        pool_put((*c).poolkey, (*c).host);
+        (*c).host = -1;
+    }
+    end_response(loop, c);
+}
+
+// The response to (*c).req is out: closes the connection, or makes
+// it ready for the next request, which may already be in buf.
+static
+void end_response(event_loop* loop, conn* c) {
+    if (!(*c).keep) {
+        conn_close(loop, c);
+        return;
+    }
+    if ((*c).host != -1) {
+        watch(loop, c, SIDE_HOST, 0);
+        close((*c).host);
+        (*c).host = -1;
+    }
+    if ((*c).hit) {
+        cache_release((*c).hit);
+        (*c).hit = NULL;
+    }
+    if ((*c).dhit.fd != -1) {
+        close((*c).dhit.fd);
+        (*c).dhit.fd = -1;
+    }
+    memset(&(*c).fill, 0, sizeof((*c).fill));
+    (*c).dfill.fd = -1;
+    drop_flight(c);
+    admit_release(c);
+    release_pipe(c);
+    (*c).cacheable = 0;
+    (*c).pool = 0;
+    (*c).reused = 0;
+    (*c).reusable = 0;
+
+    http_buf* in = &(*c).in;
+    (*in).count -= (*c).req.buf.len;
+    memmove((*in).ptr, &(*in).ptr[(*c).req.buf.len], (*in).count);
+    arena_restore((*c).arena, (*c).mark);
+    http_request_init(&(*c).req, (*in).headers, (*in).cap);
+    (*c).state = S_READ_REQ;
+    (*c).stamp = stats_now();
+    if ((*in).count > 0) {
+        set_deadline(loop, c, proxy_header_ms);
+        parse_request(loop, c);
+    } else {
+        (*c).idle = 1;
+        set_deadline(loop, c, proxy_idle_ms);
+        watch(loop, c, SIDE_CLIENT, EPOLLIN);
+    }
+}
+
+static
+void relay_flush(event_loop* loop, conn* c) {
+    set_deadline(loop, c, proxy_stall_ms);
+    int done = flush_out(c, (*c).client);
+    if (done < 0) {
+        conn_close(loop, c);
+        return;
+    }
+    if (done == 0) {
+        watch(loop, c, SIDE_HOST, 0);
+        watch(loop, c, SIDE_CLIENT, EPOLLOUT);
+        return;
+    }
+    while ((*c).piped > 0) {
+        // corking the last bytes would hold them back
+        unsigned more = !http_body_done(&(*c).body) ? SPLICE_F_MORE : 0;
+        ssize_t n = splice((*c).pipe[0], NULL, (*c).client, NULL, (*c).piped,
+                           SPLICE_F_MOVE|SPLICE_F_NONBLOCK|more);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                watch(loop, c, SIDE_HOST, 0);
+                watch(loop, c, SIDE_CLIENT, EPOLLOUT);
+                return;
+            }
+            perror("splice(client)");
+            conn_close(loop, c);
+            return;
+        }
+        (*c).piped -= n;
+    }
+    if (http_body_done(&(*c).body)) {
+        finish_relay(loop, c);
+        return;
+    }
+    watch(loop, c, SIDE_CLIENT, 0);
+    watch(loop, c, SIDE_HOST, EPOLLIN);
+}
+
+static
+void on_response_readable(event_loop* loop, conn* c) {
+    http_buf* b = &(*c).resbuf;
+    switch (http_buf_reserve(b)) {
+    case -1:
+        tlog(LOG_ERROR, "error reading response: %d\n", http_res_too_large);
+        stats_error(http_res_too_large);
+        send_bad_gateway(loop, c, http_res_too_large);
+        return;
+    case 1:
+        http_response_init(&(*c).res, (http_headerbuf){(*b).headers, (*b).cap});
+        break;
+    }
+    ssize_t n = read((*c).host, &(*b).ptr[(*b).count], (*b).len - (*b).count);
+    if (n == -1) {
+        if (errno != EAGAIN && errno != EINTR && !retry_stale(loop, c)) {
+            perror("read");
+            conn_close(loop, c);
+        }
+        return;
+    }
+    if (n == 0) {
+        if (!retry_stale(loop, c)) {
+            tlog(LOG_ERROR, "error reading response: %d\n", http_partial);
+            stats_error(http_partial);
+            send_bad_gateway(loop, c, http_partial);
+        }
+        return;
+    }
+    tlog(LOG_DEBUG, "read=%zd\n", n);
+    (*b).count += n;
+
+    http_response* res = &(*c).res;
+    int err = http_buf_parse_response(b, res);
+    if (err == http_partial) {
+        return;
+    }
+    if (err != 0) {
+        tlog(LOG_ERROR, "error reading response: %d\n", err);
+        stats_error(err);
+        send_bad_gateway(loop, c, err);
+        return;
+    }
+    stats_since(STAT_FIRST_BYTE, (*c).stamp);
+    // With a delimited body the relay stops at the end of the message:
+    // the origin connection can go back to the pool and the client
+    // connection can carry the next request.
+    ssize_t bodylen = http_response_body_length(res, (*c).head);
+    http_body_init(&(*c).body, res, (*c).head);
+    ssize_t extra = http_body_scan(&(*c).body,
+        (slice){&(*b).ptr[(*res).buf.len], (*b).count - (*res).buf.len});
+    if (extra < 0) {
+        tlog(LOG_ERROR, "error reading response: %d\n", (int)extra);
+        stats_error(extra);
+        send_bad_gateway(loop, c, (int)extra);
+        return;
+    }
+    int framed = (*c).body.framing != HTTP_BODY_CLOSE;
+    (*c).reusable = (*c).pool && framed && http_response_keep_alive(res);
+    (*c).keep = (*c).keep && framed;
+
+    print_http_response(res);
+    if ((*res).status.code >= 500 && send_stale(loop, c)) {
+        return;
+    }
+    size_t headlen = proxy_response_head_max(res);
+    uint8_t* headbuf = arena_alloc((*c).arena, headlen);
+    slice head = {headbuf, headbuf ? proxy_response_head(res, (mutslice){headbuf, headlen}) : 0};
+    if (head.len == 0) {
+        tlog(LOG_WARN, "response head too large to forward\n");
+        conn_close(loop, c);
+        return;
+    }
+    slice rest = {&(*b).ptr[(*res).buf.len], extra};
+    if ((*c).cacheable) {
+        proxy_fill_begin((*c).key, res, head, rest, &(*c).fill, &(*c).dfill);
+    }
+    flight* f = (*c).flight;
+    if (f) {
+        // only what the cache could store may be shared
+        int shareable = cache_response_expires(res, time(NULL)) != 0
+            && (bodylen < 0 || head.len + bodylen <= FLIGHT_MAX_BYTES);
+        flight_head(f, head, framed, shareable);
+        flight_append(f, rest);
+    }
+
+    if (!(*c).fill.entry && (*c).dfill.fd == -1 && !(f && flight_publishing(f))
+        && !http_body_done(&(*c).body) && pipes_take((*c).pipe) != 0) {
+        (*c).pipe[0] = -1;
+    }
+
+    (*c).state = S_RELAY;
+    (*c).stamp = stats_now();
+    (*c).sent = rest.len;
+    (*c).nout = 0;
+    out_add(c, head);
+    out_add(c, proxy_connection_line((*c).keep));
+    out_add(c, rest);
+    relay_flush(loop, c);
+}
+
+static
+void on_body_readable(event_loop* loop, conn* c);
+
+// The origin closed its connection: the end of a body running until
+// close, or a truncated one.
+static
+void on_body_eof(event_loop* loop, conn* c) {
+    tlog(LOG_DEBUG, "transfer_body: read=0, returning\n");
+    int err = http_body_eof(&(*c).body);
+    if (err != 0) {
+        tlog(LOG_WARN, "transfer_body: origin closed before the end of the body\n");
+        stats_error(err);
+        conn_close(loop, c);
+        return;
+    }
+    finish_relay(loop, c);
+}
+
+// Moves body content from the origin into the pipe, without copying
+// it to user space.
+static
+void on_body_spliceable(event_loop* loop, conn* c) {
+    size_t want = http_body_opaque(&(*c).body, PIPES_SIZE);
+    ssize_t n = splice((*c).host, NULL, (*c).pipe[1], NULL, want,
+                       SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+    if (n == -1) {
+        if (errno == EINVAL) {
+            // splice does not work here, copy instead
+            release_pipe(c);
+            on_body_readable(loop, c);
+        } else if (errno != EAGAIN && errno != EINTR) {
+            perror("splice(host)");
+            conn_close(loop, c);
+        }
+        return;
+    }
+    if (n == 0) {
+        on_body_eof(loop, c);
+        return;
+    }
+    (*c).piped += n;
+    (*c).sent += n;
+    http_body_skip(&(*c).body, n);
+    relay_flush(loop, c);
+}
+
+// Reads body bytes into relay, where chunk framing is parsed. Content
+// is spliced instead when there is a pipe.
+static
+void on_body_readable(event_loop* loop, conn* c) {
+    if ((*c).pipe[0] != -1 && http_body_opaque(&(*c).body, PIPES_SIZE) > 0) {
+        on_body_spliceable(loop, c);
+        return;
+    }
+    ssize_t n = read((*c).host, (*c).relay, http_body_want(&(*c).body, RELAY_BUFLEN));
+    if (n == -1) {
+        if (errno != EAGAIN && errno != EINTR) {
+            perror("read");
+            conn_close(loop, c);
+        }
+        return;
+    }
+    if (n == 0) {
+        on_body_eof(loop, c);
+        return;
+    }
+    ssize_t m = http_body_scan(&(*c).body, (slice){(*c).relay, n});
+    if (m < 0) {
+        tlog(LOG_WARN, "transfer_body: invalid chunk framing\n");
+        stats_error(m);
+        conn_close(loop, c);
+        return;
+    }
+    (*c).sent += m;
+    slice bytes = {(*c).relay, m};
+    if ((*c).fill.entry) {
+        cache_fill_append(&(*c).fill, bytes);
+    }
+    if ((*c).dfill.fd != -1) {
+        diskcache_fill_append(&(*c).dfill, bytes);
+    }
+    if ((*c).flight) {
+        flight_append((*c).flight, bytes);
+    }
+    (*c).nout = 0;
+    out_add(c, bytes);
+    relay_flush(loop, c);
+}
+
+// Sends the follower (*c).flight's bytes as they are published. They
+// stay put in the flight's chunks, (*c).out points into them.
+static
+void follow_progress(event_loop* loop, conn* c) {
+    flight* f = (*c).flight;
+    flight_reader* r = &(*c).reader;
+    if ((*r).pos > 0) {
+        set_deadline(loop, c, proxy_stall_ms);
+    }
+    while (1) {
+        int done = flush_out(c, (*c).client);
+        if (done < 0) {
+            conn_close(loop, c);
+            return;
+        }
+        if (done == 0) {
+            watch(loop, c, SIDE_CLIENT, EPOLLOUT);
+            return;
+        }
+        watch(loop, c, SIDE_CLIENT, 0);
+        slice bytes;
+        int state = flight_peek(r, &bytes);
+        if (bytes.len > 0) {
+            if ((*r).pos == 0) {
+                stats_count(STAT_CACHE_COLLAPSED);
+                stats_since(STAT_FIRST_BYTE, (*c).stamp);
+                (*c).stamp = stats_now();
+            }
+            (*c).nout = 0;
+            out_add(c, bytes);
+            if ((*r).pos + bytes.len == flight_headlen(f)) {
+                // the body length is known once the head is
+                (*c).keep = (*c).keep && flight_framed(f);
+                out_add(c, proxy_connection_line((*c).keep));
+            } else if ((*r).pos >= flight_headlen(f)) {
+                (*c).sent += bytes.len;
+            }
+            flight_advance(r, bytes.len);
+            continue;
+        }
+        if (state == FLIGHT_DONE) {
+            stats_since(STAT_TRANSFER, (*c).stamp);
+            stats_observe(STAT_TRANSFER_BYTES, (*c).sent);
+            end_response(loop, c);
+            return;
+        }
+        if (state == FLIGHT_PASS) {
+            // not shared, and no use waiting for the next flight either
+            (*c).follow_tries = FLIGHT_TRIES;
+            drop_flight(c);
+            start_fetch(loop, c);
+            return;
+        }
+        if (state == FLIGHT_FAILED) {
+            if ((*r).pos > 0) {
+                conn_close(loop, c);
+                return;
+            }
+            tlog(LOG_DEBUG, "flight: [%.*s] failed, fetching again\n",
+                (int)(*c).key.len, (*c).key.ptr);
+            drop_flight(c);
+            start_fetch(loop, c);
+            return;
+        }
+        if (!flight_watch(r, &(*c).waiter)) {
+            return;
+        }
+    }
+}
+
+static
+void follow_flight(event_loop* loop, conn* c, flight* f) {
+    (*c).flight = f;
+    (*c).leading = 0;
+    (*c).follow_tries += 1;
+    flight_reader_init(&(*c).reader, f);
+    (*c).follow_next = (*loop).followers;
+    (*c).follow_link = &(*loop).followers;
+    if ((*c).follow_next) {
+        (*(*c).follow_next).follow_link = &(*c).follow_next;
+    }
+    (*loop).followers = c;
+    (*c).state = S_FOLLOW;
+    // the leader's own deadline for the head comes first
+    set_deadline(loop, c, proxy_first_byte_ms);
+    (*c).stamp = stats_now();
+    (*c).sent = 0;
+    (*c).nout = 0;
+    follow_progress(loop, c);
+}
+
+// Carries on with the followers whose flights made progress.
+static
+void flights_progressed(event_loop* loop) {
+    uint64_t n;
+    if (read((*loop).flight_fd, &n, sizeof(n)) == -1 && errno != EAGAIN) {
+        perror("read(eventfd)");
+    }
+    conn* c = (*loop).followers;
+    while (c) {
+        conn* next = (*c).follow_next;
+        if (!__atomic_load_n(&(*c).waiter.armed, __ATOMIC_ACQUIRE)
+            && (*c).client_events == 0) {
+            follow_progress(loop, c);
+        }
+        c = next;
+    }
+}
+
+// Carries on with the queued fetches that were granted their slot.
+static
+void admissions_granted(event_loop* loop) {
+    uint64_t n;
+    if (read((*loop).admit_fd, &n, sizeof(n)) == -1 && errno != EAGAIN) {
+        perror("read(eventfd)");
+    }
+    conn* c = (*loop).admitting;
+    while (c) {
+        conn* next = (*c).admit_next;
+        if (admit_granted(&(*c).admit)) {
+            admit_unlink(c);
+            begin_fetch(loop, c);
+        }
+        c = next;
+    }
+}
+
+static
+void on_event(event_loop* loop, conn* c, int side, uint32_t events) {
+    (void)events;
+    if ((*c).closed) {
+        return;
+    }
+    switch ((*c).state) {
+    case S_READ_REQ:
+        on_request_readable(loop, c);
+        break;
+    case S_ADMIT:
+    case S_RESOLVE:
+        break;
+    case S_CONNECT:
+        dial_progress(loop, c);
+        break;
+    case S_WRITE_REQ:
+        on_request_writable(loop, c);
+        break;
+    case S_READ_RES:
+        on_response_readable(loop, c);
+        break;
+    case S_RELAY:
+        if (side == SIDE_HOST) {
+            on_body_readable(loop, c);
+        } else {
+            relay_flush(loop, c);
+        }
+        break;
+    case S_SEND:
+        send_response(loop, c);
+        break;
+    case S_SENDFILE:
+        send_cached_file(loop, c);
+        break;
+    case S_FOLLOW:
+        follow_progress(loop, c);
+        break;
+    }
+}
+
+// c missed the deadline of its state.
+static
+void on_timeout(event_loop* loop, conn* c) {
+    if ((*c).closed) {
+        return;
+    }
+    switch ((*c).state) {
+    case S_READ_REQ:
+        if ((*c).idle) {
+            tlog(LOG_DEBUG, "closing connection %d idle for %d ms\n", (*c).client, proxy_idle_ms);
+            conn_close(loop, c);
+            return;
+        }
+        tlog(LOG_WARN, "no request head within %d ms\n", proxy_header_ms);
+        stats_count(STAT_TIMEOUT_HEADER);
+        stats_error(http_read_timeout);
+        if ((*c).in.count == 0) {
+            conn_close(loop, c);
+            return;
+        }
+        size_t len = proxy_error_page((mutslice){(*c).relay, RELAY_BUFLEN},
+            "408 Request Timeout", "408 Request Timeout: no request within %d ms",
+            proxy_header_ms);
+        send_and_close(loop, c, (slice){(*c).relay, len});
+        return;
+    case S_ADMIT:
+        admit_unlink(c);
+        // a slot may have come free since the deadline
+        if (admit_cancel(&(*c).admit)) {
+            begin_fetch(loop, c);
+        } else {
+            shed_fetch(loop, c);
+        }
+        return;
+    case S_RESOLVE:
+        // the lookup finishes on its own
+        (*(*c).query).arg = NULL;
+        (*c).query = NULL;
+        connect_failed(loop, c, ETIMEDOUT);
+        return;
+    case S_CONNECT:
+        dial_progress(loop, c);
+        return;
+    case S_FOLLOW:
+        if ((*c).reader.pos > 0) {
+            break;
+        }
+        drop_flight(c);
+        // fall through
+    case S_WRITE_REQ:
+    case S_READ_RES:
+        tlog(LOG_WARN, "no response from %.*s://%.*s within %d ms\n",
+            (int)((*c).req.service.len), (*c).req.service.ptr,
+            (int)((*c).req.node.len), (*c).req.node.ptr,
+            proxy_first_byte_ms);
+        stats_count(STAT_TIMEOUT_FIRST_BYTE);
+        stats_error(http_read_timeout);
+        send_gateway_timeout(loop, c, "no response from");
+        return;
+    }
+    tlog(LOG_WARN, "connection %d made no progress within %d ms\n", (*c).client, proxy_stall_ms);
+    stats_count(STAT_TIMEOUT_STALL);
+    conn_close(loop, c);
+}
+
+static
+void expire_deadlines(event_loop* loop) {
+    timer* t = timer_expire(&(*loop).timers, timer_now());
+    while (t) {
+        timer* next = (*t).next;
+        on_timeout(loop, (conn*)((uint8_t*)t - offsetof(conn, timeout)));
+        t = next;
+    }
+}
+
+static
+void resolved_queries(event_loop* loop) {
+    dns_query* q = dns_queue_drain(&(*loop).dns);
+    while (q) {
+        dns_query* next = (*q).next;
+        conn* c = (*q).arg;
+        if (c) {
+            (*c).query = NULL;
+            (*c).addrs = (*q).result;
+            on_resolved(loop, c);
+        }
+        free(q);
+        q = next;
+    }
+}
+
+static
+void accept_clients(event_loop* loop) {
+    while (1) {
+        int fd = accept4((*loop).ln, NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("ln.accept4");
+            }
+            return;
+        }
+        uint64_t accepted = stats_now();
+        tlog(LOG_DEBUG, "accepted new client connection %d\n", fd);
+        set_nodelay(fd);
+
+        arena* a = arena_take();
+        conn* c = a ? arena_alloc(a, sizeof(conn)) : NULL;
+        if (!c) {
+            if (a) {
+                arena_put(a);
+            }
+            close(fd);
+            continue;
+        }
+        // relay is left uninitialized
+        memset(c, 0, offsetof(conn, relay));
+        (*c).arena = a;
+        (*c).client = fd;
+        (*c).host = -1;
+        (*c).state = S_READ_REQ;
+        (*c).dfill.fd = -1;
+        (*c).dhit.fd = -1;
+        (*c).pipe[0] = -1;
+        (*c).pipe[1] = -1;
+        (*c).waiter.fd = (*loop).flight_fd;
+        if (http_buf_init(&(*c).in, a, proxy_head_limit) != 0) {
+            arena_put(a);
+            close(fd);
+            continue;
+        }
+        http_request_init(&(*c).req, (*c).in.headers, (*c).in.cap);
+        if (watch(loop, c, SIDE_CLIENT, EPOLLIN) != 0) {
+            close(fd);
+            arena_put(a);
+            continue;
+        }
+        stats_since(STAT_ACCEPT, accepted);
+        (*c).stamp = stats_now();
+        set_deadline(loop, c, proxy_header_ms);
+    }
+}
+
+int event_loop_run(int ln) {
+    event_loop loop;
+    loop.ln = ln;
+    loop.dead = NULL;
+    loop.followers = NULL;
+    loop.admitting = NULL;
+    timer_wheel_init(&loop.timers, timer_now());
+    loop.epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop.epfd == -1) {
+        perror("epoll_create1");
+        return -1;
+    }
+    int flags = fcntl(ln, F_GETFL);
+    if (flags == -1 || fcntl(ln, F_SETFL, flags|O_NONBLOCK) != 0) {
+        perror("fcntl");
+        close(loop.epfd);
+        return -1;
+    }
+    if (dns_queue_init(&loop.dns) != 0) {
+        close(loop.epfd);
+        return -1;
+    }
+    loop.flight_fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+    if (loop.flight_fd == -1) {
+        perror("eventfd");
+        close(loop.epfd);
+        return -1;
+    }
+    loop.admit_fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+    if (loop.admit_fd == -1) {
+        perror("eventfd");
+        close(loop.epfd);
+        return -1;
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u64 = DATA_LISTENER;
+    if (epoll_ctl(loop.epfd, EPOLL_CTL_ADD, ln, &ev) != 0) {
+        perror("epoll_ctl");
+        close(loop.epfd);
+        return -1;
+    }
+    ev.data.u64 = DATA_DNS;
+    if (epoll_ctl(loop.epfd, EPOLL_CTL_ADD, loop.dns.fd, &ev) != 0) {
+        perror("epoll_ctl");
+        close(loop.epfd);
+        return -1;
+    }
+    ev.data.u64 = DATA_FLIGHT;
+    if (epoll_ctl(loop.epfd, EPOLL_CTL_ADD, loop.flight_fd, &ev) != 0) {
+        perror("epoll_ctl");
+        close(loop.epfd);
+        return -1;
+    }
+    ev.data.u64 = DATA_ADMIT;
+    if (epoll_ctl(loop.epfd, EPOLL_CTL_ADD, loop.admit_fd, &ev) != 0) {
+        perror("epoll_ctl");
+        close(loop.epfd);
+        return -1;
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    while (1) {
+        int n = epoll_wait(loop.epfd, events, MAX_EVENTS,
+                           timer_wheel_timeout(&loop.timers, timer_now()));
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            break;
+        }
+        for (int i = 0; i < n; ++i) {
+            uint64_t data = events[i].data.u64;
+            if (data == DATA_LISTENER) {
+                accept_clients(&loop);
+                continue;
+            }
+            if (data == DATA_DNS) {
+                resolved_queries(&loop);
+                continue;
+            }
+            if (data == DATA_FLIGHT) {
+                flights_progressed(&loop);
+                continue;
+            }
+            if (data == DATA_ADMIT) {
+                admissions_granted(&loop);
+                continue;
+            }
+            conn* c = (conn*)(uintptr_t)(data & ~(uint64_t)1);
+            on_event(&loop, c, (int)(data & 1), events[i].events);
+        }
+        expire_deadlines(&loop);
+        conn_free_dead(&loop);
+    }
+
+    close(loop.epfd);
+    return -1;
+}
@@ -0,0 +1,11 @@
+#ifndef EVENT_H
+#define EVENT_H
+#include "tprintf.h"
+
+// Serves connections accepted on the listening socket ln from a single
+// epoll loop. Each connection is a non-blocking state machine running
+// the same read request -> parse -> dial -> relay steps as handle_client.
+// Only returns on error.
+int event_loop_run(int ln);
+
+#endif
@@ -0,0 +1,340 @@
+#include "flight.h"
+#include "cache.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define FLIGHT_BUCKETS  256
+
+typedef struct chunk chunk;
+struct chunk {
+    chunk* next;
+    size_t len;
+    uint8_t data[FLIGHT_CHUNK];
+};
+
+struct flight {
+    char* key;
+    size_t keylen;
+    uint64_t hash;
+    int refs;
+    int linked;
+    int state;
+    // set before the first byte is published, read after seeing it
+    size_t headlen;
+    int framed;
+    // chunks are only appended to; readers follow next and len
+    chunk* first;
+    chunk* last;
+    size_t size;
+    pthread_cond_t cond;
+    flight_waiter* waiters;
+    flight* hnext;
+};
+
+// Guards the table, references, waiters and state changes.
+static pthread_mutex_t flight_mutex = PTHREAD_MUTEX_INITIALIZER;
+static flight* buckets[FLIGHT_BUCKETS];
+
+static
+flight** bucket_slot(uint64_t hash, slice key) {
+    flight** slot = &buckets[hash % FLIGHT_BUCKETS];
+    while (*slot) {
+        flight* f = *slot;
+        if ((*f).hash == hash && (*f).keylen == key.len
+            && memcmp((*f).key, key.ptr, key.len) == 0) {
+            break;
+        }
+        slot = &(*f).hnext;
+    }
+    return slot;
+}
+
+// Must hold flight_mutex.
+static
+void unlink_flight(flight* f) {
+    if (!(*f).linked) {
+        return;
+    }
+    flight** slot = bucket_slot((*f).hash, (slice){(uint8_t const*)(*f).key, (*f).keylen});
+    if (*slot == f) {
+        *slot = (*f).hnext;
+    }
+    (*f).hnext = NULL;
+    (*f).linked = 0;
+}
+
+// Wakes every follower. Must hold flight_mutex.
+static
+void signal_followers(flight* f) {
+    pthread_cond_broadcast(&(*f).cond);
+    while ((*f).waiters) {
+        flight_waiter* w = (*f).waiters;
+        (*f).waiters = (*w).next;
+        __atomic_store_n(&(*w).armed, 0, __ATOMIC_RELEASE);
+        uint64_t one = 1;
+        if (write((*w).fd, &one, sizeof(one)) != sizeof(one)) {
+            perror("write(eventfd)");
+        }
+    }
+}
+
+// Ends the flight in state, so that new requests no longer join it.
+static
+void end_flight(flight* f, int state) {
+    pthread_mutex_lock(&flight_mutex);
+    if (__atomic_load_n(&(*f).state, __ATOMIC_RELAXED) < FLIGHT_DONE) {
+        __atomic_store_n(&(*f).state, state, __ATOMIC_RELEASE);
+    }
+    unlink_flight(f);
+    signal_followers(f);
+    pthread_mutex_unlock(&flight_mutex);
+}
+
+static
+void flight_free(flight* f) {
+    chunk* c = (*f).first;
+    while (c) {
+        chunk* next = (*c).next;
+        free(c);
+        c = next;
+    }
+    pthread_cond_destroy(&(*f).cond);
+    free((*f).key);
+    free(f);
+}
+
+flight* flight_join(slice key, int* leader) {
+    uint64_t hash = cache_hash(key);
+    pthread_mutex_lock(&flight_mutex);
+    flight* f = *bucket_slot(hash, key);
+    if (f) {
+        (*f).refs += 1;
+        pthread_mutex_unlock(&flight_mutex);
+        *leader = 0;
+        return f;
+    }
+    f = calloc(1, sizeof(flight));
+    if (f) {
+        (*f).key = malloc(key.len);
+    }
+    if (!f || !(*f).key) {
+        pthread_mutex_unlock(&flight_mutex);
+        free(f);
+        return NULL;
+    }
+    memcpy((*f).key, key.ptr, key.len);
+    (*f).keylen = key.len;
+    (*f).hash = hash;
+    (*f).refs = 1;
+    (*f).state = FLIGHT_WAITING;
+    pthread_cond_init(&(*f).cond, NULL);
+    flight** slot = bucket_slot(hash, key);
+    (*f).hnext = *slot;
+    *slot = f;
+    (*f).linked = 1;
+    pthread_mutex_unlock(&flight_mutex);
+    *leader = 1;
+    return f;
+}
+
+void flight_leave(flight* f) {
+    pthread_mutex_lock(&flight_mutex);
+    (*f).refs -= 1;
+    int dead = (*f).refs == 0;
+    if (dead) {
+        unlink_flight(f);
+    }
+    pthread_mutex_unlock(&flight_mutex);
+    if (dead) {
+        flight_free(f);
+    }
+}
+
+void flight_finish(flight* f) {
+    end_flight(f, FLIGHT_FAILED);
+    flight_leave(f);
+}
+
+// Copies bytes into the chunks, then publishes them.
+static
+int publish(flight* f, slice bytes) {
+    if ((*f).size + bytes.len > FLIGHT_MAX_BYTES) {
+        tlog(LOG_DEBUG, "flight: [%.*s] outgrew %d bytes\n",
+            (int)(*f).keylen, (*f).key, FLIGHT_MAX_BYTES);
+        return -1;
+    }
+    while (bytes.len > 0) {
+        chunk* c = (*f).last;
+        if (!c || (*c).len == FLIGHT_CHUNK) {
+            chunk* next = malloc(sizeof(chunk));
+            if (!next) {
+                perror("malloc");
+                return -1;
+            }
+            (*next).next = NULL;
+            (*next).len = 0;
+            if (c) {
+                __atomic_store_n(&(*c).next, next, __ATOMIC_RELEASE);
+            } else {
+                __atomic_store_n(&(*f).first, next, __ATOMIC_RELEASE);
+            }
+            (*f).last = next;
+            c = next;
+        }
+        size_t n = FLIGHT_CHUNK - (*c).len;
+        if (n > bytes.len) {
+            n = bytes.len;
+        }
+        memcpy(&(*c).data[(*c).len], bytes.ptr, n);
+        __atomic_store_n(&(*c).len, (*c).len + n, __ATOMIC_RELEASE);
+        bytes.ptr += n;
+        bytes.len -= n;
+        (*f).size += n;
+    }
+    return 0;
+}
+
+void flight_head(flight* f, slice head, int framed, int shareable) {
+    if (!shareable) {
+        end_flight(f, FLIGHT_PASS);
+        return;
+    }
+    (*f).headlen = head.len;
+    (*f).framed = framed;
+    if (publish(f, head) != 0) {
+        end_flight(f, FLIGHT_FAILED);
+        return;
+    }
+    pthread_mutex_lock(&flight_mutex);
+    __atomic_store_n(&(*f).state, FLIGHT_STREAMING, __ATOMIC_RELEASE);
+    signal_followers(f);
+    pthread_mutex_unlock(&flight_mutex);
+}
+
+int flight_publishing(flight* f) {
+    return __atomic_load_n(&(*f).state, __ATOMIC_ACQUIRE) == FLIGHT_STREAMING;
+}
+
+int flight_append(flight* f, slice bytes) {
+    if (!flight_publishing(f)) {
+        return -1;
+    }
+    if (publish(f, bytes) != 0) {
+        end_flight(f, FLIGHT_FAILED);
+        return -1;
+    }
+    pthread_mutex_lock(&flight_mutex);
+    signal_followers(f);
+    pthread_mutex_unlock(&flight_mutex);
+    return 0;
+}
+
+void flight_complete(flight* f) {
+    if (flight_publishing(f)) {
+        end_flight(f, FLIGHT_DONE);
+    }
+}
+
+void flight_reader_init(flight_reader* r, flight* f) {
+    (*r).f = f;
+    (*r).chunk = NULL;
+    (*r).off = 0;
+    (*r).pos = 0;
+}
+
+int flight_peek(flight_reader* r, slice* bytes) {
+    flight* f = (*r).f;
+    // the state first: once it is final, every byte is published
+    int state = __atomic_load_n(&(*f).state, __ATOMIC_ACQUIRE);
+    (*bytes).ptr = NULL;
+    (*bytes).len = 0;
+    chunk* c = (*r).chunk;
+    if (!c) {
+        c = __atomic_load_n(&(*f).first, __ATOMIC_ACQUIRE);
+        if (!c) {
+            return state;
+        }
+        (*r).chunk = c;
+    }
+    size_t len = __atomic_load_n(&(*c).len, __ATOMIC_ACQUIRE);
+    if ((*r).off == FLIGHT_CHUNK) {
+        chunk* next = __atomic_load_n(&(*c).next, __ATOMIC_ACQUIRE);
+        if (!next) {
+            return state;
+        }
+        c = next;
+        (*r).chunk = c;
+        (*r).off = 0;
+        len = __atomic_load_n(&(*c).len, __ATOMIC_ACQUIRE);
+    }
+    if ((*r).off < len) {
+        size_t n = len - (*r).off;
+        if ((*r).pos < (*f).headlen && (*r).pos + n > (*f).headlen) {
+            n = (*f).headlen - (*r).pos;
+        }
+        (*bytes).ptr = &(*c).data[(*r).off];
+        (*bytes).len = n;
+    }
+    return state;
+}
+
+void flight_advance(flight_reader* r, size_t n) {
+    (*r).off += n;
+    (*r).pos += n;
+}
+
+size_t flight_headlen(flight* f) {
+    return (*f).headlen;
+}
+
+int flight_framed(flight* f) {
+    return (*f).framed;
+}
+
+void flight_wait(flight_reader* r) {
+    flight* f = (*r).f;
+    pthread_mutex_lock(&flight_mutex);
+    while (1) {
+        slice bytes;
+        int state = flight_peek(r, &bytes);
+        if (bytes.len > 0 || state >= FLIGHT_DONE) {
+            break;
+        }
+        pthread_cond_wait(&(*f).cond, &flight_mutex);
+    }
+    pthread_mutex_unlock(&flight_mutex);
+}
+
+int flight_watch(flight_reader* r, flight_waiter* w) {
+    flight* f = (*r).f;
+    pthread_mutex_lock(&flight_mutex);
+    slice bytes;
+    int state = flight_peek(r, &bytes);
+    int ready = bytes.len > 0 || state >= FLIGHT_DONE;
+    if (!ready && !(*w).armed) {
+        __atomic_store_n(&(*w).armed, 1, __ATOMIC_RELAXED);
+        (*w).next = (*f).waiters;
+        (*f).waiters = w;
+    }
+    pthread_mutex_unlock(&flight_mutex);
+    return ready;
+}
+
+void flight_unwatch(flight* f, flight_waiter* w) {
+    pthread_mutex_lock(&flight_mutex);
+    if ((*w).armed) {
+        flight_waiter** link = &(*f).waiters;
+        while (*link && *link != w) {
+            link = &(**link).next;
+        }
+        if (*link) {
+            *link = (*w).next;
+        }
+        __atomic_store_n(&(*w).armed, 0, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&flight_mutex);
+}
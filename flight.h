@@ -0,0 +1,84 @@
+#ifndef FLIGHT_H
+#define FLIGHT_H
+#include "tprintf.h"
+#include "slice.h"
+#include <stddef.h>
+#include <sys/types.h>
+
+#define FLIGHT_CHUNK        (64 << 10)
+#define FLIGHT_MAX_BYTES    (32 << 20)
+// flights a request follows, when they fail, before fetching on its own
+#define FLIGHT_TRIES        3
+
+// A response being fetched from an origin for one cache key, shared
+// with every client that asks for the same key meanwhile (collapsed
+// forwarding). The first client leads the fetch and publishes the
+// response, head then body, into append-only chunks; followers stream
+// them to their own clients as they arrive.
+typedef struct flight flight;
+
+enum {
+    FLIGHT_WAITING,     // no head yet
+    FLIGHT_STREAMING,   // bytes are being published
+    FLIGHT_DONE,        // all of the response is published
+    FLIGHT_FAILED,      // the fetch failed, or outgrew FLIGHT_MAX_BYTES
+    FLIGHT_PASS,        // the response may not be shared
+};
+
+// Where a follower is in the published bytes.
+typedef struct {
+    flight* f;
+    void* chunk;
+    size_t off;
+    size_t pos;
+} flight_reader;
+
+// Lets an event loop sleep until a flight it follows makes progress:
+// fd (an eventfd) is written once the next bytes or the end arrive.
+// armed is cleared (atomically) when that happens, so a loop sharing
+// one fd between waiters can tell which of them fired.
+typedef struct flight_waiter flight_waiter;
+struct flight_waiter {
+    int fd;
+    int armed;
+    flight_waiter* next;
+};
+
+// Returns the flight for key, referenced. *leader is set if the caller
+// created it and must fetch the response. Returns NULL if no flight
+// can be created.
+flight* flight_join(slice key, int* leader);
+// Drops a follower's reference.
+void flight_leave(flight* f);
+// Drops the leader's reference, failing the flight unless
+// flight_complete was called.
+void flight_finish(flight* f);
+
+// Called by the leader once the response head is known: head is sent
+// to followers as is, then each adds its own Connection line. framed
+// means the body length is known. A response that may not be shared
+// turns the flight to FLIGHT_PASS.
+void flight_head(flight* f, slice head, int framed, int shareable);
+// Publishes body bytes. Returns -1 once the flight has failed or
+// passed; the leader carries on alone.
+int flight_append(flight* f, slice bytes);
+void flight_complete(flight* f);
+// Returns 1 if the leader has to publish its body bytes.
+int flight_publishing(flight* f);
+
+void flight_reader_init(flight_reader* r, flight* f);
+// Sets *bytes to the published bytes at r's position, if any, and
+// returns the flight's state. The head's bytes are never returned
+// together with body bytes.
+int flight_peek(flight_reader* r, slice* bytes);
+void flight_advance(flight_reader* r, size_t n);
+size_t flight_headlen(flight* f);
+int flight_framed(flight* f);
+// Blocks until flight_peek has bytes for r or the flight has ended.
+void flight_wait(flight_reader* r);
+// Arms w to be signalled when there is progress past r. Returns 1
+// (and leaves w unarmed) if there already is.
+int flight_watch(flight_reader* r, flight_waiter* w);
+void flight_unwatch(flight* f, flight_waiter* w);
+
+#endif
@@ -1,9 +1,13 @@
 #include "http.h"
 #include "url.h"
+#include "scan.h"
+#include "timer.h"
 #include <stdio.h>
 #include <string.h>
-#include <assert.h>
+#include <strings.h>
 #include <unistd.h>
+#include <errno.h>
+#include <poll.h>
 
 #define ZERO_LEN_PATH   "/"
 
@@ -16,9 +20,7 @@ int is_space(uint8_t b) {
 // Returns 0 or http_partial
 static
 int parse_line(uint8_t const* buf, size_t len, size_t* pos) {
-    while (*pos < len && buf[*pos] != '\r' && buf[*pos] != '\n') {
-        *pos += 1;
-    }
+    *pos += scan_eol(&buf[*pos], len - *pos);
 
     if (*pos < len) {
         return 0;
@@ -27,15 +29,12 @@ int parse_line(uint8_t const* buf, size_t len, size_t* pos) {
     }
 }
 
+// Skips spaces and tabs, but not line ends.
 static
-int consume_whitespace(slice buf, size_t* pos) {
-    while (*pos < buf.len && is_space(buf.ptr[*pos])) {
+void skip_blanks(uint8_t const* buf, size_t len, size_t* pos) {
+    while (*pos < len && (buf[*pos] == ' ' || buf[*pos] == '\t')) {
         *pos += 1;
     }
-    if (*pos < buf.len) {
-        return 0;
-    }
-    return http_partial;
 }
 
 static
@@ -46,26 +45,22 @@ int parse_token(uint8_t const* buf, size_t len, size_t* pos, slice* token) {
     }
 
     size_t start = *pos;
-    while (1) {
-        if (*pos >= len) {
-            return http_partial;
-        }
-
-        uint8_t b = buf[*pos];
-        *pos += 1;
+    *pos += scan_space(&buf[*pos], len - *pos);
+    if (*pos >= len) {
+        return http_partial;
+    }
+    // the delimiter is consumed with the token
+    *pos += 1;
 
-        if (is_space(b)) {
-            size_t toklen = *pos - start - 1;
-            if (toklen == 0) {
-                // should never happen because of
-                // consuming whitespace at start
-                return http_err_zerolentok;
-            }
-            token->ptr = &buf[start];
-            token->len = toklen;
-            return 0;
-        }
+    size_t toklen = *pos - start - 1;
+    if (toklen == 0) {
+        // should never happen because of
+        // consuming whitespace at start
+        return http_err_zerolentok;
     }
+    token->ptr = &buf[start];
+    token->len = toklen;
+    return 0;
 }
 
 static
@@ -127,7 +122,8 @@ static
 int is_valid_method(slice const* b) {
     char const* valid[NUM_HTTP_METHODS] = {"GET", "HEAD", "PUT", "DELETE", "POST", "TRACE", "CONNECT"};
     for (int i = 0; i < NUM_HTTP_METHODS; ++i) {
-        if (strncmp((*b).ptr, valid[i], (*b).len) == 0) {
+        if ((*b).len == strlen(valid[i])
+            && memcmp((*b).ptr, valid[i], (*b).len) == 0) {
             return 1;
         }
     }
@@ -136,23 +132,26 @@ int is_valid_method(slice const* b) {
 
 static
 int parse_header(uint8_t const* buf, size_t len, size_t* pos, http_header* header) {
-    int err = parse_token(buf, len, pos, &(*header).name);
-    if (err != 0) {
-        assert(err == http_partial);
+    skip_blanks(buf, len, pos);
+    uint8_t const* colon = memchr(&buf[*pos], ':', len - *pos);
+    if (!colon) {
         return http_partial;
     }
-    if ((*header).name.ptr[(*header).name.len - 1] != ':') {
+    // the name is everything up to the colon, which need not be
+    // followed by a space, and may not be empty or contain one
+    (*header).name.ptr = &buf[*pos];
+    (*header).name.len = colon - &buf[*pos];
+    if ((*header).name.len == 0
+        || scan_space((*header).name.ptr, (*header).name.len) != (*header).name.len) {
         return http_err_header;
     }
-    (*header).name.len -= 1;
+    *pos += (*header).name.len + 1;
 
-    err = consume_whitespace((slice){buf, len}, pos);
-    if (err != 0) {
-        return err;
-    }
+    // the value may be empty
+    skip_blanks(buf, len, pos);
     (*header).value.ptr = &buf[*pos];
 
-    err = parse_line(buf, len, pos);
+    int err = parse_line(buf, len, pos);
     if (err != 0) {
         return http_partial;
     }
@@ -166,44 +165,60 @@ int parse_header(uint8_t const* buf, size_t len, size_t* pos, http_header* heade
     return 0;
 }
 
+// Finds the end of the line starting at (*p).pos, one past its LF.
+// Only searches bytes that were not searched by an earlier call.
 static
-int parse_headers(uint8_t const* buf, size_t len, size_t* pos, http_headerbuf* headerbuf) {
-    int header = 0;
-    while (1) {
-        int err = parse_newline(buf, len, pos);
-        switch (err) {
-        case 0:
-            (*headerbuf).cap = header;
-            return 0;
-        case http_partial:
-            return http_partial;
-        case http_err_newline:
-            return http_err_newline;
-        case http_not_newline:
-            break;
-        }
+int next_line(uint8_t const* buf, size_t len, http_parser* p, size_t* end) {
+    size_t from = (*p).scan > (*p).pos ? (*p).scan : (*p).pos;
+    uint8_t const* lf = memchr(&buf[from], '\n', len - from);
+    if (!lf) {
+        (*p).scan = len;
+        return http_partial;
+    }
+    *end = lf - buf + 1;
+    return 0;
+}
 
-        if (header >= (*headerbuf).cap) {
-            return http_too_many_headers;
-        }
-        err = parse_header(buf, len, pos, &(*headerbuf).ptr[header]);
-        if (err != 0) {
-            return err; // partial or err_header
-        }
-        header += 1;
+// Parses the header line buf[*pos..end), or the blank line ending the
+// headers, after which headerbuf's cap is the number of headers.
+// Returns 1 at the end of the headers, 0 after a header.
+static
+int parse_header_line(uint8_t const* buf, size_t end, size_t* pos, http_headerbuf* headerbuf, int header) {
+    int err = parse_newline(buf, end, pos);
+    switch (err) {
+    case 0:
+        (*headerbuf).cap = header;
+        return 1;
+    case http_err_newline:
+        return http_err_newline;
+    case http_not_newline:
+        break;
+    }
+
+    if (header >= (*headerbuf).cap) {
+        return http_too_many_headers;
     }
+    err = parse_header(buf, end, pos, &(*headerbuf).ptr[header]);
+    if (err != 0) {
+        // the line is complete, so it cannot be partial
+        return err == http_partial ? http_err_header : err;
+    }
+    return 0;
 }
 
+// The status is exactly three digits, the first one 1 to 9.
 static
 int parse_status(slice status, int* code) {
-    if (status.len < 3) {
-        return http_partial;
+    if (status.len != 3 || status.ptr[0] < '1' || status.ptr[0] > '9') {
+        return http_err_status;
+    }
+    *code = 0;
+    for (size_t i = 0; i < 3; ++i) {
+        if (status.ptr[i] < '0' || status.ptr[i] > '9') {
+            return http_err_status;
+        }
+        *code = 10*(*code) + (status.ptr[i] - '0');
     }
-    int a = status.ptr[0] - '0';
-    int b = status.ptr[1] - '0';
-    int c = status.ptr[2] - '0';
-    // TODO status error checking
-    *code = 100*a + 10*b + c;
     return 0;
 }
 
@@ -211,10 +226,8 @@ static
 int parse_status_phrase(slice buf, size_t* pos, slice* phrase) {
     int err;
 
-    err = consume_whitespace(buf, pos);
-    if (err != 0) {
-        return err;
-    }
+    // the phrase may be empty
+    skip_blanks(buf.ptr, buf.len, pos);
     (*phrase).ptr = &buf.ptr[*pos];
 
     err = parse_line(buf.ptr, buf.len, pos);
@@ -225,46 +238,67 @@ int parse_status_phrase(slice buf, size_t* pos, slice* phrase) {
     return 0;
 }
 
-int http_parse_request(uint8_t const* buf, size_t len, http_request* r) {
-    size_t pos = 0;
+// Parses the request line buf[*pos..end).
+static
+int parse_request_line(uint8_t const* buf, size_t end, size_t* pos, http_request* r) {
     int err;
 
-    err = parse_token(buf, len, &pos, &(*r).method);
+    err = parse_token(buf, end, pos, &(*r).method);
     if (err != 0) {
-        assert(err == http_partial);
+        // only a blank line ends before the method
         return http_partial;
     }
     if (!is_valid_method(&(*r).method)) {
         return http_err_method;
     }
 
-    err = parse_token(buf, len, &pos, &(*r).url);
+    err = parse_token(buf, end, pos, &(*r).url);
     if (err != 0) {
-        assert(err == http_partial);
-        return http_partial;
+        return http_err_url;
     }
     // validate url?
 
-    err = parse_version(buf, len, &pos, &(*r).version, &(*r).version_slice);
+    err = parse_version(buf, end, pos, &(*r).version, &(*r).version_slice);
     if (err != 0) {
-        // either http_partial or http_err_version
-        return err;
+        return http_err_version;
     }
 
-    err = parse_newline(buf, len, &pos);
-    if (err != 0) {
-        return err; // either partial or err_newline or not_newline
-    }
+    return parse_newline(buf, end, pos); // either ok, err_newline or not_newline
+}
 
-    err = parse_headers(buf, len, &pos, &(*r).headerbuf);
-    if (err != 0) {
-        return err; // either partial or err_header
+int http_parse_request(uint8_t const* buf, size_t len, http_request* r) {
+    http_parser* p = &(*r).parser;
+    while (1) {
+        size_t end;
+        int err = next_line(buf, len, p, &end);
+        if (err != 0) {
+            return http_partial;
+        }
+        size_t pos = (*p).pos;
+        if ((*p).lines == 0) {
+            err = parse_request_line(buf, end, &pos, r);
+            if (err == http_partial) {
+                // blank lines before the request line are ignored
+                (*p).pos = end;
+                continue;
+            }
+        } else {
+            err = parse_header_line(buf, end, &pos, &(*r).headerbuf, (*p).lines - 1);
+        }
+        if (err < 0) {
+            return err;
+        }
+        (*p).pos = end;
+        (*p).lines += 1;
+        if (err == 1) {
+            break;
+        }
     }
 
     (*r).buf.ptr = buf;
-    (*r).buf.len = pos;
+    (*r).buf.len = (*p).pos;
 
-    err = split_url((*r).url, &(*r).node, &(*r).service, &(*r).path);
+    int err = split_url((*r).url, &(*r).node, &(*r).service, &(*r).path);
     if (err != 0) {
         return http_err_url;
     }
@@ -294,29 +328,135 @@ void http_response_init(http_response* res, http_headerbuf hdrbuf) {
     (*res).headerbuf = hdrbuf;
 }
 
-int http_read_request(int fd, mutslice buf, http_request* req) {
-    size_t count = 0;
+int http_buf_init(http_buf* b, arena* a, size_t limit) {
+    (*b).arena = a;
+    (*b).limit = limit;
+    (*b).count = 0;
+    (*b).cap = HTTP_HEADERS_INITIAL;
+    (*b).headers = arena_alloc(a, (*b).cap * sizeof(http_header));
+    // the bytes last, so that they are the allocation grown in place
+    (*b).len = HTTP_BUF_INITIAL < limit ? HTTP_BUF_INITIAL : limit;
+    (*b).ptr = arena_alloc(a, (*b).len);
+    if (!(*b).headers || !(*b).ptr) {
+        return -1;
+    }
+    return 0;
+}
+
+int http_buf_reserve(http_buf* b) {
+    if ((*b).count < (*b).len) {
+        return 0;
+    }
+    if ((*b).len >= (*b).limit) {
+        return -1;
+    }
+    size_t len = 2*(*b).len < (*b).limit ? 2*(*b).len : (*b).limit;
+    uint8_t* ptr = arena_grow((*b).arena, (*b).ptr, (*b).len, len);
+    if (!ptr) {
+        return -1;
+    }
+    (*b).ptr = ptr;
+    (*b).len = len;
+    return 1;
+}
+
+// Doubles b's headers. Every header line takes at least three bytes,
+// so their number is bounded by the limit of the bytes.
+static
+int grow_headers(http_buf* b) {
+    if ((*b).cap >= (*b).limit / 3) {
+        return -1;
+    }
+    http_header* headers = arena_alloc((*b).arena, 2*(*b).cap * sizeof(http_header));
+    if (!headers) {
+        return -1;
+    }
+    (*b).headers = headers;
+    (*b).cap *= 2;
+    return 0;
+}
+
+int http_buf_parse_request(http_buf* b, http_request* req) {
+    while (1) {
+        int err = http_parse_request((*b).ptr, (*b).count, req);
+        if (err != http_too_many_headers || grow_headers(b) != 0) {
+            return err;
+        }
+        http_request_init(req, (*b).headers, (*b).cap);
+    }
+}
+
+int http_buf_parse_response(http_buf* b, http_response* res) {
+    while (1) {
+        int err = http_parse_response((slice){(*b).ptr, (*b).count}, res);
+        if (err != http_too_many_headers || grow_headers(b) != 0) {
+            return err;
+        }
+        http_response_init(res, (http_headerbuf){(*b).headers, (*b).cap});
+    }
+}
+
+// Reads like read, failing with ETIMEDOUT if nothing arrives before
+// deadline (0 for none).
+static
+ssize_t read_by(int fd, void* buf, size_t len, uint64_t deadline) {
+    if (deadline != 0) {
+        uint64_t now = timer_now();
+        struct pollfd p = {fd, POLLIN, 0};
+        int ready = now < deadline ? poll(&p, 1, (int)(deadline - now)) : 0;
+        if (ready == -1) {
+            return -1;
+        }
+        if (ready == 0) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+    }
+    return read(fd, buf, len);
+}
+
+int http_read_request(int fd, http_buf* b, http_request* req, uint64_t deadline) {
+    // a pipelined request may already be waiting in b
+    if ((*b).count > 0) {
+        int err = http_buf_parse_request(b, req);
+        if (err != http_partial) {
+            return err;
+        }
+    }
+
     int eof = 0;
     while (!eof) {
-        size_t tail = buf.len - count;
-        if (tail == 0) {
+        switch (http_buf_reserve(b)) {
+        case -1:
             return http_req_too_large;
+        case 1:
+            http_request_init(req, (*b).headers, (*b).cap);
+            break;
         }
-        ssize_t n = read(fd, &buf.ptr[count], tail);
+        ssize_t n = read_by(fd, &(*b).ptr[(*b).count], (*b).len - (*b).count, deadline);
         switch (n) {
         case -1:
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == ETIMEDOUT) {
+                return http_read_timeout;
+            }
             perror("read");
-            continue;
+            return http_read_err;
         case 0:
-            tprintf("read=0\n");
+            tlog(LOG_DEBUG, "read=0\n");
+            if ((*b).count == 0) {
+                return http_read_eof;
+            }
             eof = 1;
             break;
         default:
-            tprintf("read=%zd\n", n);
-            count += n;
+            tlog(LOG_DEBUG, "read=%zd\n", n);
+            (*b).count += n;
         }
 
-        int err = http_parse_request(buf.ptr, count, req);
+        int err = http_buf_parse_request(b, req);
         if (err != 0) {
             if (err == http_partial) {
                 continue;
@@ -325,81 +465,464 @@ int http_read_request(int fd, mutslice buf, http_request* req) {
         }
         return 0;
     }
-    return http_partial; // TODO should return http_partial?
+    // the connection closed in the middle of the head
+    return http_partial;
 }
 
-int http_parse_response(slice buf, http_response* res) {
-    size_t pos = 0;
+// Parses the status line buf[*pos..end).
+static
+int parse_status_line(slice buf, size_t* pos, http_response* res) {
     int err;
 
-    err = parse_version(buf.ptr, buf.len, &pos,
+    err = parse_version(buf.ptr, buf.len, pos,
         &(*res).version.minor, &(*res).version.slice);
     if (err != 0) {
-        return err;
+        return http_err_version;
     }
 
     slice status;
-    err = parse_token(buf.ptr, buf.len, &pos, &status);
+    err = parse_token(buf.ptr, buf.len, pos, &status);
     if (err != 0) {
-        return err;
+        return http_err_status;
     }
     err = parse_status(status, &(*res).status.code);
     if (err != 0) {
-        return err;
+        return http_err_status;
     }
 
-    err = parse_status_phrase(buf, &pos, &(*res).status.phrase);
+    err = parse_status_phrase(buf, pos, &(*res).status.phrase);
     if (err != 0) {
-        return err;
+        return http_err_status;
     }
 
-    err = parse_newline(buf.ptr, buf.len, &pos);
-    if (err != 0) {
-        return err;
-    }
+    return parse_newline(buf.ptr, buf.len, pos);
+}
 
-    err = parse_headers(buf.ptr, buf.len, &pos, &(*res).headerbuf);
-    if (err != 0) {
-        return err;
+int http_parse_response(slice buf, http_response* res) {
+    http_parser* p = &(*res).parser;
+    while (1) {
+        size_t end;
+        int err = next_line(buf.ptr, buf.len, p, &end);
+        if (err != 0) {
+            return http_partial;
+        }
+        size_t pos = (*p).pos;
+        if ((*p).lines == 0) {
+            err = parse_status_line((slice){buf.ptr, end}, &pos, res);
+        } else {
+            err = parse_header_line(buf.ptr, end, &pos, &(*res).headerbuf, (*p).lines - 1);
+        }
+        if (err < 0) {
+            return err;
+        }
+        (*p).pos = end;
+        (*p).lines += 1;
+        if (err == 1) {
+            break;
+        }
     }
 
     (*res).buf.ptr = buf.ptr;
-    (*res).buf.len = pos;
+    (*res).buf.len = (*p).pos;
 
     return 0;
 }
 
-ssize_t http_read_response(int fd, mutslice buf, http_response* res) {
-    size_t count = 0;
+ssize_t http_read_response(int fd, http_buf* b, http_response* res, uint64_t deadline) {
+    (*b).count = 0;
     int eof = 0;
     while (!eof) {
-        size_t tail = buf.len - count;
-        if (tail == 0) {
+        switch (http_buf_reserve(b)) {
+        case -1:
             return http_res_too_large;
+        case 1:
+            http_response_init(res, (http_headerbuf){(*b).headers, (*b).cap});
+            break;
         }
-        ssize_t n = read(fd, &buf.ptr[count], tail);
+        ssize_t n = read_by(fd, &(*b).ptr[(*b).count], (*b).len - (*b).count, deadline);
         switch (n) {
         case -1:
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == ETIMEDOUT) {
+                return http_read_timeout;
+            }
             perror("read");
-            continue;
+            return http_read_err;
         case 0:
-            tprintf("read=0\n");
+            tlog(LOG_DEBUG, "read=0\n");
+            if ((*b).count == 0) {
+                return http_read_eof;
+            }
             eof = 1;
             break;
         default:
-            tprintf("read=%zd\n", n);
-            count += n;
+            tlog(LOG_DEBUG, "read=%zd\n", n);
+            (*b).count += n;
         }
 
-        int err = http_parse_response((slice){buf.ptr, count}, res);
+        int err = http_buf_parse_response(b, res);
         if (err != 0) {
             if (err == http_partial) {
                 continue;
             }
             return err;
         }
-        return count;
+        return (*b).count;
+    }
+    // the connection closed in the middle of the head
+    return http_partial;
+}
+
+int http_find_header(http_headerbuf headerbuf, char const* name, slice* value) {
+    size_t namelen = strlen(name);
+    for (size_t i = 0; i < headerbuf.cap; ++i) {
+        http_header const* h = &headerbuf.ptr[i];
+        if ((*h).name.len == namelen
+            && strncasecmp((char const*)(*h).name.ptr, name, namelen) == 0) {
+            *value = (*h).value;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int http_content_length(http_headerbuf headerbuf, size_t* len) {
+    slice value;
+    if (!http_find_header(headerbuf, "Content-Length", &value)) {
+        return 0;
+    }
+    while (value.len > 0 && is_space(value.ptr[value.len - 1])) {
+        value.len -= 1;
+    }
+    if (value.len == 0 || value.len > 18) {
+        return -1;
+    }
+    size_t n = 0;
+    for (size_t i = 0; i < value.len; ++i) {
+        if (value.ptr[i] < '0' || value.ptr[i] > '9') {
+            return -1;
+        }
+        n = n*10 + (value.ptr[i] - '0');
+    }
+    *len = n;
+    return 1;
+}
+
+int http_connection_has(http_headerbuf headerbuf, char const* token) {
+    size_t toklen = strlen(token);
+    for (size_t i = 0; i < headerbuf.cap; ++i) {
+        http_header const* h = &headerbuf.ptr[i];
+        if ((*h).name.len != strlen("Connection")
+            || strncasecmp((char const*)(*h).name.ptr, "Connection", (*h).name.len) != 0) {
+            continue;
+        }
+        slice v = (*h).value;
+        size_t pos = 0;
+        while (pos < v.len) {
+            while (pos < v.len && (v.ptr[pos] == ',' || is_space(v.ptr[pos]))) {
+                pos += 1;
+            }
+            size_t start = pos;
+            while (pos < v.len && v.ptr[pos] != ',' && !is_space(v.ptr[pos])) {
+                pos += 1;
+            }
+            if (pos - start == toklen
+                && strncasecmp((char const*)&v.ptr[start], token, toklen) == 0) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+int http_request_keep_alive(http_request const* req) {
+    if (http_connection_has((*req).headerbuf, "close")) {
+        return 0;
+    }
+    if ((*req).version >= 1) {
+        return 1;
+    }
+    return http_connection_has((*req).headerbuf, "keep-alive");
+}
+
+int http_request_has_body(http_request const* req) {
+    slice te;
+    if (http_find_header((*req).headerbuf, "Transfer-Encoding", &te)) {
+        return 1;
+    }
+    size_t len = 0;
+    return http_content_length((*req).headerbuf, &len) != 0 && len != 0;
+}
+
+int http_response_keep_alive(http_response const* res) {
+    if (http_connection_has((*res).headerbuf, "close")) {
+        return 0;
+    }
+    if ((*res).version.minor >= 1) {
+        return 1;
+    }
+    return http_connection_has((*res).headerbuf, "keep-alive");
+}
+
+int http_chunked(http_headerbuf headerbuf) {
+    // Transfer-Encoding may be split over several headers, the
+    // codings apply in order
+    slice last = {NULL, 0};
+    for (size_t i = 0; i < headerbuf.cap; ++i) {
+        http_header const* h = &headerbuf.ptr[i];
+        if ((*h).name.len == strlen("Transfer-Encoding")
+            && strncasecmp((char const*)(*h).name.ptr, "Transfer-Encoding", (*h).name.len) == 0) {
+            last = (*h).value;
+        }
+    }
+    while (last.len > 0 && is_space(last.ptr[last.len - 1])) {
+        last.len -= 1;
+    }
+    size_t start = last.len;
+    while (start > 0 && last.ptr[start - 1] != ',' && !is_space(last.ptr[start - 1])) {
+        start -= 1;
+    }
+    return last.len - start == strlen("chunked")
+        && strncasecmp((char const*)&last.ptr[start], "chunked", strlen("chunked")) == 0;
+}
+
+ssize_t http_response_body_length(http_response const* res, int head) {
+    int code = (*res).status.code;
+    if (head || (code >= 100 && code < 200) || code == 204 || code == 304) {
+        return 0;
+    }
+    // a transfer coding overrides any Content-Length
+    slice te;
+    if (http_find_header((*res).headerbuf, "Transfer-Encoding", &te)) {
+        return -1;
+    }
+    size_t len = 0;
+    if (http_content_length((*res).headerbuf, &len) == 1) {
+        return (ssize_t)len;
+    }
+    return -1;
+}
+
+// States of the chunk parser.
+enum {
+    CHUNK_SIZE,         // in the hex digits of a chunk size
+    CHUNK_EXT,          // in a chunk extension, up to the LF
+    CHUNK_SIZE_LF,      // after the CR of a size line
+    CHUNK_DATA,
+    CHUNK_DATA_CR,      // after the data, expecting its CRLF
+    CHUNK_DATA_LF,
+    CHUNK_TRAILER,      // at the start of a trailer line
+    CHUNK_TRAILER_LINE, // in a trailer line, up to the LF
+    CHUNK_END_LF,       // after the CR of the empty last line
+    CHUNK_DONE,
+};
+
+// Longest chunk extension or trailer line accepted.
+#define CHUNK_LINE_MAX  8192
+
+void http_body_init(http_body* b, http_response const* res, int head) {
+    memset(b, 0, sizeof(*b));
+    ssize_t len = http_response_body_length(res, head);
+    if (len == 0) {
+        (*b).framing = HTTP_BODY_NONE;
+    } else if (len > 0) {
+        (*b).framing = HTTP_BODY_LENGTH;
+        (*b).left = len;
+    } else if (http_chunked((*res).headerbuf)) {
+        (*b).framing = HTTP_BODY_CHUNKED;
+        (*b).state = CHUNK_SIZE;
+    } else {
+        (*b).framing = HTTP_BODY_CLOSE;
+    }
+}
+
+static
+int hex_digit(uint8_t c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+// Runs the chunk parser over bytes up to the end of the body.
+static
+ssize_t scan_chunked(http_body* b, slice bytes) {
+    size_t i = 0;
+    while (i < bytes.len && (*b).state != CHUNK_DONE) {
+        uint8_t c = bytes.ptr[i];
+        switch ((*b).state) {
+        case CHUNK_SIZE: {
+            int d = hex_digit(c);
+            if (d >= 0) {
+                // 15 digits keep the size within 60 bits
+                if ((*b).digits == 15) {
+                    return http_err_chunk;
+                }
+                (*b).left = (*b).left*16 + d;
+                (*b).digits += 1;
+                break;
+            }
+            if ((*b).digits == 0) {
+                return http_err_chunk;
+            }
+            if (c == ';' || c == ' ' || c == '\t') {
+                (*b).state = CHUNK_EXT;
+                (*b).line = 0;
+            } else if (c == '\r') {
+                (*b).state = CHUNK_SIZE_LF;
+            } else if (c == '\n') {
+                (*b).state = (*b).left > 0 ? CHUNK_DATA : CHUNK_TRAILER;
+            } else {
+                return http_err_chunk;
+            }
+            break;
+        }
+        case CHUNK_EXT:
+            if (c == '\n') {
+                (*b).state = (*b).left > 0 ? CHUNK_DATA : CHUNK_TRAILER;
+            } else if (++(*b).line > CHUNK_LINE_MAX) {
+                return http_err_chunk;
+            }
+            break;
+        case CHUNK_SIZE_LF:
+            if (c != '\n') {
+                return http_err_chunk;
+            }
+            (*b).state = (*b).left > 0 ? CHUNK_DATA : CHUNK_TRAILER;
+            break;
+        case CHUNK_DATA: {
+            size_t n = bytes.len - i;
+            if (n > (*b).left) {
+                n = (*b).left;
+            }
+            http_body_skip(b, n);
+            i += n;
+            continue;
+        }
+        case CHUNK_DATA_CR:
+            if (c == '\r') {
+                (*b).state = CHUNK_DATA_LF;
+            } else if (c == '\n') {
+                (*b).state = CHUNK_SIZE;
+            } else {
+                return http_err_chunk;
+            }
+            break;
+        case CHUNK_DATA_LF:
+            if (c != '\n') {
+                return http_err_chunk;
+            }
+            (*b).state = CHUNK_SIZE;
+            break;
+        case CHUNK_TRAILER:
+            if (c == '\r') {
+                (*b).state = CHUNK_END_LF;
+            } else if (c == '\n') {
+                (*b).state = CHUNK_DONE;
+            } else {
+                (*b).state = CHUNK_TRAILER_LINE;
+                (*b).line = 1;
+            }
+            break;
+        case CHUNK_TRAILER_LINE:
+            if (c == '\n') {
+                (*b).state = CHUNK_TRAILER;
+            } else if (++(*b).line > CHUNK_LINE_MAX) {
+                return http_err_chunk;
+            }
+            break;
+        case CHUNK_END_LF:
+            if (c != '\n') {
+                return http_err_chunk;
+            }
+            (*b).state = CHUNK_DONE;
+            break;
+        }
+        i += 1;
+    }
+    return i;
+}
+
+ssize_t http_body_scan(http_body* b, slice bytes) {
+    ssize_t n = bytes.len;
+    switch ((*b).framing) {
+    case HTTP_BODY_NONE:
+        n = 0;
+        break;
+    case HTTP_BODY_LENGTH:
+        if ((uint64_t)n > (*b).left) {
+            n = (*b).left;
+        }
+        (*b).left -= n;
+        break;
+    case HTTP_BODY_CHUNKED:
+        n = scan_chunked(b, bytes);
+        if (n < 0) {
+            return n;
+        }
+        break;
     }
-    return http_partial; // TODO should return http_partial?
+    (*b).extra += bytes.len - n;
+    return n;
+}
+
+int http_body_done(http_body const* b) {
+    switch ((*b).framing) {
+    case HTTP_BODY_NONE:
+        return 1;
+    case HTTP_BODY_LENGTH:
+        return (*b).left == 0;
+    case HTTP_BODY_CHUNKED:
+        return (*b).state == CHUNK_DONE;
+    }
+    return 0;
+}
+
+size_t http_body_opaque(http_body const* b, size_t max) {
+    uint64_t n = 0;
+    switch ((*b).framing) {
+    case HTTP_BODY_LENGTH:
+        n = (*b).left;
+        break;
+    case HTTP_BODY_CHUNKED:
+        n = (*b).state == CHUNK_DATA ? (*b).left : 0;
+        break;
+    case HTTP_BODY_CLOSE:
+        n = max;
+        break;
+    }
+    return n < max ? n : max;
+}
+
+void http_body_skip(http_body* b, size_t n) {
+    if ((*b).framing == HTTP_BODY_CLOSE) {
+        return;
+    }
+    (*b).left -= n;
+    if ((*b).framing == HTTP_BODY_CHUNKED && (*b).left == 0) {
+        (*b).state = CHUNK_DATA_CR;
+        (*b).digits = 0;
+    }
+}
+
+size_t http_body_want(http_body const* b, size_t max) {
+    if ((*b).framing == HTTP_BODY_CHUNKED) {
+        return http_body_done(b) ? 0 : max;
+    }
+    return http_body_opaque(b, max);
+}
 
+int http_body_eof(http_body const* b) {
+    if ((*b).framing == HTTP_BODY_CLOSE || http_body_done(b)) {
+        return 0;
+    }
+    return http_err_truncated;
 }
@@ -2,6 +2,7 @@
 #define HTTP_H
 #include "tprintf.h"
 #include "slice.h"
+#include "arena.h"
 #include <stdint.h>
 #include <sys/types.h>
 
@@ -17,6 +18,11 @@
 #define http_req_too_large  -10
 #define http_read_eof       -11
 #define http_res_too_large  -12
+#define http_read_err       -13
+#define http_err_status     -14
+#define http_err_chunk      -15
+#define http_err_truncated  -16
+#define http_read_timeout   -17
 
 typedef struct {
     slice name;
@@ -28,6 +34,15 @@ typedef struct {
     size_t cap;
 } http_headerbuf;
 
+// Where parsing stopped, so that a message arriving in pieces is
+// parsed line by line as the lines complete instead of from its start
+// after every read. Offsets are into the buffer passed to each parse.
+typedef struct {
+    size_t pos;     // start of the first line not parsed yet
+    size_t scan;    // end of the bytes already searched for its LF
+    int lines;      // lines parsed, the request or status line first
+} http_parser;
+
 typedef struct {
     slice buf;
     slice method;
@@ -38,6 +53,7 @@ typedef struct {
     slice version_slice;
     uint8_t version;
     http_headerbuf headerbuf;
+    http_parser parser;
 } http_request;
 
 typedef struct {
@@ -45,14 +61,110 @@ typedef struct {
     struct{uint8_t minor; slice slice;} version;
     struct{int code; slice phrase;} status;
     http_headerbuf headerbuf;
+    http_parser parser;
 } http_response;
 
+#define HTTP_BUF_INITIAL    4096
+#define HTTP_HEADERS_INITIAL 32
+
+// A message head being read, and room for its headers. Both come from
+// an arena and double when a head does not fit, the bytes up to limit.
+typedef struct {
+    arena* arena;
+    uint8_t* ptr;
+    size_t len;     // bytes allocated
+    size_t count;   // bytes filled
+    size_t limit;
+    http_header* headers;
+    size_t cap;
+} http_buf;
+
+int http_buf_init(http_buf* b, arena* a, size_t limit);
+// Makes room for more bytes once all of b is filled. Returns 0 if
+// there was room, 1 if b grew, which moves its bytes so that a parse
+// of them has to start over, and -1 if b is at its limit.
+int http_buf_reserve(http_buf* b);
+// Parse the head in b, growing b's headers as long as there are too
+// many of them for it. req and res are (re)initialized on growth.
+int http_buf_parse_request(http_buf* b, http_request* req);
+int http_buf_parse_response(http_buf* b, http_response* res);
+
 void http_request_init(http_request* req, http_header* headers, size_t cap);
 void http_response_init(http_response* res, http_headerbuf hdrbuf);
 
+// Both parsers resume where the previous call on the same message
+// stopped: buf must hold the same bytes as before, plus any new ones.
+// They return http_partial until the whole head is there.
 int http_parse_request(uint8_t const* buf, size_t len, http_request* r);
-int http_read_request(int fd, mutslice buf, http_request* req);
+// Some of b may already be filled (e.g. a pipelined request), on
+// return (*b).count is the number of bytes in it. req must have been
+// initialized with b's headers.
+// Gives up with http_read_timeout once timer_now() passes deadline,
+// unless it is 0.
+int http_read_request(int fd, http_buf* b, http_request* req, uint64_t deadline);
 int http_parse_response(slice buf, http_response* res);
-ssize_t http_read_response(int fd, mutslice buf, http_response* res);
+// Reads a response head into the empty b. Returns the number of bytes
+// read, which may include the start of the body. deadline is as for
+// http_read_request.
+ssize_t http_read_response(int fd, http_buf* b, http_response* res, uint64_t deadline);
+
+// Looks up the first header called name (case-insensitive).
+// Returns 1 and sets *value if found, 0 otherwise.
+int http_find_header(http_headerbuf headerbuf, char const* name, slice* value);
+// Returns 1 and sets *len if a valid Content-Length is present,
+// 0 if there is none and -1 if it is malformed.
+int http_content_length(http_headerbuf headerbuf, size_t* len);
+// Returns 1 if the Connection header lists token (case-insensitive).
+int http_connection_has(http_headerbuf headerbuf, char const* token);
+// Return 1 if the connection may carry another message after req/res.
+int http_request_keep_alive(http_request const* req);
+int http_response_keep_alive(http_response const* res);
+// Returns 1 if req announces a body (a malformed length counts as one).
+int http_request_has_body(http_request const* req);
+// Returns 1 if the last transfer coding of the message is chunked.
+int http_chunked(http_headerbuf headerbuf);
+// Returns the length of res's body: 0 if it cannot have one (HEAD,
+// 1xx, 204, 304), its Content-Length, or -1 if it is not known in
+// advance (chunked, or running until close).
+ssize_t http_response_body_length(http_response const* res, int head);
+
+// How a response body ends.
+enum {
+    HTTP_BODY_NONE,     // there is none
+    HTTP_BODY_LENGTH,   // after Content-Length bytes
+    HTTP_BODY_CHUNKED,  // after the last chunk and the trailers
+    HTTP_BODY_CLOSE,    // when the origin closes the connection
+};
+
+// Finds the end of a body as it is relayed, without buffering any of
+// it: chunk size and trailer lines are parsed a byte at a time across
+// reads, chunk data and Content-Length bodies are only counted.
+typedef struct {
+    int framing;
+    int state;      // of the chunk parser
+    uint64_t left;  // of the Content-Length body or the current chunk
+    int digits;     // of the chunk size read so far
+    size_t line;    // length of the extension or trailer line so far
+    size_t extra;   // bytes scanned past the end of the body
+} http_body;
+
+void http_body_init(http_body* b, http_response const* res, int head);
+// Scans bytes, the next ones of the body. Returns how many of them are
+// part of it (fewer than bytes.len only once it is complete, the rest
+// are added to (*b).extra), or http_err_chunk on malformed framing.
+ssize_t http_body_scan(http_body* b, slice bytes);
+int http_body_done(http_body const* b);
+// The number of next bytes, at most max, that are content and may be
+// relayed unscanned (e.g. spliced), then passed to http_body_skip.
+// 0 means the next bytes are framing that has to be scanned.
+size_t http_body_opaque(http_body const* b, size_t max);
+void http_body_skip(http_body* b, size_t n);
+// The most bytes, up to max, that may be read next without reading
+// past a body of known length. Chunked bodies are read max at a time,
+// only an origin sending more than its response can overshoot them.
+size_t http_body_want(http_body const* b, size_t max);
+// Returns 0 if an end of file after the bytes scanned so far ends the
+// body, http_err_truncated if the body is incomplete.
+int http_body_eof(http_body const* b);
 
 #endif
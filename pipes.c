@@ -0,0 +1,49 @@
+#define _GNU_SOURCE
+#include "pipes.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+static pthread_mutex_t pipes_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int pipes_idle[PIPES_MAX_IDLE][2];
+static int pipes_nidle;
+
+int pipes_take(int p[2]) {
+    pthread_mutex_lock(&pipes_mutex);
+    if (pipes_nidle > 0) {
+        pipes_nidle -= 1;
+        p[0] = pipes_idle[pipes_nidle][0];
+        p[1] = pipes_idle[pipes_nidle][1];
+        pthread_mutex_unlock(&pipes_mutex);
+        return 0;
+    }
+    pthread_mutex_unlock(&pipes_mutex);
+
+    if (pipe2(p, O_CLOEXEC) != 0) {
+        perror("pipe2");
+        return -1;
+    }
+    // Larger pipes move more per splice; the default is kept if
+    // this goes past /proc/sys/fs/pipe-max-size.
+    fcntl(p[1], F_SETPIPE_SZ, PIPES_SIZE);
+    return 0;
+}
+
+void pipes_put(int p[2]) {
+    pthread_mutex_lock(&pipes_mutex);
+    if (pipes_nidle < PIPES_MAX_IDLE) {
+        pipes_idle[pipes_nidle][0] = p[0];
+        pipes_idle[pipes_nidle][1] = p[1];
+        pipes_nidle += 1;
+        pthread_mutex_unlock(&pipes_mutex);
+        return;
+    }
+    pthread_mutex_unlock(&pipes_mutex);
+    pipes_close(p);
+}
+
+void pipes_close(int p[2]) {
+    close(p[0]);
+    close(p[1]);
+}
@@ -0,0 +1,20 @@
+#ifndef PIPES_H
+#define PIPES_H
+#include "tprintf.h"
+
+#define PIPES_SIZE      (1 << 18)
+#define PIPES_MAX_IDLE  256
+
+// Pipes for splicing bodies between sockets, reused across
+// connections instead of being created for each response.
+// Both ends are non-blocking only through SPLICE_F_NONBLOCK.
+
+// Fills p with an empty pipe. Returns -1 if none can be made.
+int pipes_take(int p[2]);
+// Hands back a pipe that has been drained, it is closed if the
+// pool is full.
+void pipes_put(int p[2]);
+// Closes a pipe that may still hold data.
+void pipes_close(int p[2]);
+
+#endif
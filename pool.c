@@ -0,0 +1,180 @@
+#include "pool.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#define POOL_BUCKETS 256
+
+typedef struct {
+    int fd;
+    time_t since;
+} pool_conn;
+
+// Idle connections of one origin, oldest first.
+typedef struct pool_host pool_host;
+struct pool_host {
+    char* key;
+    size_t keylen;
+    int nidle;
+    pool_conn* idle;
+    pool_host* next;
+};
+
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int pool_idle_per_host;
+static int pool_idle_total;
+static int pool_idle_timeout;
+static int pool_nidle;
+static pool_host* pool_buckets[POOL_BUCKETS];
+
+void pool_init(int idle_per_host, int idle_total, int idle_timeout) {
+    pool_idle_per_host = idle_per_host;
+    pool_idle_total = idle_total;
+    pool_idle_timeout = idle_timeout;
+}
+
+int pool_enabled(void) {
+    return pool_idle_per_host > 0;
+}
+
+int pool_key(mutslice buf, slice node, slice service, slice* key) {
+    size_t len = service.len + strlen("://") + node.len;
+    if (len > buf.len) {
+        return -1;
+    }
+    memcpy(buf.ptr, service.ptr, service.len);
+    memcpy(&buf.ptr[service.len], "://", 3);
+    memcpy(&buf.ptr[service.len + 3], node.ptr, node.len);
+    (*key).ptr = buf.ptr;
+    (*key).len = len;
+    return 0;
+}
+
+static
+unsigned bucket_of(slice key) {
+    unsigned h = 5381;
+    for (size_t i = 0; i < key.len; ++i) {
+        h = h*33 + key.ptr[i];
+    }
+    return h % POOL_BUCKETS;
+}
+
+// Must hold pool_mutex.
+static
+pool_host* find_host(slice key, int create) {
+    pool_host** slot = &pool_buckets[bucket_of(key)];
+    for (; *slot; slot = &(**slot).next) {
+        if ((**slot).keylen == key.len && memcmp((**slot).key, key.ptr, key.len) == 0) {
+            return *slot;
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+    pool_host* h = calloc(1, sizeof(pool_host));
+    if (!h) {
+        return NULL;
+    }
+    (*h).key = malloc(key.len);
+    (*h).idle = calloc(pool_idle_per_host, sizeof(pool_conn));
+    if (!(*h).key || !(*h).idle) {
+        free((*h).key);
+        free((*h).idle);
+        free(h);
+        return NULL;
+    }
+    memcpy((*h).key, key.ptr, key.len);
+    (*h).keylen = key.len;
+    *slot = h;
+    return h;
+}
+
+// Must hold pool_mutex. Closes connections idle for too long.
+static
+void expire_idle(pool_host* h, time_t now) {
+    int n = 0;
+    while (n < (*h).nidle && now - (*h).idle[n].since >= pool_idle_timeout) {
+        close((*h).idle[n].fd);
+        n += 1;
+    }
+    if (n > 0) {
+        memmove((*h).idle, &(*h).idle[n], ((*h).nidle - n) * sizeof(pool_conn));
+        (*h).nidle -= n;
+        pool_nidle -= n;
+    }
+}
+
+// An idle connection must have nothing to read: EOF means the origin
+// closed it, data means it sent something we never asked for.
+static
+int healthy(int fd) {
+    uint8_t b;
+    ssize_t n = recv(fd, &b, 1, MSG_PEEK|MSG_DONTWAIT);
+    return n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+int pool_take(slice key) {
+    if (!pool_enabled()) {
+        return -1;
+    }
+    time_t now = time(NULL);
+    int fd = -1;
+    pthread_mutex_lock(&pool_mutex);
+    pool_host* h = find_host(key, 0);
+    if (h) {
+        expire_idle(h, now);
+        // most recently used first, it is the least likely to be closed
+        while ((*h).nidle > 0) {
+            (*h).nidle -= 1;
+            pool_nidle -= 1;
+            int c = (*h).idle[(*h).nidle].fd;
+            if (healthy(c)) {
+                fd = c;
+                break;
+            }
+            close(c);
+        }
+    }
+    pthread_mutex_unlock(&pool_mutex);
+    if (fd != -1) {
+        tlog(LOG_DEBUG, "pool: reusing connection %d to [%.*s]\n", fd, (int)key.len, key.ptr);
+    }
+    return fd;
+}
+
+void pool_put(slice key, int fd) {
+    if (!pool_enabled()) {
+        close(fd);
+        return;
+    }
+    time_t now = time(NULL);
+    pthread_mutex_lock(&pool_mutex);
+    pool_host* h = find_host(key, 1);
+    if (h) {
+        expire_idle(h, now);
+    }
+    if (!h || pool_nidle >= pool_idle_total) {
+        pthread_mutex_unlock(&pool_mutex);
+        close(fd);
+        return;
+    }
+    if ((*h).nidle == pool_idle_per_host) {
+        // drop the oldest
+        close((*h).idle[0].fd);
+        memmove((*h).idle, &(*h).idle[1], ((*h).nidle - 1) * sizeof(pool_conn));
+        (*h).nidle -= 1;
+        pool_nidle -= 1;
+    }
+    (*h).idle[(*h).nidle].fd = fd;
+    (*h).idle[(*h).nidle].since = now;
+    (*h).nidle += 1;
+    pool_nidle += 1;
+    pthread_mutex_unlock(&pool_mutex);
+    tlog(LOG_DEBUG, "pool: keeping connection %d to [%.*s]\n", fd, (int)key.len, key.ptr);
+}
@@ -0,0 +1,25 @@
+#ifndef POOL_H
+#define POOL_H
+#include "tprintf.h"
+#include "slice.h"
+
+#define POOL_DEFAULT_IDLE_PER_HOST  8
+#define POOL_DEFAULT_IDLE_TOTAL     1024
+#define POOL_DEFAULT_IDLE_TIMEOUT   30
+
+// Idle persistent connections to origins, keyed on node:service.
+// idle_per_host of 0 disables pooling.
+void pool_init(int idle_per_host, int idle_total, int idle_timeout);
+int pool_enabled(void);
+
+// Writes the pool key for an origin into buf. Returns -1 if it does not fit.
+int pool_key(mutslice buf, slice node, slice service, slice* key);
+
+// Returns an idle connection that still looks healthy, or -1.
+// The descriptor's blocking mode is whatever its last user left.
+int pool_take(slice key);
+// Hands back a connection whose last response has been read in full.
+// It is closed instead if the limits are reached.
+void pool_put(slice key, int fd);
+
+#endif
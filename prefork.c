@@ -0,0 +1,170 @@
+#define _GNU_SOURCE
+#include "prefork.h"
+#include "tcp.h"
+#include "cache.h"
+#include "stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <netdb.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+
+typedef struct {
+    pid_t pid;
+    int ln;
+    uint64_t started;   // stats_now
+} prefork_worker;
+
+static prefork_worker* workers;
+static int nworkers;
+static volatile sig_atomic_t stopping;
+
+static
+void on_stop(int sig) {
+    stopping = sig;
+}
+
+// Forks worker i. Returns 1 in the worker, 0 in the supervisor.
+static
+int spawn(int i) {
+    // what the supervisor logged goes out once, not again from the worker
+    log_flush();
+    pid_t parent = getpid();
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return 0;
+    }
+    if (pid == 0) {
+        signal(SIGTERM, SIG_DFL);
+        signal(SIGINT, SIG_DFL);
+        // a worker goes with its supervisor
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        if (getppid() != parent) {
+            _exit(0);
+        }
+        log_init();
+        cache_attach(i);
+        for (int j = 0; j < nworkers; ++j) {
+            if (j != i) {
+                close(workers[j].ln);
+            }
+        }
+        return 1;
+    }
+    workers[i].pid = pid;
+    workers[i].started = stats_now();
+    tprintf("prefork: worker %d started (pid %d)\n", i, (int)pid);
+    return 0;
+}
+
+// Frees what a dead worker held and says why it died.
+static
+void bury(int i, int status) {
+    pid_t pid = workers[i].pid;
+    workers[i].pid = 0;
+    if (WIFSIGNALED(status)) {
+        tlog(stopping ? LOG_INFO : LOG_ERROR, "prefork: worker %d (pid %d) killed by signal %d\n",
+            i, (int)pid, WTERMSIG(status));
+    } else {
+        tlog(stopping ? LOG_INFO : LOG_ERROR, "prefork: worker %d (pid %d) exited with status %d\n",
+            i, (int)pid, WEXITSTATUS(status));
+    }
+    cache_reclaim(i, pid);
+    stats_reclaim(pid);
+}
+
+int prefork_run(char const* node, char const* service, int n, int* ln) {
+    workers = calloc(n, sizeof(prefork_worker));
+    if (!workers) {
+        perror("calloc");
+        return -1;
+    }
+    nworkers = n;
+    for (int i = 0; i < n; ++i) {
+        workers[i].ln = listen_tcp_reuseport(node, service);
+        if (workers[i].ln < 0) {
+            if (workers[i].ln != EAI_SYSTEM) {
+                tlog(LOG_ERROR, "ListenTCP: %s\n", gai_strerror(workers[i].ln));
+            } else {
+                perror("ListenTCP");
+            }
+            for (int j = 0; j < i; ++j) {
+                close(workers[j].ln);
+            }
+            free(workers);
+            return -1;
+        }
+    }
+
+    // no SA_RESTART, so that waitpid returns to check stopping
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_stop;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+
+    for (int i = 0; i < n; ++i) {
+        if (spawn(i)) {
+            *ln = workers[i].ln;
+            return i;
+        }
+    }
+
+    int alive = n;
+    int killed = 0;
+    while (alive > 0) {
+        if (stopping && !killed) {
+            killed = 1;
+            for (int i = 0; i < n; ++i) {
+                if (workers[i].pid > 0) {
+                    kill(workers[i].pid, SIGTERM);
+                }
+            }
+        }
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("waitpid");
+            break;
+        }
+        int i = 0;
+        while (i < n && workers[i].pid != pid) {
+            i += 1;
+        }
+        if (i == n) {
+            continue;
+        }
+        bury(i, status);
+        alive -= 1;
+        if (stopping) {
+            continue;
+        }
+        // one that dies as it starts would otherwise be restarted in a loop
+        if (stats_now() - workers[i].started < PREFORK_RESPAWN_MS * 1000000ULL) {
+            struct timespec pause = {PREFORK_RESPAWN_MS / 1000, PREFORK_RESPAWN_MS % 1000 * 1000000};
+            nanosleep(&pause, NULL);
+        }
+        if (stopping) {
+            continue;
+        }
+        if (spawn(i)) {
+            *ln = workers[i].ln;
+            return i;
+        }
+        if (workers[i].pid > 0) {
+            alive += 1;
+        }
+    }
+    log_flush();
+    exit(0);
+}
@@ -0,0 +1,17 @@
+#ifndef PREFORK_H
+#define PREFORK_H
+#include "tprintf.h"
+
+#define PREFORK_RESPAWN_MS  1000    // between restarts of a worker that keeps dying
+
+// Binds a SO_REUSEPORT listener on node:service for each of n worker
+// processes and forks them. Returns in each worker, with its index and
+// *ln its listener. The calling process stays behind to supervise them
+// and does not return: it restarts a worker that dies, once it dropped
+// what the worker held of the shared cache (cache_reclaim), and stops
+// them all and exits on SIGTERM or SIGINT. The listeners outlive the
+// workers, so connections queued on one wait for its next worker.
+// Returns -1 if the listeners cannot be bound.
+int prefork_run(char const* node, char const* service, int n, int* ln);
+
+#endif
@@ -1,71 +1,89 @@
+#define _GNU_SOURCE
 #include "proxy.h"
 #include "http.h"
 #include "url.h"
 #include "tcp.h"
 #include "slice.h"
-#include <pthread.h>
+#include "cache.h"
+#include "diskcache.h"
+#include "pool.h"
+#include "pipes.h"
+#include "dns.h"
+#include "stats.h"
+#include "arena.h"
+#include "flight.h"
+#include "timer.h"
+#include "admit.h"
+#include "revalidate.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <strings.h>
 #include <stdint.h>
+#include <stdarg.h>
 #include <assert.h>
 #include <errno.h>
 #include <netdb.h>
+#include <time.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 
-#define BUFLEN          1024
-#define TRANSFER_BUFLEN 1048576
-#define HTTP_VERSION    0
+#define TRANSFER_BUFLEN     65536
+#define SPLICE_UNSUPPORTED  -2
+// a read or write of the body made no progress within proxy_stall_ms
+#define TRANSFER_STALLED    -3
+#define FOLLOW_RETRY        -2
+#define FOLLOW_PASS         -3
+
+size_t proxy_head_limit = PROXY_DEFAULT_HEAD_LIMIT;
+int proxy_header_ms = PROXY_DEFAULT_HEADER_MS;
+int proxy_idle_ms = PROXY_DEFAULT_IDLE_MS;
+int proxy_first_byte_ms = PROXY_DEFAULT_FIRST_BYTE_MS;
+int proxy_stall_ms = PROXY_DEFAULT_STALL_MS;
 
 void print_http_request(http_request const* req) {
-    tprintf("http_request {\n");
-    tprintf("    method: [%.*s]\n", (int)(*req).method.len, (*req).method.ptr);
-    tprintf("    url: [%.*s]\n", (int)(*req).url.len, (*req).url.ptr);
-    tprintf("    node: [%.*s]\n", (int)(*req).node.len, (*req).node.ptr);
-    tprintf("    service: [%.*s]\n", (int)(*req).service.len, (*req).service.ptr);
-    tprintf("    path: [%.*s]\n", (int)(*req).path.len, (*req).path.ptr);
-    tprintf("    version: HTTP/1.%d\n", (*req).version);
+    if (log_level < LOG_DEBUG) {
+        return;
+    }
+    tlog(LOG_DEBUG, "http_request {\n");
+    tlog(LOG_DEBUG, "    method: [%.*s]\n", (int)(*req).method.len, (*req).method.ptr);
+    tlog(LOG_DEBUG, "    url: [%.*s]\n", (int)(*req).url.len, (*req).url.ptr);
+    tlog(LOG_DEBUG, "    node: [%.*s]\n", (int)(*req).node.len, (*req).node.ptr);
+    tlog(LOG_DEBUG, "    service: [%.*s]\n", (int)(*req).service.len, (*req).service.ptr);
+    tlog(LOG_DEBUG, "    path: [%.*s]\n", (int)(*req).path.len, (*req).path.ptr);
+    tlog(LOG_DEBUG, "    version: HTTP/1.%d\n", (*req).version);
     for (int i = 0; i < (*req).headerbuf.cap; ++i) {
-        tprintf("    header: {[%.*s]: [%.*s]}\n",
+        tlog(LOG_DEBUG, "    header: {[%.*s]: [%.*s]}\n",
             (int)(*req).headerbuf.ptr[i].name.len,
             (*req).headerbuf.ptr[i].name.ptr,
             (int)(*req).headerbuf.ptr[i].value.len,
             (*req).headerbuf.ptr[i].value.ptr);
     }
-    tprintf("}\n");
+    tlog(LOG_DEBUG, "}\n");
 }
 
 void print_http_response(http_response const* res) {
-    tprintf("http_response {\n");
-    tprintf("    version: [%.*s]\n", (int)(*res).version.slice.len,
-                                    (*res).version.slice.ptr);
-    tprintf("    status: %d, phrase: [%.*s]\n",
+    if (log_level < LOG_DEBUG) {
+        return;
+    }
+    tlog(LOG_DEBUG, "http_response {\n");
+    tlog(LOG_DEBUG, "    version: [%.*s]\n", (int)(*res).version.slice.len,
+                                            (*res).version.slice.ptr);
+    tlog(LOG_DEBUG, "    status: %d, phrase: [%.*s]\n",
         (*res).status.code, (int)(*res).status.phrase.len,
         (*res).status.phrase.ptr);
     for (int i = 0; i < (*res).headerbuf.cap; ++i) {
-        tprintf("    header: {[%.*s]: [%.*s]}\n",
+        tlog(LOG_DEBUG, "    header: {[%.*s]: [%.*s]}\n",
             (int)(*res).headerbuf.ptr[i].name.len,
             (*res).headerbuf.ptr[i].name.ptr,
             (int)(*res).headerbuf.ptr[i].value.len,
             (*res).headerbuf.ptr[i].value.ptr);
     }
-    tprintf("}\n");
-}
-
-void set_close(mutslice value) {
-    memset(value.ptr, ' ', value.len);
-    char const* close = "close";
-    size_t closelen = strlen(close);
-    memcpy(value.ptr + value.len - closelen, close, closelen);
-}
-
-void change_keep_alive_to_close(http_headerbuf headerbuf) {
-    for (size_t i = 0; i < headerbuf.cap; ++i) {
-        http_header* h = &headerbuf.ptr[i];
-        if (strncmp((*h).name.ptr, "Connection", (*h).name.len) == 0) {
-            set_close((mutslice){(uint8_t*)(*h).value.ptr, (*h).value.len});
-        }
-    }
+    tlog(LOG_DEBUG, "}\n");
 }
 
 static
@@ -74,31 +92,78 @@ int write_all(int fd, slice bytes) {
     while (total < bytes.len) {
         ssize_t n = write(fd, &bytes.ptr[total], bytes.len - total);
         if (n == -1) {
-            perror("write");
-            if (errno != EINTR) {
-                return -1;
+            if (errno == EINTR) {
+                continue;
             }
-            continue;
+            // perror may change errno, a timed out write is left for
+            // the caller to report
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("write");
+            }
+            return -1;
         }
         total += n;
     }
     return 0;
 }
 
+// Writes all of iov, which it consumes.
 static
-int send_invalid_url(int client, slice url) {
-    uint8_t response[1024];
-    sprintf(response,
-        "HTTP/1.%d 400 Bad Request\r\n"
+int writev_all(int fd, struct iovec* iov, int iovcnt) {
+    while (iovcnt > 0) {
+        ssize_t n = writev(fd, iov, iovcnt);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // perror may change errno, a timed out write is left for
+            // the caller to report
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("writev");
+            }
+            return -1;
+        }
+        while (iovcnt > 0 && (size_t)n >= (*iov).iov_len) {
+            n -= (*iov).iov_len;
+            iov += 1;
+            iovcnt -= 1;
+        }
+        if (iovcnt > 0) {
+            (*iov).iov_base = (uint8_t*)(*iov).iov_base + n;
+            (*iov).iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+size_t proxy_error_page(mutslice buf, char const* status, char const* fmt, ...) {
+    int n = snprintf((char*)buf.ptr, buf.len,
+        "HTTP/1.%d %s\r\n"
+        "Connection: close\r\n"
         "\r\n"
         "<html>"
-            "<body>"
-                "400 Bad Request Reason: Invalid URL: %.*s"
-            "</body>"
-        "</html>",
-        HTTP_VERSION, (int)(url.len), url.ptr);
-    slice s = {response, strlen(response)};
-    int err = write_all(client, s);
+            "<body>",
+        HTTP_VERSION, status);
+    va_list ap;
+    va_start(ap, fmt);
+    if (n >= 0 && (size_t)n < buf.len) {
+        n += vsnprintf((char*)&buf.ptr[n], buf.len - n, fmt, ap);
+    }
+    va_end(ap);
+    if (n >= 0 && (size_t)n < buf.len) {
+        n += snprintf((char*)&buf.ptr[n], buf.len - n,
+                "</body>"
+            "</html>");
+    }
+    if (n < 0) {
+        return 0;
+    }
+    return (size_t)n < buf.len ? (size_t)n : buf.len - 1;
+}
+
+static
+int send_page(int client, slice page) {
+    int err = write_all(client, page);
     if (err != 0) {
         perror("write_all");
         return -1;
@@ -106,230 +171,942 @@ int send_invalid_url(int client, slice url) {
     return 0;
 }
 
+static
+int send_invalid_url(int client, slice url) {
+    uint8_t response[1024];
+    size_t len = proxy_error_page((mutslice){response, sizeof(response)},
+        "400 Bad Request", "400 Bad Request Reason: Invalid URL: %.*s",
+        (int)(url.len), url.ptr);
+    return send_page(client, (slice){response, len});
+}
+
 static
 int send_invalid_method(int client, slice method) {
     uint8_t response[1024];
-    sprintf(response,
-        "HTTP/1.%d 400 Bad Request\r\n"
-        "\r\n"
-        "<html>"
-            "<body>"
-                "400 Bad Request Reason: Invalid Method: %.*s"
-            "</body>"
-        "</html>",
-        HTTP_VERSION, (int)(method.len), method.ptr);
-    slice s = {response, strlen(response)};
-    int err = write_all(client, s);
-    if (err != 0) {
-        perror("write_all");
-        return -1;
-    }
-    return 0;
+    size_t len = proxy_error_page((mutslice){response, sizeof(response)},
+        "400 Bad Request", "400 Bad Request Reason: Invalid Method: %.*s",
+        (int)(method.len), method.ptr);
+    return send_page(client, (slice){response, len});
 }
 
 static
 int send_invalid_version(int client, slice version) {
     uint8_t response[1024];
-    sprintf(response,
-        "HTTP/1.%d 400 Bad Request\r\n"
-        "\r\n"
-        "<html>"
-            "<body>"
-                "400 Bad Request Reason: Invalid Version: %.*s"
-            "</body>"
-        "</html>",
-        HTTP_VERSION, (int)(version.len), version.ptr);
-    slice s = {response, strlen(response)};
-    int err = write_all(client, s);
-    if (err != 0) {
-        perror("write_all");
-        return -1;
-    }
-    return 0;
+    size_t len = proxy_error_page((mutslice){response, sizeof(response)},
+        "400 Bad Request", "400 Bad Request Reason: Invalid Version: %.*s",
+        (int)(version.len), version.ptr);
+    return send_page(client, (slice){response, len});
 }
 
 static
 int send_unsupported_version(int client, uint8_t version) {
     uint8_t response[1024];
-    sprintf(response,
-        "HTTP/1.%d 501 Not Implemented\r\n"
-        "\r\n"
-        "<html>"
-            "<body>"
-                "501 Not Implemented HTTP Version: HTTP/1.%d"
-            "</body>"
-        "</html>",
-        HTTP_VERSION, version);
-    slice s = {response, strlen(response)};
-    int err = write_all(client, s);
-    if (err != 0) {
-        perror("write_all");
-        return -1;
-    }
-    return 0;
+    size_t len = proxy_error_page((mutslice){response, sizeof(response)},
+        "501 Not Implemented", "501 Not Implemented HTTP Version: HTTP/1.%d",
+        version);
+    return send_page(client, (slice){response, len});
+}
+
+static
+int send_too_large(int client) {
+    uint8_t response[1024];
+    size_t len = proxy_error_page((mutslice){response, sizeof(response)},
+        "431 Request Header Fields Too Large",
+        "431 Request Header Fields Too Large: over %zu bytes", proxy_head_limit);
+    return send_page(client, (slice){response, len});
+}
+
+static
+int send_bad_gateway(int client, int err) {
+    uint8_t response[1024];
+    size_t len = proxy_error_page((mutslice){response, sizeof(response)},
+        "502 Bad Gateway", "502 Bad Gateway: invalid response from origin (%d)", err);
+    return send_page(client, (slice){response, len});
+}
+
+static
+int send_request_timeout(int client) {
+    uint8_t response[1024];
+    size_t len = proxy_error_page((mutslice){response, sizeof(response)},
+        "408 Request Timeout", "408 Request Timeout: no request within %d ms", proxy_header_ms);
+    return send_page(client, (slice){response, len});
+}
+
+static
+int send_gateway_timeout(int client, char const* what, slice node, slice service) {
+    uint8_t response[1024];
+    size_t len = proxy_error_page((mutslice){response, sizeof(response)},
+        "504 Gateway Timeout", "504 Gateway Timeout: %s %.*s://%.*s", what,
+        (int)(service.len), service.ptr,
+        (int)(node.len), node.ptr);
+    return send_page(client, (slice){response, len});
 }
 
 static
 int send_not_found(int client, slice node, slice service, slice reason) {
     uint8_t response[1024];
-    sprintf(response,
-        "HTTP/1.%d 404 Not Found\r\n"
-        "\r\n"
-        "<html>"
-            "<body>"
-                "404 Not Found: %.*s: %.*s://%.*s"
-            "</body>"
-        "</html>",
-        HTTP_VERSION,
+    size_t len = proxy_error_page((mutslice){response, sizeof(response)},
+        "404 Not Found", "404 Not Found: %.*s: %.*s://%.*s",
         (int)(reason.len), reason.ptr,
         (int)(service.len), service.ptr,
         (int)(node.len), node.ptr);
-    slice s = {response, strlen(response)};
-    int err = write_all(client, s);
-    if (err != 0) {
-        perror("write_all");
+    return send_page(client, (slice){response, len});
+}
+
+static
+int is_hop_by_hop(slice name) {
+    char const* hop[] = {"Connection", "Proxy-Connection", "Keep-Alive"};
+    for (size_t i = 0; i < sizeof(hop)/sizeof(hop[0]); ++i) {
+        size_t n = strlen(hop[i]);
+        if (name.len == n && strncasecmp((char const*)name.ptr, hop[i], n) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static
+int append(mutslice out, size_t* pos, slice bytes) {
+    if (*pos + bytes.len > out.len) {
         return -1;
     }
+    memcpy(&out.ptr[*pos], bytes.ptr, bytes.len);
+    *pos += bytes.len;
     return 0;
+}
+
+#define LIT(s) ((slice){(uint8_t const*)(s), sizeof(s) - 1})
+
+size_t proxy_upstream_request(http_request const* req, int keep, mutslice out) {
+    size_t pos = 0;
+    int err = append(out, &pos, (*req).method)
+        | append(out, &pos, LIT(" "))
+        | append(out, &pos, (*req).url)
+        | append(out, &pos, LIT(" HTTP/1.0\r\n"));
+    for (size_t i = 0; i < (*req).headerbuf.cap; ++i) {
+        http_header const* h = &(*req).headerbuf.ptr[i];
+        if (is_hop_by_hop((*h).name)) {
+            continue;
+        }
+        err |= append(out, &pos, (*h).name)
+            | append(out, &pos, LIT(": "))
+            | append(out, &pos, (*h).value)
+            | append(out, &pos, LIT("\r\n"));
+    }
+    if (keep) {
+        err |= append(out, &pos, LIT("Connection: keep-alive\r\n\r\n"));
+    } else {
+        err |= append(out, &pos, LIT("Connection: close\r\n\r\n"));
+    }
+    return err != 0 ? 0 : pos;
+}
 
+// A header line grows by at most two bytes, ":" -> ": " and "\n" -> "\r\n".
+size_t proxy_upstream_request_max(http_request const* req) {
+    return (*req).buf.len + 2*(*req).headerbuf.cap + LIT("Connection: keep-alive\r\n\r\n").len + 16;
+}
+
+size_t proxy_response_head_max(http_response const* res) {
+    return (*res).buf.len + 2*(*res).headerbuf.cap + 16;
+}
+
+size_t proxy_response_head(http_response const* res, mutslice out) {
+    char status[16];
+    snprintf(status, sizeof(status), "HTTP/1.%d %03d ", HTTP_VERSION, (*res).status.code);
+    size_t pos = 0;
+    int err = append(out, &pos, (slice){(uint8_t const*)status, strlen(status)})
+        | append(out, &pos, (*res).status.phrase)
+        | append(out, &pos, LIT("\r\n"));
+    for (size_t i = 0; i < (*res).headerbuf.cap; ++i) {
+        http_header const* h = &(*res).headerbuf.ptr[i];
+        if (is_hop_by_hop((*h).name)) {
+            continue;
+        }
+        err |= append(out, &pos, (*h).name)
+            | append(out, &pos, LIT(": "))
+            | append(out, &pos, (*h).value)
+            | append(out, &pos, LIT("\r\n"));
+    }
+    return err != 0 ? 0 : pos;
+}
+
+slice proxy_connection_line(int keep) {
+    if (keep) {
+        return LIT("Connection: keep-alive\r\n\r\n");
+    }
+    return LIT("Connection: close\r\n\r\n");
+}
+
+int proxy_cacheable(http_request const* req, mutslice keybuf, slice* key) {
+    return (cache_enabled() || diskcache_enabled())
+        && cache_request_cacheable(req)
+        && cache_key(keybuf, (*req).node, (*req).service, (*req).path, key) == 0;
+}
+
+// Small objects go to memory, large or unknown length ones to disk.
+void proxy_fill_begin(slice key, http_response const* res, slice head, slice rest,
+                      cache_fill* fill, diskcache_fill* dfill) {
+    time_t expires = cache_response_expires(res, time(NULL));
+    if (expires == 0) {
+        return;
+    }
+    size_t clen = 0;
+    int small = http_content_length((*res).headerbuf, &clen) == 1
+        && head.len + clen <= cache_max_object();
+    if (small || !diskcache_enabled()) {
+        if (cache_fill_begin(fill, key, head, res, expires) == 0) {
+            cache_fill_append(fill, rest);
+        }
+    } else if (diskcache_fill_begin(dfill, key, head, res, expires) == 0) {
+        diskcache_fill_append(dfill, rest);
+    }
 }
 
-uint8_t transfer_buf[TRANSFER_BUFLEN];
 static
-int transfer_body(int src, int dst) {
-    while (1) {
-        ssize_t n = read(src, transfer_buf, TRANSFER_BUFLEN);
+int send_cached(int client, cache_entry const* e, int keep) {
+    slice conn = proxy_connection_line(keep);
+    struct iovec iov[3] = {
+        {(*e).data, (*e).headlen},
+        {(void*)conn.ptr, conn.len},
+        {&(*e).data[(*e).headlen], (*e).len - (*e).headlen},
+    };
+    return writev_all(client, iov, 3);
+}
+
+// Answers a request whose origin failed with the stale response for
+// key, if it is within its stale-if-error window. Returns 1 if it did.
+static
+int send_stale(int client, slice key) {
+    cache_entry* e = key.len > 0 ? cache_lookup_if_error(key) : NULL;
+    if (!e) {
+        return 0;
+    }
+    tlog(LOG_INFO, "origin failed, serving stale [%.*s]\n", (int)key.len, key.ptr);
+    stats_count(STAT_CACHE_STALE);
+    if (send_cached(client, e, 0) != 0) {
+        perror("send_cached(client)");
+    }
+    cache_release(e);
+    return 1;
+}
+
+// Sends the head from user space, as the Connection header has to be
+// spliced into it, and the body with sendfile.
+static
+int send_cached_file(int client, diskcache_hit hit, int keep) {
+    slice conn = proxy_connection_line(keep);
+    uint8_t* head = malloc(hit.headlen + conn.len);
+    if (!head) {
+        return -1;
+    }
+    int err = pread(hit.fd, head, hit.headlen, hit.offset) == (ssize_t)hit.headlen ? 0 : -1;
+    memcpy(&head[hit.headlen], conn.ptr, conn.len);
+    size_t sent = 0;
+    while (err == 0 && sent < hit.headlen + conn.len) {
+        ssize_t n = send(client, &head[sent], hit.headlen + conn.len - sent, MSG_MORE);
         if (n == -1) {
-            perror("read");
-            if (errno != EINTR) {
-                return -1;
+            if (errno == EINTR) {
+                continue;
             }
-            continue;
+            perror("send(head)");
+            err = -1;
+            break;
+        }
+        sent += n;
+    }
+    free(head);
+
+    off_t off = hit.offset + hit.headlen;
+    size_t left = hit.len - hit.headlen;
+    while (err == 0 && left > 0) {
+        ssize_t n = sendfile(client, hit.fd, &off, left);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("sendfile");
+            return -1;
         }
         if (n == 0) {
-            tprintf("transfer_body: read=0, returning\n");
-            break;
+            tlog(LOG_WARN, "sendfile: cached object truncated\n");
+            return -1;
         }
+        left -= n;
+    }
+    return err;
+}
 
-        int err = write_all(dst, (slice){transfer_buf, n});
-        if (err != 0) {
-            perror("write_all(dst, (slice){buf, n})");
+// Moves exactly n bytes out of the pipe in. SPLICE_F_MORE in flags
+// corks the socket out, it must not be set on the last bytes.
+static
+int splice_all(int in, int out, loff_t* off, size_t n, unsigned flags) {
+    while (n > 0) {
+        ssize_t m = splice(in, NULL, out, off, n, SPLICE_F_MOVE|flags);
+        if (m == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
             return -1;
         }
+        if (m == 0) {
+            return -1;
+        }
+        n -= m;
+    }
+    return 0;
+}
+
+// Reads the next bytes of body into buf, scans them and relays the
+// ones that are part of it. Returns the number relayed, 0 at end of
+// file, TRANSFER_STALLED or -1.
+static
+ssize_t relay_scanned(int src, int dst, http_body* body, mutslice buf,
+                      cache_fill* fill, diskcache_fill* dfill, flight* f) {
+    ssize_t n;
+    do {
+        n = read(src, buf.ptr, http_body_want(body, buf.len));
+    } while (n == -1 && errno == EINTR);
+    if (n <= 0) {
+        if (n == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return TRANSFER_STALLED;
+            }
+            perror("read");
+        }
+        return n;
+    }
+    ssize_t m = http_body_scan(body, (slice){buf.ptr, n});
+    if (m < 0) {
+        tlog(LOG_WARN, "transfer_body: invalid chunk framing\n");
+        stats_error(m);
+        return -1;
+    }
+    if (write_all(dst, (slice){buf.ptr, m}) != 0) {
+        return errno == EAGAIN || errno == EWOULDBLOCK ? TRANSFER_STALLED : -1;
     }
+    if ((*fill).entry) {
+        cache_fill_append(fill, (slice){buf.ptr, m});
+    }
+    if ((*dfill).fd != -1) {
+        diskcache_fill_append(dfill, (slice){buf.ptr, m});
+    }
+    if (f) {
+        flight_append(f, (slice){buf.ptr, m});
+    }
+    return m;
+}
 
+// Relays the end of file that ended body, or the truncated body.
+static
+int body_eof(http_body const* body) {
+    tlog(LOG_DEBUG, "transfer_body: read=0, returning\n");
+    int err = http_body_eof(body);
+    if (err != 0) {
+        tlog(LOG_WARN, "transfer_body: origin closed before the end of the body\n");
+        stats_error(err);
+        return -1;
+    }
     return 0;
 }
 
-#define HEADERBUF_CAP 64
-void* handle_client(void* ptr) {
-    handle_client_args* args = (handle_client_args*)(ptr);
-    int client = args->client;
-    free(args);
+// Streams the body src -> pipe a -> dst with splice, so no byte passes
+// through user space, except for chunk framing, which is read into buf
+// to be parsed. With a disk fill, each spliced piece is duplicated into
+// pipe b with tee() and from there into the cache object. Returns
+// SPLICE_UNSUPPORTED if splice cannot be used on these descriptors
+// and nothing was moved yet.
+static
+int transfer_body_splice(int src, int dst, http_body* body, mutslice buf,
+                         diskcache_fill* dfill, size_t* sent) {
+    int a[2];
+    int b[2] = {-1, -1};
+    if (pipes_take(a) != 0) {
+        return SPLICE_UNSUPPORTED;
+    }
+    if ((*dfill).fd != -1 && pipes_take(b) != 0) {
+        pipes_put(a);
+        return SPLICE_UNSUPPORTED;
+    }
 
-    http_header headers[HEADERBUF_CAP];
-    uint8_t buf[BUFLEN] = {0};
+    int err = 0;
+    int moved = 0;
+    // set once a pipe may have been left holding data
+    int dirty_a = 0;
+    int dirty_b = 0;
+    cache_fill nofill = {0};
+    while (!http_body_done(body)) {
+        size_t want = http_body_opaque(body, PIPES_SIZE);
+        if (want == 0) {
+            ssize_t m = relay_scanned(src, dst, body, buf, &nofill, dfill, NULL);
+            if (m <= 0) {
+                err = m == 0 ? body_eof(body) : (int)m;
+                break;
+            }
+            moved = 1;
+            *sent += m;
+            continue;
+        }
+        ssize_t n = splice(src, NULL, a[1], NULL, want, SPLICE_F_MOVE|SPLICE_F_MORE);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (!moved && errno == EINVAL) {
+                err = SPLICE_UNSUPPORTED;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                err = TRANSFER_STALLED;
+            } else {
+                perror("splice(src)");
+                err = -1;
+            }
+            break;
+        }
+        if (n == 0) {
+            err = body_eof(body);
+            break;
+        }
+        moved = 1;
+        http_body_skip(body, n);
 
-    http_request req;
-    http_request_init(&req, headers, 64);
-    int err = http_read_request(client, (mutslice){buf, BUFLEN}, &req);
-    switch (err) {
-    case 0:
-        break;
-    case http_partial:
-        tprintf("only partial request received, then eof\n");
-        goto done;
-    case http_err_method:
-        tprintf("invalid method: [%.*s]\n", (int)(req.method.len), req.method.ptr);
-        send_invalid_method(client, req.method);
-        goto done;
-    case http_err_url:
-        tprintf("invalid url: [%.*s]\n", (int)(req.url.len), req.url.ptr);
-        send_invalid_url(client, req.url);
-        goto done;
-    case http_err_version:
-        tprintf("invalid version: [%.*s]\n", (int)(req.version_slice.len), req.version_slice.ptr);
-        send_invalid_version(client, req.version_slice);
-        goto done;
-    }
-
-    if (req.version > HTTP_VERSION) {
-        tprintf("expected HTTP version %d or lower, got %d\n", HTTP_VERSION, req.version);
-        send_unsupported_version(client, req.version);
-        goto done;
+        if ((*dfill).fd != -1) {
+            // b is empty and as large as a, so tee duplicates all n
+            ssize_t t = tee(a[0], b[1], n, 0);
+            loff_t off = (*dfill).off;
+            if (t != n || splice_all(b[0], (*dfill).fd, &off, t, 0) != 0) {
+                perror("tee(body)");
+                diskcache_fill_abort(dfill);
+                dirty_b = 1;
+            } else {
+                diskcache_fill_spliced(dfill, t);
+            }
+        }
+
+        unsigned more = !http_body_done(body) ? SPLICE_F_MORE : 0;
+        if (splice_all(a[0], dst, NULL, n, more) != 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                err = TRANSFER_STALLED;
+            } else {
+                perror("splice(dst)");
+                err = -1;
+            }
+            dirty_a = 1;
+            break;
+        }
+        *sent += n;
     }
 
-    // valid http request received
-    print_http_request(&req);
-    change_keep_alive_to_close(req.headerbuf);
+    if (dirty_a) {
+        pipes_close(a);
+    } else {
+        pipes_put(a);
+    }
+    if (b[0] != -1) {
+        if (dirty_b) {
+            pipes_close(b);
+        } else {
+            pipes_put(b);
+        }
+    }
+    return err;
+}
 
-    // check if requested url in cache?
+// Relays the rest of body, adding the bytes relayed to *sent. Bodies
+// headed for the memory cache or published to a flight are copied
+// through user space, all others are spliced. Returns 0,
+// TRANSFER_STALLED or -1.
+static
+int transfer_body(int src, int dst, http_body* body, cache_fill* fill, diskcache_fill* dfill,
+                  flight* f, size_t* sent) {
+    uint8_t buf[TRANSFER_BUFLEN];
+    if (!(*fill).entry && !(f && flight_publishing(f))) {
+        int err = transfer_body_splice(src, dst, body, (mutslice){buf, TRANSFER_BUFLEN},
+                                       dfill, sent);
+        if (err != SPLICE_UNSUPPORTED) {
+            return err;
+        }
+    }
 
-    // if not in cache, try connect to host
-    char* node_cstring = strndup(req.node.ptr, req.node.len);
-    char* service_cstring = strndup(req.service.ptr, req.service.len);
-    int host = dial_tcp(node_cstring, service_cstring);
-    if (host < 0) {
-        char const* reason = NULL;
-        if (host != EAI_SYSTEM) {
-            reason = gai_strerror(host);
+    while (!http_body_done(body)) {
+        ssize_t n = relay_scanned(src, dst, body, (mutslice){buf, TRANSFER_BUFLEN}, fill, dfill, f);
+        if (n < 0) {
+            return (int)n;
+        }
+        if (n == 0) {
+            return body_eof(body);
+        }
+        *sent += n;
+    }
+
+    return 0;
+}
+
+// Dials the origin of req, answering the client with the stale
+// response for key if there is one, or with 404 if that fails, or 504
+// if it timed out.
+static
+int dial_origin(int client, http_request const* req, slice key) {
+    dns_result addrs;
+    uint64_t start = stats_now();
+    dns_resolve((*req).node, (*req).service, &addrs);
+    stats_since(STAT_DNS, start);
+    int host = -1;
+    int timedout = 0;
+    char const* reason = NULL;
+    if (addrs.err != 0) {
+        reason = gai_strerror(addrs.err);
+    } else {
+        start = stats_now();
+        host = dial_tcp_addrs(&addrs);
+        if (host < 0) {
+            timedout = errno == ETIMEDOUT;
+            reason = strerror(errno);
         } else {
-            reason = strerror(host);
+            stats_since(STAT_CONNECT, start);
         }
-        tprintf("unable to connect to %.*s://%.*s: %s\n",
-            (int)(req.service.len), req.service.ptr,
-            (int)(req.node.len), req.node.ptr,
+    }
+    if (host < 0) {
+        tlog(LOG_WARN, "unable to connect to %.*s://%.*s: %s\n",
+            (int)((*req).service.len), (*req).service.ptr,
+            (int)((*req).node.len), (*req).node.ptr,
             reason);
-        send_not_found(client, req.node, req.service, (slice){reason, strlen(reason)});
-        free(node_cstring);
-        free(service_cstring);
-        goto done;
+        if (timedout) {
+            stats_count(STAT_TIMEOUT_CONNECT);
+        }
+        if (send_stale(client, key)) {
+            return -1;
+        }
+        if (timedout) {
+            send_gateway_timeout(client, "connecting to", (*req).node, (*req).service);
+        } else {
+            send_not_found(client, (*req).node, (*req).service,
+                           (slice){(uint8_t const*)reason, strlen(reason)});
+        }
+        return -1;
+    }
+    // the response is waited for with a deadline of its own
+    set_io_timeout(host, proxy_stall_ms);
+    return host;
+}
+
+// Streams the response another client's request for the same object
+// is fetching. Returns 1 if the client connection may carry another
+// request, FOLLOW_RETRY if the fetch failed before any of it was sent,
+// or FOLLOW_PASS if the response may not be shared, so this request
+// has to be fetched on its own.
+static
+int follow_flight(int client, flight* f, int keep) {
+    flight_reader r;
+    flight_reader_init(&r, f);
+    uint64_t start = stats_now();
+    size_t sent = 0;
+    while (1) {
+        slice bytes;
+        int state = flight_peek(&r, &bytes);
+        if (bytes.len == 0) {
+            if (state == FLIGHT_DONE) {
+                break;
+            }
+            if (state == FLIGHT_PASS) {
+                return FOLLOW_PASS;
+            }
+            if (state == FLIGHT_FAILED) {
+                return r.pos == 0 ? FOLLOW_RETRY : 0;
+            }
+            flight_wait(&r);
+            continue;
+        }
+        if (r.pos == 0) {
+            stats_count(STAT_CACHE_COLLAPSED);
+            stats_since(STAT_FIRST_BYTE, start);
+            start = stats_now();
+        }
+        struct iovec iov[2] = {{(void*)bytes.ptr, bytes.len}, {NULL, 0}};
+        int iovcnt = 1;
+        if (r.pos + bytes.len == flight_headlen(f)) {
+            // the body length is known once the head is
+            keep = keep && flight_framed(f);
+            slice conn = proxy_connection_line(keep);
+            iov[1] = (struct iovec){(void*)conn.ptr, conn.len};
+            iovcnt = 2;
+        } else if (r.pos >= flight_headlen(f)) {
+            sent += bytes.len;
+        }
+        if (writev_all(client, iov, iovcnt) != 0) {
+            perror("writev_all(client, flight)");
+            return 0;
+        }
+        flight_advance(&r, bytes.len);
     }
-    free(node_cstring);
-    free(service_cstring);
+    stats_since(STAT_TRANSFER, start);
+    stats_observe(STAT_TRANSFER_BYTES, sent);
+    return keep;
+}
+
+// Fetches the response to req from its origin, leading f if set.
+static
+int fetch_request(int client, http_request const* req, arena* a, int keep, int head,
+                  int cacheable, slice key, flight* f) {
+    // Ask the origin to keep the connection open if we can pool it.
+    uint8_t poolkeybuf[BUFLEN];
+    slice poolkey = {NULL, 0};
+    int pool = pool_enabled()
+        && pool_key((mutslice){poolkeybuf, BUFLEN}, (*req).node, (*req).service, &poolkey) == 0;
+    size_t uplen = proxy_upstream_request_max(req);
+    uint8_t* upbuf = arena_alloc(a, uplen);
+    http_buf buf;
+    if (!upbuf || http_buf_init(&buf, a, proxy_head_limit) != 0) {
+        return 0;
+    }
+    slice upreq = {upbuf, proxy_upstream_request(req, pool, (mutslice){upbuf, uplen})};
+    if (upreq.len == 0) {
+        tlog(LOG_WARN, "request too large to forward\n");
+        return 0;
+    }
+
+    http_response res;
+    ssize_t totalread = http_read_err;
+    int err = 0;
+    int host = -1;
+    for (int attempt = 0; ; ++attempt) {
+        int reused = 0;
+        host = -1;
+        if (pool && attempt == 0) {
+            host = pool_take(poolkey);
+            if (host >= 0) {
+                reused = 1;
+                set_nonblocking(host, 0);
+                set_io_timeout(host, proxy_stall_ms);
+            }
+        }
+        if (host < 0) {
+            // if not in cache, try connect to host
+            host = dial_origin(client, req, key);
+            if (host < 0) {
+                return 0;
+            }
+        }
 
 /*
-    tprintf("forwarding request [%.*s] to %.*s://%.*s\n",
-        (int)(req.buf.len), req.buf.ptr,
-        (int)(req.service.len), req.service.ptr,
-        (int)(req.node.len), req.node.ptr);
+        tlog(LOG_DEBUG, "forwarding request [%.*s] to %.*s://%.*s\n",
+            (int)(upreq.len), upreq.ptr,
+            (int)((*req).service.len), (*req).service.ptr,
+            (int)((*req).node.len), (*req).node.ptr);
 */
-    err = write_all(host, req.buf);
+        err = write_all(host, upreq);
+        totalread = http_read_err;
+        if (err == 0) {
+            http_response_init(&res, (http_headerbuf){buf.headers, buf.cap});
+            uint64_t start = stats_now();
+            totalread = http_read_response(host, &buf, &res, timer_now() + proxy_first_byte_ms);
+            if (totalread >= 0) {
+                stats_since(STAT_FIRST_BYTE, start);
+            } else {
+                stats_error(totalread);
+            }
+        }
+        // The origin may have closed a pooled connection just as we took
+        // it. Nothing of the response was read, so retrying is safe.
+        if (reused && (err != 0 || totalread == http_read_eof || totalread == http_read_err)) {
+            tlog(LOG_WARN, "pool: connection %d went stale, redialing\n", host);
+            close(host);
+            continue;
+        }
+        break;
+    }
     if (err != 0) {
-        perror("write_all(host, req.buf)");
+        perror("write_all(host, upreq)");
         close(host);
-        goto done;
+        return 0;
+    }
+    if (totalread == http_read_timeout) {
+        tlog(LOG_WARN, "no response from %.*s://%.*s within %d ms\n",
+            (int)((*req).service.len), (*req).service.ptr,
+            (int)((*req).node.len), (*req).node.ptr,
+            proxy_first_byte_ms);
+        stats_count(STAT_TIMEOUT_FIRST_BYTE);
+        if (!send_stale(client, key)) {
+            send_gateway_timeout(client, "no response from", (*req).node, (*req).service);
+        }
+        close(host);
+        return 0;
     }
-
-    http_response res;
-    http_response_init(&res, (http_headerbuf){headers, HEADERBUF_CAP});
-    ssize_t totalread = http_read_response(host, (mutslice){buf, BUFLEN}, &res);
     if (totalread < 0) {
-        tprintf("error reading response: %d, panicking!\n", (int)totalread);
-        exit(1);
+        tlog(LOG_ERROR, "error reading response: %d\n", (int)totalread);
+        if (!send_stale(client, key)) {
+            send_bad_gateway(client, (int)totalread);
+        }
+        close(host);
+        return 0;
     }
-    change_keep_alive_to_close(res.headerbuf);
-    print_http_response(&res);
 
-    err = write_all(client, (slice){buf, totalread});
+    // With a delimited body the relay stops at the end of the message:
+    // the origin connection can go back to the pool and the client
+    // connection can carry the next request.
+    ssize_t bodylen = http_response_body_length(&res, head);
+    http_body body;
+    http_body_init(&body, &res, head);
+    ssize_t extra = http_body_scan(&body, (slice){&buf.ptr[res.buf.len], totalread - res.buf.len});
+    if (extra < 0) {
+        tlog(LOG_ERROR, "error reading response: %d\n", (int)extra);
+        stats_error(extra);
+        if (!send_stale(client, key)) {
+            send_bad_gateway(client, (int)extra);
+        }
+        close(host);
+        return 0;
+    }
+    int framed = body.framing != HTTP_BODY_CLOSE;
+    keep = keep && framed;
+
+    print_http_response(&res);
+    if (res.status.code >= 500 && send_stale(client, key)) {
+        close(host);
+        return 0;
+    }
+    size_t headlen = proxy_response_head_max(&res);
+    uint8_t* headbuf = arena_alloc(a, headlen);
+    slice reshead = {headbuf, headbuf ? proxy_response_head(&res, (mutslice){headbuf, headlen}) : 0};
+    if (reshead.len == 0) {
+        tlog(LOG_WARN, "response head too large to forward\n");
+        close(host);
+        return 0;
+    }
+    slice rest = {&buf.ptr[res.buf.len], extra};
+    if (f) {
+        // only what the cache could store may be shared
+        int shareable = cache_response_expires(&res, time(NULL)) != 0
+            && (bodylen < 0 || reshead.len + bodylen <= FLIGHT_MAX_BYTES);
+        flight_head(f, reshead, framed, shareable);
+        flight_append(f, rest);
+    }
+    slice conn = proxy_connection_line(keep);
+    struct iovec iov[3] = {
+        {(void*)reshead.ptr, reshead.len},
+        {(void*)conn.ptr, conn.len},
+        {(void*)rest.ptr, rest.len},
+    };
+    err = writev_all(client, iov, 3);
     if (err != 0) {
-        perror("write_all(client, res.buf)");
+        perror("writev_all(client, res)");
         close(host);
-        goto done;
+        return 0;
     }
 
-    //int dst[2] = {client, file}
-    err = transfer_body(host, client);
+    cache_fill fill = {0};
+    diskcache_fill dfill = {.fd = -1};
+    if (cacheable) {
+        proxy_fill_begin(key, &res, reshead, rest, &fill, &dfill);
+    }
+
+    uint64_t start = stats_now();
+    size_t sent = rest.len;
+    err = transfer_body(host, client, &body, &fill, &dfill, f, &sent);
     if (err != 0) {
-        perror("transfer_body(host, client)");
+        if (err == TRANSFER_STALLED) {
+            tlog(LOG_WARN, "transfer_body: no progress within %d ms\n", proxy_stall_ms);
+            stats_count(STAT_TIMEOUT_STALL);
+        } else {
+            perror("transfer_body(host, client)");
+        }
+        cache_fill_abort(&fill);
+        diskcache_fill_abort(&dfill);
         close(host);
-        goto done;
+        return 0;
+    }
+    stats_since(STAT_TRANSFER, start);
+    stats_observe(STAT_TRANSFER_BYTES, sent);
+    cache_fill_commit(&fill);
+    diskcache_fill_commit(&dfill);
+    if (f) {
+        flight_complete(f);
+    }
+
+    // whatever the origin sent past the response makes the
+    // connection unusable
+    if (pool && framed && body.extra == 0 && http_response_keep_alive(&res)) {
+        pool_put(poolkey, host);
+    } else {
+        close(host);
+    }
+    return keep;
+}
+
+// Answers one request, with buffers from a. Returns 1 if the client
+// connection may carry another one.
+static
+int serve_request(int client, http_request const* req, arena* a) {
+    if ((*req).version > HTTP_VERSION) {
+        tlog(LOG_WARN, "expected HTTP version %d or lower, got %d\n", HTTP_VERSION, (*req).version);
+        send_unsupported_version(client, (*req).version);
+        return 0;
+    }
+
+    // valid http request received
+    print_http_request(req);
+    // A request body we do not forward would be read as the next request.
+    int keep = http_request_keep_alive(req) && !http_request_has_body(req);
+    int head = (*req).method.len == 4 && memcmp((*req).method.ptr, "HEAD", 4) == 0;
+
+    // check if requested url in cache?
+    uint8_t keybuf[CACHE_KEYLEN];
+    slice key = {NULL, 0};
+    int cacheable = proxy_cacheable(req, (mutslice){keybuf, CACHE_KEYLEN}, &key);
+    if (cacheable) {
+        int state;
+        cache_entry* e = cache_lookup(key, &state);
+        if (e) {
+            if (state == cache_fresh) {
+                tlog(LOG_DEBUG, "cache hit: [%.*s]\n", (int)key.len, key.ptr);
+                stats_count(STAT_CACHE_HIT);
+            } else {
+                tlog(LOG_DEBUG, "cache hit, stale: [%.*s]\n", (int)key.len, key.ptr);
+                stats_count(STAT_CACHE_STALE);
+            }
+            if (state == cache_revalidate) {
+                revalidate_start(e, req);
+            }
+            int err = send_cached(client, e, keep);
+            if (err != 0) {
+                perror("send_cached(client)");
+            }
+            cache_release(e);
+            return keep && err == 0;
+        }
+        diskcache_hit hit;
+        if (diskcache_lookup(key, &hit)) {
+            tlog(LOG_DEBUG, "disk cache hit: [%.*s]\n", (int)key.len, key.ptr);
+            stats_count(STAT_CACHE_DISK_HIT);
+            int err = send_cached_file(client, hit, keep);
+            close(hit.fd);
+            return keep && err == 0;
+        }
+        tlog(LOG_DEBUG, "cache miss: [%.*s]\n", (int)key.len, key.ptr);
+    } else {
+        stats_count(STAT_CACHE_BYPASS);
+    }
+
+    // Identical requests in progress share one fetch.
+    flight* f = NULL;
+    for (int i = 0; cacheable && i < FLIGHT_TRIES; ++i) {
+        int leader = 0;
+        f = flight_join(key, &leader);
+        if (!f || leader) {
+            break;
+        }
+        int ret = follow_flight(client, f, keep);
+        flight_leave(f);
+        f = NULL;
+        if (ret == FOLLOW_PASS) {
+            break;
+        }
+        if (ret != FOLLOW_RETRY) {
+            return ret;
+        }
+        tlog(LOG_DEBUG, "flight: [%.*s] failed, fetching again\n", (int)key.len, key.ptr);
     }
+    if (cacheable) {
+        stats_count(STAT_CACHE_MISS);
+    }
+    admit_ticket t;
+    if (admit_enter(&t, (*req).node, (*req).service) != admit_ok) {
+        tlog(LOG_INFO, "shedding fetch from %.*s\n", (int)(*req).node.len, (*req).node.ptr);
+        stats_count(STAT_SHED);
+        if (f) {
+            flight_finish(f);
+        }
+        send_page(client, admit_page());
+        return 0;
+    }
+    int ret = fetch_request(client, req, a, keep, head, cacheable, key, f);
+    admit_leave(&t);
+    if (f) {
+        flight_finish(f);
+    }
+    return ret;
+}
+
+void handle_client(int client, uint64_t accepted) {
+    stats_since(STAT_ACCEPT, accepted);
+
+    arena* a = arena_take();
+    http_buf buf;
+    if (!a || http_buf_init(&buf, a, proxy_head_limit) != 0) {
+        if (a) {
+            arena_put(a);
+        }
+        close(client);
+        return;
+    }
+
+    // Responses that the client stops reading are given up.
+    set_io_timeout(client, proxy_stall_ms);
 
-    close(host);
+    // Requests are answered in order; bytes read past the end of one
+    // are the start of the next (pipelined) request.
+    int keep = 1;
+    for (int first = 1; keep; first = 0) {
+        http_request req;
+        http_request_init(&req, buf.headers, buf.cap);
+        uint64_t start = stats_now();
+        if (!first && buf.count == 0) {
+            struct pollfd p = {client, POLLIN, 0};
+            if (poll(&p, 1, proxy_idle_ms) == 0) {
+                tlog(LOG_DEBUG, "closing connection %d idle for %d ms\n", client, proxy_idle_ms);
+                goto done;
+            }
+        }
+        int err = http_read_request(client, &buf, &req, timer_now() + proxy_header_ms);
+        if (err == 0) {
+            stats_since(STAT_READ_REQUEST, start);
+        } else {
+            stats_error(err);
+        }
+        switch (err) {
+        case 0:
+            break;
+        case http_read_eof:
+            goto done;
+        case http_read_timeout:
+            tlog(LOG_WARN, "no request head within %d ms\n", proxy_header_ms);
+            stats_count(STAT_TIMEOUT_HEADER);
+            if (buf.count > 0) {
+                send_request_timeout(client);
+            }
+            goto done;
+        case http_partial:
+            tlog(LOG_WARN, "only partial request received, then eof\n");
+            goto done;
+        case http_err_method:
+            tlog(LOG_WARN, "invalid method: [%.*s]\n", (int)(req.method.len), req.method.ptr);
+            send_invalid_method(client, req.method);
+            goto done;
+        case http_err_url:
+            tlog(LOG_WARN, "invalid url: [%.*s]\n", (int)(req.url.len), req.url.ptr);
+            send_invalid_url(client, req.url);
+            goto done;
+        case http_err_version:
+            tlog(LOG_WARN, "invalid version: [%.*s]\n", (int)(req.version_slice.len), req.version_slice.ptr);
+            send_invalid_version(client, req.version_slice);
+            goto done;
+        case http_req_too_large:
+            tlog(LOG_WARN, "request head over %zu bytes\n", proxy_head_limit);
+            send_too_large(client);
+            goto done;
+        default:
+            tlog(LOG_WARN, "error reading request: %d\n", err);
+            goto done;
+        }
+
+        // what serve_request allocates lasts for this request only
+        arena_mark mark = arena_save(a);
+        keep = serve_request(client, &req, a);
+        arena_restore(a, mark);
+        buf.count -= req.buf.len;
+        memmove(buf.ptr, &buf.ptr[req.buf.len], buf.count);
+    }
 
 done:
-    tprintf("closing connection %d\n", client);
+    tlog(LOG_DEBUG, "closing connection %d\n", client);
     close(client);
-    pthread_exit(0);
+    arena_put(a);
 }
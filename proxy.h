@@ -1,11 +1,65 @@
 #ifndef PROXY_H
 #define PROXY_H
 #include "tprintf.h"
+#include "slice.h"
+#include "http.h"
+#include "cache.h"
+#include "diskcache.h"
 
-typedef struct {
-    int client;
-} handle_client_args;
+#define BUFLEN          1024
+#define HTTP_VERSION    1
+#define PROXY_DEFAULT_HEAD_LIMIT (64 << 10)
+#define PROXY_DEFAULT_HEADER_MS     10000
+#define PROXY_DEFAULT_IDLE_MS       60000
+#define PROXY_DEFAULT_FIRST_BYTE_MS 30000
+#define PROXY_DEFAULT_STALL_MS      30000
 
-void* handle_client(void* ptr);
+// The largest request or response head accepted, in bytes.
+extern size_t proxy_head_limit;
+// Deadlines, in milliseconds: for a request head to arrive (from
+// accept, or from its first byte on a kept-alive connection), for a
+// kept-alive connection to start its next request, for the response
+// head once the request is being forwarded, and for a body relay or
+// a response to the client to make progress.
+extern int proxy_header_ms;
+extern int proxy_idle_ms;
+extern int proxy_first_byte_ms;
+extern int proxy_stall_ms;
+
+// Serves the requests of a client connection until it closes, then
+// closes client. accepted is stats_now() when accept returned.
+void handle_client(int client, uint64_t accepted);
+
+void print_http_request(http_request const* req);
+void print_http_response(http_response const* res);
+
+// Formats one of the proxy's own error pages into buf, e.g.
+// status "404 Not Found". Returns its length.
+size_t proxy_error_page(mutslice buf, char const* status, char const* fmt, ...);
+
+// Writes req as sent to an origin: as HTTP/1.0, so the response is
+// never chunked, without hop-by-hop headers and asking for
+// Connection: keep-alive if keep, close otherwise.
+// Returns its length, or 0 if it does not fit in out.
+size_t proxy_upstream_request(http_request const* req, int keep, mutslice out);
+// The most bytes proxy_upstream_request can write for req.
+size_t proxy_upstream_request_max(http_request const* req);
+
+// Writes res's status line and end-to-end headers as sent to clients,
+// without the blank line, so that the head can be cached and finished
+// with each client's own proxy_connection_line.
+// Returns its length, or 0 if it does not fit in out.
+size_t proxy_response_head(http_response const* res, mutslice out);
+// The most bytes proxy_response_head can write for res.
+size_t proxy_response_head_max(http_response const* res);
+// The Connection header and blank line ending a head sent to a client.
+slice proxy_connection_line(int keep);
+
+// Returns 1 and writes the cache key if req may be served from a cache.
+int proxy_cacheable(http_request const* req, mutslice keybuf, slice* key);
+// Starts filling the memory or disk tier with a response whose head
+// and first body bytes (rest) have been read.
+void proxy_fill_begin(slice key, http_response const* res, slice head, slice rest,
+                      cache_fill* fill, diskcache_fill* dfill);
 
 #endif
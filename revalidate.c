@@ -0,0 +1,374 @@
+#include "revalidate.h"
+#include "proxy.h"
+#include "diskcache.h"
+#include "tcp.h"
+#include "dns.h"
+#include "arena.h"
+#include "admit.h"
+#include "stats.h"
+#include "timer.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#define REVALIDATE_BUFLEN   16384
+
+// what a revalidation made of its entry
+#define outcome_answered    0
+#define outcome_failed      1
+#define outcome_skipped     -1
+
+typedef struct revalidation revalidation;
+struct revalidation {
+    cache_entry* entry;
+    slice node;
+    slice service;
+    slice path;
+    // of the request that found the entry stale, may be empty
+    slice host;
+    revalidation* next;
+    uint8_t bytes[];
+};
+
+static pthread_once_t threads_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t jobs_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobs_cond = PTHREAD_COND_INITIALIZER;
+static revalidation* jobs_head;
+static revalidation* jobs_tail;
+static int jobs_count;
+
+static
+int name_is(slice name, char const* s) {
+    size_t n = strlen(s);
+    return name.len == n && strncasecmp((char const*)name.ptr, s, n) == 0;
+}
+
+static
+int has_header(http_headerbuf headerbuf, slice name) {
+    for (size_t i = 0; i < headerbuf.cap; ++i) {
+        slice n = headerbuf.ptr[i].name;
+        if (n.len == name.len && strncasecmp((char const*)n.ptr, (char const*)name.ptr, n.len) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Parses the head of a cache entry, which lacks the blank line.
+static
+int parse_head(arena* a, slice head, http_response* res) {
+    size_t lines = 2;
+    for (size_t i = 0; i < head.len; ++i) {
+        lines += head.ptr[i] == '\n';
+    }
+    uint8_t* buf = arena_alloc(a, head.len + 2);
+    http_header* headers = arena_alloc(a, lines * sizeof(http_header));
+    if (!buf || !headers) {
+        return -1;
+    }
+    memcpy(buf, head.ptr, head.len);
+    memcpy(&buf[head.len], "\r\n", 2);
+    http_response_init(res, (http_headerbuf){headers, lines});
+    return http_parse_response((slice){buf, head.len + 2}, res);
+}
+
+static
+int send_all(int fd, slice bytes) {
+    while (bytes.len > 0) {
+        ssize_t n = send(fd, bytes.ptr, bytes.len, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        bytes.ptr += n;
+        bytes.len -= n;
+    }
+    return 0;
+}
+
+// Stores e's body under the headers of e updated with those of the
+// 304 res, or drops e if that is no longer to be stored.
+static
+void refresh(cache_entry* e, http_response const* old, http_response const* res, arena* a) {
+    slice key = {(uint8_t const*)(*e).key, (*e).keylen};
+    size_t cap = (*old).headerbuf.cap + (*res).headerbuf.cap;
+    http_header* headers = arena_alloc(a, (cap ? cap : 1) * sizeof(http_header));
+    if (!headers) {
+        return;
+    }
+    size_t n = 0;
+    for (size_t i = 0; i < (*old).headerbuf.cap; ++i) {
+        if (!has_header((*res).headerbuf, (*old).headerbuf.ptr[i].name)) {
+            headers[n++] = (*old).headerbuf.ptr[i];
+        }
+    }
+    for (size_t i = 0; i < (*res).headerbuf.cap; ++i) {
+        slice name = (*res).headerbuf.ptr[i].name;
+        // these describe the 304, not the stored body
+        if (!name_is(name, "Content-Length") && !name_is(name, "Transfer-Encoding")) {
+            headers[n++] = (*res).headerbuf.ptr[i];
+        }
+    }
+    http_response merged = *old;
+    merged.headerbuf = (http_headerbuf){headers, n};
+    merged.buf.len = (*old).buf.len + (*res).buf.len;
+    size_t max = proxy_response_head_max(&merged);
+    uint8_t* buf = arena_alloc(a, max);
+    slice head = {buf, buf ? proxy_response_head(&merged, (mutslice){buf, max}) : 0};
+    time_t expires = cache_response_expires(&merged, time(NULL));
+    cache_fill fill;
+    if (head.len == 0 || expires == 0 || cache_fill_begin(&fill, key, head, &merged, expires) != 0) {
+        cache_drop(e);
+        return;
+    }
+    cache_fill_append(&fill, (slice){&(*e).data[(*e).headlen], (*e).len - (*e).headlen});
+    cache_fill_commit(&fill);
+}
+
+// Stores the new response res, whose head and the first body bytes
+// are in buf, in place of e. Returns outcome_failed if its body could
+// not be read.
+static
+int replace(int fd, cache_entry* e, http_response const* res, http_buf* buf, size_t count,
+            arena* a) {
+    slice key = {(uint8_t const*)(*e).key, (*e).keylen};
+    // whatever the new response is, the stored one is out of date
+    cache_drop(e);
+    http_body body;
+    http_body_init(&body, res, 0);
+    ssize_t extra = http_body_scan(&body, (slice){&(*buf).ptr[(*res).buf.len], count - (*res).buf.len});
+    size_t max = proxy_response_head_max(res);
+    uint8_t* headbuf = arena_alloc(a, max);
+    uint8_t* chunk = arena_alloc(a, REVALIDATE_BUFLEN);
+    if (extra < 0 || !headbuf || !chunk) {
+        return extra < 0 ? outcome_failed : outcome_answered;
+    }
+    slice head = {headbuf, proxy_response_head(res, (mutslice){headbuf, max})};
+    cache_fill fill = {0};
+    diskcache_fill dfill = {.fd = -1};
+    if (head.len > 0) {
+        proxy_fill_begin(key, res, head, (slice){&(*buf).ptr[(*res).buf.len], extra}, &fill, &dfill);
+    }
+    while (!http_body_done(&body) && (fill.entry || dfill.fd != -1)) {
+        ssize_t n = read(fd, chunk, http_body_want(&body, REVALIDATE_BUFLEN));
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == 0 && http_body_eof(&body) == 0) {
+            break;
+        }
+        ssize_t used = n > 0 ? http_body_scan(&body, (slice){chunk, n}) : -1;
+        if (used < 0) {
+            cache_fill_abort(&fill);
+            diskcache_fill_abort(&dfill);
+            return outcome_failed;
+        }
+        cache_fill_append(&fill, (slice){chunk, used});
+        if (dfill.fd != -1) {
+            diskcache_fill_append(&dfill, (slice){chunk, used});
+        }
+    }
+    cache_fill_commit(&fill);
+    diskcache_fill_commit(&dfill);
+    return outcome_answered;
+}
+
+// Asks the origin whether e is still current.
+static
+int fetch(revalidation const* r, arena* a) {
+    cache_entry* e = (*r).entry;
+    http_response old;
+    if (parse_head(a, (slice){(*e).data, (*e).headlen}, &old) != 0) {
+        return outcome_skipped;
+    }
+    slice etag = {NULL, 0};
+    slice modified = {NULL, 0};
+    http_find_header(old.headerbuf, "ETag", &etag);
+    http_find_header(old.headerbuf, "Last-Modified", &modified);
+
+    slice host = (*r).host;
+    size_t cap = (*r).path.len + host.len + (*r).node.len + (*r).service.len
+        + etag.len + modified.len + 128;
+    char* upreq = arena_alloc(a, cap);
+    if (!upreq) {
+        return outcome_skipped;
+    }
+    int len;
+    if (host.len > 0 || name_is((*r).service, "http") || name_is((*r).service, "80")) {
+        if (host.len == 0) {
+            host = (*r).node;
+        }
+        len = snprintf(upreq, cap, "GET %.*s HTTP/1.0\r\nHost: %.*s\r\n",
+            (int)(*r).path.len, (*r).path.ptr, (int)host.len, host.ptr);
+    } else {
+        len = snprintf(upreq, cap, "GET %.*s HTTP/1.0\r\nHost: %.*s:%.*s\r\n",
+            (int)(*r).path.len, (*r).path.ptr, (int)(*r).node.len, (*r).node.ptr,
+            (int)(*r).service.len, (*r).service.ptr);
+    }
+    if (etag.len > 0) {
+        len += snprintf(&upreq[len], cap - len, "If-None-Match: %.*s\r\n", (int)etag.len, etag.ptr);
+    }
+    if (modified.len > 0) {
+        len += snprintf(&upreq[len], cap - len, "If-Modified-Since: %.*s\r\n",
+            (int)modified.len, modified.ptr);
+    }
+    len += snprintf(&upreq[len], cap - len, "Connection: close\r\n\r\n");
+
+    dns_result addrs;
+    dns_resolve((*r).node, (*r).service, &addrs);
+    int fd = addrs.err == 0 ? dial_tcp_addrs(&addrs) : -1;
+    if (fd < 0) {
+        tlog(LOG_WARN, "revalidate: unable to connect to %.*s://%.*s\n",
+            (int)(*r).service.len, (*r).service.ptr, (int)(*r).node.len, (*r).node.ptr);
+        return outcome_failed;
+    }
+    set_io_timeout(fd, proxy_stall_ms);
+    http_buf buf;
+    http_response res;
+    ssize_t n = http_read_err;
+    if (send_all(fd, (slice){(uint8_t const*)upreq, len}) == 0
+        && http_buf_init(&buf, a, proxy_head_limit) == 0) {
+        http_response_init(&res, (http_headerbuf){buf.headers, buf.cap});
+        n = http_read_response(fd, &buf, &res, timer_now() + proxy_first_byte_ms);
+    }
+    if (n < 0) {
+        tlog(LOG_WARN, "revalidate: no response for [%.*s]: %d\n",
+            (int)(*e).keylen, (*e).key, (int)n);
+        stats_error(n);
+        close(fd);
+        return outcome_failed;
+    }
+    int ret = outcome_answered;
+    if (res.status.code == 304) {
+        tlog(LOG_DEBUG, "revalidate: [%.*s] not modified\n", (int)(*e).keylen, (*e).key);
+        stats_count(STAT_REVALIDATE_NOT_MODIFIED);
+        refresh(e, &old, &res, a);
+    } else if (res.status.code >= 500) {
+        tlog(LOG_WARN, "revalidate: [%.*s]: origin answered %d\n",
+            (int)(*e).keylen, (*e).key, res.status.code);
+        ret = outcome_failed;
+    } else {
+        tlog(LOG_DEBUG, "revalidate: [%.*s] replaced (%d)\n",
+            (int)(*e).keylen, (*e).key, res.status.code);
+        ret = replace(fd, e, &res, &buf, n, a);
+        if (ret == outcome_answered) {
+            stats_count(STAT_REVALIDATE_REPLACED);
+        }
+    }
+    close(fd);
+    return ret;
+}
+
+static
+void revalidate(revalidation const* r) {
+    cache_entry* e = (*r).entry;
+    admit_ticket t;
+    if (admit_enter(&t, (*r).node, (*r).service) != admit_ok) {
+        // the origin is busy enough, a later request tries again
+        cache_revalidated(e, -1);
+        return;
+    }
+    arena* a = arena_take();
+    int outcome = a ? fetch(r, a) : outcome_skipped;
+    admit_leave(&t);
+    if (a) {
+        arena_put(a);
+    }
+    if (outcome == outcome_failed) {
+        stats_count(STAT_REVALIDATE_FAILED);
+    }
+    cache_revalidated(e, outcome);
+}
+
+static
+void* revalidator_main(void* arg) {
+    (void)arg;
+    while (1) {
+        pthread_mutex_lock(&jobs_mutex);
+        while (!jobs_head) {
+            pthread_cond_wait(&jobs_cond, &jobs_mutex);
+        }
+        revalidation* r = jobs_head;
+        jobs_head = (*r).next;
+        if (!jobs_head) {
+            jobs_tail = NULL;
+        }
+        jobs_count -= 1;
+        pthread_mutex_unlock(&jobs_mutex);
+
+        revalidate(r);
+        cache_release((*r).entry);
+        free(r);
+    }
+    return NULL;
+}
+
+static
+void start_threads(void) {
+    for (int i = 0; i < REVALIDATE_THREADS; ++i) {
+        pthread_t thread;
+        int err = pthread_create(&thread, NULL, revalidator_main, NULL);
+        if (err != 0) {
+            tlog(LOG_ERROR, "revalidate: pthread_create: %s\n", strerror(err));
+            continue;
+        }
+        pthread_detach(thread);
+    }
+}
+
+static
+slice copy_to(uint8_t** pos, slice s) {
+    if (s.len > 0) {
+        memcpy(*pos, s.ptr, s.len);
+    }
+    slice copy = {*pos, s.len};
+    *pos += s.len;
+    return copy;
+}
+
+void revalidate_start(cache_entry* e, http_request const* req) {
+    slice host = {NULL, 0};
+    http_find_header((*req).headerbuf, "Host", &host);
+    size_t len = (*req).node.len + (*req).service.len + (*req).path.len + host.len;
+    revalidation* r = malloc(sizeof(revalidation) + len);
+    if (!r) {
+        cache_revalidated(e, -1);
+        cache_release(e);
+        return;
+    }
+    uint8_t* pos = (*r).bytes;
+    (*r).entry = e;
+    (*r).node = copy_to(&pos, (*req).node);
+    (*r).service = copy_to(&pos, (*req).service);
+    (*r).path = copy_to(&pos, (*req).path);
+    (*r).host = copy_to(&pos, host);
+    (*r).next = NULL;
+
+    pthread_once(&threads_once, start_threads);
+    pthread_mutex_lock(&jobs_mutex);
+    if (jobs_count >= REVALIDATE_QUEUE) {
+        pthread_mutex_unlock(&jobs_mutex);
+        tlog(LOG_WARN, "revalidate: queue full, skipping [%.*s]\n", (int)(*e).keylen, (*e).key);
+        cache_revalidated(e, -1);
+        cache_release(e);
+        free(r);
+        return;
+    }
+    if (jobs_tail) {
+        (*jobs_tail).next = r;
+    } else {
+        jobs_head = r;
+    }
+    jobs_tail = r;
+    jobs_count += 1;
+    pthread_cond_signal(&jobs_cond);
+    pthread_mutex_unlock(&jobs_mutex);
+}
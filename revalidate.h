@@ -0,0 +1,22 @@
+#ifndef REVALIDATE_H
+#define REVALIDATE_H
+#include "tprintf.h"
+#include "cache.h"
+#include "http.h"
+
+#define REVALIDATE_THREADS  4
+#define REVALIDATE_QUEUE    256
+
+// Revalidates stale memory cache entries in the background while they
+// are served (RFC 5861 stale-while-revalidate): a conditional GET with
+// the entry's ETag and Last-Modified goes to the origin from a thread
+// of its own. A 304 refreshes the entry's headers and expiry and keeps
+// its body, any other response replaces or drops the entry, and a
+// failed fetch or a 5xx leaves it to be served within its
+// stale-if-error window.
+
+// Revalidates e, which cache_lookup returned as cache_revalidate for
+// req, taking over the lookup's second reference to it.
+void revalidate_start(cache_entry* e, http_request const* req);
+
+#endif
@@ -0,0 +1,176 @@
+#include "scan.h"
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SCAN_X86
+#include <immintrin.h>
+#endif
+
+typedef struct {
+    char const* name;
+    size_t (*space)(uint8_t const* buf, size_t len);
+    size_t (*eol)(uint8_t const* buf, size_t len);
+} scan_impl;
+
+static
+size_t space_scalar(uint8_t const* buf, size_t len) {
+    size_t i = 0;
+    while (i < len && buf[i] != ' ' && buf[i] != '\t' && buf[i] != '\r' && buf[i] != '\n') {
+        i += 1;
+    }
+    return i;
+}
+
+static
+size_t eol_scalar(uint8_t const* buf, size_t len) {
+    size_t i = 0;
+    while (i < len && buf[i] != '\r' && buf[i] != '\n') {
+        i += 1;
+    }
+    return i;
+}
+
+#ifdef SCAN_X86
+// The vector loops stop at the last full block, the scalar ones
+// finish the tail.
+
+__attribute__((target("sse2")))
+static
+size_t space_sse2(uint8_t const* buf, size_t len) {
+    __m128i const sp = _mm_set1_epi8(' ');
+    __m128i const ht = _mm_set1_epi8('\t');
+    __m128i const cr = _mm_set1_epi8('\r');
+    __m128i const lf = _mm_set1_epi8('\n');
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((__m128i const*)&buf[i]);
+        __m128i m = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(v, sp), _mm_cmpeq_epi8(v, ht)),
+            _mm_or_si128(_mm_cmpeq_epi8(v, cr), _mm_cmpeq_epi8(v, lf)));
+        int mask = _mm_movemask_epi8(m);
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i + space_scalar(&buf[i], len - i);
+}
+
+__attribute__((target("sse2")))
+static
+size_t eol_sse2(uint8_t const* buf, size_t len) {
+    __m128i const cr = _mm_set1_epi8('\r');
+    __m128i const lf = _mm_set1_epi8('\n');
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((__m128i const*)&buf[i]);
+        __m128i m = _mm_or_si128(_mm_cmpeq_epi8(v, cr), _mm_cmpeq_epi8(v, lf));
+        int mask = _mm_movemask_epi8(m);
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i + eol_scalar(&buf[i], len - i);
+}
+
+__attribute__((target("avx2")))
+static
+size_t space_avx2(uint8_t const* buf, size_t len) {
+    __m256i const sp = _mm256_set1_epi8(' ');
+    __m256i const ht = _mm256_set1_epi8('\t');
+    __m256i const cr = _mm256_set1_epi8('\r');
+    __m256i const lf = _mm256_set1_epi8('\n');
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((__m256i const*)&buf[i]);
+        __m256i m = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, sp), _mm256_cmpeq_epi8(v, ht)),
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, cr), _mm256_cmpeq_epi8(v, lf)));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(m);
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    // Leaving dirty upper halves across the legacy SSE tail stalls
+    // every instruction in it.
+    _mm256_zeroupper();
+    return i + space_sse2(&buf[i], len - i);
+}
+
+__attribute__((target("avx2")))
+static
+size_t eol_avx2(uint8_t const* buf, size_t len) {
+    __m256i const cr = _mm256_set1_epi8('\r');
+    __m256i const lf = _mm256_set1_epi8('\n');
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((__m256i const*)&buf[i]);
+        __m256i m = _mm256_or_si256(_mm256_cmpeq_epi8(v, cr), _mm256_cmpeq_epi8(v, lf));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(m);
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    // Leaving dirty upper halves across the legacy SSE tail stalls
+    // every instruction in it.
+    _mm256_zeroupper();
+    return i + eol_sse2(&buf[i], len - i);
+}
+#endif
+
+static scan_impl const impls[] = {
+    {"scalar", space_scalar, eol_scalar},
+#ifdef SCAN_X86
+    {"sse2", space_sse2, eol_sse2},
+    {"avx2", space_avx2, eol_avx2},
+#endif
+};
+
+static scan_impl const* impl = &impls[0];
+
+static
+int supported(char const* name) {
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+    if (strcmp(name, "sse2") == 0) {
+        return __builtin_cpu_supports("sse2");
+    }
+    if (strcmp(name, "avx2") == 0) {
+        return __builtin_cpu_supports("avx2");
+    }
+#endif
+    return strcmp(name, "scalar") == 0;
+}
+
+// Picks the widest implementation before main runs, so the
+// pointer never changes while threads read it.
+__attribute__((constructor))
+static
+void scan_init(void) {
+    for (size_t i = 0; i < sizeof(impls)/sizeof(impls[0]); ++i) {
+        if (supported(impls[i].name)) {
+            impl = &impls[i];
+        }
+    }
+}
+
+int scan_select(char const* name) {
+    for (size_t i = 0; i < sizeof(impls)/sizeof(impls[0]); ++i) {
+        if (strcmp(impls[i].name, name) == 0 && supported(name)) {
+            impl = &impls[i];
+            return 0;
+        }
+    }
+    return -1;
+}
+
+char const* scan_selected(void) {
+    return (*impl).name;
+}
+
+size_t scan_space(uint8_t const* buf, size_t len) {
+    return (*impl).space(buf, len);
+}
+
+size_t scan_eol(uint8_t const* buf, size_t len) {
+    return (*impl).eol(buf, len);
+}
@@ -0,0 +1,23 @@
+#ifndef SCAN_H
+#define SCAN_H
+#include "tprintf.h"
+#include <stdint.h>
+#include <sys/types.h>
+
+// Delimiter scanning for the HTTP parser. Each function returns the
+// offset of the first matching byte of buf[0..len), or len if there is
+// none. They run 16 (SSE2) or 32 (AVX2) bytes per step where the CPU
+// has it, chosen at startup, and byte by byte otherwise.
+
+// First SP, HT, CR or LF: the end of a token.
+size_t scan_space(uint8_t const* buf, size_t len);
+// First CR or LF: the end of a line's contents.
+size_t scan_eol(uint8_t const* buf, size_t len);
+
+// Forces an implementation, "scalar", "sse2" or "avx2", e.g. to compare
+// them. Returns -1 if this CPU or build does not have it.
+int scan_select(char const* name);
+// The implementation in use.
+char const* scan_selected(void);
+
+#endif
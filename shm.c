@@ -0,0 +1,433 @@
+#define _GNU_SOURCE
+#include "shm.h"
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define SHM_FREE        -1  // a run of free pages
+#define SHM_LARGE       -2  // a run of pages allocated as one
+#define SHM_RUN_LISTS   64  // of free runs, by length; the last for longer ones
+
+// Pages are numbered from 0, and lists link them by number + 1, so
+// that 0 is none. The pages are split into runs, each taken or free;
+// free runs are merged with the free runs next to them when freed.
+typedef struct {
+    uint32_t run;       // pages in the run that starts here, on its first page
+    uint32_t first;     // the first page of the run, on every page of a taken
+                        // run and on the last page of a free one
+    int32_t cls;        // on its first page: SHM_FREE, SHM_LARGE or the class of a slab
+    uint32_t used;      // chunks of a slab handed out
+    uint32_t carved;    // chunks of a slab handed out at least once
+    uint32_t free;      // offset + 1 in a slab of its first free chunk
+    uint32_t prev;      // neighbours in the slab's list of those with free
+    uint32_t next;      // chunks, or the free run's list of free runs
+} shm_page;
+
+typedef struct {
+    pthread_mutex_t mutex;
+    size_t npages;
+    size_t pages;
+    size_t used;
+    uint32_t partial[SHM_CLASSES];  // the slabs of each class with free chunks
+    uint32_t runs[SHM_RUN_LISTS];   // free runs of 1, 2, ... pages
+    shm_page meta[];
+} shm_header;
+
+// Set before any worker is forked, and then the same in all of them.
+static shm_header* region;
+static char* base;      // of page 0
+static uint32_t class_size[SHM_CLASSES];
+static uint32_t class_pages[SHM_CLASSES];
+
+// 16 to 256 bytes by 16, then sixteen classes per doubling. The sizes
+// of 64 and more that are multiples of 64 are all classes, so that
+// such allocations stay aligned to a cache line.
+static
+void make_classes(void) {
+    int c = 0;
+    for (uint32_t size = 16; size <= 256; size += 16) {
+        class_size[c++] = size;
+    }
+    for (uint32_t from = 256; c < SHM_CLASSES; from *= 2) {
+        for (int i = 1; i <= 16; ++i) {
+            class_size[c++] = from + from / 16 * i;
+        }
+    }
+    // the fewest pages that leave at most 1/16 unused, else the least unused
+    for (c = 0; c < SHM_CLASSES; ++c) {
+        uint32_t best = 0;
+        double best_waste = 1;
+        for (uint32_t k = 1; k <= SHM_SLAB_PAGES; ++k) {
+            size_t bytes = (size_t)k * SHM_PAGE;
+            if (bytes < class_size[c]) {
+                continue;
+            }
+            double waste = (double)(bytes % class_size[c]) / bytes;
+            if (waste * 16 <= 1) {
+                best = k;
+                break;
+            }
+            if (waste < best_waste) {
+                best = k;
+                best_waste = waste;
+            }
+        }
+        class_pages[c] = best;
+    }
+}
+
+static
+int class_of(size_t n) {
+    int lo = 0;
+    int hi = SHM_CLASSES - 1;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (class_size[mid] < n) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static
+uint32_t slab_chunks(int cls) {
+    return class_pages[cls] * SHM_PAGE / class_size[cls];
+}
+
+static
+void list_push(uint32_t* head, uint32_t p) {
+    shm_page* m = &(*region).meta[p];
+    (*m).prev = 0;
+    (*m).next = *head;
+    if ((*m).next) {
+        (*region).meta[(*m).next - 1].prev = p + 1;
+    }
+    *head = p + 1;
+}
+
+static
+void list_remove(uint32_t* head, uint32_t p) {
+    shm_page* m = &(*region).meta[p];
+    if ((*m).prev) {
+        (*region).meta[(*m).prev - 1].next = (*m).next;
+    } else {
+        *head = (*m).next;
+    }
+    if ((*m).next) {
+        (*region).meta[(*m).next - 1].prev = (*m).prev;
+    }
+    (*m).prev = 0;
+    (*m).next = 0;
+}
+
+static
+uint32_t* run_list(uint32_t len) {
+    return &(*region).runs[len < SHM_RUN_LISTS ? len - 1 : SHM_RUN_LISTS - 1];
+}
+
+// Makes the len pages from p a free run.
+static
+void add_run(uint32_t p, uint32_t len) {
+    shm_page* meta = (*region).meta;
+    meta[p].run = len;
+    meta[p].cls = SHM_FREE;
+    meta[p + len - 1].first = p;
+    list_push(run_list(len), p);
+}
+
+int shm_init(size_t size) {
+    make_classes();
+    size_t npages = size / SHM_PAGE;
+    size_t head = sizeof(shm_header) + npages * sizeof(shm_page);
+    head = (head + SHM_PAGE - 1) / SHM_PAGE * SHM_PAGE;
+    size_t total = head + npages * SHM_PAGE;
+
+    int fd = memfd_create("webproxy-cache", MFD_CLOEXEC);
+    if (fd < 0) {
+        perror("memfd_create");
+        return -1;
+    }
+    if (ftruncate(fd, total) != 0) {
+        perror("ftruncate");
+        close(fd);
+        return -1;
+    }
+    void* p = mmap(NULL, total, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+    region = p;
+    base = (char*)p + head;
+    shm_mutex_init(&(*region).mutex);
+    (*region).npages = npages;
+    add_run(0, npages);
+    return 0;
+}
+
+int shm_enabled(void) {
+    return region != NULL;
+}
+
+void shm_mutex_init(pthread_mutex_t* m) {
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(m, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+int shm_lock(pthread_mutex_t* m) {
+    if (pthread_mutex_lock(m) == EOWNERDEAD) {
+        pthread_mutex_consistent(m);
+        return 1;
+    }
+    return 0;
+}
+
+int shm_trylock(pthread_mutex_t* m) {
+    switch (pthread_mutex_trylock(m)) {
+    case 0:
+        return 0;
+    case EOWNERDEAD:
+        pthread_mutex_consistent(m);
+        return 1;
+    default:
+        return -1;
+    }
+}
+
+// Rebuilds what can be derived from the pages after a process died
+// allocating: the lists of slabs with free chunks and the counts. A
+// chunk it was taking or giving back may be lost.
+static
+void repair(void) {
+    tlog(LOG_WARN, "shm: a process died allocating, repairing the allocator\n");
+    memset((*region).partial, 0, sizeof((*region).partial));
+    memset((*region).runs, 0, sizeof((*region).runs));
+    (*region).pages = 0;
+    (*region).used = 0;
+    for (size_t p = 0; p < (*region).npages; p += (*region).meta[p].run) {
+        shm_page* m = &(*region).meta[p];
+        if ((*m).cls == SHM_FREE) {
+            uint32_t len = (*m).run;
+            while (p + len < (*region).npages && (*region).meta[p + len].cls == SHM_FREE) {
+                len += (*region).meta[p + len].run;
+            }
+            add_run(p, len);
+            continue;
+        }
+        (*region).pages += (*m).run;
+        if ((*m).cls == SHM_LARGE) {
+            (*region).used += (size_t)(*m).run * SHM_PAGE;
+            continue;
+        }
+        (*region).used += (size_t)(*m).used * class_size[(*m).cls];
+        if ((*m).free || (*m).carved < slab_chunks((*m).cls)) {
+            list_push(&(*region).partial[(*m).cls], p);
+        }
+    }
+}
+
+static
+void lock(void) {
+    if (shm_lock(&(*region).mutex)) {
+        repair();
+    }
+}
+
+static
+void unlock(void) {
+    pthread_mutex_unlock(&(*region).mutex);
+}
+
+// Takes a run of k pages from the shortest free run that has them.
+// Returns its first page, or -1. Must hold the mutex.
+static
+long take_pages(uint32_t k) {
+    shm_page* meta = (*region).meta;
+    uint32_t p = 0;
+    for (uint32_t len = k; len < SHM_RUN_LISTS && !p; ++len) {
+        p = (*region).runs[len - 1];
+    }
+    if (!p) {
+        // longer runs, first fit
+        p = (*region).runs[SHM_RUN_LISTS - 1];
+        while (p && meta[p - 1].run < k) {
+            p = meta[p - 1].next;
+        }
+        if (!p) {
+            return -1;
+        }
+    }
+    p -= 1;
+    uint32_t len = meta[p].run;
+    list_remove(run_list(len), p);
+    if (len > k) {
+        add_run(p + k, len - k);
+    }
+    meta[p].run = k;
+    for (uint32_t i = 0; i < k; ++i) {
+        meta[p + i].first = p;
+    }
+    (*region).pages += k;
+    return p;
+}
+
+// Frees the run at p, merged with the free runs around it.
+static
+void give_pages(uint32_t p) {
+    shm_page* meta = (*region).meta;
+    uint32_t len = meta[p].run;
+    (*region).pages -= len;
+    uint32_t next = p + len;
+    if (next < (*region).npages && meta[next].cls == SHM_FREE) {
+        list_remove(run_list(meta[next].run), next);
+        len += meta[next].run;
+    }
+    if (p > 0) {
+        uint32_t prev = meta[p - 1].first;
+        if (meta[prev].cls == SHM_FREE && prev + meta[prev].run == p) {
+            list_remove(run_list(meta[prev].run), prev);
+            len += meta[prev].run;
+            p = prev;
+        }
+    }
+    add_run(p, len);
+}
+
+void* shm_alloc(size_t n) {
+    if (!region) {
+        return NULL;
+    }
+    if (n == 0) {
+        n = 1;
+    }
+    lock();
+    if (n > SHM_SLAB_MAX) {
+        size_t k = (n + SHM_PAGE - 1) / SHM_PAGE;
+        long p = k <= UINT32_MAX ? take_pages(k) : -1;
+        if (p < 0) {
+            unlock();
+            return NULL;
+        }
+        (*region).meta[p].cls = SHM_LARGE;
+        (*region).used += k * SHM_PAGE;
+        unlock();
+        return base + (size_t)p * SHM_PAGE;
+    }
+
+    int cls = class_of(n);
+    uint32_t p;
+    if ((*region).partial[cls]) {
+        p = (*region).partial[cls] - 1;
+    } else {
+        long taken = take_pages(class_pages[cls]);
+        if (taken < 0) {
+            unlock();
+            return NULL;
+        }
+        p = taken;
+        shm_page* m = &(*region).meta[p];
+        (*m).cls = cls;
+        (*m).used = 0;
+        (*m).carved = 0;
+        (*m).free = 0;
+        list_push(&(*region).partial[cls], p);
+    }
+    shm_page* m = &(*region).meta[p];
+    char* slab = base + (size_t)p * SHM_PAGE;
+    char* chunk;
+    if ((*m).free) {
+        chunk = slab + (*m).free - 1;
+        (*m).free = *(uint32_t*)chunk;
+    } else {
+        chunk = slab + (size_t)(*m).carved * class_size[cls];
+        (*m).carved += 1;
+    }
+    (*m).used += 1;
+    if (!(*m).free && (*m).carved == slab_chunks(cls)) {
+        list_remove(&(*region).partial[cls], p);
+    }
+    (*region).used += class_size[cls];
+    unlock();
+    return chunk;
+}
+
+// The first page of the run p is in.
+static
+uint32_t run_of(void const* p) {
+    return (*region).meta[((char const*)p - base) / SHM_PAGE].first;
+}
+
+void shm_free(void* ptr) {
+    if (!ptr) {
+        return;
+    }
+    lock();
+    uint32_t p = run_of(ptr);
+    shm_page* m = &(*region).meta[p];
+    if ((*m).cls == SHM_LARGE) {
+        (*region).used -= (size_t)(*m).run * SHM_PAGE;
+        give_pages(p);
+        unlock();
+        return;
+    }
+    int cls = (*m).cls;
+    int full = !(*m).free && (*m).carved == slab_chunks(cls);
+    char* slab = base + (size_t)p * SHM_PAGE;
+    *(uint32_t*)ptr = (*m).free;
+    (*m).free = (char*)ptr - slab + 1;
+    (*m).used -= 1;
+    (*region).used -= class_size[cls];
+    if ((*m).used == 0) {
+        if (!full) {
+            list_remove(&(*region).partial[cls], p);
+        }
+        give_pages(p);
+    } else if (full) {
+        list_push(&(*region).partial[cls], p);
+    }
+    unlock();
+}
+
+void* shm_realloc(void* ptr, size_t n) {
+    if (!ptr) {
+        return shm_alloc(n);
+    }
+    // the meta of a taken run only changes when it is freed, by its owner
+    shm_page const* m = &(*region).meta[run_of(ptr)];
+    size_t cap = (*m).cls == SHM_LARGE ? (size_t)(*m).run * SHM_PAGE : class_size[(*m).cls];
+    int same = (*m).cls == SHM_LARGE
+        ? n > SHM_SLAB_MAX && (n + SHM_PAGE - 1) / SHM_PAGE == (*m).run
+        : n <= SHM_SLAB_MAX && class_of(n) == (*m).cls;
+    if (same) {
+        return ptr;
+    }
+    void* p = shm_alloc(n);
+    if (!p) {
+        return NULL;
+    }
+    memcpy(p, ptr, n < cap ? n : cap);
+    shm_free(ptr);
+    return p;
+}
+
+void shm_counts(shm_usage* u) {
+    memset(u, 0, sizeof(*u));
+    if (!region) {
+        return;
+    }
+    lock();
+    (*u).size = (*region).npages * SHM_PAGE;
+    (*u).pages = (*region).pages * SHM_PAGE;
+    (*u).used = (*region).used;
+    unlock();
+}
@@ -0,0 +1,50 @@
+#ifndef SHM_H
+#define SHM_H
+#include "tprintf.h"
+#include <stddef.h>
+#include <pthread.h>
+
+#define SHM_PAGE        4096
+#define SHM_SLAB_MAX    (32 << 10)  // larger allocations take whole pages
+#define SHM_CLASSES     128
+#define SHM_SLAB_PAGES  16          // at most, per slab
+
+// A region of memory shared with the processes forked after it is
+// mapped (a memfd mapped MAP_SHARED), and an allocator for it. Every
+// process sees the region at the same address, so pointers into it
+// may be stored in it; the allocator itself keeps offsets only.
+//
+// The region is cut into pages. Allocations up to SHM_SLAB_MAX come
+// from slabs, runs of pages cut into chunks of one size class (sixteen
+// classes per doubling, so at most 1/16 of a chunk goes unused); larger
+// ones take runs of pages of their own. Empty slabs go back to the
+// pages. Nothing is touched before it is first allocated, so the
+// region may be sized generously.
+
+// Maps a region of size bytes. Returns -1 (and maps nothing) on error.
+int shm_init(size_t size);
+int shm_enabled(void);
+// Like malloc, realloc and free, for the region.
+void* shm_alloc(size_t n);
+void* shm_realloc(void* p, size_t n);
+void shm_free(void* p);
+
+typedef struct {
+    size_t size;    // of the pages
+    size_t pages;   // bytes of pages taken by slabs and large allocations
+    size_t used;    // bytes of chunks and large allocations handed out
+} shm_usage;
+
+void shm_counts(shm_usage* u);
+
+// Mutexes for the region: shared between processes and robust, so
+// that a process dying while it holds one does not leave it locked.
+// shm_lock returns 1 if the last owner died holding it, with the mutex
+// locked and made usable again: what it guards may be half updated,
+// and the caller should repair it. Fine for private mutexes as well.
+void shm_mutex_init(pthread_mutex_t* m);
+int shm_lock(pthread_mutex_t* m);
+// Returns -1 if the mutex is held, else like shm_lock.
+int shm_trylock(pthread_mutex_t* m);
+
+#endif
@@ -0,0 +1,72 @@
+#include "sketch.h"
+
+#define SKETCH_MIN_KEYS 1024
+
+// Counter i of a key, by double hashing its remixed hash.
+static
+size_t counter_index(sketch const* s, uint64_t hash, int i) {
+    uint64_t h = hash * 0x9e3779b97f4a7c15ULL;
+    h ^= h >> 29;
+    uint32_t a = (uint32_t)h;
+    uint32_t b = (uint32_t)(h >> 32) | 1;
+    return (a + (uint64_t)i*b) & (*s).mask;
+}
+
+static
+int counter_get(sketch const* s, size_t c) {
+    return ((*s).table[c >> 4] >> ((c & 15) << 2)) & 15;
+}
+
+int sketch_init(sketch* s, size_t keys, void* (*alloc)(size_t)) {
+    if (keys < SKETCH_MIN_KEYS) {
+        keys = SKETCH_MIN_KEYS;
+    }
+    // SKETCH_ROWS counters a key, as a power of two
+    size_t counters = 16;
+    while (counters < keys * SKETCH_ROWS) {
+        counters <<= 1;
+    }
+    (*s).table = alloc(counters / 16 * sizeof(uint64_t));
+    if (!(*s).table) {
+        return -1;
+    }
+    (*s).mask = counters - 1;
+    (*s).additions = 0;
+    (*s).sample = keys * SKETCH_SAMPLE;
+    return 0;
+}
+
+// Halves every counter at once, word by word.
+static
+void age(sketch* s) {
+    size_t words = ((*s).mask + 1) / 16;
+    for (size_t i = 0; i < words; ++i) {
+        (*s).table[i] = ((*s).table[i] >> 1) & 0x7777777777777777ULL;
+    }
+    (*s).additions /= 2;
+}
+
+void sketch_add(sketch* s, uint64_t hash) {
+    int added = 0;
+    for (int i = 0; i < SKETCH_ROWS; ++i) {
+        size_t c = counter_index(s, hash, i);
+        if (counter_get(s, c) < SKETCH_MAX) {
+            (*s).table[c >> 4] += 1ULL << ((c & 15) << 2);
+            added = 1;
+        }
+    }
+    if (added && ++(*s).additions >= (*s).sample) {
+        age(s);
+    }
+}
+
+int sketch_estimate(sketch const* s, uint64_t hash) {
+    int min = SKETCH_MAX;
+    for (int i = 0; i < SKETCH_ROWS; ++i) {
+        int n = counter_get(s, counter_index(s, hash, i));
+        if (n < min) {
+            min = n;
+        }
+    }
+    return min;
+}
@@ -0,0 +1,30 @@
+#ifndef SKETCH_H
+#define SKETCH_H
+#include "tprintf.h"
+#include <stddef.h>
+#include <stdint.h>
+
+#define SKETCH_ROWS     4
+#define SKETCH_MAX      15  // counters are 4 bits
+#define SKETCH_SAMPLE   10  // additions per tracked key before aging
+
+// A count-min sketch of how often keys were seen, by their 64-bit
+// hash: SKETCH_ROWS counters per key, spread over one table of 4-bit
+// counters packed 16 to a word, the smallest of them the estimate.
+// Once the sketch has taken SKETCH_SAMPLE additions per key it was
+// sized for, every counter is halved, so that frequencies age and keys
+// popular long ago make way for those popular now (TinyLFU).
+typedef struct {
+    uint64_t* table;
+    size_t mask;        // counters - 1
+    size_t additions;
+    size_t sample;
+} sketch;
+
+// Sizes the sketch to track about keys keys, with a table from alloc,
+// which returns zeroed memory. Returns -1 if out of memory.
+int sketch_init(sketch* s, size_t keys, void* (*alloc)(size_t));
+void sketch_add(sketch* s, uint64_t hash);
+int sketch_estimate(sketch const* s, uint64_t hash);
+
+#endif
@@ -0,0 +1,513 @@
+#define _GNU_SOURCE
+#include "stats.h"
+#include "tcp.h"
+#include "http.h"
+#include "admit.h"
+#include "cache.h"
+#include "shm.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <netdb.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#define STATS_REQLEN    1024
+
+// The numbers of one thread. Only the owner writes them; a slot
+// outlives its thread and is handed to the next new thread, so the
+// totals survive thread exits.
+typedef struct stats_slot stats_slot;
+struct stats_slot {
+    int owned;
+    pid_t pid;      // of the owner's process
+    stats_slot* next;
+    uint64_t hist[STAT_NHIST][STATS_BUCKETS];
+    uint64_t sum[STAT_NHIST];
+    uint64_t counters[STAT_NCOUNTERS];
+    uint64_t errors[STATS_ERRORS];
+};
+
+// In the shared region once stats_share moved them there, so that
+// every worker process's numbers are merged.
+static stats_slot* private_slots;
+static stats_slot** slots = &private_slots;
+static __thread stats_slot* slot;
+static pthread_key_t slot_key;
+static pthread_once_t slot_once = PTHREAD_ONCE_INIT;
+
+static char const* const hist_names[STAT_NHIST] = {
+    "accept", "read_request", "dns", "connect", "first_byte", "transfer", "transfer_bytes",
+};
+
+static char const* const counter_names[STAT_NCOUNTERS] = {
+    "hit", "disk_hit", "stale", "miss", "collapsed", "bypass", "rejected",
+    "header", "connect", "first_byte", "stall", "shed",
+    "not_modified", "replaced", "failed",
+};
+
+static char const* const error_names[STATS_ERRORS] = {
+    NULL,
+    "http_partial",
+    "http_err_method",
+    "http_err_url",
+    "http_err_version",
+    "http_err_newline",
+    "http_err_zerolentok",
+    "http_err_header",
+    "http_not_newline",
+    "http_too_many_headers",
+    "http_req_too_large",
+    "http_read_eof",
+    "http_res_too_large",
+    "http_read_err",
+    "http_err_status",
+    "http_err_chunk",
+    "http_err_truncated",
+    "http_read_timeout",
+};
+
+static double const quantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+static
+void release_slot(void* ptr) {
+    stats_slot* s = ptr;
+    // as for epoch records: no stale pid for stats_reclaim to match
+    __atomic_store_n(&(*s).pid, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&(*s).owned, 0, __ATOMIC_RELEASE);
+}
+
+static
+void make_slot_key(void) {
+    pthread_key_create(&slot_key, release_slot);
+}
+
+static
+stats_slot* take_slot(void) {
+    pthread_once(&slot_once, make_slot_key);
+    stats_slot* s = __atomic_load_n(slots, __ATOMIC_ACQUIRE);
+    for (; s != NULL; s = (*s).next) {
+        int expected = 0;
+        if (__atomic_load_n(&(*s).owned, __ATOMIC_RELAXED) == 0 &&
+            __atomic_compare_exchange_n(&(*s).owned, &expected, 1, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+    if (s == NULL) {
+        s = slots == &private_slots ? malloc(sizeof(stats_slot)) : shm_alloc(sizeof(stats_slot));
+        if (s == NULL) {
+            return NULL;
+        }
+        memset(s, 0, sizeof(*s));
+        (*s).owned = 1;
+        (*s).next = __atomic_load_n(slots, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(slots, &(*s).next, s, 1,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        }
+    }
+    __atomic_store_n(&(*s).pid, getpid(), __ATOMIC_RELAXED);
+    pthread_setspecific(slot_key, s);
+    return s;
+}
+
+int stats_share(void) {
+    stats_slot** head = shm_alloc(sizeof(stats_slot*));
+    if (head == NULL) {
+        return -1;
+    }
+    *head = NULL;
+    slots = head;
+    return 0;
+}
+
+void stats_reclaim(pid_t pid) {
+    for (stats_slot* s = __atomic_load_n(slots, __ATOMIC_ACQUIRE); s != NULL; s = (*s).next) {
+        if (__atomic_load_n(&(*s).owned, __ATOMIC_ACQUIRE)
+            && __atomic_load_n(&(*s).pid, __ATOMIC_RELAXED) == pid) {
+            __atomic_store_n(&(*s).pid, 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&(*s).owned, 0, __ATOMIC_RELEASE);
+        }
+    }
+}
+
+static
+stats_slot* own_slot(void) {
+    if (slot == NULL) {
+        slot = take_slot();
+    }
+    return slot;
+}
+
+// Single writer: a plain load and store, made atomic only so that
+// readers never see a torn value.
+static
+void add(uint64_t* p, uint64_t n) {
+    __atomic_store_n(p, __atomic_load_n(p, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+int stats_bucket(uint64_t v) {
+    if (v < (1 << STATS_SUB_BITS)) {
+        return (int)v;
+    }
+    int exp = 63 - __builtin_clzll(v);
+    int sub = (int)(v >> (exp - STATS_SUB_BITS)) & ((1 << STATS_SUB_BITS) - 1);
+    return ((exp - STATS_SUB_BITS + 1) << STATS_SUB_BITS) + sub;
+}
+
+uint64_t stats_bucket_top(int b) {
+    if (b < (1 << STATS_SUB_BITS)) {
+        return b;
+    }
+    int exp = (b >> STATS_SUB_BITS) + STATS_SUB_BITS - 1;
+    uint64_t sub = b & ((1 << STATS_SUB_BITS) - 1);
+    uint64_t width = 1ULL << (exp - STATS_SUB_BITS);
+    return (((1ULL << STATS_SUB_BITS) + sub) << (exp - STATS_SUB_BITS)) + (width - 1);
+}
+
+uint64_t stats_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void stats_observe(int hist, uint64_t value) {
+    stats_slot* s = own_slot();
+    if (s == NULL) {
+        return;
+    }
+    add(&(*s).hist[hist][stats_bucket(value)], 1);
+    add(&(*s).sum[hist], value);
+}
+
+void stats_since(int hist, uint64_t start) {
+    uint64_t now = stats_now();
+    stats_observe(hist, now > start ? now - start : 0);
+}
+
+void stats_count(int counter) {
+    stats_slot* s = own_slot();
+    if (s != NULL) {
+        add(&(*s).counters[counter], 1);
+    }
+}
+
+void stats_error(int err) {
+    stats_slot* s = own_slot();
+    if (s != NULL && err < 0 && -err < STATS_ERRORS) {
+        add(&(*s).errors[-err], 1);
+    }
+}
+
+// Sums every thread's numbers into total.
+static
+void merge(stats_slot* total) {
+    memset(total, 0, sizeof(*total));
+    stats_slot* s = __atomic_load_n(slots, __ATOMIC_ACQUIRE);
+    for (; s != NULL; s = (*s).next) {
+        for (int h = 0; h < STAT_NHIST; ++h) {
+            for (int b = 0; b < STATS_BUCKETS; ++b) {
+                (*total).hist[h][b] += __atomic_load_n(&(*s).hist[h][b], __ATOMIC_RELAXED);
+            }
+            (*total).sum[h] += __atomic_load_n(&(*s).sum[h], __ATOMIC_RELAXED);
+        }
+        for (int i = 0; i < STAT_NCOUNTERS; ++i) {
+            (*total).counters[i] += __atomic_load_n(&(*s).counters[i], __ATOMIC_RELAXED);
+        }
+        for (int i = 0; i < STATS_ERRORS; ++i) {
+            (*total).errors[i] += __atomic_load_n(&(*s).errors[i], __ATOMIC_RELAXED);
+        }
+    }
+}
+
+// Prints hist as a summary; label is empty or like stage="dns".
+static
+void print_summary(FILE* f, char const* name, char const* label,
+                   uint64_t const* hist, uint64_t sum, double scale) {
+    uint64_t count = 0;
+    for (int b = 0; b < STATS_BUCKETS; ++b) {
+        count += hist[b];
+    }
+    char const* sep = label[0] ? "," : "";
+    for (size_t q = 0; q < sizeof(quantiles)/sizeof(quantiles[0]); ++q) {
+        // the bucket holding the value of this rank
+        uint64_t rank = (uint64_t)(quantiles[q] * count + 0.999999);
+        uint64_t seen = 0;
+        uint64_t value = 0;
+        for (int b = 0; b < STATS_BUCKETS && count > 0; ++b) {
+            seen += hist[b];
+            if (seen >= rank) {
+                value = stats_bucket_top(b);
+                break;
+            }
+        }
+        fprintf(f, "%s{%s%squantile=\"%g\"} %.9g\n", name, label, sep, quantiles[q], value * scale);
+    }
+    char braces[80] = "";
+    if (label[0]) {
+        snprintf(braces, sizeof(braces), "{%s}", label);
+    }
+    fprintf(f, "%s_sum%s %.9g\n", name, braces, sum * scale);
+    fprintf(f, "%s_count%s %llu\n", name, braces, (unsigned long long)count);
+}
+
+// Renders all statistics; the caller frees the returned text.
+static
+char* render(size_t* len) {
+    stats_slot* total = malloc(sizeof(stats_slot));
+    if (total == NULL) {
+        return NULL;
+    }
+    merge(total);
+
+    char* text = NULL;
+    FILE* f = open_memstream(&text, len);
+    if (f == NULL) {
+        free(total);
+        return NULL;
+    }
+    fprintf(f, "# HELP webproxy_stage_seconds Time spent in each stage of serving a request.\n");
+    fprintf(f, "# TYPE webproxy_stage_seconds summary\n");
+    for (int h = 0; h < STAT_NHIST; ++h) {
+        if (h == STAT_TRANSFER_BYTES) {
+            continue;
+        }
+        char label[64];
+        snprintf(label, sizeof(label), "stage=\"%s\"", hist_names[h]);
+        print_summary(f, "webproxy_stage_seconds", label, (*total).hist[h], (*total).sum[h], 1e-9);
+    }
+    fprintf(f, "# HELP webproxy_transfer_bytes Body bytes relayed per response.\n");
+    fprintf(f, "# TYPE webproxy_transfer_bytes summary\n");
+    print_summary(f, "webproxy_transfer_bytes", "", (*total).hist[STAT_TRANSFER_BYTES],
+                  (*total).sum[STAT_TRANSFER_BYTES], 1);
+
+    fprintf(f, "# HELP webproxy_cache_requests_total Requests by cache outcome.\n");
+    fprintf(f, "# TYPE webproxy_cache_requests_total counter\n");
+    for (int i = STAT_CACHE_HIT; i <= STAT_CACHE_BYPASS; ++i) {
+        fprintf(f, "webproxy_cache_requests_total{outcome=\"%s\"} %llu\n",
+                counter_names[i], (unsigned long long)(*total).counters[i]);
+    }
+    uint64_t const* c = (*total).counters;
+    uint64_t hits = c[STAT_CACHE_HIT] + c[STAT_CACHE_DISK_HIT] + c[STAT_CACHE_STALE];
+    uint64_t lookups = hits + c[STAT_CACHE_MISS] + c[STAT_CACHE_COLLAPSED];
+    fprintf(f, "# HELP webproxy_cache_hit_ratio Cacheable requests answered from the cache, of all since startup.\n");
+    fprintf(f, "# TYPE webproxy_cache_hit_ratio gauge\n");
+    fprintf(f, "webproxy_cache_hit_ratio %.6f\n", lookups ? (double)hits / lookups : 0.0);
+    cache_usage usage;
+    cache_counts(&usage);
+    fprintf(f, "# HELP webproxy_cache_bytes Bytes held by the memory cache.\n");
+    fprintf(f, "# TYPE webproxy_cache_bytes gauge\n");
+    fprintf(f, "webproxy_cache_bytes %zu\n", usage.used);
+    fprintf(f, "# HELP webproxy_cache_entries Entries in the memory cache.\n");
+    fprintf(f, "# TYPE webproxy_cache_entries gauge\n");
+    fprintf(f, "webproxy_cache_entries %zu\n", usage.entries);
+    fprintf(f, "# HELP webproxy_cache_admissions_total New entries the TinyLFU window evicted, by whether they displaced older ones.\n");
+    fprintf(f, "# TYPE webproxy_cache_admissions_total counter\n");
+    fprintf(f, "webproxy_cache_admissions_total{result=\"admitted\"} %llu\n",
+            (unsigned long long)usage.admitted);
+    fprintf(f, "webproxy_cache_admissions_total{result=\"rejected\"} %llu\n",
+            (unsigned long long)usage.rejected);
+    if (usage.region_size) {
+        fprintf(f, "# HELP webproxy_cache_region_bytes Pages of the region shared by the worker processes, by use.\n");
+        fprintf(f, "# TYPE webproxy_cache_region_bytes gauge\n");
+        fprintf(f, "webproxy_cache_region_bytes{state=\"used\"} %zu\n", usage.region_used);
+        fprintf(f, "webproxy_cache_region_bytes{state=\"free\"} %zu\n",
+                usage.region_size - usage.region_used);
+    }
+    fprintf(f, "# HELP webproxy_rejected_connections_total Connections answered with a 503 because no thread was free.\n");
+    fprintf(f, "# TYPE webproxy_rejected_connections_total counter\n");
+    fprintf(f, "webproxy_rejected_connections_total %llu\n",
+            (unsigned long long)(*total).counters[STAT_REJECTED]);
+    int admitted, queued;
+    admit_counts(&admitted, &queued);
+    fprintf(f, "# HELP webproxy_shed_requests_total Fetches answered with a 503 by admission control.\n");
+    fprintf(f, "# TYPE webproxy_shed_requests_total counter\n");
+    fprintf(f, "webproxy_shed_requests_total %llu\n",
+            (unsigned long long)(*total).counters[STAT_SHED]);
+    fprintf(f, "# HELP webproxy_fetches_in_flight Origin fetches admitted and not done.\n");
+    fprintf(f, "# TYPE webproxy_fetches_in_flight gauge\n");
+    fprintf(f, "webproxy_fetches_in_flight %d\n", admitted);
+    fprintf(f, "# HELP webproxy_fetches_queued Origin fetches waiting to be admitted.\n");
+    fprintf(f, "# TYPE webproxy_fetches_queued gauge\n");
+    fprintf(f, "webproxy_fetches_queued %d\n", queued);
+    fprintf(f, "# HELP webproxy_timeouts_total Requests given up by the deadline they missed.\n");
+    fprintf(f, "# TYPE webproxy_timeouts_total counter\n");
+    for (int i = STAT_TIMEOUT_HEADER; i <= STAT_TIMEOUT_STALL; ++i) {
+        fprintf(f, "webproxy_timeouts_total{deadline=\"%s\"} %llu\n",
+                counter_names[i], (unsigned long long)(*total).counters[i]);
+    }
+    fprintf(f, "# HELP webproxy_revalidations_total Background revalidations of stale entries by outcome.\n");
+    fprintf(f, "# TYPE webproxy_revalidations_total counter\n");
+    for (int i = STAT_REVALIDATE_NOT_MODIFIED; i <= STAT_REVALIDATE_FAILED; ++i) {
+        fprintf(f, "webproxy_revalidations_total{result=\"%s\"} %llu\n",
+                counter_names[i], (unsigned long long)(*total).counters[i]);
+    }
+    fprintf(f, "# HELP webproxy_http_errors_total Request and response reads by http.h error code.\n");
+    fprintf(f, "# TYPE webproxy_http_errors_total counter\n");
+    for (int i = 1; i < STATS_ERRORS; ++i) {
+        fprintf(f, "webproxy_http_errors_total{code=\"%s\"} %llu\n",
+                error_names[i], (unsigned long long)(*total).errors[i]);
+    }
+    fprintf(f, "# HELP webproxy_log_dropped_total Log messages dropped on full rings.\n");
+    fprintf(f, "# TYPE webproxy_log_dropped_total counter\n");
+    fprintf(f, "webproxy_log_dropped_total %llu\n", (unsigned long long)log_dropped());
+    fclose(f);
+    free(total);
+    return text;
+}
+
+static
+int write_all(int fd, char const* buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Sets the limit called name to value, if that is one.
+static
+int set_limit(admit_limits* l, char const* name, int value) {
+    if (strcmp(name, "global") == 0 && value >= 1) {
+        (*l).global = value;
+    } else if (strcmp(name, "origin") == 0 && value >= 1) {
+        (*l).per_origin = value;
+    } else if (strcmp(name, "queue") == 0 && value >= 0) {
+        (*l).queue = value;
+    } else if (strcmp(name, "wait_ms") == 0 && value >= 0) {
+        (*l).wait_ms = value;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+// Shows the admission limits, after changing those in the query of
+// a POST. Nothing changes unless all of them are valid.
+static
+void serve_limits(int fd, char const* req) {
+    admit_limits l = admit_get();
+    if (strncmp(req, "POST /limits?", 13) == 0) {
+        char const* p = &req[13];
+        while (*p != ' ' && *p != '\0') {
+            char name[16];
+            int value;
+            int used = 0;
+            if (sscanf(p, "%15[a-z_]=%d%n", name, &value, &used) != 2
+                || set_limit(&l, name, value) != 0) {
+                char const* bad = "HTTP/1.0 400 Bad Request\r\nContent-Length: 0\r\n\r\n";
+                write_all(fd, bad, strlen(bad));
+                return;
+            }
+            p += used;
+            if (*p == '&') {
+                p += 1;
+            }
+        }
+        admit_set(l);
+        tlog(LOG_INFO, "admission limits: global %d, per origin %d, queue %d, wait %d ms\n",
+            l.global, l.per_origin, l.queue, l.wait_ms);
+    }
+    char body[256];
+    int len = snprintf(body, sizeof(body), "global %d\norigin %d\nqueue %d\nwait_ms %d\n",
+        l.global, l.per_origin, l.queue, l.wait_ms);
+    char head[128];
+    int n = snprintf(head, sizeof(head),
+        "HTTP/1.0 200 OK\r\n"
+        "Content-Type: text/plain\r\n"
+        "Content-Length: %d\r\n"
+        "\r\n", len);
+    if (write_all(fd, head, n) == 0) {
+        write_all(fd, body, len);
+    }
+}
+
+// Answers one admin request and closes the connection.
+static
+void serve_admin(int fd) {
+    char req[STATS_REQLEN];
+    size_t count = 0;
+    while (count < sizeof(req) - 1) {
+        ssize_t n = read(fd, &req[count], sizeof(req) - 1 - count);
+        if (n <= 0) {
+            break;
+        }
+        count += n;
+        req[count] = '\0';
+        if (strstr(req, "\r\n\r\n") || strstr(req, "\n\n")) {
+            break;
+        }
+    }
+    req[count] = '\0';
+
+    char head[256];
+    if (strncmp(req, "GET /limits ", 12) == 0 || strncmp(req, "POST /limits ", 13) == 0
+        || strncmp(req, "POST /limits?", 13) == 0) {
+        serve_limits(fd, req);
+        return;
+    }
+    if (strncmp(req, "GET /metrics ", 13) != 0 && strncmp(req, "GET / ", 6) != 0) {
+        char const* notfound = "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+        write_all(fd, notfound, strlen(notfound));
+        return;
+    }
+    size_t len = 0;
+    char* text = render(&len);
+    if (text == NULL) {
+        char const* err = "HTTP/1.0 500 Internal Server Error\r\nContent-Length: 0\r\n\r\n";
+        write_all(fd, err, strlen(err));
+        return;
+    }
+    int n = snprintf(head, sizeof(head),
+        "HTTP/1.0 200 OK\r\n"
+        "Content-Type: text/plain; version=0.0.4\r\n"
+        "Content-Length: %zu\r\n"
+        "\r\n", len);
+    if (write_all(fd, head, n) == 0) {
+        write_all(fd, text, len);
+    }
+    free(text);
+}
+
+static
+void* admin_main(void* arg) {
+    int ln = (int)(intptr_t)arg;
+    while (1) {
+        int fd = accept4(ln, NULL, NULL, SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno != EINTR) {
+                perror("admin.accept4");
+            }
+            continue;
+        }
+        serve_admin(fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+int stats_serve(char const* node, char const* service) {
+    int ln = listen_tcp(node, service);
+    if (ln < 0) {
+        return ln;
+    }
+    pthread_t thread;
+    int err = pthread_create(&thread, NULL, admin_main, (void*)(intptr_t)ln);
+    if (err != 0) {
+        tlog(LOG_ERROR, "stats: pthread_create: %s\n", strerror(err));
+        close(ln);
+        return EAI_SYSTEM;
+    }
+    pthread_detach(thread);
+    return 0;
+}
@@ -0,0 +1,74 @@
+#ifndef STATS_H
+#define STATS_H
+#include "tprintf.h"
+#include <stdint.h>
+#include <sys/types.h>
+
+// Histograms, of nanoseconds unless noted.
+enum {
+    STAT_ACCEPT,        // accept returned -> connection handed to its server
+    STAT_READ_REQUEST,  // waiting for and reading a request head
+    STAT_DNS,           // looking up the origin
+    STAT_CONNECT,       // connecting to the origin (all addresses tried)
+    STAT_FIRST_BYTE,    // request forwarded -> response head parsed
+    STAT_TRANSFER,      // relaying the body
+    STAT_TRANSFER_BYTES,// body bytes relayed (bytes, not time)
+    STAT_NHIST,
+};
+
+// Counters.
+enum {
+    STAT_CACHE_HIT,
+    STAT_CACHE_DISK_HIT,
+    STAT_CACHE_STALE,     // served past its expiry
+    STAT_CACHE_MISS,
+    STAT_CACHE_COLLAPSED, // served from another request's fetch
+    STAT_CACHE_BYPASS,    // not cacheable
+    STAT_REJECTED,        // connections turned away with a 503
+    STAT_TIMEOUT_HEADER,  // request head not in within the deadline
+    STAT_TIMEOUT_CONNECT,
+    STAT_TIMEOUT_FIRST_BYTE,
+    STAT_TIMEOUT_STALL,   // body relay made no progress
+    STAT_SHED,            // fetches answered with a 503 by admission control
+    STAT_REVALIDATE_NOT_MODIFIED,
+    STAT_REVALIDATE_REPLACED, // the origin sent a new response
+    STAT_REVALIDATE_FAILED,
+    STAT_NCOUNTERS,
+};
+
+// Buckets cover every uint64_t with 4 significant bits, so a value is
+// off by at most 1/16 (HDR histogram style, log-linear).
+#define STATS_SUB_BITS  4
+#define STATS_BUCKETS   ((64 - STATS_SUB_BITS + 1) << STATS_SUB_BITS)
+// http_err_* codes, counted by their negation
+#define STATS_ERRORS    18
+
+uint64_t stats_now(void);
+// The bucket of value v, and the largest value in bucket b.
+int stats_bucket(uint64_t v);
+uint64_t stats_bucket_top(int b);
+
+// Each thread records into its own set of histograms and counters
+// without synchronization; readers merge all of them.
+void stats_observe(int hist, uint64_t value);
+// Observes the nanoseconds since start (from stats_now).
+void stats_since(int hist, uint64_t start);
+void stats_count(int counter);
+// Counts an http_err_* (or other http_*) code.
+void stats_error(int err);
+
+// Moves the statistics into the shared region (shm.h), before any
+// thread records any, so that the worker processes forked after it
+// record into it and are merged together. Returns -1 if out of memory.
+int stats_share(void);
+// Hands the numbers of a process that died to new threads.
+void stats_reclaim(pid_t pid);
+
+// Serves the merged statistics in the Prometheus text format at
+// http://node:service/metrics from a thread of its own. GET /limits
+// there shows the admission limits (admit.h); POST /limits?global=N&
+// origin=N&queue=N&wait_ms=N changes those given.
+// Returns 0, or a listen_tcp error.
+int stats_serve(char const* node, char const* service);
+
+#endif
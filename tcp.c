@@ -1,10 +1,19 @@
 #include "tcp.h"
+#include "timer.h"
+#include <string.h>
+#include <poll.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
 
-int listen_tcp(char const* node, char const* service) {
+static
+int listen_tcp_opts(char const* node, char const* service, int reuseport) {
     struct addrinfo* res = NULL;
     struct addrinfo hints = {0, 0, SOCK_STREAM, 0, 0, 0, 0, 0};
     int err = getaddrinfo(node, service, &hints, &res);
@@ -26,6 +35,14 @@ int listen_tcp(char const* node, char const* service) {
             continue;
         }
 
+        if (reuseport) {
+            int one = 1;
+            err = setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+            if (err != 0) {
+                continue;
+            }
+        }
+
         err = bind(fd, r->ai_addr, r->ai_addrlen);
         if (err != 0) {
             continue;
@@ -47,6 +64,18 @@ int listen_tcp(char const* node, char const* service) {
     return fd;
 }
 
+int listen_tcp(char const* node, char const* service) {
+    return listen_tcp_opts(node, service, 0);
+}
+
+int listen_tcp_reuseport(char const* node, char const* service) {
+    return listen_tcp_opts(node, service, 1);
+}
+
+int dial_stagger_ms = DIAL_DEFAULT_STAGGER_MS;
+int dial_attempt_ms = DIAL_DEFAULT_ATTEMPT_MS;
+int dial_timeout_ms = DIAL_DEFAULT_TIMEOUT_MS;
+
 int dial_tcp(char const* node, char const* service) {
     struct addrinfo* res = NULL;
     struct addrinfo hints = {0, 0, SOCK_STREAM, 0, 0, 0, 0, 0};
@@ -54,27 +83,239 @@ int dial_tcp(char const* node, char const* service) {
     if (err != 0) {
         return err;
     }
+    dns_result addrs;
+    addrs.err = 0;
+    addrs.n = 0;
+    for (struct addrinfo const* r = res; r != NULL && addrs.n < DNS_MAX_ADDRS; r = r->ai_next) {
+        if (r->ai_addrlen > sizeof(addrs.addr[0])) {
+            continue;
+        }
+        memcpy(&addrs.addr[addrs.n], r->ai_addr, r->ai_addrlen);
+        addrs.addrlen[addrs.n] = r->ai_addrlen;
+        addrs.n += 1;
+    }
+    freeaddrinfo(res);
 
-    struct addrinfo const* r = res;
-    int fd = -1;
-    for (; r != NULL; r = r->ai_next) {
-        fd = socket(r->ai_family, r->ai_socktype|SOCK_CLOEXEC, r->ai_protocol);
+    int fd = dial_tcp_addrs(&addrs);
+    return fd == -1 ? EAI_SYSTEM : fd;
+}
+
+int dial_tcp_addrs(dns_result const* addrs) {
+    dial_race r;
+    dial_race_start(&r, addrs);
+    while (1) {
+        int fd = dial_race_poll(&r, -1);
+        if (fd >= 0) {
+            set_nonblocking(fd, 0);
+            return fd;
+        }
+        if (fd == dial_failed) {
+            errno = r.err;
+            return -1;
+        }
+    }
+}
+
+static
+int family(dns_result const* addrs, int i) {
+    return ((struct sockaddr const*)&(*addrs).addr[i])->sa_family;
+}
+
+// Orders addrs alternating between families, starting with the
+// family of the first address (RFC 8305 section 4).
+static
+void interleave(dial_race* r) {
+    dns_result const* addrs = (*r).addrs;
+    int taken[DNS_MAX_ADDRS] = {0};
+    int want = (*r).n > 0 ? family(addrs, 0) : AF_UNSPEC;
+    for (int k = 0; k < (*r).n; ++k) {
+        int pick = -1;
+        for (int i = 0; i < (*r).n && pick == -1; ++i) {
+            if (!taken[i] && family(addrs, i) == want) {
+                pick = i;
+            }
+        }
+        for (int i = 0; i < (*r).n && pick == -1; ++i) {
+            if (!taken[i]) {
+                pick = i;
+            }
+        }
+        taken[pick] = 1;
+        (*r).order[k] = pick;
+        for (int i = 0; i < (*r).n; ++i) {
+            if (!taken[i] && family(addrs, i) != family(addrs, pick)) {
+                want = family(addrs, i);
+                break;
+            }
+        }
+    }
+}
+
+// Starts the next attempt that gets as far as connecting.
+static
+void start_next(dial_race* r, uint64_t now) {
+    while ((*r).next < (*r).n) {
+        int k = (*r).next;
+        (*r).next += 1;
+        int i = (*r).order[k];
+        struct sockaddr const* addr = (struct sockaddr const*)&(*(*r).addrs).addr[i];
+        int fd = socket((*addr).sa_family, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
         if (fd == -1) {
+            (*r).err = errno;
+            continue;
+        }
+        if (connect(fd, addr, (*(*r).addrs).addrlen[i]) != 0 && errno != EINPROGRESS) {
+            (*r).err = errno;
+            close(fd);
             continue;
         }
+        // an immediate connect is found by the next poll like the others
+        (*r).fd[k] = fd;
+        (*r).expires[k] = now + dial_attempt_ms;
+        (*r).pending += 1;
+        (*r).next_at = now + dial_stagger_ms;
+        return;
+    }
+}
 
-        int err = connect(fd, r->ai_addr, r->ai_addrlen);
-        if (err != 0) {
+void dial_race_start(dial_race* r, dns_result const* addrs) {
+    memset(r, 0, sizeof(*r));
+    (*r).addrs = addrs;
+    (*r).n = (*addrs).n;
+    (*r).err = ECONNREFUSED;
+    for (int k = 0; k < DNS_MAX_ADDRS; ++k) {
+        (*r).fd[k] = -1;
+    }
+    interleave(r);
+    uint64_t now = timer_now();
+    (*r).deadline = now + dial_timeout_ms;
+    start_next(r, now);
+}
+
+static
+void drop_attempt(dial_race* r, int k, int err) {
+    close((*r).fd[k]);
+    (*r).fd[k] = -1;
+    (*r).pending -= 1;
+    (*r).err = err;
+}
+
+int dial_race_timeout(dial_race const* r) {
+    uint64_t due = (*r).deadline;
+    if ((*r).next < (*r).n && (*r).next_at < due) {
+        due = (*r).next_at;
+    }
+    for (int k = 0; k < (*r).next; ++k) {
+        if ((*r).fd[k] != -1 && (*r).expires[k] < due) {
+            due = (*r).expires[k];
+        }
+    }
+    uint64_t now = timer_now();
+    return due > now ? (int)(due - now) : 0;
+}
+
+int dial_race_poll(dial_race* r, int timeout_ms) {
+    if ((*r).pending == 0 && (*r).next >= (*r).n) {
+        return dial_failed;
+    }
+    struct pollfd fds[DNS_MAX_ADDRS];
+    int slot[DNS_MAX_ADDRS];
+    int nfds = 0;
+    for (int k = 0; k < (*r).next; ++k) {
+        if ((*r).fd[k] != -1) {
+            fds[nfds].fd = (*r).fd[k];
+            fds[nfds].events = POLLOUT;
+            fds[nfds].revents = 0;
+            slot[nfds] = k;
+            nfds += 1;
+        }
+    }
+    int due = dial_race_timeout(r);
+    if (timeout_ms < 0 || timeout_ms > due) {
+        timeout_ms = due;
+    }
+    if (poll(fds, nfds, timeout_ms) == -1 && errno != EINTR) {
+        (*r).err = errno;
+        dial_race_cancel(r);
+        return dial_failed;
+    }
+
+    uint64_t now = timer_now();
+    int failed = 0;
+    for (int j = 0; j < nfds; ++j) {
+        if (fds[j].revents == 0) {
             continue;
         }
+        int k = slot[j];
+        int soerr = 0;
+        socklen_t len = sizeof(soerr);
+        if (getsockopt((*r).fd[k], SOL_SOCKET, SO_ERROR, &soerr, &len) != 0) {
+            soerr = errno;
+        }
+        if (soerr != 0) {
+            drop_attempt(r, k, soerr);
+            failed = 1;
+            continue;
+        }
+        int fd = (*r).fd[k];
+        (*r).fd[k] = -1;
+        (*r).pending -= 1;
+        dial_race_cancel(r);
+        return fd;
+    }
+    for (int k = 0; k < (*r).next; ++k) {
+        if ((*r).fd[k] != -1 && (*r).expires[k] <= now) {
+            drop_attempt(r, k, ETIMEDOUT);
+            failed = 1;
+        }
+    }
+    if (now >= (*r).deadline) {
+        if ((*r).pending > 0 || (*r).next < (*r).n) {
+            (*r).err = ETIMEDOUT;
+        }
+        dial_race_cancel(r);
+        return dial_failed;
+    }
+    // the next address goes once an attempt failed or it is its turn
+    if ((*r).next < (*r).n && (failed || (*r).pending == 0 || now >= (*r).next_at)) {
+        start_next(r, now);
+    }
+    if ((*r).pending == 0) {
+        dial_race_cancel(r);
+        return dial_failed;
+    }
+    return dial_in_progress;
+}
 
-        break;
+void dial_race_cancel(dial_race* r) {
+    for (int k = 0; k < (*r).next; ++k) {
+        if ((*r).fd[k] != -1) {
+            close((*r).fd[k]);
+            (*r).fd[k] = -1;
+        }
     }
-    freeaddrinfo(res);
+    (*r).pending = 0;
+    (*r).next = (*r).n;
+}
 
-    if (r == NULL) {
-        return EAI_SYSTEM;
+int set_nonblocking(int fd, int on) {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags == -1) {
+        return -1;
     }
+    flags = on ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+    return fcntl(fd, F_SETFL, flags);
+}
 
-    return fd;
+int set_nodelay(int fd) {
+    int one = 1;
+    return setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+int set_io_timeout(int fd, int ms) {
+    struct timeval tv = {ms / 1000, (ms % 1000) * 1000};
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) != 0) {
+        return -1;
+    }
+    return setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
 }
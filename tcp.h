@@ -1,9 +1,70 @@
 #ifndef TCP_H
 #define TCP_H
 #include "tprintf.h"
+#include "dns.h"
 #include <stdint.h>
 
 int listen_tcp(char const* node, char const* service);
+// Like listen_tcp, but with SO_REUSEPORT set so several sockets can be
+// bound to the same address and the kernel spreads accepts across them.
+int listen_tcp_reuseport(char const* node, char const* service);
+// Resolves node:service with getaddrinfo and dials it like
+// dial_tcp_addrs. Returns the socket, or an EAI_* code (< 0).
 int dial_tcp(char const* node, char const* service);
+// Connects to whichever of addrs accepts first (see dial_race).
+// Returns the socket, or -1 with errno set by the last failure or
+// ETIMEDOUT.
+int dial_tcp_addrs(dns_result const* addrs);
+
+#define DIAL_DEFAULT_STAGGER_MS 250
+#define DIAL_DEFAULT_ATTEMPT_MS 3000
+#define DIAL_DEFAULT_TIMEOUT_MS 10000
+
+// Delay before racing the next address while earlier ones are still
+// connecting, the time an attempt gets, and the time all of them get.
+extern int dial_stagger_ms;
+extern int dial_attempt_ms;
+extern int dial_timeout_ms;
+
+#define dial_in_progress    -1
+#define dial_failed         -2
+
+// A Happy Eyeballs (RFC 8305) dial: non-blocking connects to the
+// addresses in turn, alternating address families, each started once
+// the previous one failed or dial_stagger_ms passed. The first to
+// connect wins and the others are closed.
+typedef struct {
+    dns_result const* addrs;
+    int n;
+    int order[DNS_MAX_ADDRS];
+    // the attempt on addrs[order[i]], -1 if not started or over
+    int fd[DNS_MAX_ADDRS];
+    uint64_t expires[DNS_MAX_ADDRS];
+    int next;           // of order, to start next
+    int pending;        // attempts connecting
+    uint64_t next_at;   // when to start the next one regardless
+    uint64_t deadline;
+    int err;            // errno of the last failure
+} dial_race;
+
+// Starts the first attempt. addrs must stay put until the race is over.
+void dial_race_start(dial_race* r, dns_result const* addrs);
+// Waits up to timeout_ms (-1: until something is due) for an attempt
+// to connect, and starts or expires attempts as they fall due.
+// Returns the connected socket (non-blocking), dial_in_progress, or
+// dial_failed with (*r).err set once every attempt failed or the
+// deadline passed.
+int dial_race_poll(dial_race* r, int timeout_ms);
+// Milliseconds until dial_race_poll has something to do by the clock.
+int dial_race_timeout(dial_race const* r);
+// Closes the attempts still connecting.
+void dial_race_cancel(dial_race* r);
+int set_nonblocking(int fd, int on);
+// Disables Nagle's algorithm, so the tail of a response written in
+// several pieces does not wait for the client's delayed ACK.
+int set_nodelay(int fd);
+// Bounds every blocking read and write on fd to ms milliseconds
+// (0 for no bound); one that takes longer fails with EAGAIN.
+int set_io_timeout(int fd, int ms);
 
 #endif
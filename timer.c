@@ -0,0 +1,137 @@
+#include "timer.h"
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+
+#define TIMER_MASK      (TIMER_SLOTS - 1)
+// the furthest a timer can be put: the top level's last slot
+#define TIMER_MAX_DELAY ((uint64_t)TIMER_MASK << (TIMER_BITS * (TIMER_LEVELS - 1)))
+
+uint64_t timer_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void timer_wheel_init(timer_wheel* w, uint64_t now) {
+    memset(w, 0, sizeof(*w));
+    (*w).now = now;
+}
+
+// Puts t into the lowest level whose slots reach its expiry, counted
+// from the wheel's current tick.
+static
+void insert(timer_wheel* w, timer* t) {
+    int level = 0;
+    while (level < TIMER_LEVELS - 1
+           && ((*t).expires >> (level * TIMER_BITS))
+              - ((*w).now >> (level * TIMER_BITS)) >= TIMER_SLOTS) {
+        level += 1;
+    }
+    timer** slot = &(*w).slots[level][((*t).expires >> (level * TIMER_BITS)) & TIMER_MASK];
+    (*t).next = *slot;
+    if ((*t).next) {
+        (*(*t).next).link = &(*t).next;
+    }
+    *slot = t;
+    (*t).link = slot;
+}
+
+void timer_arm(timer_wheel* w, timer* t, uint64_t expires) {
+    if ((*t).link) {
+        timer_cancel(w, t);
+    }
+    if (expires <= (*w).now) {
+        expires = (*w).now + 1;
+    } else if (expires - (*w).now > TIMER_MAX_DELAY) {
+        expires = (*w).now + TIMER_MAX_DELAY;
+    }
+    (*t).expires = expires;
+    insert(w, t);
+    (*w).armed += 1;
+}
+
+void timer_cancel(timer_wheel* w, timer* t) {
+    if (!(*t).link) {
+        return;
+    }
+    *(*t).link = (*t).next;
+    if ((*t).next) {
+        (*(*t).next).link = (*t).link;
+    }
+    (*t).link = NULL;
+    (*t).next = NULL;
+    (*w).armed -= 1;
+}
+
+int timer_armed(timer const* t) {
+    return (*t).link != NULL;
+}
+
+// Moves the timers of a slot that the wheel turned onto down to the
+// levels below.
+static
+void cascade(timer_wheel* w, int level) {
+    timer** slot = &(*w).slots[level][((*w).now >> (level * TIMER_BITS)) & TIMER_MASK];
+    timer* t = *slot;
+    *slot = NULL;
+    while (t) {
+        timer* next = (*t).next;
+        insert(w, t);
+        t = next;
+    }
+}
+
+timer* timer_expire(timer_wheel* w, uint64_t now) {
+    timer* expired = NULL;
+    while ((*w).now < now) {
+        if ((*w).armed == 0) {
+            (*w).now = now;
+            break;
+        }
+        (*w).now += 1;
+        int top = 0;
+        while (top < TIMER_LEVELS - 1
+               && ((*w).now & (((uint64_t)1 << ((top + 1) * TIMER_BITS)) - 1)) == 0) {
+            top += 1;
+        }
+        // from the top, so that what comes down lands in the slots
+        // cascaded next
+        for (int level = top; level > 0; --level) {
+            cascade(w, level);
+        }
+        timer** slot = &(*w).slots[0][(*w).now & TIMER_MASK];
+        while (*slot) {
+            timer* t = *slot;
+            *slot = (*t).next;
+            (*t).link = NULL;
+            (*t).next = expired;
+            expired = t;
+            (*w).armed -= 1;
+        }
+    }
+    return expired;
+}
+
+int timer_wheel_timeout(timer_wheel const* w, uint64_t now) {
+    if ((*w).armed == 0) {
+        return -1;
+    }
+    uint64_t due = UINT64_MAX;
+    for (int level = 0; level < TIMER_LEVELS; ++level) {
+        int shift = level * TIMER_BITS;
+        uint64_t cur = (*w).now >> shift;
+        for (uint64_t k = 1; k < TIMER_SLOTS; ++k) {
+            if ((*w).slots[level][(cur + k) & TIMER_MASK]) {
+                if (((cur + k) << shift) < due) {
+                    due = (cur + k) << shift;
+                }
+                break;
+            }
+        }
+    }
+    if (due <= now) {
+        return 0;
+    }
+    return due - now > INT_MAX ? INT_MAX : (int)(due - now);
+}
@@ -0,0 +1,48 @@
+#ifndef TIMER_H
+#define TIMER_H
+#include "tprintf.h"
+#include <stdint.h>
+
+// A hierarchical timing wheel (Varghese and Lauck) of millisecond
+// ticks: TIMER_LEVELS wheels of TIMER_SLOTS slots, each slot of a
+// level spanning a whole turn of the level below. A timer goes into
+// the lowest level whose turn reaches its expiry and moves down a
+// level each time the wheel turns onto its slot, so arming and
+// cancelling are O(1) and expiring is O(1) per timer and level.
+#define TIMER_BITS      8
+#define TIMER_SLOTS     (1 << TIMER_BITS)
+#define TIMER_LEVELS    4   // 2^32 ms, about 49 days
+
+typedef struct timer timer;
+struct timer {
+    uint64_t expires;
+    timer* next;
+    // what points at the timer, NULL if it is not armed
+    timer** link;
+};
+
+typedef struct {
+    // the last tick expired
+    uint64_t now;
+    int armed;
+    timer* slots[TIMER_LEVELS][TIMER_SLOTS];
+} timer_wheel;
+
+// Milliseconds of CLOCK_MONOTONIC.
+uint64_t timer_now(void);
+
+void timer_wheel_init(timer_wheel* w, uint64_t now);
+// (Re)arms t to expire at expires; a time already past expires it
+// on the next tick.
+void timer_arm(timer_wheel* w, timer* t, uint64_t expires);
+void timer_cancel(timer_wheel* w, timer* t);
+int timer_armed(timer const* t);
+// Turns the wheel up to now. Returns the timers that expired, linked
+// through next and no longer armed.
+timer* timer_expire(timer_wheel* w, uint64_t now);
+// Milliseconds until timer_expire may have something to return, for
+// a poll timeout: -1 if no timer is armed. Timers on the upper levels
+// wake the caller when their slot comes down a level.
+int timer_wheel_timeout(timer_wheel const* w, uint64_t now);
+
+#endif
@@ -1,3 +1,234 @@
+#define _GNU_SOURCE
 #include "tprintf.h"
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/uio.h>
 
-pthread_mutex_t stdout_mutex;
+#define LOG_BATCH   64  // iovecs per writev
+
+// A single-producer, single-consumer byte ring. head and tail only
+// grow; the owning thread advances head, the drainer advances tail.
+// A ring outlives its thread and is handed to the next new thread.
+typedef struct log_ring log_ring;
+struct log_ring {
+    size_t head;
+    size_t tail;
+    int owned;
+    log_ring* next;
+    char buf[LOG_RING_SIZE];
+};
+
+int log_level = LOG_INFO;
+
+static log_ring* rings;
+static uint64_t dropped;
+static uint64_t dropped_total;
+static __thread log_ring* ring;
+static pthread_key_t ring_key;
+static pthread_once_t ring_once = PTHREAD_ONCE_INIT;
+// serializes the drain thread against log_flush
+static pthread_mutex_t drain_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t hooks_once = PTHREAD_ONCE_INIT;
+
+static
+void release_ring(void* ptr) {
+    log_ring* r = ptr;
+    __atomic_store_n(&(*r).owned, 0, __ATOMIC_RELEASE);
+}
+
+static
+void make_ring_key(void) {
+    pthread_key_create(&ring_key, release_ring);
+}
+
+static
+log_ring* take_ring(void) {
+    pthread_once(&ring_once, make_ring_key);
+    log_ring* r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+    for (; r != NULL; r = (*r).next) {
+        int expected = 0;
+        if (__atomic_load_n(&(*r).owned, __ATOMIC_RELAXED) == 0 &&
+            __atomic_compare_exchange_n(&(*r).owned, &expected, 1, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+    if (r == NULL) {
+        r = malloc(sizeof(log_ring));
+        if (r == NULL) {
+            return NULL;
+        }
+        (*r).head = 0;
+        (*r).tail = 0;
+        (*r).owned = 1;
+        (*r).next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&rings, &(*r).next, r, 1,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        }
+    }
+    pthread_setspecific(ring_key, r);
+    return r;
+}
+
+void log_printf(char const* fmt, ...) {
+    char line[LOG_LINE_MAX];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    if (n < 0) {
+        return;
+    }
+    size_t len = (size_t)n < sizeof(line) ? (size_t)n : sizeof(line) - 1;
+
+    if (ring == NULL) {
+        ring = take_ring();
+    }
+    if (ring == NULL) {
+        __atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    size_t head = (*ring).head;
+    size_t tail = __atomic_load_n(&(*ring).tail, __ATOMIC_ACQUIRE);
+    if (LOG_RING_SIZE - (head - tail) < len) {
+        __atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    size_t at = head % LOG_RING_SIZE;
+    size_t first = len < LOG_RING_SIZE - at ? len : LOG_RING_SIZE - at;
+    memcpy(&(*ring).buf[at], line, first);
+    memcpy((*ring).buf, &line[first], len - first);
+    __atomic_store_n(&(*ring).head, head + len, __ATOMIC_RELEASE);
+}
+
+static
+int writev_all(int fd, struct iovec* iov, int n) {
+    while (n > 0) {
+        ssize_t w = writev(fd, iov, n);
+        if (w < 0) {
+            return -1;
+        }
+        while (n > 0 && (size_t)w >= (*iov).iov_len) {
+            w -= (*iov).iov_len;
+            iov += 1;
+            n -= 1;
+        }
+        if (n > 0) {
+            (*iov).iov_base = (char*)(*iov).iov_base + w;
+            (*iov).iov_len -= w;
+        }
+    }
+    return 0;
+}
+
+// Writes what the rings hold (up to one batch) with a single writev.
+// Returns the number of bytes taken from the rings.
+static
+size_t drain(void) {
+    struct iovec iov[LOG_BATCH + 1];
+    log_ring* taken[LOG_BATCH / 2];
+    size_t heads[LOG_BATCH / 2];
+    char note[64];
+    int n = 0;
+    int ntaken = 0;
+    size_t total = 0;
+
+    pthread_mutex_lock(&drain_mutex);
+    log_ring* r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+    for (; r != NULL && ntaken < LOG_BATCH / 2; r = (*r).next) {
+        size_t head = __atomic_load_n(&(*r).head, __ATOMIC_ACQUIRE);
+        size_t tail = (*r).tail;
+        if (head == tail) {
+            continue;
+        }
+        size_t len = head - tail;
+        size_t at = tail % LOG_RING_SIZE;
+        size_t first = len < LOG_RING_SIZE - at ? len : LOG_RING_SIZE - at;
+        iov[n++] = (struct iovec){&(*r).buf[at], first};
+        if (len > first) {
+            iov[n++] = (struct iovec){(*r).buf, len - first};
+        }
+        taken[ntaken] = r;
+        heads[ntaken] = head;
+        ntaken += 1;
+        total += len;
+    }
+    uint64_t lost = __atomic_exchange_n(&dropped, 0, __ATOMIC_RELAXED);
+    if (lost > 0) {
+        __atomic_add_fetch(&dropped_total, lost, __ATOMIC_RELAXED);
+        int len = snprintf(note, sizeof(note), "log: dropped %llu messages\n",
+                           (unsigned long long)lost);
+        iov[n++] = (struct iovec){note, len};
+    }
+    if (n > 0) {
+        writev_all(STDOUT_FILENO, iov, n);
+    }
+    for (int i = 0; i < ntaken; ++i) {
+        __atomic_store_n(&(*taken[i]).tail, heads[i], __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&drain_mutex);
+    return total;
+}
+
+static
+void* drain_thread(void* arg) {
+    (void)arg;
+    while (1) {
+        if (drain() == 0) {
+            struct timespec idle = {0, LOG_IDLE_NS};
+            nanosleep(&idle, NULL);
+        }
+    }
+    return NULL;
+}
+
+static
+void lock_drain(void) {
+    pthread_mutex_lock(&drain_mutex);
+}
+
+static
+void unlock_drain(void) {
+    pthread_mutex_unlock(&drain_mutex);
+}
+
+// Flushes at exit; and forks with drain_mutex held, so that a child is
+// not left with it locked by a drain thread it does not have.
+static
+void add_hooks(void) {
+    atexit(log_flush);
+    pthread_atfork(lock_drain, unlock_drain, unlock_drain);
+}
+
+void log_init(void) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, drain_thread, NULL) != 0) {
+        return;
+    }
+    pthread_detach(thread);
+    pthread_once(&hooks_once, add_hooks);
+}
+
+int log_parse_level(char const* name) {
+    char const* names[] = {"error", "warn", "info", "debug"};
+    for (int i = 0; i < (int)(sizeof(names)/sizeof(names[0])); ++i) {
+        if (strcmp(name, names[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+void log_flush(void) {
+    while (drain() > 0) {
+    }
+}
+
+uint64_t log_dropped(void) {
+    return __atomic_load_n(&dropped_total, __ATOMIC_RELAXED) +
+           __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+}
@@ -1,22 +1,47 @@
 #ifndef TPRINTF_H
 #define TPRINTF_H
 #include <stdio.h>
-#include <pthread.h>
+#include <stdint.h>
 
-extern pthread_mutex_t stdout_mutex;
+#define LOG_ERROR   0
+#define LOG_WARN    1
+#define LOG_INFO    2
+#define LOG_DEBUG   3
+
+#define LOG_RING_SIZE   (1 << 15)   // per thread
+#define LOG_LINE_MAX    1024        // longer messages are truncated
+#define LOG_IDLE_NS     10000000    // drain thread sleep when idle
+
+// Messages above this level are skipped without formatting them.
+extern int log_level;
 
 // comment out this #define to allow
 // ./webproxy to print debug info.
 // #define CSCI_TEST_PY
 
 #ifdef CSCI_TEST_PY
-#define tprintf(...)
+#define tlog(level, ...)
 #else
-#define tprintf(...) do {                   \
-    pthread_mutex_lock(&stdout_mutex);      \
-    printf(__VA_ARGS__);                    \
-    pthread_mutex_unlock(&stdout_mutex);    \
+#define tlog(level, ...) do {               \
+    if ((level) <= log_level) {             \
+        log_printf(__VA_ARGS__);            \
+    }                                       \
 } while (0)
 #endif
 
+#define tprintf(...) tlog(LOG_INFO, __VA_ARGS__)
+
+// Each thread formats into its own ring buffer; a drain thread
+// writes the rings to stdout in batches. Nothing blocks on a full
+// ring: the message is dropped and counted instead, and the count
+// is reported with the next batch. A process forked after log_init
+// has no drain thread: it calls log_init again for one of its own.
+void log_init(void);
+// "error", "warn", "info" or "debug"; -1 for anything else.
+int log_parse_level(char const* name);
+void log_printf(char const* fmt, ...) __attribute__((format(printf, 1, 2)));
+// Writes out everything logged so far. Runs at exit.
+void log_flush(void);
+uint64_t log_dropped(void);
+
 #endif
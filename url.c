@@ -1,7 +1,8 @@
 #include "url.h"
 #include <string.h>
 
-// assumes for of <service>://<node>/<path>
+// assumes for of <service>://<node>/<path>; a node ending in :<port>
+// makes the port the service. IPv6 nodes are in brackets.
 int split_url(slice url, slice* node, slice* service, slice* path) {
     uint8_t const* colon = memchr(url.ptr, ':', url.len);
     if (!colon) {
@@ -23,5 +24,33 @@ int split_url(slice url, slice* node, slice* service, slice* path) {
     (*path).ptr = path_start;
     (*path).len = url.len - ((*path).ptr - url.ptr);
 
+    uint8_t const* port = NULL;
+    if (*node_start == '[') {
+        uint8_t const* bracket = memchr(node_start, ']', path_start - node_start);
+        if (!bracket) {
+            return url_no_node;
+        }
+        (*node).ptr = node_start + 1;
+        (*node).len = bracket - node_start - 1;
+        if (bracket + 1 < path_start && bracket[1] == ':') {
+            port = bracket + 1;
+        }
+    } else {
+        port = memchr(node_start, ':', path_start - node_start);
+        if (port) {
+            (*node).len = port - node_start;
+        }
+    }
+    if (port) {
+        if (port + 1 == path_start) {
+            return url_no_node;
+        }
+        (*service).ptr = port + 1;
+        (*service).len = path_start - port - 1;
+    }
+    if ((*node).len == 0) {
+        return url_no_node;
+    }
+
     return 0;
 }
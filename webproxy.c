@@ -2,6 +2,16 @@
 #include "tprintf.h"
 #include "proxy.h"
 #include "tcp.h"
+#include "cache.h"
+#include "diskcache.h"
+#include "event.h"
+#include "worker.h"
+#include "pool.h"
+#include "dns.h"
+#include "stats.h"
+#include "clients.h"
+#include "admit.h"
+#include "prefork.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -9,32 +19,401 @@
 #include <errno.h>
 #include <netdb.h>
 #include <unistd.h>
-#include <pthread.h>
+#include <signal.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 
 #define LISTEN_ADDR "127.0.0.1"
 
-int main(int argc, char const* const argv[]) {
-    pthread_mutex_init(&stdout_mutex, NULL);
+// Parses a byte count with an optional k/m/g suffix.
+static
+int parse_size(char const* s, size_t* size) {
+    char* end = NULL;
+    errno = 0;
+    unsigned long long n = strtoull(s, &end, 10);
+    if (errno != 0 || end == s) {
+        return -1;
+    }
+    switch (*end) {
+    case 'k': case 'K': n <<= 10; end += 1; break;
+    case 'm': case 'M': n <<= 20; end += 1; break;
+    case 'g': case 'G': n <<= 30; end += 1; break;
+    }
+    if (*end != '\0') {
+        return -1;
+    }
+    *size = n;
+    return 0;
+}
+
+// Parses a timeout of at least 1 ms.
+static
+int parse_ms(char const* s, int* ms) {
+    *ms = atoi(s);
+    return *ms < 1 ? -1 : 0;
+}
+
+// Turns away a client no thread is free for. Never blocks the accept
+// loop: the page goes out only if it fits in the socket buffer.
+static
+void reject_client(int fd) {
+    uint8_t page[256];
+    size_t len = proxy_error_page((mutslice){page, sizeof(page)},
+        "503 Service Unavailable", "503 Service Unavailable: too many connections");
+    send(fd, page, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    shutdown(fd, SHUT_WR);
+    // closing with unread request bytes would reset the connection
+    // and could discard the page before the client reads it
+    while (recv(fd, page, sizeof(page), MSG_DONTWAIT) > 0) {
+    }
+    close(fd);
+}
+
+static
+void usage(char const* argv0) {
+    tprintf("usage: %s [-e] [-w workers [-p]] [-f processes] [-k idle_per_origin] [-c cache_bytes] [-o max_object_bytes]"
+            " [-d disk_cache_dir] [-D disk_cache_bytes] [-N nameserver] [-H hosts_file] [-l level] [-a admin_port]"
+            " [-t threads] [-S stack_bytes] [-q queue_depth] [-m max_head_bytes] [-C connect_ms]"
+            " [-T header_ms] [-I idle_ms] [-F first_byte_ms] [-B stall_ms]"
+            " [-G fetches] [-O fetches_per_origin] [-Q fetch_queue] [-W fetch_wait_ms]"
+            " [-R stale_while_revalidate] [-E stale_if_error] [-P lru|tinylfu] [port]\n", argv0);
+    tprintf("  -e  serve connections from an epoll event loop"
+            " instead of a thread per connection\n");
+    tprintf("  -w  run that many event loops, each with its own"
+            " SO_REUSEPORT listener\n");
+    tprintf("  -p  pin each event loop worker to a CPU\n");
+    tprintf("  -f  serve from that many worker processes, each an epoll event loop,"
+            " sharing the memory cache and restarted when they die (not with -w or -d)\n");
+    tprintf("  -k  keep up to that many idle connections per origin"
+            " (default %d, 0 disables)\n", POOL_DEFAULT_IDLE_PER_HOST);
+    tprintf("  -N  query this nameserver (addr[:port]) instead of the"
+            " first one in /etc/resolv.conf\n");
+    tprintf("  -H  look names up in this file instead of /etc/hosts\n");
+    tprintf("  -l  log level: error, warn, info (default) or debug\n");
+    tprintf("  -a  serve /metrics (Prometheus text format) on this port\n");
+    tprintf("  -t  serve clients from that many threads (default %d)\n", CLIENTS_DEFAULT_THREADS);
+    tprintf("  -S  stack size of those threads (default %dk, at least %dk)\n",
+            CLIENTS_DEFAULT_STACK >> 10, CLIENTS_MIN_STACK >> 10);
+    tprintf("  -q  let up to that many clients wait for a thread, answer"
+            " others 503 (default %d)\n", CLIENTS_DEFAULT_QUEUE);
+    tprintf("  -m  largest request or response head accepted (default %dk)\n",
+            PROXY_DEFAULT_HEAD_LIMIT >> 10);
+    tprintf("  -C  give up connecting to an origin after that many ms"
+            " (default %d, each address gets at most %d)\n",
+            DIAL_DEFAULT_TIMEOUT_MS, DIAL_DEFAULT_ATTEMPT_MS);
+    tprintf("  -T  answer 408 to a request head not in within that many ms"
+            " (default %d)\n", PROXY_DEFAULT_HEADER_MS);
+    tprintf("  -I  close kept-alive connections idle for that many ms"
+            " (default %d)\n", PROXY_DEFAULT_IDLE_MS);
+    tprintf("  -F  answer 504 to a response head not in within that many ms"
+            " (default %d)\n", PROXY_DEFAULT_FIRST_BYTE_MS);
+    tprintf("  -B  give up a body relay or response making no progress"
+            " for that many ms (default %d)\n", PROXY_DEFAULT_STALL_MS);
+    tprintf("  -G  fetch from origins at most that many responses at once"
+            " (default %d)\n", ADMIT_DEFAULT_GLOBAL);
+    tprintf("  -O  and at most that many from any one origin (default %d)\n",
+            ADMIT_DEFAULT_PER_ORIGIN);
+    tprintf("  -Q  let up to that many fetches wait for a slot, answer"
+            " others 503 (default %d)\n", ADMIT_DEFAULT_QUEUE);
+    tprintf("  -W  answer 503 to a fetch still waiting after that many ms"
+            " (default %d, 0 never waits)\n", ADMIT_DEFAULT_WAIT_MS);
+    tprintf("  -R  serve cached responses up to that many seconds past expiry"
+            " while revalidating them (default %d)\n", CACHE_DEFAULT_STALE_WHILE_REVALIDATE);
+    tprintf("  -E  and up to that many when the origin fails (default %d);"
+            " a response's own stale-while-revalidate and stale-if-error win\n",
+            CACHE_DEFAULT_STALE_IF_ERROR);
+    tprintf("  -P  memory cache eviction policy: lru, or tinylfu (default), which"
+            " keeps keys requested once from evicting popular ones\n");
+    tprintf("  limits of fetches can be changed at runtime through the admin port"
+            " (GET/POST /limits)\n");
+}
+
+int main(int argc, char* const argv[]) {
+    log_init();
+
+    size_t cache_bytes = CACHE_DEFAULT_BUDGET;
+    size_t max_object = CACHE_DEFAULT_MAXOBJ;
+    char const* disk_dir = NULL;
+    size_t disk_bytes = DISKCACHE_DEFAULT_LIMIT;
+    int evented = 0;
+    int nworkers = 0;
+    int pin = 0;
+    int nprocs = 0;
+    int idle_per_host = POOL_DEFAULT_IDLE_PER_HOST;
+    char const* nameserver = NULL;
+    char const* hosts = NULL;
+    char const* admin_port = NULL;
+    int nthreads = CLIENTS_DEFAULT_THREADS;
+    size_t stack = CLIENTS_DEFAULT_STACK;
+    size_t queue = CLIENTS_DEFAULT_QUEUE;
+    admit_limits limits = admit_get();
+    long stale_while_revalidate = CACHE_DEFAULT_STALE_WHILE_REVALIDATE;
+    int cache_policy = CACHE_DEFAULT_POLICY;
+    long stale_if_error = CACHE_DEFAULT_STALE_IF_ERROR;
+    int opt;
+    while ((opt = getopt(argc, argv, "ew:pf:k:c:o:d:D:N:H:l:a:t:S:q:m:C:T:I:F:B:G:O:Q:W:R:E:P:")) != -1) {
+        switch (opt) {
+        case 'e':
+            evented = 1;
+            break;
+        case 'w':
+            nworkers = atoi(optarg);
+            if (nworkers < 1) {
+                usage(argv[0]);
+                return 0;
+            }
+            break;
+        case 'p':
+            pin = 1;
+            break;
+        case 'f':
+            nprocs = atoi(optarg);
+            if (nprocs < 1) {
+                usage(argv[0]);
+                return 0;
+            }
+            break;
+        case 'k':
+            idle_per_host = atoi(optarg);
+            break;
+        case 'c':
+            if (parse_size(optarg, &cache_bytes) != 0) {
+                usage(argv[0]);
+                return 0;
+            }
+            break;
+        case 'o':
+            if (parse_size(optarg, &max_object) != 0) {
+                usage(argv[0]);
+                return 0;
+            }
+            break;
+        case 'd':
+            disk_dir = optarg;
+            break;
+        case 'D':
+            if (parse_size(optarg, &disk_bytes) != 0) {
+                usage(argv[0]);
+                return 0;
+            }
+            break;
+        case 'N':
+            nameserver = optarg;
+            break;
+        case 'H':
+            hosts = optarg;
+            break;
+        case 'a':
+            admin_port = optarg;
+            break;
+        case 't':
+            nthreads = atoi(optarg);
+            if (nthreads < 1) {
+                usage(argv[0]);
+                return 0;
+            }
+            break;
+        case 'S':
+            if (parse_size(optarg, &stack) != 0 || stack < CLIENTS_MIN_STACK) {
+                usage(argv[0]);
+                return 0;
+            }
+            break;
+        case 'q':
+            if (parse_size(optarg, &queue) != 0 || queue < 1) {
+                usage(argv[0]);
+                return 0;
+            }
+            break;
+        case 'm':
+            if (parse_size(optarg, &proxy_head_limit) != 0 || proxy_head_limit < BUFLEN) {
+                usage(argv[0]);
+                return 0;
+            }
+            break;
+        case 'C':
+            dial_timeout_ms = atoi(optarg);
+            if (dial_timeout_ms < 1) {
+                usage(argv[0]);
+                return 0;
+            }
+            if (dial_attempt_ms > dial_timeout_ms) {
+                dial_attempt_ms = dial_timeout_ms;
+            }
+            break;
+        case 'T':
+            if (parse_ms(optarg, &proxy_header_ms) != 0) {
+                usage(argv[0]);
+                return 0;
+            }
+            break;
+        case 'I':
+            if (parse_ms(optarg, &proxy_idle_ms) != 0) {
+                usage(argv[0]);
+                return 0;
+            }
+            break;
+        case 'F':
+            if (parse_ms(optarg, &proxy_first_byte_ms) != 0) {
+                usage(argv[0]);
+                return 0;
+            }
+            break;
+        case 'B':
+            if (parse_ms(optarg, &proxy_stall_ms) != 0) {
+                usage(argv[0]);
+                return 0;
+            }
+            break;
+        case 'G':
+            limits.global = atoi(optarg);
+            if (limits.global < 1) {
+                usage(argv[0]);
+                return 0;
+            }
+            break;
+        case 'O':
+            limits.per_origin = atoi(optarg);
+            if (limits.per_origin < 1) {
+                usage(argv[0]);
+                return 0;
+            }
+            break;
+        case 'Q':
+            limits.queue = atoi(optarg);
+            if (limits.queue < 0) {
+                usage(argv[0]);
+                return 0;
+            }
+            break;
+        case 'W':
+            limits.wait_ms = atoi(optarg);
+            if (limits.wait_ms < 0) {
+                usage(argv[0]);
+                return 0;
+            }
+            break;
+        case 'R':
+            stale_while_revalidate = atol(optarg);
+            if (stale_while_revalidate < 0) {
+                usage(argv[0]);
+                return 0;
+            }
+            break;
+        case 'E':
+            stale_if_error = atol(optarg);
+            if (stale_if_error < 0) {
+                usage(argv[0]);
+                return 0;
+            }
+            break;
+        case 'P':
+            cache_policy = cache_parse_policy(optarg);
+            if (cache_policy < 0) {
+                usage(argv[0]);
+                return 0;
+            }
+            break;
+        case 'l':
+            log_level = log_parse_level(optarg);
+            if (log_level < 0) {
+                log_level = LOG_INFO;
+                usage(argv[0]);
+                return 0;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return 0;
+        }
+    }
+    if (optind >= argc) {
+        usage(argv[0]);
+        return 0;
+    }
+    char const* port = argv[optind];
+    // each process would index the disk cache on its own
+    if (nprocs > 0 && (nworkers > 0 || disk_dir)) {
+        usage(argv[0]);
+        return 0;
+    }
+    // like -w, each worker process is an event loop
+    if (nprocs > 0) {
+        evented = 1;
+    }
 
-    if (argc < 2) {
-        tprintf("usage: %s [port]\n", argv[0]);
+    if (nprocs == 0) {
+        cache_init(cache_bytes, max_object);
+    } else if (cache_init_shared(cache_bytes, max_object, nprocs) != 0 || stats_share() != 0) {
+        tlog(LOG_ERROR, "cannot set up the memory shared by the worker processes\n");
+        return 0;
+    }
+    cache_set_stale(stale_while_revalidate, stale_if_error);
+    cache_set_policy(cache_policy);
+
+    // from here on, in each worker process
+    int ln = -1;
+    int worker = 0;
+    if (nprocs > 0) {
+        worker = prefork_run(LISTEN_ADDR, port, nprocs, &ln);
+        if (worker < 0) {
+            return 0;
+        }
+    }
+    admit_set(limits);
+    pool_init(idle_per_host, POOL_DEFAULT_IDLE_TOTAL, POOL_DEFAULT_IDLE_TIMEOUT);
+    if (disk_dir && diskcache_init(disk_dir, disk_bytes) != 0) {
+        return 0;
+    }
+    if (dns_init(nameserver, hosts) != 0) {
+        return 0;
+    }
+
+    // the other workers' statistics are merged in with worker 0's
+    if (admin_port && worker == 0) {
+        int err = stats_serve(LISTEN_ADDR, admin_port);
+        if (err != 0) {
+            if (err != EAI_SYSTEM) {
+                tlog(LOG_ERROR, "admin ListenTCP: %s\n", gai_strerror(err));
+            } else {
+                perror("admin ListenTCP");
+            }
+            return 0;
+        }
+    }
+
+    // a client hanging up mid-response must not kill the proxy
+    signal(SIGPIPE, SIG_IGN);
+
+    if (nworkers > 0) {
+        workers_run(LISTEN_ADDR, port, nworkers, pin);
         return 0;
     }
-    char const* port = argv[1];
 
-    int ln = listen_tcp(LISTEN_ADDR, port);
+    if (ln < 0) {
+        ln = listen_tcp(LISTEN_ADDR, port);
+    }
     if (ln < 0) {
         if (ln != EAI_SYSTEM) {
-            tprintf("ListenTCP: %s\n", gai_strerror(ln));
+            tlog(LOG_ERROR, "ListenTCP: %s\n", gai_strerror(ln));
         } else {
             perror("ListenTCP");
         }
         return 0;
     }
 
+    if (evented) {
+        event_loop_run(ln);
+        close(ln);
+        return 0;
+    }
+
+    if (clients_start(nthreads, stack, queue) != 0) {
+        close(ln);
+        return 0;
+    }
+
     while (1) {
         struct sockaddr_storage addr;
         socklen_t addrlen = sizeof(addr);
@@ -43,6 +422,8 @@ int main(int argc, char const* const argv[]) {
             perror("ln.accept4");
             continue;
         }
+        uint64_t accepted = stats_now();
+        set_nodelay(fd);
 
         {
             char buf[INET6_ADDRSTRLEN];
@@ -53,25 +434,14 @@ int main(int argc, char const* const argv[]) {
             if (!s) {
                 perror("inet_ntop");
             } else {
-                tprintf("accepted new client connection from %s:%d\n", s, port);
+                tlog(LOG_DEBUG, "accepted new client connection from %s:%d\n", s, port);
             }
         }
 
-        pthread_t thread;
-        handle_client_args* args = malloc(sizeof(handle_client_args));
-        args->client = fd;
-        int err = pthread_create(&thread, NULL, handle_client, (void*)(args));
-        if (err != 0) {
-            tprintf("pthread_create: %s", strerror(err));
-            close(args->client);
-            free(args);
-            continue;
-        }
-
-        err = pthread_detach(thread);
-        if (err != 0) {
-            tprintf("pthread_detach: %s", strerror(err));
-            continue;
+        if (clients_submit(fd, accepted) != 0) {
+            tlog(LOG_WARN, "client queue full, rejecting connection %d\n", fd);
+            stats_count(STAT_REJECTED);
+            reject_client(fd);
         }
     }
 
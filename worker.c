@@ -0,0 +1,97 @@
+#define _GNU_SOURCE
+#include "worker.h"
+#include "event.h"
+#include "tcp.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+
+typedef struct {
+    int id;
+    int cpu;
+    int ln;
+    int running;
+    pthread_t thread;
+} worker;
+
+static
+void* worker_main(void* ptr) {
+    worker* w = ptr;
+    if ((*w).cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET((*w).cpu, &set);
+        int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (err != 0) {
+            tlog(LOG_ERROR, "worker %d: pthread_setaffinity_np: %s\n", (*w).id, strerror(err));
+        }
+    }
+    tprintf("worker %d: serving on fd %d (cpu %d)\n", (*w).id, (*w).ln, (*w).cpu);
+    event_loop_run((*w).ln);
+    close((*w).ln);
+    return NULL;
+}
+
+// Returns the index-th CPU this process may run on, wrapping around.
+static
+int allowed_cpu(int index) {
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) != 0 || CPU_COUNT(&set) == 0) {
+        return -1;
+    }
+    index %= CPU_COUNT(&set);
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (CPU_ISSET(cpu, &set) && index-- == 0) {
+            return cpu;
+        }
+    }
+    return -1;
+}
+
+int workers_run(char const* node, char const* service, int n, int pin) {
+    worker* workers = calloc(n, sizeof(worker));
+    if (!workers) {
+        perror("calloc");
+        return -1;
+    }
+
+    // Bind every listener before serving so a failure leaves nothing running.
+    for (int i = 0; i < n; ++i) {
+        workers[i].id = i;
+        workers[i].cpu = pin ? allowed_cpu(i) : -1;
+        workers[i].ln = listen_tcp_reuseport(node, service);
+        if (workers[i].ln < 0) {
+            if (workers[i].ln != EAI_SYSTEM) {
+                tlog(LOG_ERROR, "ListenTCP: %s\n", gai_strerror(workers[i].ln));
+            } else {
+                perror("ListenTCP");
+            }
+            for (int j = 0; j < i; ++j) {
+                close(workers[j].ln);
+            }
+            free(workers);
+            return -1;
+        }
+    }
+
+    for (int i = 0; i < n; ++i) {
+        int err = pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]);
+        if (err != 0) {
+            tlog(LOG_ERROR, "pthread_create: %s\n", strerror(err));
+            close(workers[i].ln);
+            continue;
+        }
+        workers[i].running = 1;
+    }
+    for (int i = 0; i < n; ++i) {
+        if (workers[i].running) {
+            pthread_join(workers[i].thread, NULL);
+        }
+    }
+    free(workers);
+    return -1;
+}
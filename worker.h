@@ -0,0 +1,11 @@
+#ifndef WORKER_H
+#define WORKER_H
+#include "tprintf.h"
+
+// Runs n event loop workers, each with its own SO_REUSEPORT listener
+// on node:service, its own epoll set and its own connections. With pin
+// set, worker i is pinned to the i-th CPU the process may run on.
+// Only returns on error.
+int workers_run(char const* node, char const* service, int n, int pin);
+
+#endif